@@ -3,9 +3,15 @@
 
 #include "EventPump.h"
 #include "Logger.h"
+#include "FrameDecoder.h"
+#include "Transport.h"
+#include "TcpTransport.h"
 #include "fmitcp.pb.h"
 #include <string>
 #include <vector>
+#include <map>
+#include <set>
+#include <deque>
 #define lw_import
 #include <lacewing.h>
 
@@ -13,11 +19,22 @@ using namespace std;
 
 namespace fmitcp {
 
+    class ShmTransport;
+    class Server;
+
     /**
      * @brief FMI Client that can do requests to a server, similar to the FMI API.
      * The idea is that this class should be extended by a subclass that implements its methods. In this way the subclass can fetch events such as "onConnect" and "onError".
+     * When a connection is made, the server and the client exchange hello messages and only use the features both of
+     * them support. onConnect is called after that. If the server is on the same machine, the connection moves to
+     * shared memory before onConnect, see setSharedMemory().
      */
-    class Client {
+    class Client : public TransportListener {
+
+    public:
+
+        /// Handles one type of response: unpacks it and calls the matching on_*_res event.
+        typedef void (Client::*MessageHandler)(fmitcp_proto::fmitcp_message& res);
 
     protected:
 
@@ -28,14 +45,258 @@ namespace fmitcp {
         Logger m_logger;
 
     private:
-        lw_client m_client;
+        /// Socket connection to the server, TCP or Unix domain. NULL before connect().
+        Transport * m_connection;
+
+        /// Shared memory the connection moved to, or is moving to. NULL if none.
+        ShmTransport * m_shm;
+
+        /// Where requests are sent: m_connection, or m_shm once the server has opened it
+        Transport * m_transport;
+
+        /// True if the connection should move to shared memory when the server is local
+        bool m_sharedMemory;
+
+        /// True if the server is on this machine
+        bool m_local;
+
+        /// True once the hello of the server has arrived on the current connection
+        bool m_greeted;
+
+        /// What the server said about itself in its hello
+        fmitcp_proto::server_hello m_serverHello;
+
+        /// Capabilities this end listed in its hello
+        vector<fmitcp_proto::capability_t> m_capabilities;
+
+        /// True if both ends allow more than one request in flight
+        bool m_pipelining;
+
+        /// Replace the connection to the server
+        void setConnection(Transport * connection, bool local);
+
+        /// Reassembly buffers for data from the server
+        FrameDecoder m_decoder;
+        FrameDecoder m_shmDecoder;
+
+        /// Run the handler of a response and track the requests in flight
+        void handleResponse(fmitcp_proto::fmitcp_message& res);
+
+        /// Max number of requests in flight that both ends allow, 0 means no limit
+        int getWindowLimit() const;
+
+        /// Max number of bytes of FMU state per message, so that the messages fit in the frames both ends accept
+        int getStateChunkLimit() const;
+
+        /// Ask the server to move the connection to shared memory. Returns false if it could not be set up.
+        bool startSharedMemory();
+
+        /// Requests that are sent but not answered yet, keyed by message_id
+        map<int,fmitcp_proto::fmitcp_message_Type> m_inFlight;
+
+        /// Requests waiting for room in the window, in the order they were made
+        deque<pair<int,fmitcp_proto::fmitcp_message> > m_pending;
+
+        /// Max number of requests in flight, 0 means no limit
+        int m_windowSize;
+
+        /// Response handlers, indexed by message type
+        vector<MessageHandler> m_handlers;
+
+        /// Reused for every request, response and send, so their memory is kept between messages
+        fmitcp_proto::fmitcp_message m_request;
+        fmitcp_proto::fmitcp_message m_response;
+        string m_sendBuffer;
+
+        /// Fill in m_handlers
+        void registerHandlers();
+
+        /// What a state transfer does when its chunks are done
+        enum StateTransferStep {
+            TRANSFER_ONLY,
+            SAVE_GET_STATE,
+            SAVE_SERIALIZE,
+            SAVE_FREE_STATE,
+            RESTORE_DE_SERIALIZE,
+            RESTORE_SET_STATE,
+            RESTORE_FREE_STATE
+        };
+
+        /// A serialized FMU state that is sent or received in chunks, possibly as part of a checkpoint
+        struct StateTransfer {
+            StateTransferStep step;
+            int fmuId;
+            int stateId;
+            string data;
+
+            /// Bytes of data sent so far, when uploading
+            size_t offset;
+
+            /// Checkpoint file
+            string path;
+
+            /// Status of the checkpoint, kept while the temporary state is freed
+            fmitcp_proto::fmi2_status_t result;
+        };
+
+        /// Transfers in progress, keyed by message_id. The message id is reused for every chunk and step.
+        map<int,StateTransfer> m_stateTransfers;
+
+        /// Max size of a serialized state chunk
+        int m_stateChunkSize;
+
+        void sendSerializeChunk(int message_id, StateTransfer& transfer);
+        void sendDeSerializeChunk(int message_id, StateTransfer& transfer);
+
+        /// Remove a checkpoint transfer and report its result
+        void finishCheckpoint(int message_id, fmitcp_proto::fmi2_status_t status);
+
+        /// Values of a prepared list or subscription, kept to send or receive only the ones that changed
+        struct DeltaValues {
+            vector<double> reals;
+            vector<int> integers;
+            vector<bool> booleans;
+            vector<string> strings;
+        };
+
+        /// A request that sends or asks for only the changed values
+        struct DeltaRequest {
+            int fmuId;
+
+            /// List of the real, integer, boolean and string outputs: -1 for none, 0 for the output subscription
+            int outputs[4];
+        };
+
+        /// True to send and receive only the changed values, where the server supports it
+        bool m_delta;
+
+        /// Smallest change of a real that is sent
+        double m_realThreshold;
+
+        /// Values last sent and received, keyed by fmuId and list id. List id 0 is the output subscription.
+        map<pair<int,int>,DeltaValues> m_sentValues;
+        map<pair<int,int>,DeltaValues> m_receivedValues;
+
+        /// Requests that send or ask for changed values, keyed by message_id
+        map<int,DeltaRequest> m_deltaRequests;
+
+        /// Instances whose output subscription sends changed values
+        set<int> m_deltaSubscriptions;
+
+        /// Directory with copies of modelDescription.xml, see setXmlCacheDir()
+        string m_xmlCacheDir;
+
+        /// XML read from the cache for get_xml requests that passed its hash, keyed by message_id
+        map<int,string> m_cachedXml;
+
+        /// Path of the cached XML with a hash. Empty if there is no cache or the hash is not a plain name.
+        string xmlCachePath(const string& hash) const;
+
+        /// True if values are sent as changes on this connection
+        bool useDelta() const;
+
+        /// Track a request that sends or asks for changed values. Pass -1 for the output types it does not get.
+        void addDeltaRequest(int message_id, int fmuId, int realOutputs, int integerOutputs, int booleanOutputs, int stringOutputs);
+
+        /**
+         * Stop tracking a request. If it failed, the values sent to the instance are forgotten, since the server may
+         * not have set them, and the next ones go in full.
+         * @return false if the request is not tracked
+         */
+        bool takeDeltaRequest(int message_id, fmitcp_proto::fmi2_status_t status, DeltaRequest& request);
+
+        /// Values received before for an output list of a request: 0 for reals, 1 integers, 2 booleans, 3 strings. NULL if it has none.
+        DeltaValues * receivedValues(const DeltaRequest& request, int type);
+
+        /// Forget the values kept for an instance
+        static void forgetValues(map<pair<int,int>,DeltaValues>& values, int fmuId);
+
+    protected:
+
+        /// Get the cleared message to build the next request in. Valid until the next call.
+        fmitcp_proto::fmitcp_message& newRequest();
+
+        /// Send a request and track it until its response arrives. Queues the request if the window is full.
+        void sendRequest(int message_id, fmitcp_proto::fmitcp_message * message);
+
+        /// Called when the response to a request arrives. Sends queued requests that now fit in the window.
+        void requestCompleted(int message_id);
+
+        /**
+         * Set the handler for a message type. Subclasses may use this to add or replace handlers; a handler of a
+         * subclass is passed with static_cast<MessageHandler>(&Subclass::handler).
+         */
+        void setHandler(fmitcp_proto::fmitcp_message_Type type, MessageHandler handler);
+
+        /// Handler for responses that are not implemented
+        void handleUnimplemented(fmitcp_proto::fmitcp_message& res);
+
+        /// Response handlers
+        virtual void handle_fmi2_import_instantiate_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_initialize_slave_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_terminate_slave_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_reset_slave_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_free_slave_instance_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_set_real_input_derivatives_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_get_real_output_derivatives_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_cancel_step_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_do_step_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_get_status_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_get_real_status_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_get_integer_status_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_get_boolean_status_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_get_string_status_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_instantiate_model_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_free_model_instance_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_set_time_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_set_continuous_states_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_completed_integrator_step_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_get_version_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_set_debug_logging_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_set_real_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_set_integer_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_set_boolean_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_set_string_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_get_real_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_get_integer_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_get_boolean_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_get_string_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_get_fmu_state_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_set_fmu_state_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_free_fmu_state_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_serialized_fmu_state_size_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_serialize_fmu_state_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_de_serialize_fmu_state_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_get_directional_derivative_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_get_xml_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_fmi2_import_step_exchange_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_shm_connect_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_server_hello(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_prepare_value_references_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_release_value_references_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_subscribe_outputs_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_get_jacobian_res(fmitcp_proto::fmitcp_message& res);
+        virtual void handle_error_res(fmitcp_proto::fmitcp_message& res);
 
     public:
         Client(EventPump * pump);
-        ~Client();
+        virtual ~Client();
 
         /// Connect the client to a server
         void connect(string host, long port);
+
+        /**
+         * Connect to a server on this machine through a Unix domain socket, see Server::hostUnix(). Skips the TCP/IP
+         * stack. Returns false if the connection failed; onConnect is called as usual if it succeeds.
+         */
+        bool connectUnix(string path);
+
+        /**
+         * Connect to a server in this process, on the same event pump, without a socket. Messages are handed over in
+         * memory; with passMessages they are not even serialized, so a call costs little more than the FMU call
+         * itself. The callbacks still come from the event pump, as with a socket.
+         */
+        void connectLoopback(Server * server, bool passMessages = true);
         void disconnect();
         Logger * getLogger();
 
@@ -44,6 +305,77 @@ namespace fmitcp {
 
         bool isConnected();
 
+        /**
+         * Move the connection to shared memory if the server is on this machine, i.e. if the host is localhost or a
+         * loopback address, or the connection is a Unix domain socket. Messages and callbacks are the same, but a
+         * round trip skips the network stack. The socket connection stays open to tell when the server goes away.
+         * Falls back to the socket if the server or the platform does not support it. On by default. Call before
+         * connect().
+         */
+        void setSharedMemory(bool sharedMemory);
+        bool getSharedMemory() const;
+
+        /// True if messages go through shared memory
+        bool isUsingSharedMemory() const;
+
+        /// What the server said about itself when the connection was made: protocol version, capacity and features
+        const fmitcp_proto::server_hello& getServerHello() const;
+
+        /// True if the server listed a feature in its hello
+        bool serverHasCapability(fmitcp_proto::capability_t capability) const;
+
+        /// True if both ends listed a feature in their hellos, so that it may be used on this connection
+        bool hasCapability(fmitcp_proto::capability_t capability) const;
+
+        /**
+         * Set the max number of requests that may be in flight at the same time. Requests made when the window is
+         * full are queued and sent as responses come in. Requests do not need to wait for the previous response, so
+         * a batch of requests costs one round trip instead of one per request. 0 means no limit, which is the
+         * default. A server that does not list pipelining in its hello gets one request at a time.
+         */
+        void setWindowSize(int windowSize);
+        int getWindowSize() const;
+
+        /// Number of requests sent that have not been answered yet
+        int getNumInFlight() const;
+
+        /// Number of requests waiting for room in the window
+        int getNumPending() const;
+
+        /// True if the request with the given message id is not answered yet
+        bool isInFlight(int message_id) const;
+
+        /**
+         * Set the max number of bytes per message when a serialized FMU state is sent or received. Default is 1 MB.
+         * Smaller chunks are used if the server or this client does not accept messages that large.
+         */
+        void setStateChunkSize(int chunkSize);
+        int getStateChunkSize() const;
+
+        /**
+         * Only send the values that changed since they were last sent, for get, set and step exchange requests with
+         * prepared value reference lists and for output subscriptions. Saves bandwidth when many variables rarely
+         * change. Callbacks still get all values. A real counts as changed if it moved more than realThreshold; 0
+         * keeps the values exact. Inputs are tracked per list, so a variable should not also be set some other way.
+         * Used if the server lists capability_delta_encoding. Off by default. Set it before connecting, the client
+         * only lists the capability in its hello if it is on.
+         */
+        void setDeltaEncoding(bool delta, double realThreshold = 0);
+        bool getDeltaEncoding() const;
+
+        /**
+         * Keep copies of modelDescription.xml in a directory, named by their hash. get_xml() then only downloads
+         * the XML if the server has one that is not in the directory, so connecting to servers with large FMUs is
+         * fast. Several clients may share the directory; a copy is checked against its hash before it is used.
+         * Used if the server lists capability_xml_cache. Empty, the default, turns it off. Set it before
+         * connecting, like setDeltaEncoding().
+         */
+        void setXmlCacheDir(const string& dir);
+        const string& getXmlCacheDir() const;
+
+        /// To be implemented in subclass. Called after the response callback when no requests are left in flight.
+        virtual void onAllRequestsCompleted(){}
+
         /// To be implemented in subclass
         virtual void onConnect(){}
 
@@ -53,15 +385,22 @@ namespace fmitcp {
         /// To be implemented in subclass
         virtual void onError(string message){}
 
-        /// Called when a client connects
-        void clientConnected(lw_client c);
-        void clientData(lw_client c, const char* data, long size);
-        void clientDisconnected(lw_client c);
-        void clientError(lw_client c, lw_error error);
+        /// The server refused a request, see error_res. The request gets no other response.
+        virtual void on_error_res(int mid, const string& reason){}
+
+        /// Events of the transports
+        void transportConnected(Transport * transport);
+        void transportData(Transport * transport, const char* data, size_t size);
+        void transportMessage(Transport * transport, fmitcp_proto::fmitcp_message& message);
+        void transportClosed(Transport * transport);
+        void transportError(Transport * transport, const string& message);
+
+        /// Handle one complete message from the server
+        void clientMessage(Transport * transport, const char* data, long size);
 
         // Response functions - to be implemented by subclass
         virtual void onGetXmlRes(int mid, fmitcp_proto::jm_log_level_enu_t logLevel, string xml){}
-        virtual void on_fmi2_import_instantiate_res                     (int mid, fmitcp_proto::jm_status_enu_t status){}
+        virtual void on_fmi2_import_instantiate_res                     (int mid, fmitcp_proto::jm_status_enu_t status, int fmuId){}
         virtual void on_fmi2_import_initialize_slave_res                (int mid, fmitcp_proto::fmi2_status_t status){}
         virtual void on_fmi2_import_terminate_slave_res                 (int mid, fmitcp_proto::fmi2_status_t status){}
         virtual void on_fmi2_import_reset_slave_res                     (int mid, fmitcp_proto::fmi2_status_t status){}
@@ -70,6 +409,9 @@ namespace fmitcp {
         virtual void on_fmi2_import_get_real_output_derivatives_res     (int mid, fmitcp_proto::fmi2_status_t status, const vector<double>& values){}
         virtual void on_fmi2_import_cancel_step_res                     (int mid, fmitcp_proto::fmi2_status_t status){}
         virtual void on_fmi2_import_do_step_res                         (int mid, fmitcp_proto::fmi2_status_t status){}
+
+        /// The subscribed outputs that came with a do_step response, see subscribe_outputs(). Called before on_fmi2_import_do_step_res.
+        virtual void on_fmi2_import_do_step_outputs(int mid, const vector<double>& realValues, const vector<int>& integerValues, const vector<bool>& booleanValues, const vector<string>& stringValues){}
         virtual void on_fmi2_import_get_status_res                      (int mid, fmitcp_proto::fmi2_status_t status){}
         virtual void on_fmi2_import_get_real_status_res                 (int mid, double value){}
         virtual void on_fmi2_import_get_integer_status_res              (int mid, int value){}
@@ -101,11 +443,18 @@ namespace fmitcp {
         virtual void on_fmi2_import_get_fmu_state_res                   (int mid, int stateId, fmitcp_proto::fmi2_status_t status){}
         virtual void on_fmi2_import_set_fmu_state_res                   (int mid, fmitcp_proto::fmi2_status_t status){}
         virtual void on_fmi2_import_free_fmu_state_res                  (int mid, fmitcp_proto::fmi2_status_t status){}
-        /*virtual void on_fmi2_import_serialized_fmu_state_size_res(){}
-        virtual void on_fmi2_import_serialize_fmu_state_res(){}
-        virtual void on_fmi2_import_de_serialize_fmu_state_res(){}
-        */
+        virtual void on_fmi2_import_serialized_fmu_state_size_res       (int mid, long long size, fmitcp_proto::fmi2_status_t status){}
+        virtual void on_fmi2_import_serialize_fmu_state_res             (int mid, const string& state, fmitcp_proto::fmi2_status_t status){}
+        virtual void on_fmi2_import_de_serialize_fmu_state_res          (int mid, int stateId, fmitcp_proto::fmi2_status_t status){}
         virtual void on_fmi2_import_get_directional_derivative_res(int mid, const vector<double>& dz, fmitcp_proto::fmi2_status_t status){}
+        virtual void on_fmi2_import_step_exchange_res(int mid, fmitcp_proto::fmi2_status_t status, const vector<double>& realValues, const vector<int>& integerValues, const vector<bool>& booleanValues, const vector<string>& stringValues){}
+        virtual void on_prepare_value_references_res(int mid, fmitcp_proto::fmi2_status_t status, int valueReferenceSet){}
+        virtual void on_release_value_references_res(int mid, fmitcp_proto::fmi2_status_t status){}
+        virtual void on_subscribe_outputs_res(int mid, fmitcp_proto::fmi2_status_t status){}
+        /// Dense: rows and columns are empty and values has all entries, row by row. Sparse: entry k is at rows[k], columns[k].
+        virtual void on_get_jacobian_res(int mid, fmitcp_proto::fmi2_status_t status, const vector<double>& values, const vector<int>& rows, const vector<int>& columns){}
+        virtual void onCheckpointSaved(int mid, fmitcp_proto::fmi2_status_t status){}
+        virtual void onCheckpointRestored(int mid, fmitcp_proto::fmi2_status_t status){}
 
         void getXml(int message_id, int fmuId);
 
@@ -158,16 +507,122 @@ namespace fmitcp {
         void fmi2_import_get_integer(int message_id, int fmuId, const vector<int>& valueRefs);
         void fmi2_import_get_boolean(int message_id, int fmuId, const vector<int>& valueRefs);
         void fmi2_import_get_string (int message_id, int fmuId, const vector<int>& valueRefs);
+
+        /// The same with a list of value references made by prepare_value_references()
+        void fmi2_import_set_real   (int message_id, int fmuId, int valueReferenceSet, const vector<double>& values);
+        void fmi2_import_set_integer(int message_id, int fmuId, int valueReferenceSet, const vector<int>& values);
+        void fmi2_import_set_boolean(int message_id, int fmuId, int valueReferenceSet, const vector<bool>& values);
+        void fmi2_import_set_string (int message_id, int fmuId, int valueReferenceSet, const vector<string>& values);
+        void fmi2_import_get_real   (int message_id, int fmuId, int valueReferenceSet);
+        void fmi2_import_get_integer(int message_id, int fmuId, int valueReferenceSet);
+        void fmi2_import_get_boolean(int message_id, int fmuId, int valueReferenceSet);
+        void fmi2_import_get_string (int message_id, int fmuId, int valueReferenceSet);
         void fmi2_import_get_fmu_state(int message_id, int fmuId);
         void fmi2_import_set_fmu_state(int message_id, int fmuId, int stateId);
-        void fmi2_import_free_fmu_state(int messageId, int stateId);
-        void fmi2_import_serialized_fmu_state_size();
-        void fmi2_import_serialize_fmu_state();
-        void fmi2_import_de_serialize_fmu_state();
+        void fmi2_import_free_fmu_state(int message_id, int fmuId, int stateId);
+        void fmi2_import_serialized_fmu_state_size(int message_id, int fmuId, int stateId);
+
+        /**
+         * Fetch a saved state as bytes. Large states come in several chunks, each one a request with the same
+         * message id; the response callback is called once, with the whole state. For a Model Exchange FMU the
+         * server appends the state of its integrator, so the bytes are only meant for de-serializing on a server.
+         */
+        void fmi2_import_serialize_fmu_state(int message_id, int fmuId, int stateId);
+
+        /// Upload a serialized state in chunks. The response callback gets the stateId of the new state.
+        void fmi2_import_de_serialize_fmu_state(int message_id, int fmuId, const string& state);
         void fmi2_import_get_directional_derivative(int message_id, int fmuId, const vector<int>& v_ref, const vector<int>& z_ref, const vector<double>& dv);
 
         // ========= NETWORK SPECIFIC FUNCTIONS ============
         void get_xml(int message_id, int fmuId);
+
+        /**
+         * Set inputs, do a step and read outputs in one round trip. Does the same as calling fmi2_import_set_real,
+         * _integer, _boolean and _string, fmi2_import_do_step and then fmi2_import_get_real, _integer, _boolean and
+         * _string. The server stops at the first call that fails and returns its status.
+         */
+        void fmi2_import_step_exchange(int message_id, int fmuId,
+                                       const vector<int>& realValueRefs, const vector<double>& realValues,
+                                       const vector<int>& integerValueRefs, const vector<int>& integerValues,
+                                       const vector<int>& booleanValueRefs, const vector<bool>& booleanValues,
+                                       const vector<int>& stringValueRefs, const vector<string>& stringValues,
+                                       double currentCommunicationPoint,
+                                       double communicationStepSize,
+                                       bool newStep,
+                                       const vector<int>& realOutputValueRefs,
+                                       const vector<int>& integerOutputValueRefs,
+                                       const vector<int>& booleanOutputValueRefs,
+                                       const vector<int>& stringOutputValueRefs);
+
+        /// The same with lists of value references made by prepare_value_references(). A set of 0 is an empty list.
+        void fmi2_import_step_exchange(int message_id, int fmuId,
+                                       int realValueReferenceSet, const vector<double>& realValues,
+                                       int integerValueReferenceSet, const vector<int>& integerValues,
+                                       int booleanValueReferenceSet, const vector<bool>& booleanValues,
+                                       int stringValueReferenceSet, const vector<string>& stringValues,
+                                       double currentCommunicationPoint,
+                                       double communicationStepSize,
+                                       bool newStep,
+                                       int realOutputValueReferenceSet,
+                                       int integerOutputValueReferenceSet,
+                                       int booleanOutputValueReferenceSet,
+                                       int stringOutputValueReferenceSet);
+
+        /**
+         * Keep a list of value references on the server, for variables that are read or written over and over. The
+         * response callback gets the id of the list, to pass to the get, set and step exchange functions instead of
+         * the list. The list may be used for variables of any type, and goes away with the instance.
+         */
+        void prepare_value_references(int message_id, int fmuId, const vector<int>& valueRefs);
+
+        /// Free a list made by prepare_value_references()
+        void release_value_references(int message_id, int fmuId, int valueReferenceSet);
+
+        /**
+         * Have the server read these outputs after every fmi2_import_do_step of the instance and send them with the
+         * response, to on_fmi2_import_do_step_outputs. Saves a get request per type and step. Replaces the earlier
+         * subscription; empty lists end it. Needs a server that lists capability_output_subscriptions.
+         */
+        void subscribe_outputs(int message_id, int fmuId,
+                               const vector<int>& realValueRefs,
+                               const vector<int>& integerValueRefs,
+                               const vector<int>& booleanValueRefs,
+                               const vector<int>& stringValueRefs);
+
+        /**
+         * Get the partial derivatives of the unknowns with respect to the knowns, all reals, in one request. The
+         * server computes them with one directional derivative per group of knowns that no unknown depends on
+         * together. Needs a server that lists capability_jacobian.
+         *
+         * If the FMU does not provide directional derivatives, the server uses forward differences, perturbing the
+         * knowns and restoring the FMU state after each evaluation; the instance is left as it was.
+         * @param sparse Only get the entries that may be nonzero, according to the model description.
+         * @param finiteDifferences Use forward differences even if the FMU provides directional derivatives.
+         * @param communicationStepSize If > 0, get the sensitivities of the outputs after a step of this size from
+         * currentCommunicationPoint instead, with forward differences.
+         * @param relativePerturbation For forward differences: how much each known is perturbed, relative to its
+         * value and at least this much in absolute terms.
+         */
+        void get_jacobian(int message_id, int fmuId, const vector<int>& unknownValueRefs, const vector<int>& knownValueRefs, bool sparse,
+                          bool finiteDifferences = false, double currentCommunicationPoint = 0, double communicationStepSize = 0,
+                          double relativePerturbation = 1e-6);
+
+        /// The same with lists of value references made by prepare_value_references()
+        void get_jacobian(int message_id, int fmuId, int unknownValueReferenceSet, int knownValueReferenceSet, bool sparse,
+                          bool finiteDifferences = false, double currentCommunicationPoint = 0, double communicationStepSize = 0,
+                          double relativePerturbation = 1e-6);
+
+        /**
+         * Save the current state of an instance to a local file. Gets the FMU state, serializes it, writes it and
+         * frees it on the server. onCheckpointSaved is called when done. The message id is used for every step.
+         */
+        void saveCheckpoint(int message_id, int fmuId, const string& path);
+
+        /**
+         * Restore a checkpoint file onto an instance, which may run on another server than the one that saved it.
+         * The FMU must be the same. onCheckpointRestored is called when done.
+         */
+        void restoreCheckpoint(int message_id, int fmuId, const string& path);
     };
 
 };
@@ -0,0 +1,109 @@
+#ifndef FMUSTATESTORE_H_
+#define FMUSTATESTORE_H_
+
+#include <map>
+#include <list>
+#include <vector>
+#include <string>
+#include <stddef.h>
+#define FMILIB_BUILDING_LIBRARY
+#include <fmilib.h>
+#include "Integrator.h"
+
+namespace fmitcp {
+
+    /**
+     * @brief FMU state snapshots of one FMU instance, keyed by stateId.
+     * Holds at most a fixed number of states. When a new state does not fit, the least recently used one is evicted.
+     * The store only keeps the handles; freeing them with fmi2_import_free_fmu_state is up to the owner.
+     * For a Model Exchange FMU, each state is kept together with the state of its integrator.
+     * It also holds the serialized states that are being sent or received in chunks.
+     */
+    class FmuStateStore {
+
+    private:
+
+        struct Entry {
+            fmi2_FMU_state_t state;
+
+            bool hasIntegrator;
+            Integrator::Snapshot integrator;
+
+            /// Position in m_lru
+            std::list<int>::iterator lru;
+        };
+
+        std::map<int,Entry> m_states;
+
+        /// State ids, most recently used first
+        std::list<int> m_lru;
+
+        int m_nextStateId;
+        size_t m_capacity;
+
+    public:
+
+        /// Default max number of states per instance
+        static const size_t DEFAULT_CAPACITY = 64;
+
+        /// Default max size of a serialized state that is received, four frames of the default max size
+        static const size_t DEFAULT_MAX_SERIALIZED_SIZE = 256 * 1024 * 1024;
+
+        FmuStateStore();
+        ~FmuStateStore();
+
+        /**
+         * Add a state.
+         * @param evicted Set to the state that was evicted to make room, or NULL.
+         * @param integrator State of the integrator at the same time, or NULL if there is none
+         * @return The stateId of the new state
+         */
+        int add(fmi2_FMU_state_t state, fmi2_FMU_state_t * evicted, const Integrator::Snapshot * integrator = NULL);
+
+        /// Get a state and mark it as recently used. Returns NULL if there is no such state.
+        fmi2_FMU_state_t get(int stateId);
+
+        /// State of the integrator that was added with a state, or NULL
+        const Integrator::Snapshot * getIntegrator(int stateId) const;
+
+        /// Remove a state from the store and return it. Returns NULL if there is no such state.
+        fmi2_FMU_state_t remove(int stateId);
+
+        /// Remove all states from the store, appending them to states
+        void removeAll(std::vector<fmi2_FMU_state_t>& states);
+
+        /// Set the max number of states. Must be at least 1. Does not evict states already in the store.
+        void setCapacity(size_t capacity);
+        size_t getCapacity() const;
+        size_t size() const;
+
+        /// Copy of a serialized state that is being sent in chunks, and the stateId it was made from (-1 if none)
+        std::string outgoing;
+        int outgoingStateId;
+
+        /// Serialized state that is being received in chunks, and the size it has when all chunks are here
+        std::string incoming;
+        size_t incomingSize;
+
+        /// Drop the serialized states and free their memory
+        void clearTransfers();
+
+        /**
+         * Append the state of an integrator to a serialized FMU state, so it travels with it. It goes at the end,
+         * with a marker that takeIntegrator() looks for.
+         */
+        static void appendIntegrator(std::string& data, const Integrator::Snapshot& integrator);
+
+        /// Size that appendIntegrator() adds
+        static size_t integratorSize(const Integrator::Snapshot& integrator);
+
+        /**
+         * Take the state of an integrator off the end of a serialized FMU state, if appendIntegrator() put one there.
+         * @return true if there was one. Otherwise data is left as it is.
+         */
+        static bool takeIntegrator(std::string& data, Integrator::Snapshot& integrator);
+    };
+
+};
+
+#endif
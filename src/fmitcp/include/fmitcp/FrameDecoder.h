@@ -0,0 +1,84 @@
+#ifndef FRAMEDECODER_H_
+#define FRAMEDECODER_H_
+
+#include <string>
+#include <stddef.h>
+
+namespace fmitcp {
+
+    /**
+     * @brief Splits an incoming byte stream into messages.
+     * Every message on the wire is prefixed with its length encoded as a protobuf varint. TCP may deliver several
+     * messages in one chunk or split one message over several chunks, so the decoder keeps the bytes of an incomplete
+     * frame until the rest of it arrives. Each connection needs its own decoder.
+     *
+     * While nothing is buffered, frames are decoded straight from the data given to feed(), and only the tail of an
+     * incomplete frame is copied. The data must therefore stay valid until next() returns false.
+     */
+    class FrameDecoder {
+
+    private:
+
+        /// Received bytes that are not yet consumed
+        std::string m_buffer;
+
+        /// Data from feed() that is decoded in place, or NULL if decoding from m_buffer
+        const char * m_external;
+        size_t m_externalSize;
+
+        /// Start of the unconsumed bytes in m_external or m_buffer
+        size_t m_offset;
+
+        /// Frames larger than this are treated as a corrupt stream
+        size_t m_maxFrameSize;
+
+        /// True if the stream could not be decoded
+        bool m_error;
+
+        /// Copy the unconsumed part of m_external into m_buffer
+        void keepExternal();
+
+    public:
+
+        /// Maximum number of bytes of a varint32 length prefix
+        static const size_t MAX_HEADER_SIZE = 5;
+
+        /// Default value for the maximum frame size
+        static const size_t DEFAULT_MAX_FRAME_SIZE = 64 * 1024 * 1024;
+
+        FrameDecoder();
+        ~FrameDecoder();
+
+        /// Append received data to the decoder
+        void feed(const char * data, size_t size);
+
+        /**
+         * Get the next complete frame, if there is one. The returned pointer is valid until the next call to feed()
+         * or reset(), and no longer than the data given to feed().
+         * @return true if a frame was extracted
+         */
+        bool next(const char ** frame, size_t * size);
+
+        /// True if the stream is corrupt, e.g. a frame exceeded the maximum frame size.
+        bool hasError() const;
+
+        /// Drop all buffered data and clear the error flag
+        void reset();
+
+        void setMaxFrameSize(size_t maxFrameSize);
+        size_t getMaxFrameSize() const;
+
+        /// Number of buffered bytes belonging to incomplete frames
+        size_t getBufferedSize() const;
+
+        /**
+         * Write the length prefix for a frame of the given size.
+         * @param header Must have room for MAX_HEADER_SIZE bytes.
+         * @return Number of bytes written
+         */
+        static size_t encodeHeader(size_t size, char * header);
+    };
+
+};
+
+#endif
@@ -0,0 +1,144 @@
+#ifndef INTEGRATOR_H_
+#define INTEGRATOR_H_
+
+#include <vector>
+#include <stddef.h>
+#define FMILIB_BUILDING_LIBRARY
+#include <fmilib.h>
+
+namespace fmitcp {
+
+    /**
+     * @brief Integrates an instance of a Model Exchange FMU over communication steps, so that the server can serve it
+     * like a Co-Simulation FMU. The step size is controlled within each communication step. Time events, state events
+     * (sign changes of the event indicators, located by bisection) and step events are handled with an event
+     * iteration, as in the FMI 2.0 standard. The inputs are held constant over a communication step.
+     */
+    class Integrator {
+
+    public:
+        enum Method {
+            /// Explicit Runge-Kutta 5(4) of Dormand and Prince. Good for most models.
+            METHOD_RK45,
+
+            /// Implicit Euler, the first order BDF, with Newton iterations on a finite difference Jacobian. For stiff models.
+            METHOD_BDF1
+        };
+
+        static const double DEFAULT_TOLERANCE;
+
+        /// What the integrator knows besides the FMU state. Saved and restored along with FMU states.
+        struct Snapshot {
+            double stepSize;
+            fmi2_event_info_t eventInfo;
+            bool terminated;
+            fmi2_status_t lastStatus;
+            double lastSuccessfulTime;
+            std::vector<double> nominals;
+        };
+
+    private:
+        fmi2_import_t* m_fmu;
+        Method m_method;
+        double m_relativeTolerance;
+        size_t m_numStates;
+        size_t m_numIndicators;
+
+        /// Nominal value of each state, which scales its absolute tolerance
+        std::vector<double> m_nominals;
+
+        /// Step size to try next, 0 before the first step
+        double m_stepSize;
+
+        /// From the last event iteration
+        fmi2_event_info_t m_eventInfo;
+        bool m_terminated;
+
+        /// Of the last doStep(): what it returned and the time it got to
+        fmi2_status_t m_lastStatus;
+        double m_lastSuccessfulTime;
+
+        /// States, derivatives and event indicators at the current time, at the end of a step, and of a step tried
+        /// while locating a state event
+        std::vector<double> m_x, m_dx, m_z;
+        std::vector<double> m_xNew, m_dxNew, m_zNew;
+        std::vector<double> m_xTry, m_dxTry, m_zTry;
+
+        /// Scratch space of the methods
+        std::vector<double> m_k[7];
+        std::vector<double> m_error;
+        std::vector<double> m_jacobian;
+        std::vector<int> m_pivots;
+
+        /// Set the time and states and get the derivatives
+        fmi2_status_t derivatives(double time, const std::vector<double>& states, std::vector<double>& derivatives);
+
+        /**
+         * Take one step of size h from time and states, with derivatives the derivatives there. Leaves the FMU at
+         * the end of the step.
+         * @param newDerivatives Set to the derivatives at the end of the step
+         * @param error Set to the scaled norm of the error estimate. The step is accepted if it is at most 1.
+         */
+        fmi2_status_t step(double time, const std::vector<double>& states, const std::vector<double>& derivatives,
+                           double h, std::vector<double>& newStates, std::vector<double>& newDerivatives, double* error);
+        fmi2_status_t stepRK45(double time, const std::vector<double>& states, const std::vector<double>& derivatives,
+                               double h, std::vector<double>& newStates, std::vector<double>& newDerivatives, double* error);
+        fmi2_status_t stepBDF1(double time, const std::vector<double>& states, const std::vector<double>& derivatives,
+                               double h, std::vector<double>& newStates, std::vector<double>& newDerivatives, double* error);
+
+        /// Root mean square of values, each divided by the tolerance of its state
+        double errorNorm(const std::vector<double>& values, const std::vector<double>& states,
+                         const std::vector<double>& newStates) const;
+
+        /// Read the nominal values of the states, if the FMU gives them
+        void readNominals();
+
+        /// Iterate the discrete states, in event mode
+        fmi2_status_t iterateEvent();
+
+        /**
+         * Handle an event at time: enter event mode, iterate the discrete states, go back to continuous time mode and
+         * read the states, derivatives and event indicators again.
+         */
+        fmi2_status_t handleEvent(double time);
+
+    public:
+        Integrator(fmi2_import_t* fmu, Method method, double relativeTolerance);
+        ~Integrator();
+
+        Method getMethod() const {return m_method;}
+        void setRelativeTolerance(double relativeTolerance) {m_relativeTolerance = relativeTolerance;}
+        double getRelativeTolerance() const {return m_relativeTolerance;}
+
+        /**
+         * Finish the initialization. Call right after fmi2ExitInitializationMode, which leaves the FMU in event mode.
+         * Does the event iteration and enters continuous time mode.
+         */
+        fmi2_status_t initialize();
+
+        /**
+         * Integrate from currentTime to currentTime + stepSize, like fmi2DoStep. Returns fmi2_status_discard if the
+         * FMU asked to terminate the simulation, and fmi2_status_error if the step size got too small.
+         */
+        fmi2_status_t doStep(double currentTime, double stepSize);
+
+        /// Forget what was learnt about the model, after the FMU was reset
+        void reset();
+
+        /// Save the state of the integrator, when an FMU state is made
+        void save(Snapshot& snapshot) const;
+
+        /// Go back to a saved state, when the FMU state it was saved with is set
+        void restore(const Snapshot& snapshot);
+
+        /// True once the FMU asked to terminate the simulation
+        bool isTerminated() const {return m_terminated;}
+
+        /// What fmi2GetStatus and fmi2GetRealStatus would give for fmi2DoStepStatus and fmi2LastSuccessfulTime
+        fmi2_status_t getLastStatus() const {return m_lastStatus;}
+        double getLastSuccessfulTime() const {return m_lastSuccessfulTime;}
+    };
+
+};
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef JACOBIANPATTERN_H_
+#define JACOBIANPATTERN_H_
+
+#include <vector>
+#include <stddef.h>
+#define FMILIB_BUILDING_LIBRARY
+#include <fmilib.h>
+
+namespace fmitcp {
+
+    /**
+     * @brief Sparsity pattern of a Jacobian block, and a grouping of its columns for computing it.
+     * Rows are unknowns and columns are knowns. Columns that have no row in common can be seeded together: one
+     * directional derivative with all of them set to 1 gives each of their entries, since each row sees only one of
+     * them. So a block that is sparse needs far fewer directional derivatives than it has columns.
+     */
+    class JacobianPattern {
+
+    private:
+        int m_numRows;
+        int m_numColumns;
+
+        /// Columns that may be nonzero in each row, ascending
+        std::vector<std::vector<int> > m_rows;
+
+        /// Rows that may be nonzero in each column, ascending
+        std::vector<std::vector<int> > m_columns;
+
+        /// Columns of each group
+        std::vector<std::vector<int> > m_groups;
+
+        /// Fill m_columns and group the columns
+        void finish();
+
+    public:
+        /// What finiteDifferences() differentiates
+        class Function {
+        public:
+            virtual ~Function() {}
+
+            /**
+             * Evaluate the unknowns with the given columns set to values and the other knowns as they are. Without
+             * columns, the unknowns are evaluated at the knowns as they are. Must leave the knowns as they were.
+             */
+            virtual fmi2_status_t evaluate(const std::vector<int>& columns, const std::vector<double>& values,
+                                           double* unknowns) = 0;
+        };
+
+        JacobianPattern();
+        ~JacobianPattern();
+
+        /// Pattern where every entry may be nonzero
+        void setDense(int numRows, int numColumns);
+
+        /// Pattern with the given columns in each row. The columns need not be sorted.
+        void setRows(int numColumns, const std::vector<std::vector<int> >& rows);
+
+        /**
+         * Pattern from the dependencies of the outputs and derivatives in the model description. Variables are
+         * matched by value reference and must be reals. A row of an unknown that is neither an output nor a
+         * derivative, or whose dependencies are not given, is dense. So is the column of a known that is neither an
+         * input nor a state, since dependencies only name those.
+         */
+        void build(fmi2_import_t* fmu, const fmi2_value_reference_t* unknowns, size_t numUnknowns,
+                   const fmi2_value_reference_t* knowns, size_t numKnowns);
+
+        int getNumRows() const {return m_numRows;}
+        int getNumColumns() const {return m_numColumns;}
+        const std::vector<int>& getRow(int row) const {return m_rows[row];}
+        const std::vector<int>& getColumn(int column) const {return m_columns[column];}
+
+        /// Number of entries that may be nonzero
+        size_t getNumNonzeros() const;
+
+        /// Groups of columns that can be seeded together
+        int getNumGroups() const {return (int)m_groups.size();}
+        const std::vector<int>& getGroup(int group) const {return m_groups[group];}
+
+        /**
+         * Compute the entries that may be nonzero with forward differences, perturbing the columns of each group
+         * together. Stops at the first evaluation that fails.
+         * @param knowns Values of the knowns that the function is evaluated at
+         * @param perturbation Relative perturbation of the knowns, at least this much in absolute terms
+         * @param jacobian All entries, row by row. The others are left as they are.
+         * @param numSeeds Set to the number of perturbed evaluations
+         * @return The status of the failing evaluation, or of the last one
+         */
+        fmi2_status_t finiteDifferences(Function& function, const double* knowns, double perturbation,
+                                        double* jacobian, int* numSeeds) const;
+    };
+
+};
+
+#endif
@@ -5,9 +5,24 @@
 #include <stdarg.h>
 #include <stdlib.h>
 
+/**
+ * Log through a Logger, but only evaluate the arguments if the message type passes the filter. Use this when the
+ * arguments are expensive to build, e.g. arrayToString(...) or DebugString().
+ */
+#define FMITCP_LOG(logger, type, ...) \
+    do { \
+        if ((logger).isEnabled(type)) { \
+            (logger).log(type, __VA_ARGS__); \
+        } \
+    } while (0)
+
 namespace fmitcp {
 
-    /// Logs stuff with a filter
+    /**
+     * @brief Logs stuff with a filter.
+     * Messages are formatted on the calling thread and written to stdout by a background thread, so logging does
+     * not wait for the terminal. Messages of filtered types are dropped before any formatting.
+     */
     class Logger {
 
     private:
@@ -20,13 +35,19 @@ namespace fmitcp {
 
     public:
 
-        /// Log message filter types
+        /// Log message filter types. Can be OR'ed together for setFilter().
         enum LogMessageType {
-            LOG_DEBUG,
-            LOG_NETWORK,
-            LOG_ERROR
+            LOG_DEBUG = 1,
+            LOG_NETWORK = 2,
+            LOG_ERROR = 4,
+
+            /// Full dump of every sent message. Costly, so it is not enabled by default.
+            LOG_NETWORK_DEBUG = 8
         };
 
+        /// Default filter: everything except LOG_NETWORK_DEBUG
+        static const int DEFAULT_FILTER = LOG_DEBUG | LOG_NETWORK | LOG_ERROR;
+
         Logger();
         virtual ~Logger();
 
@@ -35,6 +56,14 @@ namespace fmitcp {
         virtual void setFilter(int filter);
         virtual int getFilter() const;
         void setPrefix(std::string prefix);
+
+        /// True if messages of the given type pass the filter
+        bool isEnabled(LogMessageType type) const {
+            return (m_filter & type) != 0;
+        }
+
+        /// Write all buffered log messages to stdout, and wait until they are written.
+        static void flush();
     };
 
 };
@@ -0,0 +1,51 @@
+#ifndef LOOPBACKTRANSPORT_H_
+#define LOOPBACKTRANSPORT_H_
+
+#include "Transport.h"
+#include "EventPump.h"
+
+namespace fmitcp {
+
+    struct LoopbackChannel;
+
+    /**
+     * @brief One end of an in-process connection, e.g. between a Client and a Server on the same event pump.
+     * What is written to one end is queued and handed to the listener of the other end from the event pump, never
+     * from within write(), so a response callback may send the next request like over a socket. By default, whole
+     * messages are passed on without being serialized.
+     */
+    class LoopbackTransport : public Transport {
+
+    private:
+        LoopbackChannel * m_channel;
+
+        /// Index of this end in the channel
+        int m_side;
+        bool m_passMessages;
+        bool m_closedNotified;
+
+        LoopbackTransport(LoopbackChannel * channel, int side, bool passMessages);
+
+    public:
+        /**
+         * Make a connected pair of transports. Each end is deleted by its owner; the queued data goes away with the
+         * second one.
+         * @param passMessages False to serialize messages like other transports, e.g. to measure what that costs.
+         */
+        static void createPair(EventPump * pump, bool passMessages, LoopbackTransport ** first, LoopbackTransport ** second);
+
+        ~LoopbackTransport();
+
+        void write(const char * data, size_t size);
+        bool passesMessages() const;
+        bool writeMessage(const fmitcp_proto::fmitcp_message& message);
+        void close();
+        bool isConnected() const;
+
+        /// Hand the queued data to the listener. Called by the event pump.
+        void deliver();
+    };
+
+};
+
+#endif
@@ -0,0 +1,293 @@
+#ifndef MASTER_H_
+#define MASTER_H_
+
+#include "EventPump.h"
+#include "Logger.h"
+#include "fmitcp.pb.h"
+#include <string>
+#include <vector>
+#include <map>
+
+using namespace std;
+
+namespace fmitcp {
+
+    class SlaveClient;
+
+    /**
+     * @brief Co-simulation master that steps a number of slaves with a fixed step size.
+     * Each slave is an FMU served by a Server, reached through its own Client connection. With the Jacobi scheme, all
+     * slaves are stepped at the same time with fmi2_import_step_exchange, using the outputs of the previous step as
+     * inputs. A step therefore takes as long as the slowest slave, not the sum of all slaves. With the Gauss-Seidel
+     * scheme, the slaves are stepped in levels; see setScheme(). Where the servers support it, the value references
+     * are sent once and kept on the servers, so that a step only sends values, or only the changed ones with
+     * setDeltaEncoding().
+     *
+     * Everything runs on the event pump: call simulate() and then run the pump. onSimulationDone is called at the end.
+     */
+    class Master {
+
+        friend class SlaveClient;
+
+    public:
+
+        /// Type of a connected variable
+        enum ValueType {
+            REAL,
+            INTEGER,
+            BOOLEAN,
+            STRING
+        };
+
+        /// How the slaves are ordered within a macro step
+        enum Scheme {
+            JACOBI,
+            GAUSS_SEIDEL
+        };
+
+    private:
+
+        /// Copies an output of one slave to an input of another after each step
+        struct Connection {
+            ValueType type;
+
+            /// Index in the output refs of the source slave
+            int fromIndex;
+
+            int toSlave;
+
+            /// Index in the input refs of the target slave
+            int toIndex;
+        };
+
+        /// The value ref lists of a slave
+        enum RefList {
+            REAL_INPUT_REFS,
+            INTEGER_INPUT_REFS,
+            BOOLEAN_INPUT_REFS,
+            STRING_INPUT_REFS,
+            REAL_OUTPUT_REFS,
+            INTEGER_OUTPUT_REFS,
+            BOOLEAN_OUTPUT_REFS,
+            STRING_OUTPUT_REFS,
+            NUM_REF_LISTS
+        };
+
+        struct Slave {
+            SlaveClient * client;
+            string host;
+            long port;
+            int fmuId;
+            bool instantiated;
+            int nextMessageId;
+
+            /// True once the connection is gone
+            bool lost;
+
+            /// True while a free request for the instance is unanswered
+            bool freePending;
+
+            /// Inputs sent with each step
+            vector<int> realInputRefs;
+            vector<double> realInputs;
+            vector<int> integerInputRefs;
+            vector<int> integerInputs;
+            vector<int> booleanInputRefs;
+            vector<bool> booleanInputs;
+            vector<int> stringInputRefs;
+            vector<string> stringInputs;
+
+            /// Outputs read after each step, and their latest values
+            vector<int> realOutputRefs;
+            vector<double> realOutputs;
+            vector<int> integerOutputRefs;
+            vector<int> integerOutputs;
+            vector<int> booleanOutputRefs;
+            vector<bool> booleanOutputs;
+            vector<int> stringOutputRefs;
+            vector<string> stringOutputs;
+
+            /// Connections from the outputs of this slave
+            vector<Connection> connections;
+
+            /// Model description, fetched for the Gauss-Seidel scheme
+            string xml;
+
+            /// True if the ref lists are kept on the server, so that requests name them by refSets instead
+            bool prepared;
+
+            /// Id of each prepared ref list, 0 for an empty list
+            int refSets[NUM_REF_LISTS];
+
+            /// The list each prepare request is for, by message id
+            map<int, RefList> preparing;
+        };
+
+        /// Where the simulation is. Each state waits for one response per request sent.
+        enum State {
+            IDLE,
+            CONNECTING,
+            READING_XML,
+            INSTANTIATING,
+            PREPARING,
+            INITIALIZING,
+            READING_OUTPUTS,
+            STEPPING,
+            TERMINATING,
+            FREEING,
+            DONE
+        };
+
+        vector<Slave*> m_slaves;
+        State m_state;
+        Scheme m_scheme;
+
+        /// Passed on to the slave clients, see setDeltaEncoding()
+        bool m_delta;
+        double m_realThreshold;
+
+        /// Passed on to the slave clients, see setXmlCacheDir()
+        string m_xmlCacheDir;
+
+        /// Slaves that step at the same time, in the order the groups step
+        vector<vector<int> > m_levels;
+
+        /// Level that is stepping
+        size_t m_level;
+
+        /// Responses left before the next state
+        int m_numPending;
+
+        /// True if a slave call failed
+        bool m_failed;
+
+        double m_startTime;
+        double m_stopTime;
+        double m_stepSize;
+        double m_time;
+        long m_step;
+        long m_numSteps;
+
+        /// Add a value ref to a list if it is not there yet, and return its index
+        static int addRef(vector<int>& refs, int valueRef);
+
+        /// Index of a value ref in a list, or -1
+        static int findRef(const vector<int>& refs, int valueRef);
+
+        static vector<int>& getRefList(Slave * slave, RefList list);
+
+        /// Send one request per slave for the next state
+        void advance();
+        void instantiateSlaves();
+
+        /// Keep the ref lists of the slaves on their servers, where supported, so each step does not resend them
+        void prepareRefLists();
+
+        /// Order the slaves into m_levels, by the connections between them
+        void buildLevels();
+        void startStep();
+        void stepLevel();
+        void terminateSlaves();
+
+        /// Free the instances that were created. Returns the number of requests sent.
+        int sendFreeInstances();
+        void finish();
+
+        /// Copy the latest outputs of a slave to the connected inputs
+        void routeOutputs(Slave * slave);
+
+        /// One response of the current state arrived. Only the frees count while freeing, see slaveFreed().
+        void responseDone(bool ok);
+
+        /// Called by the slave clients
+        void slaveConnected(int slave);
+        void slaveLost(int slave, string message);
+        void slaveXml(int slave, const string& xml);
+        void slaveInstantiated(int slave, fmitcp_proto::jm_status_enu_t status, int fmuId);
+        void slavePrepared(int slave, int mid, fmitcp_proto::fmi2_status_t status, int valueReferenceSet);
+        void slaveStatus(int slave, fmitcp_proto::fmi2_status_t status);
+        void slaveFreed(int slave);
+        void slaveRealOutputs(int slave, const vector<double>& values, fmitcp_proto::fmi2_status_t status);
+        void slaveIntegerOutputs(int slave, const vector<int>& values, fmitcp_proto::fmi2_status_t status);
+        void slaveBooleanOutputs(int slave, const vector<bool>& values, fmitcp_proto::fmi2_status_t status);
+        void slaveStringOutputs(int slave, const vector<string>& values, fmitcp_proto::fmi2_status_t status);
+        void slaveStepped(int slave, fmitcp_proto::fmi2_status_t status, const vector<double>& realValues, const vector<int>& integerValues, const vector<bool>& booleanValues, const vector<string>& stringValues);
+
+    protected:
+
+        /// Event pump that drives the slave connections
+        EventPump * m_pump;
+
+        /// For logging
+        Logger m_logger;
+
+    public:
+        Master(EventPump * pump);
+        virtual ~Master();
+
+        /// Add a slave served at host:port. Returns the index of the slave.
+        int addSlave(string host, long port);
+
+        /// Number of slaves
+        int getNumSlaves() const;
+
+        /**
+         * Set the scheme. JACOBI is the default.
+         *
+         * GAUSS_SEIDEL orders the slaves by the connections between them. Slaves that do not depend on each other
+         * form a level and step at the same time; the next level steps when they are done and gets their new
+         * outputs, like in plain Gauss-Seidel. Loops are broken where the outputs do not depend directly on the
+         * inputs, according to the model descriptions of the slaves, and the slave after the break gets the value
+         * of the previous step. Call before simulate().
+         */
+        void setScheme(Scheme scheme);
+        Scheme getScheme() const;
+
+        /**
+         * Only send the inputs and outputs that changed since the previous step, see Client::setDeltaEncoding().
+         * Off by default.
+         */
+        void setDeltaEncoding(bool delta, double realThreshold = 0);
+
+        /// Keep the model descriptions of the slaves in a directory, see Client::setXmlCacheDir()
+        void setXmlCacheDir(const string& dir);
+
+        /// The slaves of each level, in stepping order. Known once the simulation has started stepping.
+        const vector<vector<int> >& getLevels() const;
+
+        /**
+         * Connect an output of one slave to an input of another. After each step, the output value is passed on to
+         * the input for the next step. Call before simulate().
+         */
+        void connect(int fromSlave, int outputValueRef, int toSlave, int inputValueRef, ValueType type = REAL);
+
+        /// Read an output after each step even if it is not connected, so it can be fetched with getReal() etc.
+        void addOutput(int slave, int outputValueRef, ValueType type = REAL);
+
+        /// Latest value of an output added with connect() or addOutput()
+        double getReal(int slave, int outputValueRef) const;
+        int getInteger(int slave, int outputValueRef) const;
+        bool getBoolean(int slave, int outputValueRef) const;
+        string getString(int slave, int outputValueRef) const;
+
+        /// Connect to the slaves and simulate from startTime to stopTime. The pump must run for anything to happen.
+        void simulate(double startTime, double stopTime, double stepSize);
+
+        /// Time of the latest completed step
+        double getTime() const;
+
+        Logger * getLogger();
+
+        /// To be implemented in subclass. Called after each step, when the outputs have been routed.
+        virtual void onStepCompleted(double time){}
+
+        /// To be implemented in subclass. Called when the slaves are freed, or when a slave was lost.
+        virtual void onSimulationDone(bool ok){}
+
+        /// To be implemented in subclass
+        virtual void onError(string message){}
+    };
+
+};
+
+#endif
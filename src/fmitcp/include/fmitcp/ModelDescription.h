@@ -0,0 +1,56 @@
+#ifndef MODELDESCRIPTION_H_
+#define MODELDESCRIPTION_H_
+
+#include <string>
+#define FMILIB_BUILDING_LIBRARY
+#include <fmilib.h>
+#include "Logger.h"
+
+namespace fmitcp {
+
+    /**
+     * @brief Parsed modelDescription.xml of an FMU, e.g. one fetched with get_xml.
+     * Lets a client look up variables and their dependencies without having the FMU itself.
+     */
+    class ModelDescription {
+
+    private:
+        Logger m_logger;
+        jm_callbacks m_callbacks;
+        fmi_import_context_t* m_context;
+        fmi2_import_t* m_fmu;
+
+        /// All model variables, in the order of the XML. Dependencies refer to this order.
+        fmi2_import_variable_list_t* m_variables;
+
+        static void logger(jm_callbacks* c, jm_string module, jm_log_level_enu_t logLevel, jm_string message);
+        void clear();
+
+    public:
+        ModelDescription();
+        ~ModelDescription();
+
+        /// Parse the contents of a modelDescription.xml. Returns false if it could not be parsed.
+        bool parse(const std::string& xml);
+
+        bool isParsed() const {return m_fmu != NULL;}
+
+        /// The parsed model, or NULL
+        fmi2_import_t* getImport() {return m_fmu;}
+
+        /// Get a variable by type and value reference, or NULL if there is none
+        fmi2_import_variable_t* getVariable(fmi2_base_type_enu_t type, int valueRef);
+
+        /// Causality of a variable, or fmi2_causality_enu_unknown if there is no such variable
+        fmi2_causality_enu_t getCausality(fmi2_base_type_enu_t type, int valueRef);
+
+        /**
+         * True if an output depends directly on an input, i.e. a new input changes it without a step. Also true when
+         * the model description does not list the dependencies of the output, since that means it may depend on all.
+         */
+        bool dependsOnInputs(fmi2_base_type_enu_t type, int valueRef);
+    };
+
+};
+
+#endif
@@ -2,20 +2,44 @@
 #define SERVER_H_
 
 #include <string>
+#include <map>
+#include <vector>
+#include <set>
 #define lw_import
 #include <lacewing.h>
 #define FMILIB_BUILDING_LIBRARY
 #include <fmilib.h>
 #include "EventPump.h"
 #include "Logger.h"
+#include "FrameDecoder.h"
+#include "WorkerPool.h"
+#include "FmuStateStore.h"
+#include "JacobianPattern.h"
+#include "Integrator.h"
+#include "Transport.h"
+#include "TcpTransport.h"
 #include "fmitcp.pb.h"
 
 using namespace std;
 
 namespace fmitcp {
 
-  /// Serves an FMU to a port via FMI/TCP.
-  class Server {
+  struct ServerJob;
+  struct ServerJobs;
+
+  /**
+   * Serves an FMU to a port via FMI/TCP. A client on the same machine may move its connection to shared memory, see
+   * ShmTransport.
+   */
+  class Server : public TransportListener {
+
+  public:
+
+    /**
+     * Handles one type of request. Unpacks the request, runs it and fills in the response.
+     * @return false if there is no response to send
+     */
+    typedef bool (Server::*MessageHandler)(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
 
   private:
     Logger m_logger;
@@ -23,6 +47,89 @@ namespace fmitcp {
     bool m_sendDummyResponses;
     bool m_fmuParsed;
 
+    /// State of a connection to a client
+    struct Connection {
+      /// Unique id. A worker response is dropped if its connection is gone.
+      unsigned int id;
+
+      /// Reassembly buffer
+      FrameDecoder decoder;
+
+      /// Shared memory transport the client moved to, closed along with this connection. NULL if none.
+      Transport * shm;
+
+      /// For a shared memory transport: the connection that set it up. NULL otherwise.
+      Transport * control;
+
+      /// Protocol version from the hello of the client, 0 until it has arrived
+      int protocolVersion;
+
+      /// Capabilities as bits 1 << capability: listed in the hello of the server, and listed in both hellos. The
+      /// latter is 0 until the hello of the client has arrived.
+      unsigned int offered;
+      unsigned int capabilities;
+    };
+
+    /// Connected clients, by the transport they talk through. The server owns the transports.
+    map<Transport*, Connection> m_connections;
+    unsigned int m_nextConnectionId;
+
+    /// Transport of each TCP client
+    map<lw_client, TcpTransport*> m_tcpTransports;
+
+    /// Listening Unix domain socket, or -1
+    int m_unixSocket;
+    string m_unixSocketPath;
+    lw_pump_watch m_unixSocketWatch;
+
+    /// True if clients may move to shared memory
+    bool m_sharedMemory;
+
+    /// Request handlers, indexed by message type
+    vector<MessageHandler> m_handlers;
+
+    /// Fill in m_handlers
+    void registerHandlers();
+
+    /// Threads that run the FMU calls, one serial queue per fmuId
+    WorkerPool m_workers;
+    int m_numWorkers;
+
+    /// Finished worker jobs, ready to be reused. Only touched on the pump thread.
+    vector<ServerJob*> m_freeJobs;
+
+    /// Jobs that are not back from the workers yet, see ServerJobs
+    ServerJobs * m_jobs;
+
+    /// Register a new connection
+    Connection& openConnection(Transport * transport);
+
+    /// Handle a request about the connection itself rather than the FMU. Returns false if it is not one.
+    bool handleConnectionMessage(Transport * transport, fmitcp_proto::fmitcp_message& req);
+
+    /// Greet a new client with what this server supports
+    void sendHello(Transport * transport);
+
+    /// Answer a request with error_res instead of its response
+    void sendError(Transport * transport, int messageId, const string& reason);
+
+    /// Refuse a request that the connection may not make. Returns false if it was answered with an error.
+    bool allowRequest(Transport * transport, const fmitcp_proto::fmitcp_message& req);
+
+    /// Read modelDescription.xml from the unpacked FMU into m_xml
+    void loadXml();
+
+    /// Unpack the FMU into m_workingDir, or find it in the unpack cache, and get its version
+    void unpackFmu();
+
+    /// Remove m_workingDir, unless it is in the unpack cache
+    void removeWorkingDir();
+
+    /// Request, response and send buffer reused for every message handled on the pump thread
+    fmitcp_proto::fmitcp_message m_request;
+    fmitcp_proto::fmitcp_message m_response;
+    string m_sendBuffer;
+
   protected:
     EventPump * m_pump;
     string m_fmuPath;
@@ -34,11 +141,110 @@ namespace fmitcp {
 
     /// Directory for the unpacked FMU
     string m_workingDir;
+
+    /// Directory of FMUs unpacked by earlier servers, see the constructor. Empty if there is none.
+    string m_unpackCacheDir;
+
+    /// True if m_workingDir is in the unpack cache, so it is kept when the server goes away
+    bool m_workingDirCached;
     fmi_import_context_t* m_context;
     fmi_version_enu_t m_version;
 
-    /// FMI 2.0 instance
-    fmi2_import_t* m_fmi2Instance;
+    /// Parsed FMI 2.0 model. Its XML and binary are shared by all instances of the FMU.
+    fmi2_import_t* m_fmi2Model;
+    fmi2_fmu_kind_enu_t m_fmuKind;
+
+    /// True if the FMU only supports Model Exchange. Its instances are then integrated on the server, see setIntegrator().
+    bool m_modelExchange;
+    Integrator::Method m_integratorMethod;
+    double m_integratorTolerance;
+
+    /// modelDescription.xml, read once when the FMU is unpacked, and its contentHash(). Empty without an FMU.
+    string m_xml;
+    string m_xmlHash;
+
+    /// True if m_fmi2Model currently hosts an instance, or is taken for one that is being made. Needs m_instancesLock.
+    bool m_fmi2ModelInUse;
+
+    /// FMI 2.0 instances, keyed by fmuId
+    map<int, fmi2_import_t*> m_fmi2Instances;
+    int m_nextFmuId;
+
+    /// Instances that are reset and ready to be handed out, see setInstancePoolSize()
+    vector<fmi2_import_t*> m_instancePool;
+    size_t m_instancePoolSize;
+
+    /// Saved FMU states of each instance, keyed by fmuId
+    map<int, FmuStateStore> m_fmuStates;
+    size_t m_maxFmuStates;
+
+    /// Max size of a serialized state that a client sends, see setMaxSerializedStateSize()
+    size_t m_maxSerializedStateSize;
+
+    /// Values last sent to the client for a list, to send only the ones that changed. A vector is valid if its size fits the list.
+    struct SentValues {
+      vector<fmi2_real_t> reals;
+      vector<fmi2_integer_t> integers;
+      vector<fmi2_boolean_t> booleans;
+      vector<string> strings;
+    };
+
+    /// Value reference lists prepared for one instance, by id
+    struct ValueReferenceSets {
+      int nextId;
+      map<int, vector<fmi2_value_reference_t> > sets;
+
+      /// Values sent for the lists, by connection id and list id. Each client keeps its own copy to compare with.
+      map<pair<unsigned int, int>, SentValues> sent;
+
+      /**
+       * Lists whose inputs failed to set, by connection id and list id (0 for the references in the request). The
+       * client may already have sent changes against the values that failed, so changes are refused until it sends
+       * all values of the list again.
+       */
+      set<pair<unsigned int, int> > lostInputs;
+      ValueReferenceSets() : nextId(1) {}
+    };
+
+    /// Prepared value reference lists of each instance, keyed by fmuId
+    map<int, ValueReferenceSets> m_valueReferenceSets;
+
+    /// Outputs read after each step of an instance
+    struct OutputSubscription {
+      vector<fmi2_value_reference_t> realValueReferences;
+      vector<fmi2_value_reference_t> integerValueReferences;
+      vector<fmi2_value_reference_t> booleanValueReferences;
+      vector<fmi2_value_reference_t> stringValueReferences;
+
+      /// True to send only the changed values, with the smallest change of a real that counts
+      bool delta;
+      double realThreshold;
+
+      /// Values sent, by connection id
+      map<unsigned int, SentValues> sent;
+    };
+
+    /// Output subscriptions, keyed by fmuId
+    map<int, OutputSubscription> m_outputSubscriptions;
+
+    /// Integrators of the instances of a Model Exchange FMU, keyed by fmuId
+    map<int, Integrator*> m_integrators;
+
+    /**
+     * Connection of the request that runs on each instance, keyed by fmuId. The requests to an instance run one at a
+     * time, so a handler finds its own connection here. Entries go with the instance, since connection ids are not
+     * reused.
+     */
+    map<int, unsigned int> m_requestConnections;
+
+    /// Socket connection that made each instance, keyed by fmuId. Its instances are freed when it closes.
+    map<int, unsigned int> m_instanceOwners;
+
+    /// Protects the instance table, m_instancePool, m_fmuStates, m_valueReferenceSets, m_outputSubscriptions, m_integrators, m_requestConnections and m_instanceOwners, which are shared by the workers
+    lw_sync m_instancesLock;
+
+    /// Serializes parsing, loading and unloading of instances besides m_fmi2Model, which share m_context
+    lw_sync m_contextLock;
     fmi2_callback_functions_t m_fmi2CallbackFunctions;
     fmi2_import_variable_list_t* m_fmi2Variables;
 
@@ -46,11 +252,216 @@ namespace fmitcp {
     char* m_fmuLocation;
     char* m_resourcePath;
 
+    /**
+     * Get the instance with the given fmuId.
+     * @param status Set to fmi2_status_error if there is no such instance. May be NULL.
+     * @return The instance, or NULL if there is none.
+     */
+    fmi2_import_t* getFmi2Import(int fmuId, fmi2_status_t* status);
+
+    /**
+     * Get the saved states of an instance. Only the queue of the instance may use the store.
+     * @param status Set to fmi2_status_error if there is no such instance. May be NULL.
+     */
+    FmuStateStore* getFmuStateStore(int fmuId, fmi2_status_t* status);
+
+    /**
+     * Get the prepared value reference lists of an instance. Only the queue of the instance may use them.
+     * @param create True to make them if the instance has none yet.
+     * @return The lists, or NULL if there are none.
+     */
+    ValueReferenceSets* getValueReferenceSets(int fmuId, bool create);
+
+    /**
+     * Find the value references of a get or set request: the prepared list if valueReferenceSet is not 0, otherwise
+     * the list in the request, copied to buffer.
+     * @param numValues Number of values sent along, which must match the number of references. -1 for a get.
+     * @return false if the prepared list does not exist or the values do not match. Then status is set to
+     * fmi2_status_error and nvr to 0.
+     */
+    bool resolveValueReferences(int fmuId, int valueReferenceSet,
+                                const google::protobuf::RepeatedField<google::protobuf::int32>& valueReferences,
+                                int numValues, fmi2_value_reference_t* buffer,
+                                const fmi2_value_reference_t** vr, size_t* nvr, fmi2_status_t* status);
+
+    /**
+     * Narrow resolved value references down to the positions in indices, for a set request that only has the
+     * changed values.
+     * @return false if the indices do not match the values or the list. Then status is set to fmi2_status_error and
+     * nvr to 0.
+     */
+    bool selectValueReferences(const google::protobuf::RepeatedField<google::protobuf::int32>& indices, int numValues,
+                               fmi2_value_reference_t* buffer, const fmi2_value_reference_t** vr, size_t* nvr,
+                               fmi2_status_t* status);
+
+    /**
+     * Get the values last sent for a prepared list to the connection of the request, for a request that asks for only
+     * the changed values.
+     * @return The values, or NULL if the request does not ask for it or the list does not exist.
+     */
+    SentValues* getSentValues(int fmuId, int valueReferenceSet, bool delta);
+
+    /**
+     * Check that changed inputs for a list may be set, which they may not after a set for the list failed on the
+     * connection of the request.
+     * @return false if they may not. Then status is set to fmi2_status_error.
+     */
+    bool deltaInputsValid(int fmuId, int valueReferenceSet, fmi2_status_t* status);
+
+    /// Note whether the inputs of a request for a list were set, see ValueReferenceSets::lostInputs.
+    void trackInputs(int fmuId, int valueReferenceSet, bool delta, bool set);
+
+    /// Get the connection of the request that runs on an instance
+    unsigned int getRequestConnection(int fmuId);
+
+    /**
+     * Get the output subscription of an instance. Only the queue of the instance may use it.
+     * @return The subscription, or NULL if there is none.
+     */
+    OutputSubscription* getOutputSubscription(int fmuId);
+
+    /**
+     * Get the integrator of an instance of a Model Exchange FMU. Only the queue of the instance may use it.
+     * @return The integrator, or NULL for a Co-Simulation FMU.
+     */
+    Integrator* getIntegrator(int fmuId);
+
+    /// Step an instance like fmi2DoStep. An instance of a Model Exchange FMU is integrated by its Integrator.
+    fmi2_status_t doStep(int fmuId, fmi2_import_t* fmu, double currentCommunicationPoint, double communicationStepSize, bool newStep);
+
+    /// A capability of the FMU, as Co-Simulation or Model Exchange FMU depending on which one is used
+    bool getCapability(fmi2_import_t* fmu, fmi2_capabilities_enu_t csCapability, fmi2_capabilities_enu_t meCapability);
+
+    /**
+     * Compute the entries of a Jacobian block that may be nonzero, with one directional derivative per group of
+     * columns of the pattern. Stops at the first call that fails.
+     * @param jacobian All entries, row by row. The others are left as they are.
+     * @param numSeeds Set to the number of directional derivatives computed.
+     * @return The status of the failing call, or of the last one.
+     */
+    fmi2_status_t directionalJacobian(fmi2_import_t* fmu, const JacobianPattern& pattern,
+                                      const fmi2_value_reference_t* unknowns, const fmi2_value_reference_t* knowns,
+                                      fmi2_real_t* jacobian, int* numSeeds);
+
+    /**
+     * The same with forward differences, for FMUs without directional derivatives. Saves the FMU state and restores
+     * it after each perturbed evaluation, so the instance is left as it was.
+     * @param stepSize If > 0, each evaluation is a step of this size from currentTime.
+     * @param perturbation Relative perturbation of the knowns, at least this much in absolute terms.
+     */
+    fmi2_status_t finiteDifferenceJacobian(int fmuId, fmi2_import_t* fmu, const JacobianPattern& pattern,
+                                           const fmi2_value_reference_t* unknowns, const fmi2_value_reference_t* knowns,
+                                           double currentTime, double stepSize, double perturbation,
+                                           fmi2_real_t* jacobian, int* numSeeds);
+
+    /// The unknowns of an instance as a function of its knowns, for finiteDifferenceJacobian
+    class InstanceFunction;
+
+    /// Read the unknowns of a finite difference, after a step of stepSize if it is > 0
+    fmi2_status_t evaluateUnknowns(int fmuId, fmi2_import_t* fmu, const fmi2_value_reference_t* unknowns, size_t nz,
+                                   double currentTime, double stepSize, fmi2_real_t* values);
+
+    /**
+     * Read the subscribed outputs into a do_step response, only the changed ones for a delta subscription. Only fills
+     * in values if all reads return ok or warning.
+     * @param fmu The instance, or NULL to send zeros for dummy responses.
+     */
+    void getSubscribedOutputs(fmi2_import_t* fmu, OutputSubscription& subscription, unsigned int connection,
+                              fmitcp_proto::fmi2_import_do_step_res* res, fmi2_status_t* status);
+
+    /**
+     * Instantiate the FMU once more, or take an instance from the pool. On success, fmuId is set to the id of the
+     * instance. The instance is made without m_instancesLock, which is only taken for the tables, so call it without.
+     */
+    jm_status_enu_t instantiateFmi2(int* fmuId);
+
+    /// Make a new instance, not yet in the instance table. Call without m_instancesLock.
+    jm_status_enu_t newFmi2Instance(fmi2_import_t** fmu);
+
+    /**
+     * Free an instance, or reset it and put it in the pool if there is room. The shared model stays loaded until the
+     * server is deleted. The instance is taken out of the tables first and freed without m_instancesLock, so call it
+     * without.
+     */
+    void freeFmi2Instance(int fmuId);
+
+    /// Free an instance that is not in the instance table. Call without m_instancesLock.
+    void deleteFmi2Instance(fmi2_import_t* fmu);
+
+    /**
+     * Take note of the instance in an instantiate response, made for the socket connection clientId. If that
+     * connection has closed meanwhile, the instance is freed right away. Called on the pump thread.
+     */
+    void instanceMade(const fmitcp_proto::fmitcp_message& res, unsigned int clientId);
+
+    /// Free the instances made by a socket connection that has closed, each in the queue of its requests
+    void freeInstancesOf(unsigned int clientId);
+
+    /**
+     * Set the handler for a message type. Subclasses may use this to add or replace handlers; a handler of a
+     * subclass is passed with static_cast<MessageHandler>(&Subclass::handler).
+     */
+    void setHandler(fmitcp_proto::fmitcp_message_Type type, MessageHandler handler);
+
+    /// Handler for requests that are not implemented. Sends no response.
+    bool handleUnimplemented(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+
+    /// Request handlers
+    virtual bool handle_fmi2_import_instantiate_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_fmi2_import_initialize_slave_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_fmi2_import_terminate_slave_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_fmi2_import_reset_slave_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_fmi2_import_free_slave_instance_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_fmi2_import_set_real_input_derivatives_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_fmi2_import_get_real_output_derivatives_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_fmi2_import_cancel_step_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_fmi2_import_do_step_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_fmi2_import_get_status_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_fmi2_import_get_real_status_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_fmi2_import_get_integer_status_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_fmi2_import_get_boolean_status_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_fmi2_import_get_string_status_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_fmi2_import_get_version_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_fmi2_import_set_debug_logging_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_fmi2_import_set_real_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_fmi2_import_set_integer_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_fmi2_import_set_boolean_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_fmi2_import_set_string_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_fmi2_import_get_real_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_fmi2_import_get_integer_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_fmi2_import_get_boolean_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_fmi2_import_get_string_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_fmi2_import_get_fmu_state_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_fmi2_import_set_fmu_state_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_fmi2_import_free_fmu_state_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_fmi2_import_serialized_fmu_state_size_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_fmi2_import_serialize_fmu_state_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_fmi2_import_de_serialize_fmu_state_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_fmi2_import_get_directional_derivative_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_get_xml_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_fmi2_import_step_exchange_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_prepare_value_references_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_release_value_references_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_subscribe_outputs_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+    virtual bool handle_get_jacobian_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res);
+
   public:
 
-    /// Create a server for an FMU using an eventpump
-    Server(string fmuPath, bool debugLogging, jm_log_level_enu_t logLevel, EventPump *pump);
-    Server(string fmuPath, bool debugLogging, jm_log_level_enu_t logLevel, EventPump *pump, const Logger &logger);
+    /**
+     * Create a server for an FMU using an eventpump.
+     * @param unpackCacheDir Existing directory where the FMU is unpacked under the hash of the FMU file, and kept.
+     * The next server for the same FMU then only hashes the file and loads the binary. Servers in several
+     * processes may share the directory. The FMU must not write to its unpacked files, e.g. its resources. Empty to
+     * unpack into a temporary directory, removed with the server.
+     */
+    Server(string fmuPath, bool debugLogging, jm_log_level_enu_t logLevel, EventPump *pump, const string& unpackCacheDir = "");
+    Server(string fmuPath, bool debugLogging, jm_log_level_enu_t logLevel, EventPump *pump, const Logger &logger,
+           const string& unpackCacheDir = "");
+
+    /**
+     * Waits for the requests that workers are running. Responses of finished requests that are still posted to the
+     * pump are dropped when the pump gets to them. Delete the server on the pump thread, or with the pump stopped.
+     */
     virtual ~Server();
 
     void init(EventPump *pump);
@@ -64,19 +475,102 @@ namespace fmitcp {
     /// To be implemented in subclass
     virtual void onError(string message){};
 
+    /// Events of the TCP server. Passed on to the transport of the client.
     void clientConnected(lw_client c);
     void clientDisconnected(lw_client c);
     void clientData(lw_client c, const char *data, size_t size);
+
+    /// Events of the transports
+    void transportData(Transport * transport, const char *data, size_t size);
+    void transportClosed(Transport * transport);
+    void transportError(Transport * transport, const string& message);
+
+    void transportMessage(Transport * transport, fmitcp_proto::fmitcp_message& message);
+
+    /// Handle one complete message from a client
+    void clientMessage(Transport * transport, const char *data, size_t size);
+
+    /// Run a request from a client and send the response. The request may be swapped with another message.
+    void clientRequest(Transport * transport, fmitcp_proto::fmitcp_message& req);
+
+    /**
+     * Run a request and fill in the response. Called on the pump thread, or on a worker thread if there are workers.
+     * @param fmuId Instance of the request, -1 if none
+     * @param clientId Id of the connection the request came from, or of its socket connection for shared memory
+     * @return false if there is no response to send
+     */
+    bool handleMessage(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res, int fmuId, unsigned int clientId);
+
+    /// Send the response of a finished worker job, if any, and recycle the job. Called on the pump thread.
+    void workerResponse(ServerJob * job);
+
+    /**
+     * Free an instance left behind by a closed connection, or forget it for dummy responses. Does nothing if its
+     * client freed it already. Runs like a request on the instance.
+     */
+    void freeLeftInstance(int fmuId);
     void error(lw_server s, lw_error err);
 
     /// Start hosting on a port.
     void host(string host, long port);
 
+    /**
+     * Start hosting on a Unix domain socket. For clients on the same machine, which connect with
+     * Client::connectUnix(). May be used together with host(). Returns false if the socket could not be made.
+     */
+    bool hostUnix(string path);
+
+    /// Accept the clients waiting on the Unix domain socket. Called by the event pump.
+    void unixSocketReady();
+
+    /**
+     * Serve a client through a transport that is connected already, e.g. one end of a LoopbackTransport pair. It
+     * gets the same greeting and handling as a TCP client. The server takes ownership of the transport.
+     */
+    void addConnection(Transport * transport);
+
+    /**
+     * Set the number of worker threads that run FMU calls. Requests to one FMU instance still run one at a time and
+     * in order. With 0 workers, which is the default, requests are handled on the event pump thread. Call before host().
+     */
+    void setNumWorkers(int numWorkers);
+    int getNumWorkers() const {return m_numWorkers;}
+
+    /// Set the max number of FMU states kept per instance. Older states are evicted when more are saved.
+    void setMaxFmuStates(size_t maxFmuStates);
+
+    /**
+     * Set the max size of a serialized FMU state that a client sends to be de-serialized. A state that says it is
+     * larger is refused with its first chunk, before any of it is kept.
+     */
+    void setMaxSerializedStateSize(size_t maxSize);
+
+    /**
+     * Keep up to poolSize FMU instances ready, so an instantiate request takes one rather than instantiating the FMU
+     * again. The pool is filled right away. A freed instance is reset with fmi2Reset and goes back to the pool if
+     * there is room. Good for running many short simulations of the same FMU. 0, the default, turns it off.
+     */
+    void setInstancePoolSize(size_t poolSize);
+    size_t getInstancePoolSize() const {return m_instancePoolSize;}
+
+    /**
+     * Set how the instances of an FMU that only supports Model Exchange are integrated. Such an FMU is served like a
+     * Co-Simulation FMU: each do_step is integrated on the server, with the events handled there. A tolerance given
+     * at initialization replaces relativeTolerance. Applies to instances made afterwards. The default is
+     * Integrator::METHOD_RK45 with Integrator::DEFAULT_TOLERANCE.
+     */
+    void setIntegrator(Integrator::Method method, double relativeTolerance);
+    Integrator::Method getIntegratorMethod() const {return m_integratorMethod;}
+
+    /// Let clients on the same machine move their connection to shared memory. On by default, where supported.
+    void setSharedMemory(bool sharedMemory);
+    bool getSharedMemory() const {return m_sharedMemory;}
+
     /// Set to true to start ignoring the local FMU and just send back dummy responses. Good for debugging the protocol.
     void sendDummyResponses(bool);
 
     /// Send a binary message to the client
-    void sendMessage(lw_client c, fmitcp_proto::fmitcp_message* message);
+    void sendMessage(Transport * transport, fmitcp_proto::fmitcp_message* message);
 
     Logger* getLogger() {return &m_logger;}
     void setLogger(const Logger &logger) {m_logger = logger;}
@@ -0,0 +1,106 @@
+#ifndef SHMTRANSPORT_H_
+#define SHMTRANSPORT_H_
+
+#include <string>
+#include "Transport.h"
+#include "EventPump.h"
+#define lw_import
+#include <lacewing.h>
+
+namespace fmitcp {
+
+    struct ShmHeader;
+    struct ShmWakeup;
+
+    /**
+     * @brief Transport over a shared memory segment, for a client and a server on the same machine.
+     * The segment holds one ring buffer per direction. The writer copies data into its ring and rings the doorbell
+     * of the other end. The reader thread of that end spins on its doorbell for a short while and then sleeps on it
+     * with a futex, so a busy connection is served without system calls and an idle one costs nothing. The spin gets
+     * longer while the other end answers within it and shorter while it does not. The reader thread only wakes up
+     * the event pump; the data is read and the listener is called on the pump thread, straight from the ring.
+     *
+     * The client creates the segment and the server opens it. Neither end notices if the other process dies, so the
+     * TCP connection that set up the segment should stay open and close the transport when it goes away.
+     *
+     * Only available on Linux. Elsewhere, create() and open() return NULL.
+     */
+    class ShmTransport : public Transport {
+
+    public:
+        /// Default size of each ring
+        static const size_t DEFAULT_RING_SIZE = 1024 * 1024;
+
+        /// True if shared memory transports are available on this platform
+        static bool isSupported();
+
+        /// Create a new segment, for the client end. Returns NULL if it could not be created.
+        static ShmTransport * create(EventPump * pump, size_t ringSize = DEFAULT_RING_SIZE);
+
+        /// Open a segment made by create(), for the server end, and remove its name. Returns NULL if it could not be opened.
+        static ShmTransport * open(EventPump * pump, const std::string& name);
+
+        ~ShmTransport();
+
+        /// Name of the segment, to pass to open()
+        const std::string& getName() const {return m_name;}
+
+        /// Remove the name of the segment. The memory goes away when both ends are deleted.
+        void unlink();
+
+        /// Start delivering events. Call after setListener().
+        void start();
+
+        void write(const char * data, size_t size);
+        void close();
+        bool isConnected() const;
+
+        /// Called on the pump thread after the reader thread saw the doorbell ring
+        void wakeup();
+
+        /// Body of the reader thread
+        void run();
+
+    private:
+        ShmTransport(EventPump * pump, const std::string& name, int side, void * memory, size_t size);
+
+        /// Copy as much as fits into the outgoing ring. Returns the number of bytes written.
+        size_t writeRing(const char * data, size_t size);
+
+        /// Write the data that did not fit into the ring earlier
+        void flushOutbox();
+
+        /// Wake up the reader thread of an end
+        void ring(int side);
+
+        /// Have wakeup() called on the pump thread, unless it already is on its way
+        void post();
+
+        EventPump * m_pump;
+        std::string m_name;
+
+        /// 0 for the client end, 1 for the server end. Each end writes the ring with its own index.
+        int m_side;
+        ShmHeader * m_header;
+        size_t m_size;
+        size_t m_ringSize;
+        char * m_in;
+        char * m_out;
+
+        /// Data that did not fit into the outgoing ring. Only touched on the pump thread.
+        std::string m_outbox;
+
+        lw_thread m_thread;
+        volatile int m_stopping;
+        ShmWakeup * m_wakeup;
+
+        /// True after close() was called
+        bool m_closing;
+
+        /// True after the listener got transportClosed
+        bool m_closedNotified;
+    };
+
+};
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef TCPTRANSPORT_H_
+#define TCPTRANSPORT_H_
+
+#include <string>
+#include "Transport.h"
+#include "EventPump.h"
+#define lw_import
+#include <lacewing.h>
+
+namespace fmitcp {
+
+    /// Transport over a lacewing TCP connection
+    class TcpTransport : public Transport {
+
+    private:
+        lw_client m_client;
+
+        /// True for the client end, which made m_client and gets its events from its own hooks
+        bool m_clientEnd;
+
+    public:
+        /// Client end. Call connect() to connect to a server.
+        TcpTransport(EventPump * pump);
+
+        /// Server end, for a client accepted by an lw_server. The server passes on the events with the on* functions.
+        TcpTransport(lw_client client);
+        ~TcpTransport();
+
+        void connect(const std::string& host, long port);
+
+        lw_client getClient() {return m_client;}
+
+        void write(const char * data, size_t size);
+        void close();
+        bool isConnected() const;
+
+        /// Events of the lacewing stream
+        void onConnect();
+        void onData(const char * data, size_t size);
+        void onDisconnect();
+        void onError(lw_error error);
+    };
+
+};
+
+#endif
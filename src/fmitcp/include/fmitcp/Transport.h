@@ -0,0 +1,68 @@
+#ifndef TRANSPORT_H_
+#define TRANSPORT_H_
+
+#include <string>
+#include <stddef.h>
+
+namespace fmitcp_proto {
+    class fmitcp_message;
+}
+
+namespace fmitcp {
+
+    class Transport;
+
+    /// Gets the events of a Transport. All events come on the event pump thread.
+    class TransportListener {
+    public:
+        virtual ~TransportListener(){}
+
+        /// The transport is connected and may be written to
+        virtual void transportConnected(Transport * transport){}
+
+        /// Data arrived. It is a piece of the byte stream: frames may be split over calls, or several come at once.
+        virtual void transportData(Transport * transport, const char * data, size_t size) = 0;
+
+        /// A whole message arrived, from a transport that passes messages. The listener may modify it.
+        virtual void transportMessage(Transport * transport, fmitcp_proto::fmitcp_message& message){}
+
+        /// The transport was closed, by either end. This is its last event.
+        virtual void transportClosed(Transport * transport) = 0;
+
+        virtual void transportError(Transport * transport, const std::string& message){}
+    };
+
+    /**
+     * @brief Byte stream between a client and a server, carrying length-prefixed frames.
+     * Client and Server send and receive all messages through a transport, so they work the same over TCP
+     * (TcpTransport) as over shared memory (ShmTransport). Only use a transport on the event pump thread.
+     */
+    class Transport {
+
+    protected:
+        TransportListener * m_listener;
+
+    public:
+        Transport() : m_listener(NULL) {}
+        virtual ~Transport(){}
+
+        void setListener(TransportListener * listener) {m_listener = listener;}
+
+        /// Queue data to send. All of it is sent, in order.
+        virtual void write(const char * data, size_t size) = 0;
+
+        /// True if the transport can pass whole messages with writeMessage(), without serializing them
+        virtual bool passesMessages() const {return false;}
+
+        /// Send a whole message. It is copied, so the caller may reuse it. Returns false if the transport can not.
+        virtual bool writeMessage(const fmitcp_proto::fmitcp_message& message) {return false;}
+
+        /// Close the transport. The listener gets transportClosed, possibly after this returns.
+        virtual void close() = 0;
+
+        virtual bool isConnected() const = 0;
+    };
+
+};
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef UNIXSOCKETTRANSPORT_H_
+#define UNIXSOCKETTRANSPORT_H_
+
+#include <string>
+#include "Transport.h"
+#include "EventPump.h"
+#define lw_import
+#include <lacewing.h>
+
+namespace fmitcp {
+
+    /**
+     * @brief Transport over a Unix domain socket, for a client and a server on the same machine.
+     * Skips the TCP/IP stack, but is otherwise a stream like TCP. Only available on POSIX systems; elsewhere the
+     * static functions fail.
+     */
+    class UnixSocketTransport : public Transport {
+
+    private:
+        lw_fdstream m_stream;
+        bool m_closed;
+
+        UnixSocketTransport(EventPump * pump, int fd);
+
+    public:
+        ~UnixSocketTransport();
+
+        /// Connect to a socket path. Returns NULL if the connection failed.
+        static UnixSocketTransport * connect(EventPump * pump, const std::string& path);
+
+        /**
+         * Make a non-blocking socket listening on a path, replacing a stale socket file. Returns -1 on failure.
+         * Wait for clients with lw_pump_add() and take them with accept().
+         */
+        static int listen(const std::string& path);
+
+        /// Take a waiting client from a listening socket. Returns NULL if there is none.
+        static UnixSocketTransport * accept(EventPump * pump, int listenFd);
+
+        /// Close a listening socket and remove its file
+        static void closeListener(int listenFd, const std::string& path);
+
+        void write(const char * data, size_t size);
+        void close();
+        bool isConnected() const;
+
+        /// Events of the lacewing stream
+        void onData(const char * data, size_t size);
+        void onClose();
+    };
+
+};
+
+#endif
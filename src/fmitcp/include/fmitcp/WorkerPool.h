@@ -0,0 +1,87 @@
+#ifndef WORKERPOOL_H_
+#define WORKERPOOL_H_
+
+#include <map>
+#include <deque>
+#include <vector>
+#define lw_import
+#include <lacewing.h>
+
+namespace fmitcp {
+
+    /**
+     * @brief A set of threads that drain serial job queues.
+     * Jobs posted to the same queue run one at a time and in the order they were posted. Jobs in different queues
+     * may run at the same time on different threads. The Server uses one queue per FMU instance, since an instance
+     * must not be called from two threads at once.
+     */
+    class WorkerPool {
+
+    public:
+
+        /// Function that runs or discards a job. Gets the data pointer given to post().
+        typedef void (*JobFunction)(void * data);
+
+    private:
+
+        struct Job {
+            JobFunction run;
+            JobFunction discard;
+            void * data;
+        };
+
+        struct Queue {
+            std::deque<Job> jobs;
+
+            /// True while a worker runs a job from this queue
+            bool running;
+
+            Queue() : running(false) {}
+        };
+
+        /// Queues that have jobs waiting, keyed by queue id
+        std::map<int,Queue> m_queues;
+
+        /// Ids of queues that have a job waiting and are not running
+        std::deque<int> m_ready;
+
+        /// Protects m_queues, m_ready and m_stopping
+        lw_sync m_sync;
+
+        /// Signalled while m_ready is not empty, or when stopping
+        lw_event m_wakeup;
+
+        std::vector<lw_thread> m_threads;
+        bool m_stopping;
+
+        static void * workerMain(void * tag);
+
+        /// Run jobs until stop() is called
+        void work();
+
+    public:
+
+        WorkerPool();
+        ~WorkerPool();
+
+        /// Start the worker threads. Does nothing if the pool is already started.
+        void start(int numThreads);
+
+        /**
+         * Wait for running jobs to finish and stop the threads. Jobs that did not start yet are given to their
+         * discard function.
+         */
+        void stop();
+
+        /**
+         * Add a job to a queue.
+         * @param discard Called instead of run if the pool is stopped before the job starts. May be NULL.
+         */
+        void post(int queueId, JobFunction run, JobFunction discard, void * data);
+
+        int getNumThreads() const;
+    };
+
+};
+
+#endif
@@ -3,11 +3,15 @@
 
 #define FMITCP_VERSION "0.0.1"
 
+/// Version of the messages, exchanged in the hello messages when a client connects
+#define FMITCP_PROTOCOL_VERSION 1
+
 #include "fmitcp.pb.h"
 #define lw_import
 #include <lacewing.h>
 #define FMILIB_BUILDING_LIBRARY
 #include <fmilib.h>
+#include "Transport.h"
 #include <string>
 #include <sstream>
 
@@ -39,9 +43,36 @@ namespace fmitcp {
     return res;
   }
 
-  /// Send a binary protobuf to a client
+  /// Serialize a message into a length-prefixed frame, ready to be written to a stream
+  void serializeFrame(fmitcp_proto::fmitcp_message * message, std::string& frame);
+
+  /// Get the fmuId of the request in a message, or -1 if the request does not have one
+  int getFmuId(const fmitcp_proto::fmitcp_message& message);
+
+  /// Get the message_id of the request in a message, or -1 if it does not have one
+  int getMessageId(const fmitcp_proto::fmitcp_message& message);
+
+  /// Send a binary protobuf to a client, prefixed with its length
   void sendProtoBuffer(lw_client c, fmitcp_proto::fmitcp_message * message);
 
+  /// Send a binary protobuf to a client, serializing it into a buffer that the caller reuses between calls
+  void sendProtoBuffer(lw_client c, fmitcp_proto::fmitcp_message * message, std::string& buffer);
+
+  /// Send raw data to a client as one length-prefixed frame
+  void sendFrame(lw_client c, const char* data, size_t size);
+
+  /// Send a binary protobuf through a transport, serializing it into a buffer that the caller reuses between calls
+  void sendProtoBuffer(Transport * transport, fmitcp_proto::fmitcp_message * message, std::string& buffer);
+
+  /// Send raw data through a transport as one length-prefixed frame
+  void sendFrame(Transport * transport, const char* data, size_t size);
+
+  /// Hash of some content, as hex text. Used to tell whether a cached file is the same, not for security.
+  string contentHash(const string& data);
+
+  /// contentHash() of a file, read in pieces. Returns false if the file can not be read.
+  bool fileContentHash(const string& path, string* hash);
+
   /// Convert incoming data to a C++ string
   string dataToString(const char* data, long size);
 
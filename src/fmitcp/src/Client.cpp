@@ -1,293 +1,920 @@
 #include "Client.h"
 #include "Logger.h"
 #include "common.h"
+#include "ShmTransport.h"
+#include "UnixSocketTransport.h"
+#include "LoopbackTransport.h"
+#include "Server.h"
+#include <string.h>
+#include <stdio.h>
+#include <limits.h>
+#include <algorithm>
+#include <math.h>
+#include <algorithm>
 
 using namespace std;
 using namespace fmitcp;
 using namespace fmitcp_proto;
 
-void clientOnConnect(lw_client c) {
-    Client * client = (Client*)lw_stream_tag(c);
-    client->clientConnected(c);
+/// True if a host name is this machine
+static bool isLocalHost(const string& host){
+    return host == "localhost" || host.compare(0, 4, "127.") == 0 || host == "::1";
 }
-void clientOnData(lw_client c, const char* data, long size) {
-    Client * client = (Client*)lw_stream_tag(c);
-    client->clientData(c,data,size);
+
+/// True if a value differs from the one sent last. A real only counts if it moved more than threshold.
+static bool valueChanged(double value, double sent, double threshold){
+    return !(fabs(value - sent) <= threshold);
+}
+template<typename T>
+static bool valueChanged(const T& value, const T& sent, double threshold){
+    return value != sent;
+}
+
+template<typename T, typename V>
+static void addValue(google::protobuf::RepeatedField<T> * out, const V& value){
+    out->Add(value);
 }
-void clientOnDisconnect(lw_client c) {
-    Client * client = (Client*)lw_stream_tag(c);
-    client->clientDisconnected(c);
+static void addValue(google::protobuf::RepeatedPtrField<string> * out, const string& value){
+    out->Add()->assign(value);
 }
-void clientOnError(lw_client c, lw_error error) {
-    Client * client = (Client*)lw_stream_tag(c);
-    client->clientError(c,error);
+
+/**
+ * Add input values to a request. If full, all values are added and kept in sent, if given. Otherwise only the values
+ * that differ from sent are added, with their positions in indices, and sent must have one value per value.
+ */
+template<typename T, typename F>
+static void addInputs(const vector<T>& values, bool full, double threshold, vector<T> * sent,
+                      google::protobuf::RepeatedField<google::protobuf::int32> * indices, F * out){
+    if(full){
+        for(size_t i=0; i<values.size(); i++)
+            addValue(out, values[i]);
+        if(sent)
+            *sent = values;
+        return;
+    }
+    const vector<T>& kept = *sent;
+    for(size_t i=0; i<values.size(); i++){
+        if(valueChanged(values[i], kept[i], threshold)){
+            indices->Add(i);
+            addValue(out, values[i]);
+            (*sent)[i] = values[i];
+        }
+    }
 }
 
-void Client::clientConnected(lw_client c){
+/**
+ * Get the values of a response into out. If received is given, it has the values received before: a delta response
+ * updates it and a full one replaces it. Returns false if a delta does not fit.
+ */
+template<typename T, typename R>
+static bool receiveValues(const R& values, const google::protobuf::RepeatedField<google::protobuf::int32>& indices,
+                          bool delta, vector<T> * received, vector<T>& out){
+    if(!received){
+        out.assign(values.begin(), values.end());
+        return !delta;
+    }
+    if(!delta){
+        received->assign(values.begin(), values.end());
+    } else {
+        if(indices.size() != values.size())
+            return false;
+        for(int i=0; i<indices.size(); i++){
+            if(indices.Get(i) < 0 || (size_t)indices.Get(i) >= received->size())
+                return false;
+            (*received)[indices.Get(i)] = values.Get(i);
+        }
+    }
+    out = *received;
+    return true;
+}
+
+void Client::transportConnected(Transport * transport){
     m_logger.log(Logger::LOG_NETWORK,"+ Connected to FMU server.\n");
+    m_decoder.reset();
 }
 
-void Client::clientData(lw_client c, const char* data, long size){
-    string data2 = fmitcp::dataToString(data,size);
+void Client::transportData(Transport * transport, const char* data, size_t size){
+    FrameDecoder& decoder = transport == m_shm ? m_shmDecoder : m_decoder;
+    decoder.feed(data, size);
+
+    // One chunk may hold any number of messages, and the last one may be incomplete
+    const char * frame;
+    size_t frameSize;
+    while(decoder.next(&frame, &frameSize)){
+        clientMessage(transport, frame, frameSize);
+    }
 
-    if(data2 ==  "\n"){
-        m_logger.log(Logger::LOG_NETWORK,"Recieved empty message from server.\n");
+    if(decoder.hasError()){
+        m_logger.log(Logger::LOG_ERROR,"Invalid frame from server, closing the connection.\n");
+        decoder.reset();
+        transport->close();
+    }
+}
+
+void Client::clientMessage(Transport * transport, const char* data, long size){
+    // Parse straight from the frame into the reused response
+    bool status = m_response.ParseFromArray(data, size);
+    m_logger.log(Logger::LOG_DEBUG,"Client parse status: %d\n", status);
+
+    if(!m_greeted && (!status || m_response.type() != fmitcp_message_Type_type_server_hello)){
+        m_logger.log(Logger::LOG_ERROR,"The server did not start with a hello, it may use an older protocol. Closing the connection.\n");
+        transport->close();
         return;
-    } else if(data2 == "connected\n"){
-        m_logger.log(Logger::LOG_NETWORK,"Recieved connected message from server.\n");
-        return onConnect();
     }
+    handleResponse(m_response);
+}
+
+void Client::transportMessage(Transport * transport, fmitcp_message& message){
+    handleResponse(message);
+}
 
-    // Parse message
-    fmitcp_message res;
-    bool status = res.ParseFromString(data2);
+void Client::handleResponse(fmitcp_message& res){
+    bool wasBusy = !m_inFlight.empty();
     fmitcp_message_Type type = res.type();
 
-    m_logger.log(Logger::LOG_DEBUG,"Client parse status: %d\n", status);
+    // Run the handler for the message type
+    MessageHandler handler = NULL;
+    if(type >= 0 && type < (int)m_handlers.size())
+        handler = m_handlers[type];
+    if(handler)
+        (this->*handler)(res);
+    else
+        m_logger.log(Logger::LOG_ERROR,"Message type not recognized: %d!\n",type);
+
+    if(wasBusy && m_inFlight.empty() && m_pending.empty()){
+        onAllRequestsCompleted();
+    }
+}
+
+void Client::setHandler(fmitcp_message_Type type, MessageHandler handler){
+    m_handlers[type] = handler;
+}
+
+void Client::registerHandlers(){
+    m_handlers.assign(fmitcp_message_Type_Type_MAX + 1, (MessageHandler)NULL);
+    setHandler(fmitcp_message_Type_type_fmi2_import_instantiate_res, &Client::handle_fmi2_import_instantiate_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_initialize_slave_res, &Client::handle_fmi2_import_initialize_slave_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_terminate_slave_res, &Client::handle_fmi2_import_terminate_slave_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_reset_slave_res, &Client::handle_fmi2_import_reset_slave_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_free_slave_instance_res, &Client::handle_fmi2_import_free_slave_instance_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_set_real_input_derivatives_res, &Client::handle_fmi2_import_set_real_input_derivatives_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_get_real_output_derivatives_res, &Client::handle_fmi2_import_get_real_output_derivatives_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_cancel_step_res, &Client::handle_fmi2_import_cancel_step_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_do_step_res, &Client::handle_fmi2_import_do_step_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_get_status_res, &Client::handle_fmi2_import_get_status_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_get_real_status_res, &Client::handle_fmi2_import_get_real_status_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_get_integer_status_res, &Client::handle_fmi2_import_get_integer_status_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_get_boolean_status_res, &Client::handle_fmi2_import_get_boolean_status_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_get_string_status_res, &Client::handle_fmi2_import_get_string_status_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_instantiate_model_res, &Client::handle_fmi2_import_instantiate_model_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_free_model_instance_res, &Client::handle_fmi2_import_free_model_instance_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_set_time_res, &Client::handle_fmi2_import_set_time_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_set_continuous_states_res, &Client::handle_fmi2_import_set_continuous_states_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_completed_integrator_step_res, &Client::handle_fmi2_import_completed_integrator_step_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_get_version_res, &Client::handle_fmi2_import_get_version_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_set_debug_logging_res, &Client::handle_fmi2_import_set_debug_logging_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_set_real_res, &Client::handle_fmi2_import_set_real_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_set_integer_res, &Client::handle_fmi2_import_set_integer_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_set_boolean_res, &Client::handle_fmi2_import_set_boolean_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_set_string_res, &Client::handle_fmi2_import_set_string_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_get_real_res, &Client::handle_fmi2_import_get_real_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_get_integer_res, &Client::handle_fmi2_import_get_integer_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_get_boolean_res, &Client::handle_fmi2_import_get_boolean_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_get_string_res, &Client::handle_fmi2_import_get_string_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_get_fmu_state_res, &Client::handle_fmi2_import_get_fmu_state_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_set_fmu_state_res, &Client::handle_fmi2_import_set_fmu_state_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_free_fmu_state_res, &Client::handle_fmi2_import_free_fmu_state_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_get_directional_derivative_res, &Client::handle_fmi2_import_get_directional_derivative_res);
+    setHandler(fmitcp_message_Type_type_get_xml_res, &Client::handle_get_xml_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_step_exchange_res, &Client::handle_fmi2_import_step_exchange_res);
+    setHandler(fmitcp_message_Type_type_shm_connect_res, &Client::handle_shm_connect_res);
+    setHandler(fmitcp_message_Type_type_server_hello, &Client::handle_server_hello);
+    setHandler(fmitcp_message_Type_type_prepare_value_references_res, &Client::handle_prepare_value_references_res);
+    setHandler(fmitcp_message_Type_type_release_value_references_res, &Client::handle_release_value_references_res);
+    setHandler(fmitcp_message_Type_type_subscribe_outputs_res, &Client::handle_subscribe_outputs_res);
+    setHandler(fmitcp_message_Type_type_get_jacobian_res, &Client::handle_get_jacobian_res);
+    setHandler(fmitcp_message_Type_type_error_res, &Client::handle_error_res);
+
+    // Not implemented yet
+    setHandler(fmitcp_message_Type_type_fmi2_import_initialize_model_res, &Client::handleUnimplemented);
+    setHandler(fmitcp_message_Type_type_fmi2_import_get_derivatives_res, &Client::handleUnimplemented);
+    setHandler(fmitcp_message_Type_type_fmi2_import_get_event_indicators_res, &Client::handleUnimplemented);
+    setHandler(fmitcp_message_Type_type_fmi2_import_eventUpdate_res, &Client::handleUnimplemented);
+    setHandler(fmitcp_message_Type_type_fmi2_import_completed_event_iteration_res, &Client::handleUnimplemented);
+    setHandler(fmitcp_message_Type_type_fmi2_import_get_continuous_states_res, &Client::handleUnimplemented);
+    setHandler(fmitcp_message_Type_type_fmi2_import_get_nominal_continuous_states_res, &Client::handleUnimplemented);
+    setHandler(fmitcp_message_Type_type_fmi2_import_terminate_res, &Client::handleUnimplemented);
+    setHandler(fmitcp_message_Type_type_fmi2_import_serialized_fmu_state_size_res, &Client::handle_fmi2_import_serialized_fmu_state_size_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_serialize_fmu_state_res, &Client::handle_fmi2_import_serialize_fmu_state_res);
+    setHandler(fmitcp_message_Type_type_fmi2_import_de_serialize_fmu_state_res, &Client::handle_fmi2_import_de_serialize_fmu_state_res);
+}
+
+void Client::handleUnimplemented(fmitcp_message& res){
+    m_logger.log(Logger::LOG_NETWORK,"This command is TODO\n");
+}
+
+void Client::handle_fmi2_import_instantiate_res(fmitcp_message& res){
+    fmi2_import_instantiate_res * r = res.mutable_fmi2_import_instantiate_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_instantiate_slave_res(mid=%d,status=%d,fmuId=%d)\n",r->message_id(),r->status(),r->fmuid());
+    on_fmi2_import_instantiate_res(r->message_id(), r->status(), r->fmuid());
+}
+
+void Client::handle_fmi2_import_initialize_slave_res(fmitcp_message& res){
+    fmi2_import_initialize_slave_res * r = res.mutable_fmi2_import_initialize_slave_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_initialize_slave_res(status=%d)\n",r->status());
+    on_fmi2_import_initialize_slave_res(r->message_id(), r->status());
+}
+
+void Client::handle_fmi2_import_terminate_slave_res(fmitcp_message& res){
+    fmi2_import_terminate_slave_res * r = res.mutable_fmi2_import_terminate_slave_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_terminate_slave_res(status=%d)\n",r->status());
+    on_fmi2_import_terminate_slave_res(r->message_id(), r->status());
+}
+
+void Client::handle_fmi2_import_reset_slave_res(fmitcp_message& res){
+    fmi2_import_reset_slave_res * r = res.mutable_fmi2_import_reset_slave_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_reset_slave_res(status=%d)\n",r->status());
+    on_fmi2_import_reset_slave_res(r->message_id(), r->status());
+}
+
+void Client::handle_fmi2_import_free_slave_instance_res(fmitcp_message& res){
+    fmi2_import_free_slave_instance_res * r = res.mutable_fmi2_import_free_slave_instance_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_free_slave_instance_res(mid=%d)\n",r->message_id());
+    DeltaRequest request;
+    if(takeDeltaRequest(r->message_id(), fmitcp_proto::fmi2_status_ok, request))
+        forgetValues(m_receivedValues, request.fmuId);
+    on_fmi2_import_free_slave_instance_res(r->message_id());
+}
+
+void Client::handle_fmi2_import_set_real_input_derivatives_res(fmitcp_message& res){
+    fmi2_import_set_real_input_derivatives_res * r = res.mutable_fmi2_import_set_real_input_derivatives_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_set_real_input_derivatives_res(mid=%d,status=%d)\n",r->message_id(),r->status());
+    on_fmi2_import_set_real_input_derivatives_res(r->message_id(),r->status());
+}
+
+void Client::handle_fmi2_import_get_real_output_derivatives_res(fmitcp_message& res){
+    fmi2_import_get_real_output_derivatives_res * r = res.mutable_fmi2_import_get_real_output_derivatives_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_real_output_derivatives_res(mid=%d,status=%d,values=...)\n",r->message_id(),r->status());
+    on_fmi2_import_get_real_output_derivatives_res(r->message_id(),r->status(),vector<double>());
+}
+
+void Client::handle_fmi2_import_cancel_step_res(fmitcp_message& res){
+    fmi2_import_cancel_step_res * r = res.mutable_fmi2_import_cancel_step_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_cancel_step_res(mid=%d,status=%d)\n",r->message_id(),r->status());
+    on_fmi2_import_cancel_step_res(r->message_id(),r->status());
+}
+
+void Client::handle_fmi2_import_do_step_res(fmitcp_message& res){
+    fmi2_import_do_step_res * r = res.mutable_fmi2_import_do_step_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_do_step_res(status=%d)\n",r->status());
+    fmitcp_proto::fmi2_status_t status = r->status();
+    DeltaRequest request;
+    bool tracked = takeDeltaRequest(r->message_id(), status, request) &&
+        (status == fmitcp_proto::fmi2_status_ok || status == fmitcp_proto::fmi2_status_warning);
+    if(tracked || r->realvalues_size() || r->integervalues_size() || r->booleanvalues_size() || r->stringvalues_size()){
+        // With changed values, the subscribed outputs are complete from the ones received before
+        DeltaValues * received = tracked ? receivedValues(request, 0) : NULL;
+        std::vector<double> realValues;
+        std::vector<int> integerValues;
+        std::vector<bool> booleanValues;
+        std::vector<string> stringValues;
+        bool fits =
+            receiveValues(r->realvalues(), r->realindices(), r->delta(), received ? &received->reals : NULL, realValues) &&
+            receiveValues(r->integervalues(), r->integerindices(), r->delta(), received ? &received->integers : NULL, integerValues) &&
+            receiveValues(r->booleanvalues(), r->booleanindices(), r->delta(), received ? &received->booleans : NULL, booleanValues) &&
+            receiveValues(r->stringvalues(), r->stringindices(), r->delta(), received ? &received->strings : NULL, stringValues);
+        if(!fits){
+            m_logger.log(Logger::LOG_ERROR,"Changed outputs of message id %d do not fit the outputs received before.\n",r->message_id());
+            status = fmitcp_proto::fmi2_status_error;
+        } else if(realValues.size() || integerValues.size() || booleanValues.size() || stringValues.size())
+            on_fmi2_import_do_step_outputs(r->message_id(), realValues, integerValues, booleanValues, stringValues);
+    }
+    on_fmi2_import_do_step_res(r->message_id(), status);
+}
+
+void Client::handle_fmi2_import_get_status_res(fmitcp_message& res){
+    fmi2_import_get_status_res * r = res.mutable_fmi2_import_get_status_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_status_res(value=%d)\n",r->value());
+    on_fmi2_import_get_status_res(r->message_id(), r->value());
+}
+
+void Client::handle_fmi2_import_get_real_status_res(fmitcp_message& res){
+    fmi2_import_get_real_status_res * r = res.mutable_fmi2_import_get_real_status_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_real_status_res(value=%g)\n",r->value());
+    on_fmi2_import_get_real_status_res(r->message_id(), r->value());
+}
+
+void Client::handle_fmi2_import_get_integer_status_res(fmitcp_message& res){
+    fmi2_import_get_integer_status_res * r = res.mutable_fmi2_import_get_integer_status_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_integer_status_res(mid=%d,value=%d)\n",r->message_id(),r->value());
+    on_fmi2_import_get_integer_status_res(r->message_id(), r->value());
+}
+
+void Client::handle_fmi2_import_get_boolean_status_res(fmitcp_message& res){
+    fmi2_import_get_boolean_status_res * r = res.mutable_fmi2_import_get_boolean_status_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_boolean_status_res(value=%d)\n",r->value());
+    on_fmi2_import_get_boolean_status_res(r->message_id(), r->value());
+}
+
+void Client::handle_fmi2_import_get_string_status_res(fmitcp_message& res){
+    fmi2_import_get_string_status_res * r = res.mutable_fmi2_import_get_string_status_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_string_status_res(value=%s)\n",r->value().c_str());
+    on_fmi2_import_get_string_status_res(r->message_id(), r->value());
+}
+
+void Client::handle_fmi2_import_instantiate_model_res(fmitcp_message& res){
+    fmi2_import_instantiate_model_res * r = res.mutable_fmi2_import_instantiate_model_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_instantiate_model_res(mid=%d,status=%d)\n",r->message_id(), r->status());
+    on_fmi2_import_instantiate_model_res(r->message_id(), r->status());
+}
+
+void Client::handle_fmi2_import_free_model_instance_res(fmitcp_message& res){
+    fmi2_import_free_model_instance_res * r = res.mutable_fmi2_import_free_model_instance_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_free_model_instance_res(mid=%d)\n",r->message_id());
+    on_fmi2_import_free_model_instance_res(r->message_id());
+}
+
+void Client::handle_fmi2_import_set_time_res(fmitcp_message& res){
+    fmi2_import_set_time_res * r = res.mutable_fmi2_import_set_time_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_set_time_res(mid=%d,status=%d)\n",r->message_id(), r->status());
+    on_fmi2_import_set_time_res(r->message_id(),r->status());
+}
+
+void Client::handle_fmi2_import_set_continuous_states_res(fmitcp_message& res){
+    fmi2_import_set_continuous_states_res * r = res.mutable_fmi2_import_set_continuous_states_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_set_continuous_states_res(mid=%d,status=%d)\n",r->message_id(), r->status());
+    on_fmi2_import_set_continuous_states_res(r->message_id(),r->status());
+}
+
+void Client::handle_fmi2_import_completed_integrator_step_res(fmitcp_message& res){
+    fmi2_import_completed_integrator_step_res * r = res.mutable_fmi2_import_completed_integrator_step_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_completed_integrator_step_res(mid=%d,callEventUpdate=%d,status=%d)\n",r->message_id(), r->calleventupdate(), r->status());
+    on_fmi2_import_completed_integrator_step_res(r->message_id(),r->calleventupdate(),r->status());
+}
+
+void Client::handle_fmi2_import_get_version_res(fmitcp_message& res){
+    fmi2_import_get_version_res * r = res.mutable_fmi2_import_get_version_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_version_res(mid=%d,version=%s)\n",r->message_id(), r->version().c_str());
+    on_fmi2_import_get_version_res(r->message_id(),r->version());
+}
+
+void Client::handle_fmi2_import_set_debug_logging_res(fmitcp_message& res){
+    fmi2_import_set_debug_logging_res * r = res.mutable_fmi2_import_set_debug_logging_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_set_debug_logging_res(mid=%d,status=%d)\n",r->message_id(), r->status());
+    on_fmi2_import_set_debug_logging_res(r->message_id(),r->status());
+}
+
+void Client::handle_fmi2_import_set_real_res(fmitcp_message& res){
+    fmi2_import_set_real_res * r = res.mutable_fmi2_import_set_real_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_set_real_res(mid=%d,status=%d)\n",r->message_id(), r->status());
+    DeltaRequest request;
+    takeDeltaRequest(r->message_id(), r->status(), request);
+    on_fmi2_import_set_real_res(r->message_id(),r->status());
+}
+
+void Client::handle_fmi2_import_set_integer_res(fmitcp_message& res){
+    fmi2_import_set_integer_res * r = res.mutable_fmi2_import_set_integer_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_set_integer_res(mid=%d,status=%d)\n",r->message_id(), r->status());
+    DeltaRequest request;
+    takeDeltaRequest(r->message_id(), r->status(), request);
+    on_fmi2_import_set_integer_res(r->message_id(),r->status());
+}
+
+void Client::handle_fmi2_import_set_boolean_res(fmitcp_message& res){
+    fmi2_import_set_boolean_res * r = res.mutable_fmi2_import_set_boolean_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_set_boolean_res(mid=%d,status=%d)\n",r->message_id(), r->status());
+    DeltaRequest request;
+    takeDeltaRequest(r->message_id(), r->status(), request);
+    on_fmi2_import_set_boolean_res(r->message_id(),r->status());
+}
+
+void Client::handle_fmi2_import_set_string_res(fmitcp_message& res){
+    fmi2_import_set_string_res * r = res.mutable_fmi2_import_set_string_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_set_string_res(mid=%d,status=%d)\n",r->message_id(), r->status());
+    DeltaRequest request;
+    takeDeltaRequest(r->message_id(), r->status(), request);
+    on_fmi2_import_set_string_res(r->message_id(),r->status());
+}
+
+void Client::handle_fmi2_import_get_real_res(fmitcp_message& res){
+    fmi2_import_get_real_res * r = res.mutable_fmi2_import_get_real_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_real_res(mid=%d,values=...,status=%d)\n",r->message_id(), r->status());
+    fmitcp_proto::fmi2_status_t status = r->status();
+    DeltaRequest request;
+    bool tracked = takeDeltaRequest(r->message_id(), status, request) &&
+        (status == fmitcp_proto::fmi2_status_ok || status == fmitcp_proto::fmi2_status_warning);
+    DeltaValues * received = tracked ? receivedValues(request, 0) : NULL;
+    std::vector<double> values;
+    if(!receiveValues(r->values(), r->indices(), r->delta(), received ? &received->reals : NULL, values)){
+        m_logger.log(Logger::LOG_ERROR,"Changed values of message id %d do not fit the values received before.\n",r->message_id());
+        status = fmitcp_proto::fmi2_status_error;
+    }
+    on_fmi2_import_get_real_res(r->message_id(),values,status);
+}
+
+void Client::handle_fmi2_import_get_integer_res(fmitcp_message& res){
+    fmi2_import_get_integer_res * r = res.mutable_fmi2_import_get_integer_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_integer_res(mid=%d,values=...,status=%d)\n",r->message_id(), r->status());
+    fmitcp_proto::fmi2_status_t status = r->status();
+    DeltaRequest request;
+    bool tracked = takeDeltaRequest(r->message_id(), status, request) &&
+        (status == fmitcp_proto::fmi2_status_ok || status == fmitcp_proto::fmi2_status_warning);
+    DeltaValues * received = tracked ? receivedValues(request, 1) : NULL;
+    std::vector<int> values;
+    if(!receiveValues(r->values(), r->indices(), r->delta(), received ? &received->integers : NULL, values)){
+        m_logger.log(Logger::LOG_ERROR,"Changed values of message id %d do not fit the values received before.\n",r->message_id());
+        status = fmitcp_proto::fmi2_status_error;
+    }
+    on_fmi2_import_get_integer_res(r->message_id(),values,status);
+}
+
+void Client::handle_fmi2_import_get_boolean_res(fmitcp_message& res){
+    fmi2_import_get_boolean_res * r = res.mutable_fmi2_import_get_boolean_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_boolean_res(mid=%d,values=...,status=%d)\n",r->message_id(), r->status());
+    fmitcp_proto::fmi2_status_t status = r->status();
+    DeltaRequest request;
+    bool tracked = takeDeltaRequest(r->message_id(), status, request) &&
+        (status == fmitcp_proto::fmi2_status_ok || status == fmitcp_proto::fmi2_status_warning);
+    DeltaValues * received = tracked ? receivedValues(request, 2) : NULL;
+    std::vector<bool> values;
+    if(!receiveValues(r->values(), r->indices(), r->delta(), received ? &received->booleans : NULL, values)){
+        m_logger.log(Logger::LOG_ERROR,"Changed values of message id %d do not fit the values received before.\n",r->message_id());
+        status = fmitcp_proto::fmi2_status_error;
+    }
+    on_fmi2_import_get_boolean_res(r->message_id(),values,status);
+}
+
+void Client::handle_fmi2_import_get_string_res(fmitcp_message& res){
+    fmi2_import_get_string_res * r = res.mutable_fmi2_import_get_string_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_string_res(mid=%d,values=...,status=%d)\n",r->message_id(), r->status());
+    fmitcp_proto::fmi2_status_t status = r->status();
+    DeltaRequest request;
+    bool tracked = takeDeltaRequest(r->message_id(), status, request) &&
+        (status == fmitcp_proto::fmi2_status_ok || status == fmitcp_proto::fmi2_status_warning);
+    DeltaValues * received = tracked ? receivedValues(request, 3) : NULL;
+    std::vector<string> values;
+    if(!receiveValues(r->values(), r->indices(), r->delta(), received ? &received->strings : NULL, values)){
+        m_logger.log(Logger::LOG_ERROR,"Changed values of message id %d do not fit the values received before.\n",r->message_id());
+        status = fmitcp_proto::fmi2_status_error;
+    }
+    on_fmi2_import_get_string_res(r->message_id(),values,status);
+}
+
+void Client::handle_fmi2_import_get_fmu_state_res(fmitcp_message& res){
+    fmi2_import_get_fmu_state_res * r = res.mutable_fmi2_import_get_fmu_state_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_fmu_state_res(mid=%d,stateId=%d,status=%d)\n",r->message_id(), r->stateid(), r->status());
+
+    map<int,StateTransfer>::iterator it = m_stateTransfers.find(r->message_id());
+    if(it != m_stateTransfers.end() && it->second.step == SAVE_GET_STATE){
+        // Saving a checkpoint: serialize the new state
+        if(r->status() != fmitcp_proto::fmi2_status_ok && r->status() != fmitcp_proto::fmi2_status_warning)
+            return finishCheckpoint(r->message_id(), r->status());
+        it->second.step = SAVE_SERIALIZE;
+        it->second.stateId = r->stateid();
+        return sendSerializeChunk(r->message_id(), it->second);
+    }
+
+    on_fmi2_import_get_fmu_state_res(r->message_id(),r->stateid(),r->status());
+}
+
+void Client::handle_fmi2_import_set_fmu_state_res(fmitcp_message& res){
+    fmi2_import_set_fmu_state_res * r = res.mutable_fmi2_import_set_fmu_state_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_set_fmu_state_res(mid=%d,status=%d)\n",r->message_id(), r->status());
+
+    map<int,StateTransfer>::iterator it = m_stateTransfers.find(r->message_id());
+    if(it != m_stateTransfers.end() && it->second.step == RESTORE_SET_STATE){
+        // Restoring a checkpoint: the state is applied, free it on the server
+        it->second.step = RESTORE_FREE_STATE;
+        it->second.result = r->status();
+        return fmi2_import_free_fmu_state(r->message_id(), it->second.fmuId, it->second.stateId);
+    }
+
+    on_fmi2_import_set_fmu_state_res(r->message_id(),r->status());
+}
+
+void Client::handle_fmi2_import_free_fmu_state_res(fmitcp_message& res){
+    fmi2_import_free_fmu_state_res * r = res.mutable_fmi2_import_free_fmu_state_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_free_fmu_state_res(mid=%d,status=%d)\n",r->message_id(), r->status());
+
+    map<int,StateTransfer>::iterator it = m_stateTransfers.find(r->message_id());
+    if(it != m_stateTransfers.end() && (it->second.step == SAVE_FREE_STATE || it->second.step == RESTORE_FREE_STATE)){
+        // Last step of a checkpoint. A failure in an earlier step wins over the status of the free.
+        fmitcp_proto::fmi2_status_t result = it->second.result;
+        if(result == fmitcp_proto::fmi2_status_ok || result == fmitcp_proto::fmi2_status_warning)
+            result = r->status() == fmitcp_proto::fmi2_status_ok ? result : r->status();
+        return finishCheckpoint(r->message_id(), result);
+    }
+
+    on_fmi2_import_free_fmu_state_res(r->message_id(),r->status());
+}
+
+void Client::handle_fmi2_import_serialized_fmu_state_size_res(fmitcp_message& res){
+    fmi2_import_serialized_fmu_state_size_res * r = res.mutable_fmi2_import_serialized_fmu_state_size_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_serialized_fmu_state_size_res(mid=%d,size=%ld,status=%d)\n",r->message_id(), (long)r->size(), r->status());
+    on_fmi2_import_serialized_fmu_state_size_res(r->message_id(),r->size(),r->status());
+}
+
+void Client::handle_fmi2_import_serialize_fmu_state_res(fmitcp_message& res){
+    fmi2_import_serialize_fmu_state_res * r = res.mutable_fmi2_import_serialize_fmu_state_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_serialize_fmu_state_res(mid=%d,offset=%ld,size=%lu,totalSize=%ld,status=%d)\n",r->message_id(), (long)r->offset(), (unsigned long)r->data().size(), (long)r->totalsize(), r->status());
+
+    map<int,StateTransfer>::iterator it = m_stateTransfers.find(r->message_id());
+    if(it == m_stateTransfers.end()){
+        m_logger.log(Logger::LOG_ERROR,"Got a serialized state chunk for message id %d, which has no transfer.\n",r->message_id());
+        return;
+    }
+    StateTransfer& transfer = it->second;
+    fmitcp_proto::fmi2_status_t status = r->status();
+    bool ok = (status == fmitcp_proto::fmi2_status_ok || status == fmitcp_proto::fmi2_status_warning);
+    if(ok && r->offset() != (long long)transfer.data.size()){
+        m_logger.log(Logger::LOG_ERROR,"Serialized state chunk at offset %ld does not follow the previous chunk.\n",(long)r->offset());
+        status = fmitcp_proto::fmi2_status_error;
+        ok = false;
+    }
 
-    // Check type and run the corresponding event handler
-    if(type == fmitcp_message_Type_type_fmi2_import_instantiate_res){
-        fmi2_import_instantiate_res * r = res.mutable_fmi2_import_instantiate_res();
-        m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_instantiate_slave_res(mid=%d,status=%d)\n",r->message_id(),r->status());
-        on_fmi2_import_instantiate_res(r->message_id(), r->status());
-
-    } else if(type == fmitcp_message_Type_type_fmi2_import_initialize_slave_res){
-        fmi2_import_initialize_slave_res * r = res.mutable_fmi2_import_initialize_slave_res();
-        m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_initialize_slave_res(status=%d)\n",r->status());
-        on_fmi2_import_initialize_slave_res(r->message_id(), r->status());
-
-    } else if(type == fmitcp_message_Type_type_fmi2_import_terminate_slave_res){
-        fmi2_import_terminate_slave_res * r = res.mutable_fmi2_import_terminate_slave_res();
-        m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_terminate_slave_res(status=%d)\n",r->status());
-        on_fmi2_import_terminate_slave_res(r->message_id(), r->status());
-
-    } else if(type == fmitcp_message_Type_type_fmi2_import_reset_slave_res){
-        fmi2_import_reset_slave_res * r = res.mutable_fmi2_import_reset_slave_res();
-        m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_reset_slave_res(status=%d)\n",r->status());
-        on_fmi2_import_reset_slave_res(r->message_id(), r->status());
-
-    } else if(type == fmitcp_message_Type_type_fmi2_import_free_slave_instance_res){
-        fmi2_import_free_slave_instance_res * r = res.mutable_fmi2_import_free_slave_instance_res();
-        m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_free_slave_instance_res(mid=%d)\n",r->message_id());
-        on_fmi2_import_free_slave_instance_res(r->message_id());
-
-    } else if(type == fmitcp_message_Type_type_fmi2_import_set_real_input_derivatives_res){
-        fmi2_import_set_real_input_derivatives_res * r = res.mutable_fmi2_import_set_real_input_derivatives_res();
-        m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_set_real_input_derivatives_res(mid=%d,status=%d)\n",r->message_id(),r->status());
-        on_fmi2_import_set_real_input_derivatives_res(r->message_id(),r->status());
-
-    } else if(type == fmitcp_message_Type_type_fmi2_import_get_real_output_derivatives_res){
-        fmi2_import_get_real_output_derivatives_res * r = res.mutable_fmi2_import_get_real_output_derivatives_res();
-        m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_real_output_derivatives_res(mid=%d,status=%d,values=...)\n",r->message_id(),r->status());
-        on_fmi2_import_get_real_output_derivatives_res(r->message_id(),r->status(),vector<double>());
-
-    } else if(type == fmitcp_message_Type_type_fmi2_import_cancel_step_res){
-        fmi2_import_cancel_step_res * r = res.mutable_fmi2_import_cancel_step_res();
-        m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_cancel_step_res(mid=%d,status=%d)\n",r->message_id(),r->status());
-        on_fmi2_import_cancel_step_res(r->message_id(),r->status());
-
-    } else if(type == fmitcp_message_Type_type_fmi2_import_do_step_res){
-        fmi2_import_do_step_res * r = res.mutable_fmi2_import_do_step_res();
-        m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_do_step_res(status=%d)\n",r->status());
-        on_fmi2_import_do_step_res(r->message_id(), r->status());
-
-    } else if(type == fmitcp_message_Type_type_fmi2_import_get_status_res){
-        fmi2_import_get_status_res * r = res.mutable_fmi2_import_get_status_res();
-        m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_status_res(value=%d)\n",r->value());
-        on_fmi2_import_get_status_res(r->message_id(), r->value());
-
-    } else if(type == fmitcp_message_Type_type_fmi2_import_get_real_status_res){
-        fmi2_import_get_real_status_res * r = res.mutable_fmi2_import_get_real_status_res();
-        m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_real_status_res(value=%g)\n",r->value());
-        on_fmi2_import_get_real_status_res(r->message_id(), r->value());
-
-    } else if(type == fmitcp_message_Type_type_fmi2_import_get_integer_status_res){
-        fmi2_import_get_integer_status_res * r = res.mutable_fmi2_import_get_integer_status_res();
-        m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_integer_status_res(mid=%d,value=%d)\n",r->message_id(),r->value());
-        on_fmi2_import_get_integer_status_res(r->message_id(), r->value());
-
-    } else if(type == fmitcp_message_Type_type_fmi2_import_get_boolean_status_res){
-        fmi2_import_get_boolean_status_res * r = res.mutable_fmi2_import_get_boolean_status_res();
-        m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_boolean_status_res(value=%d)\n",r->value());
-        on_fmi2_import_get_boolean_status_res(r->message_id(), r->value());
-
-    } else if(type == fmitcp_message_Type_type_fmi2_import_get_string_status_res){
-        fmi2_import_get_string_status_res * r = res.mutable_fmi2_import_get_string_status_res();
-        m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_string_status_res(value=%s)\n",r->value().c_str());
-        on_fmi2_import_get_string_status_res(r->message_id(), r->value());
-
-    } else if(type == fmitcp_message_Type_type_fmi2_import_instantiate_model_res){
-        fmi2_import_instantiate_model_res * r = res.mutable_fmi2_import_instantiate_model_res();
-        m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_instantiate_model_res(mid=%d,status=%d)\n",r->message_id(), r->status());
-        on_fmi2_import_instantiate_model_res(r->message_id(), r->status());
-
-    } else if(type == fmitcp_message_Type_type_fmi2_import_free_model_instance_res){
-        fmi2_import_free_model_instance_res * r = res.mutable_fmi2_import_free_model_instance_res();
-        m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_free_model_instance_res(mid=%d)\n",r->message_id());
-        on_fmi2_import_free_model_instance_res(r->message_id());
-
-    } else if(type == fmitcp_message_Type_type_fmi2_import_set_time_res){
-        fmi2_import_set_time_res * r = res.mutable_fmi2_import_set_time_res();
-        m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_set_time_res(mid=%d,status=%d)\n",r->message_id(), r->status());
-        on_fmi2_import_set_time_res(r->message_id(),r->status());
-
-    } else if(type == fmitcp_message_Type_type_fmi2_import_set_continuous_states_res){
-        fmi2_import_set_continuous_states_res * r = res.mutable_fmi2_import_set_continuous_states_res();
-        m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_set_continuous_states_res(mid=%d,status=%d)\n",r->message_id(), r->status());
-        on_fmi2_import_set_continuous_states_res(r->message_id(),r->status());
-
-    } else if(type == fmitcp_message_Type_type_fmi2_import_completed_integrator_step_res){
-        fmi2_import_completed_integrator_step_res * r = res.mutable_fmi2_import_completed_integrator_step_res();
-        m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_completed_integrator_step_res(mid=%d,callEventUpdate=%d,status=%d)\n",r->message_id(), r->calleventupdate(), r->status());
-        on_fmi2_import_completed_integrator_step_res(r->message_id(),r->calleventupdate(),r->status());
-
-    } else if(type == fmitcp_message_Type_type_fmi2_import_initialize_model_res){
-        m_logger.log(Logger::LOG_NETWORK,"This command is TODO\n");
-    } else if(type == fmitcp_message_Type_type_fmi2_import_get_derivatives_res){
-        m_logger.log(Logger::LOG_NETWORK,"This command is TODO\n");
-    } else if(type == fmitcp_message_Type_type_fmi2_import_get_event_indicators_res){
-        m_logger.log(Logger::LOG_NETWORK,"This command is TODO\n");
-    } else if(type == fmitcp_message_Type_type_fmi2_import_eventUpdate_res){
-        m_logger.log(Logger::LOG_NETWORK,"This command is TODO\n");
-    } else if(type == fmitcp_message_Type_type_fmi2_import_completed_event_iteration_res){
-        m_logger.log(Logger::LOG_NETWORK,"This command is TODO\n");
-    } else if(type == fmitcp_message_Type_type_fmi2_import_get_continuous_states_res){
-        m_logger.log(Logger::LOG_NETWORK,"This command is TODO\n");
-    } else if(type == fmitcp_message_Type_type_fmi2_import_get_nominal_continuous_states_res){
-        m_logger.log(Logger::LOG_NETWORK,"This command is TODO\n");
-    } else if(type == fmitcp_message_Type_type_fmi2_import_terminate_res){
-        m_logger.log(Logger::LOG_NETWORK,"This command is TODO\n");
-    } else if(type == fmitcp_message_Type_type_fmi2_import_get_version_res){
-        fmi2_import_get_version_res * r = res.mutable_fmi2_import_get_version_res();
-        m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_version_res(mid=%d,version=%s)\n",r->message_id(), r->version().c_str());
-        on_fmi2_import_get_version_res(r->message_id(),r->version());
-
-    } else if(type == fmitcp_message_Type_type_fmi2_import_set_debug_logging_res){
-        fmi2_import_set_debug_logging_res * r = res.mutable_fmi2_import_set_debug_logging_res();
-        m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_set_debug_logging_res(mid=%d,status=%d)\n",r->message_id(), r->status());
-        on_fmi2_import_set_debug_logging_res(r->message_id(),r->status());
-
-    } else if(type == fmitcp_message_Type_type_fmi2_import_set_real_res){
-        fmi2_import_set_real_res * r = res.mutable_fmi2_import_set_real_res();
-        m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_set_real_res(mid=%d,status=%d)\n",r->message_id(), r->status());
-        on_fmi2_import_set_real_res(r->message_id(),r->status());
-
-    } else if(type == fmitcp_message_Type_type_fmi2_import_set_integer_res){
-        fmi2_import_set_integer_res * r = res.mutable_fmi2_import_set_integer_res();
-        m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_set_integer_res(mid=%d,status=%d)\n",r->message_id(), r->status());
-        on_fmi2_import_set_integer_res(r->message_id(),r->status());
-
-    } else if(type == fmitcp_message_Type_type_fmi2_import_set_boolean_res){
-        fmi2_import_set_boolean_res * r = res.mutable_fmi2_import_set_boolean_res();
-        m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_set_boolean_res(mid=%d,status=%d)\n",r->message_id(), r->status());
-        on_fmi2_import_set_boolean_res(r->message_id(),r->status());
-
-    } else if(type == fmitcp_message_Type_type_fmi2_import_set_string_res){
-        fmi2_import_set_string_res * r = res.mutable_fmi2_import_set_string_res();
-        m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_set_string_res(mid=%d,status=%d)\n",r->message_id(), r->status());
-        on_fmi2_import_set_string_res(r->message_id(),r->status());
-
-    } else if(type == fmitcp_message_Type_type_fmi2_import_get_real_res){
-        fmi2_import_get_real_res * r = res.mutable_fmi2_import_get_real_res();
-        std::vector<double> values;
-        for(int i=0; i<r->values_size(); i++)
-            values.push_back(r->values(i));
-        m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_real_res(mid=%d,values=...,status=%d)\n",r->message_id(), r->status());
-        on_fmi2_import_get_real_res(r->message_id(),values,r->status());
-
-    } else if(type == fmitcp_message_Type_type_fmi2_import_get_integer_res){
-        fmi2_import_get_integer_res * r = res.mutable_fmi2_import_get_integer_res();
-        std::vector<int> values;
-        for(int i=0; i<r->values_size(); i++)
-            values.push_back(r->values(i));
-        m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_integer_res(mid=%d,values=...,status=%d)\n",r->message_id(), r->status());
-        on_fmi2_import_get_integer_res(r->message_id(),values,r->status());
-
-    } else if(type == fmitcp_message_Type_type_fmi2_import_get_boolean_res){
-        fmi2_import_get_boolean_res * r = res.mutable_fmi2_import_get_boolean_res();
-        std::vector<bool> values;
-        for(int i=0; i<r->values_size(); i++)
-            values.push_back(r->values(i));
-        m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_boolean_res(mid=%d,values=...,status=%d)\n",r->message_id(), r->status());
-        on_fmi2_import_get_boolean_res(r->message_id(),values,r->status());
-
-    } else if(type == fmitcp_message_Type_type_fmi2_import_get_string_res){
-        fmi2_import_get_string_res * r = res.mutable_fmi2_import_get_string_res();
-        std::vector<string> values;
-        for(int i=0; i<r->values_size(); i++)
-            values.push_back(r->values(i));
-        m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_string_res(mid=%d,values=...,status=%d)\n",r->message_id(), r->status());
-        on_fmi2_import_get_string_res(r->message_id(),values,r->status());
-
-    } else if(type == fmitcp_message_Type_type_fmi2_import_get_fmu_state_res){
-        fmi2_import_get_fmu_state_res * r = res.mutable_fmi2_import_get_fmu_state_res();
-        m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_fmu_state_res(mid=%d,stateId=%d,status=%d)\n",r->message_id(), r->stateid(), r->status());
-        on_fmi2_import_get_fmu_state_res(r->message_id(),r->stateid(),r->status());
-
-    } else if(type == fmitcp_message_Type_type_fmi2_import_set_fmu_state_res){
-        fmi2_import_set_fmu_state_res * r = res.mutable_fmi2_import_set_fmu_state_res();
-        m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_set_fmu_state_res(mid=%d,status=%d)\n",r->message_id(), r->status());
-        on_fmi2_import_set_fmu_state_res(r->message_id(),r->status());
-
-    } else if(type == fmitcp_message_Type_type_fmi2_import_free_fmu_state_res){
-        m_logger.log(Logger::LOG_NETWORK,"This command is TODO\n");
-    } else if(type == fmitcp_message_Type_type_fmi2_import_serialized_fmu_state_size_res){
-        m_logger.log(Logger::LOG_NETWORK,"This command is TODO\n");
-    } else if(type == fmitcp_message_Type_type_fmi2_import_serialize_fmu_state_res){
-        m_logger.log(Logger::LOG_NETWORK,"This command is TODO\n");
-    } else if(type == fmitcp_message_Type_type_fmi2_import_de_serialize_fmu_state_res){
-        m_logger.log(Logger::LOG_NETWORK,"This command is TODO\n");
-    } else if(type == fmitcp_message_Type_type_fmi2_import_get_directional_derivative_res){
-        fmi2_import_get_directional_derivative_res * r = res.mutable_fmi2_import_get_directional_derivative_res();
-        std::vector<double> dz;
-        for(int i=0; i<r->dz_size(); i++)
-            dz.push_back(r->dz(i));
-        m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_directional_derivative_res(mid=%d,dz=...,status=%d)\n",r->message_id(), r->status());
-        on_fmi2_import_get_directional_derivative_res(r->message_id(),dz,r->status());
-
-    } else if(type == fmitcp_message_Type_type_get_xml_res){
-
-        get_xml_res * r = res.mutable_get_xml_res();
-        m_logger.log(Logger::LOG_NETWORK,"< get_xml_res(mid=%d,xml=...)\n",r->message_id());
-        onGetXmlRes(r->message_id(), r->loglevel(), r->xml());
+    if(ok){
+        transfer.data.append(r->data());
+        if((long long)transfer.data.size() < r->totalsize() && !r->data().empty())
+            return sendSerializeChunk(r->message_id(), transfer);
+    }
+
+    if(transfer.step == SAVE_SERIALIZE){
+        // Saving a checkpoint: write the state to the file, then free it on the server
+        if(ok){
+            FILE * file = fopen(transfer.path.c_str(), "wb");
+            if(!file || fwrite(transfer.data.data(), 1, transfer.data.size(), file) != transfer.data.size()){
+                m_logger.log(Logger::LOG_ERROR,"Could not write checkpoint file %s.\n",transfer.path.c_str());
+                status = fmitcp_proto::fmi2_status_error;
+            }
+            if(file && fclose(file) != 0)
+                status = fmitcp_proto::fmi2_status_error;
+        }
+        transfer.step = SAVE_FREE_STATE;
+        transfer.result = status;
+        string().swap(transfer.data);
+        return fmi2_import_free_fmu_state(r->message_id(), transfer.fmuId, transfer.stateId);
+    }
+
+    string state;
+    state.swap(transfer.data);
+    m_stateTransfers.erase(it);
+    on_fmi2_import_serialize_fmu_state_res(r->message_id(),state,status);
+}
+
+void Client::handle_fmi2_import_de_serialize_fmu_state_res(fmitcp_message& res){
+    fmi2_import_de_serialize_fmu_state_res * r = res.mutable_fmi2_import_de_serialize_fmu_state_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_de_serialize_fmu_state_res(mid=%d,stateId=%d,status=%d)\n",r->message_id(), r->stateid(), r->status());
+
+    map<int,StateTransfer>::iterator it = m_stateTransfers.find(r->message_id());
+    if(it == m_stateTransfers.end()){
+        m_logger.log(Logger::LOG_ERROR,"Got a de-serialize response for message id %d, which has no transfer.\n",r->message_id());
+        return;
+    }
+    StateTransfer& transfer = it->second;
+    bool ok = (r->status() == fmitcp_proto::fmi2_status_ok || r->status() == fmitcp_proto::fmi2_status_warning);
+    if(ok && transfer.offset < transfer.data.size())
+        return sendDeSerializeChunk(r->message_id(), transfer);
+
+    if(transfer.step == RESTORE_DE_SERIALIZE){
+        // Restoring a checkpoint: apply the uploaded state
+        if(!ok)
+            return finishCheckpoint(r->message_id(), r->status());
+        transfer.step = RESTORE_SET_STATE;
+        transfer.stateId = r->stateid();
+        string().swap(transfer.data);
+        return fmi2_import_set_fmu_state(r->message_id(), transfer.fmuId, transfer.stateId);
+    }
+
+    m_stateTransfers.erase(it);
+    on_fmi2_import_de_serialize_fmu_state_res(r->message_id(),r->stateid(),r->status());
+}
+
+void Client::handle_fmi2_import_get_directional_derivative_res(fmitcp_message& res){
+    fmi2_import_get_directional_derivative_res * r = res.mutable_fmi2_import_get_directional_derivative_res();
+    requestCompleted(r->message_id());
+    std::vector<double> dz;
+    for(int i=0; i<r->dz_size(); i++)
+        dz.push_back(r->dz(i));
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_directional_derivative_res(mid=%d,dz=...,status=%d)\n",r->message_id(), r->status());
+    on_fmi2_import_get_directional_derivative_res(r->message_id(),dz,r->status());
+}
+
+void Client::handle_get_xml_res(fmitcp_message& res){
+    get_xml_res * r = res.mutable_get_xml_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< get_xml_res(mid=%d,cached=%d,xml=...)\n",r->message_id(),r->cached() ? 1 : 0);
+
+    string xml;
+    map<int,string>::iterator it = m_cachedXml.find(r->message_id());
+    if(it != m_cachedXml.end()){
+        if(r->cached())
+            xml.swap(it->second);
+        m_cachedXml.erase(it);
+    } else if(r->cached())
+        m_logger.log(Logger::LOG_ERROR,"Got a cached XML for message id %d, which has no copy.\n",r->message_id());
+
+    if(!r->cached()){
+        xml.swap(*r->mutable_xml());
+        // Keep a copy for the next time. A partly written copy fails the hash check when it is read.
+        string path = xmlCachePath(r->xmlhash());
+        if(!path.empty() && !xml.empty() && contentHash(xml) == r->xmlhash()){
+            FILE * file = fopen(path.c_str(), "wb");
+            bool written = file && fwrite(xml.data(), 1, xml.size(), file) == xml.size();
+            if(file && fclose(file) != 0)
+                written = false;
+            if(!written)
+                m_logger.log(Logger::LOG_ERROR,"Could not write %s.\n",path.c_str());
+        }
+    }
+    onGetXmlRes(r->message_id(), r->loglevel(), xml);
+}
+
+void Client::handle_fmi2_import_step_exchange_res(fmitcp_message& res){
+    fmi2_import_step_exchange_res * r = res.mutable_fmi2_import_step_exchange_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_step_exchange_res(mid=%d,status=%d,values=...)\n",r->message_id(), r->status());
+    fmitcp_proto::fmi2_status_t status = r->status();
+    DeltaRequest request;
+    bool tracked = takeDeltaRequest(r->message_id(), status, request) &&
+        (status == fmitcp_proto::fmi2_status_ok || status == fmitcp_proto::fmi2_status_warning);
+    DeltaValues * realReceived = tracked ? receivedValues(request, 0) : NULL;
+    DeltaValues * integerReceived = tracked ? receivedValues(request, 1) : NULL;
+    DeltaValues * booleanReceived = tracked ? receivedValues(request, 2) : NULL;
+    DeltaValues * stringReceived = tracked ? receivedValues(request, 3) : NULL;
+    std::vector<double> realValues;
+    std::vector<int> integerValues;
+    std::vector<bool> booleanValues;
+    std::vector<string> stringValues;
+    bool fits =
+        receiveValues(r->realvalues(), r->realindices(), r->delta(), realReceived ? &realReceived->reals : NULL, realValues) &&
+        receiveValues(r->integervalues(), r->integerindices(), r->delta(), integerReceived ? &integerReceived->integers : NULL, integerValues) &&
+        receiveValues(r->booleanvalues(), r->booleanindices(), r->delta(), booleanReceived ? &booleanReceived->booleans : NULL, booleanValues) &&
+        receiveValues(r->stringvalues(), r->stringindices(), r->delta(), stringReceived ? &stringReceived->strings : NULL, stringValues);
+    if(!fits){
+        m_logger.log(Logger::LOG_ERROR,"Changed outputs of message id %d do not fit the outputs received before.\n",r->message_id());
+        status = fmitcp_proto::fmi2_status_error;
+    }
+    on_fmi2_import_step_exchange_res(r->message_id(),status,realValues,integerValues,booleanValues,stringValues);
+}
+
+void Client::handle_prepare_value_references_res(fmitcp_message& res){
+    prepare_value_references_res * r = res.mutable_prepare_value_references_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< prepare_value_references_res(mid=%d,status=%d,set=%d)\n",r->message_id(), r->status(), r->valuereferenceset());
+    on_prepare_value_references_res(r->message_id(), r->status(), r->valuereferenceset());
+}
+
+void Client::handle_release_value_references_res(fmitcp_message& res){
+    release_value_references_res * r = res.mutable_release_value_references_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< release_value_references_res(mid=%d,status=%d)\n",r->message_id(), r->status());
+    on_release_value_references_res(r->message_id(), r->status());
+}
+
+void Client::handle_subscribe_outputs_res(fmitcp_message& res){
+    subscribe_outputs_res * r = res.mutable_subscribe_outputs_res();
+    requestCompleted(r->message_id());
+    m_logger.log(Logger::LOG_NETWORK,"< subscribe_outputs_res(mid=%d,status=%d)\n",r->message_id(), r->status());
+    on_subscribe_outputs_res(r->message_id(), r->status());
+}
+
+void Client::handle_get_jacobian_res(fmitcp_message& res){
+    get_jacobian_res * r = res.mutable_get_jacobian_res();
+    requestCompleted(r->message_id());
+    vector<double> values(r->values().begin(), r->values().end());
+    vector<int> rows(r->rows().begin(), r->rows().end());
+    vector<int> columns(r->columns().begin(), r->columns().end());
+    m_logger.log(Logger::LOG_NETWORK,"< get_jacobian_res(mid=%d,status=%d,values=%d,seeds=%d)\n",r->message_id(), r->status(), r->values_size(), r->numseeds());
+    on_get_jacobian_res(r->message_id(), r->status(), values, rows, columns);
+}
+
+void Client::handle_error_res(fmitcp_message& res){
+    error_res * r = res.mutable_error_res();
+    m_logger.log(Logger::LOG_ERROR,"< error_res(mid=%d,reason=%s)\n",r->message_id(),r->reason().c_str());
+    if(m_inFlight.find(r->message_id()) == m_inFlight.end()){
+        // The server refused the hello, and so the connection
+        m_connection->close();
+        onError(r->reason());
+        return;
+    }
+
+    // Drop what was kept for the response
+    requestCompleted(r->message_id());
+    DeltaRequest request;
+    takeDeltaRequest(r->message_id(), fmitcp_proto::fmi2_status_error, request);
+    m_cachedXml.erase(r->message_id());
+    on_error_res(r->message_id(), r->reason());
+}
 
+void Client::handle_shm_connect_res(fmitcp_message& res){
+    shm_connect_res * r = res.mutable_shm_connect_res();
+    m_logger.log(Logger::LOG_NETWORK,"< shm_connect_res(mid=%d,ok=%d)\n",r->message_id(),r->ok());
+    if(!m_shm)
+        return;
+
+    // The server has opened it or given up, so the name is not needed anymore
+    m_shm->unlink();
+    if(r->ok()){
+        m_transport = m_shm;
+        m_logger.log(Logger::LOG_NETWORK,"Using shared memory.\n");
     } else {
-        m_logger.log(Logger::LOG_ERROR,"Message type not recognized: %d!\n",type);
+        m_logger.log(Logger::LOG_NETWORK,"The server could not open the shared memory, staying on TCP.\n");
+        delete m_shm;
+        m_shm = NULL;
     }
+    onConnect();
 }
 
-void Client::clientDisconnected(lw_client c){
+void Client::handle_server_hello(fmitcp_message& res){
+    m_serverHello.Swap(res.mutable_server_hello());
+    m_logger.log(Logger::LOG_NETWORK,"< server_hello(version=%d,workers=%d,instances=%d)\n",m_serverHello.protocolversion(),m_serverHello.numworkers(),m_serverHello.numinstances());
+    if(m_serverHello.protocolversion() != FMITCP_PROTOCOL_VERSION){
+        m_logger.log(Logger::LOG_ERROR,"The server uses protocol version %d, this client %d. Closing the connection.\n",m_serverHello.protocolversion(),FMITCP_PROTOCOL_VERSION);
+        m_connection->close();
+        onError("Protocol version mismatch");
+        return;
+    }
+    m_greeted = true;
+
+    // Tell the server what this end will use. Value reference sets, subscriptions and Jacobians are up to the
+    // caller, the others are settings.
+    m_capabilities.clear();
+    if(m_windowSize != 1)
+        m_capabilities.push_back(capability_pipelining);
+    if(m_sharedMemory && ShmTransport::isSupported())
+        m_capabilities.push_back(capability_shared_memory);
+    m_capabilities.push_back(capability_value_reference_sets);
+    m_capabilities.push_back(capability_output_subscriptions);
+    if(m_delta)
+        m_capabilities.push_back(capability_delta_encoding);
+    if(!m_xmlCacheDir.empty())
+        m_capabilities.push_back(capability_xml_cache);
+    m_capabilities.push_back(capability_jacobian);
+    m_pipelining = hasCapability(capability_pipelining);
+
+    fmitcp_message& m = newRequest();
+    m.set_type(fmitcp_message_Type_type_client_hello);
+    client_hello * hello = m.mutable_client_hello();
+    hello->set_message_id(0);
+    hello->set_protocolversion(FMITCP_PROTOCOL_VERSION);
+    hello->set_maxframesize(m_decoder.getMaxFrameSize());
+    for(size_t i = 0; i < m_capabilities.size(); i++)
+        hello->add_capabilities(m_capabilities[i]);
+    m_logger.log(Logger::LOG_NETWORK,"> client_hello(version=%d)\n",hello->protocolversion());
+
+    // Not a request of the user, so not tracked in the window
+    sendMessage(&m);
+
+    // With shared memory, onConnect waits for the server to open it
+    if(m_local && hasCapability(capability_shared_memory) && startSharedMemory())
+        return;
+    onConnect();
+}
+
+bool Client::startSharedMemory(){
+    m_shm = ShmTransport::create(m_pump);
+    if(!m_shm){
+        m_logger.log(Logger::LOG_DEBUG,"Could not create shared memory, staying on TCP.\n");
+        return false;
+    }
+    m_shm->setListener(this);
+    m_shmDecoder.reset();
+    m_shm->start();
+
+    fmitcp_message& m = newRequest();
+    m.set_type(fmitcp_message_Type_type_shm_connect_req);
+    shm_connect_req * req = m.mutable_shm_connect_req();
+    req->set_message_id(0);
+    req->set_name(m_shm->getName());
+
+    m_logger.log(Logger::LOG_NETWORK,"> shm_connect_req(mid=%d,name=%s)\n",req->message_id(),req->name().c_str());
+
+    // Not a request of the user, so not tracked in the window
+    sendMessage(&m);
+    return true;
+}
+
+void Client::transportClosed(Transport * transport){
+    if(transport == m_shm){
+        // Goes away once the event is handled
+        delete m_shm;
+        m_shm = NULL;
+
+        // Without the shared memory the connection is no use, the server is told by closing the socket too
+        if(m_transport != m_connection){
+            m_transport = m_connection;
+            m_connection->close();
+        }
+        return;
+    }
+
     m_logger.log(Logger::LOG_NETWORK,"- Disconnected from server.\n");
-    lw_stream_close(c,true);
-    lw_stream_delete(c);
+    if(!m_inFlight.empty() || !m_pending.empty()){
+        m_logger.log(Logger::LOG_ERROR,"%d requests were not answered.\n",(int)(m_inFlight.size() + m_pending.size()));
+        m_inFlight.clear();
+        m_pending.clear();
+    }
+    m_transport = m_connection;
+    if(m_shm)
+        m_shm->close();
     onDisconnect();
 }
 
-void Client::clientError(lw_client c, lw_error error){
-    string err = lw_error_tostring(error);
-    m_logger.log(Logger::LOG_ERROR,"Error: %s\n",err.c_str());
-    onError(err);
+void Client::transportError(Transport * transport, const string& message){
+    m_logger.log(Logger::LOG_ERROR,"Error: %s\n",message.c_str());
+    onError(message);
 }
 
 Client::Client(EventPump * pump){
     GOOGLE_PROTOBUF_VERIFY_VERSION;
     m_pump = pump;
-    m_client = lw_client_new(m_pump->getPump());
-    //lw_fdstream_nagle(m_client,lw_false);
+    m_connection = NULL;
+    m_shm = NULL;
+    m_transport = NULL;
+    m_sharedMemory = true;
+    m_local = false;
+    m_greeted = false;
+    m_pipelining = false;
+    m_windowSize = 0;
+    m_stateChunkSize = 1024 * 1024;
+    m_delta = false;
+    m_realThreshold = 0;
+    registerHandlers();
 }
 
 Client::~Client(){
     m_logger.log(Logger::LOG_DEBUG,"Closing stream.\n");
-
-    bool status = lw_stream_close(m_client,false);
-    m_logger.log(Logger::LOG_DEBUG,"Closed stream with status %d.\n",status);
-
-    //lw_stream_delete(m_client);
+    delete m_shm;
+    delete m_connection;
     google::protobuf::ShutdownProtobufLibrary();
 }
 
 bool Client::isConnected(){
-    return lw_client_connected(m_client);
+    return m_connection && m_connection->isConnected();
+}
+
+void Client::setSharedMemory(bool sharedMemory){
+    m_sharedMemory = sharedMemory;
+}
+
+bool Client::getSharedMemory() const {
+    return m_sharedMemory;
+}
+
+bool Client::isUsingSharedMemory() const {
+    return m_shm != NULL && m_transport == m_shm;
+}
+
+const server_hello& Client::getServerHello() const {
+    return m_serverHello;
+}
+
+bool Client::serverHasCapability(capability_t capability) const {
+    for(int i = 0; i < m_serverHello.capabilities_size(); i++){
+        if(m_serverHello.capabilities(i) == capability)
+            return true;
+    }
+    return false;
+}
+
+bool Client::hasCapability(capability_t capability) const {
+    return find(m_capabilities.begin(), m_capabilities.end(), capability) != m_capabilities.end() &&
+        serverHasCapability(capability);
 }
 
 Logger * Client::getLogger() {
@@ -295,26 +922,213 @@ Logger * Client::getLogger() {
 }
 
 void Client::sendMessage(fmitcp_proto::fmitcp_message * message){
-    fmitcp::sendProtoBuffer(m_client,message);
+    if(!m_transport){
+        m_logger.log(Logger::LOG_ERROR,"Not connected, dropping a message.\n");
+        return;
+    }
+    FMITCP_LOG(m_logger, Logger::LOG_NETWORK_DEBUG, "sendProtoBuffer(%s)\n", message->DebugString().c_str());
+    fmitcp::sendProtoBuffer(m_transport,message,m_sendBuffer);
 }
 
-void Client::connect(string host, long port){
+fmitcp_message& Client::newRequest(){
+    m_request.Clear();
+    return m_request;
+}
+
+void Client::sendRequest(int message_id, fmitcp_proto::fmitcp_message * message){
+    // Keep the order of requests: if something is already queued, queue this one behind it
+    int window = getWindowLimit();
+    if(!m_pending.empty() || (window > 0 && (int)m_inFlight.size() >= window)){
+        m_pending.push_back(make_pair(message_id, *message));
+        return;
+    }
+
+    if(m_inFlight.find(message_id) != m_inFlight.end()){
+        m_logger.log(Logger::LOG_ERROR,"Message id %d is already in flight.\n",message_id);
+    }
+    m_inFlight[message_id] = message->type();
+    sendMessage(message);
+}
+
+void Client::requestCompleted(int message_id){
+    map<int,fmitcp_message_Type>::iterator it = m_inFlight.find(message_id);
+    if(it == m_inFlight.end()){
+        m_logger.log(Logger::LOG_ERROR,"Got a response to message id %d, which is not in flight.\n",message_id);
+        return;
+    }
+    m_inFlight.erase(it);
+
+    // Send queued requests now that the window has room
+    int window = getWindowLimit();
+    while(!m_pending.empty() && (window <= 0 || (int)m_inFlight.size() < window)){
+        int mid = m_pending.front().first;
+        m_inFlight[mid] = m_pending.front().second.type();
+        sendMessage(&m_pending.front().second);
+        m_pending.pop_front();
+    }
+}
+
+void Client::setWindowSize(int windowSize){
+    m_windowSize = windowSize;
+}
+
+int Client::getWindowSize() const {
+    return m_windowSize;
+}
+
+int Client::getWindowLimit() const {
+    // A server that can not take several requests at once gets them one by one
+    return m_pipelining ? m_windowSize : 1;
+}
+
+void Client::setStateChunkSize(int chunkSize){
+    m_stateChunkSize = chunkSize;
+}
+
+void Client::setDeltaEncoding(bool delta, double realThreshold){
+    m_delta = delta;
+    m_realThreshold = realThreshold;
+}
+
+bool Client::getDeltaEncoding() const {
+    return m_delta;
+}
+
+void Client::setXmlCacheDir(const string& dir){
+    m_xmlCacheDir = dir;
+}
+
+const string& Client::getXmlCacheDir() const {
+    return m_xmlCacheDir;
+}
+
+string Client::xmlCachePath(const string& hash) const {
+    // The hash comes from the server, so it must not lead out of the directory
+    if(m_xmlCacheDir.empty() || hash.empty() || hash.find_first_not_of("0123456789abcdef-") != string::npos)
+        return string();
+    return m_xmlCacheDir + "/" + hash + ".xml";
+}
+
+bool Client::useDelta() const {
+    return m_delta && hasCapability(capability_delta_encoding);
+}
+
+void Client::addDeltaRequest(int message_id, int fmuId, int realOutputs, int integerOutputs, int booleanOutputs, int stringOutputs){
+    DeltaRequest& request = m_deltaRequests[message_id];
+    request.fmuId = fmuId;
+    request.outputs[0] = realOutputs;
+    request.outputs[1] = integerOutputs;
+    request.outputs[2] = booleanOutputs;
+    request.outputs[3] = stringOutputs;
+}
+
+bool Client::takeDeltaRequest(int message_id, fmitcp_proto::fmi2_status_t status, DeltaRequest& request){
+    map<int,DeltaRequest>::iterator it = m_deltaRequests.find(message_id);
+    if(it == m_deltaRequests.end())
+        return false;
+    request = it->second;
+    m_deltaRequests.erase(it);
+    if(status != fmitcp_proto::fmi2_status_ok && status != fmitcp_proto::fmi2_status_warning)
+        forgetValues(m_sentValues, request.fmuId);
+    return true;
+}
+
+Client::DeltaValues * Client::receivedValues(const DeltaRequest& request, int type){
+    if(request.outputs[type] < 0)
+        return NULL;
+    return &m_receivedValues[make_pair(request.fmuId, request.outputs[type])];
+}
+
+void Client::forgetValues(map<pair<int,int>,DeltaValues>& values, int fmuId){
+    values.erase(values.lower_bound(make_pair(fmuId, INT_MIN)), values.lower_bound(make_pair(fmuId + 1, INT_MIN)));
+}
+
+int Client::getStateChunkSize() const {
+    return m_stateChunkSize;
+}
+
+int Client::getStateChunkLimit() const {
+    // Room for the other fields of the message
+    static const int MESSAGE_OVERHEAD = 1024;
+
+    google::protobuf::int64 frameSize = m_decoder.getMaxFrameSize();
+    if(m_serverHello.maxframesize() > 0 && m_serverHello.maxframesize() < frameSize)
+        frameSize = m_serverHello.maxframesize();
+    int limit = (int)min(frameSize - MESSAGE_OVERHEAD, (google::protobuf::int64)INT_MAX);
+    if(m_stateChunkSize > 0 && m_stateChunkSize < limit)
+        return m_stateChunkSize;
+    return limit;
+}
+
+int Client::getNumInFlight() const {
+    return m_inFlight.size();
+}
 
-    // Set the master object as tag
-    lw_stream_set_tag(m_client, (void*)this);
+int Client::getNumPending() const {
+    return m_pending.size();
+}
 
-    // connect the event handlers
-    lw_client_on_connect(   m_client, clientOnConnect);
-    lw_client_on_data(      m_client, clientOnData);
-    lw_client_on_disconnect(m_client, clientOnDisconnect);
-    lw_client_on_error(     m_client, clientOnError);
+bool Client::isInFlight(int message_id) const {
+    if(m_inFlight.find(message_id) != m_inFlight.end())
+        return true;
+    for(deque<pair<int,fmitcp_message> >::const_iterator it = m_pending.begin(); it != m_pending.end(); ++it){
+        if(it->first == message_id)
+            return true;
+    }
+    return false;
+}
 
-    // connect the client to the server
-    lw_client_connect(m_client, host.c_str(), port);
+void Client::setConnection(Transport * connection, bool local){
+    delete m_shm;
+    m_shm = NULL;
+    delete m_connection;
+    m_connection = connection;
+    m_connection->setListener(this);
+    m_transport = m_connection;
+    m_local = local;
+    m_decoder.reset();
+    m_greeted = false;
+    m_pipelining = false;
+    m_serverHello.Clear();
+    m_capabilities.clear();
+    m_sentValues.clear();
+    m_receivedValues.clear();
+    m_deltaRequests.clear();
+    m_deltaSubscriptions.clear();
+    m_cachedXml.clear();
+}
+
+void Client::connect(string host, long port){
+    TcpTransport * tcp = new TcpTransport(m_pump);
+    setConnection(tcp, isLocalHost(host));
+    tcp->connect(host, port);
 
     m_logger.log(Logger::LOG_DEBUG,"Connecting to %s:%ld...\n",host.c_str(),port);
 }
 
+void Client::connectLoopback(Server * server, bool passMessages){
+    LoopbackTransport * clientEnd;
+    LoopbackTransport * serverEnd;
+    LoopbackTransport::createPair(m_pump, passMessages, &clientEnd, &serverEnd);
+    setConnection(clientEnd, false);
+    server->addConnection(serverEnd);
+    m_logger.log(Logger::LOG_NETWORK,"+ Connected to FMU server in this process.\n");
+}
+
+bool Client::connectUnix(string path){
+    m_logger.log(Logger::LOG_DEBUG,"Connecting to %s...\n",path.c_str());
+    UnixSocketTransport * transport = UnixSocketTransport::connect(m_pump, path);
+    if(!transport){
+        m_logger.log(Logger::LOG_ERROR,"Could not connect to %s\n",path.c_str());
+        return false;
+    }
+    setConnection(transport, true);
+
+    // The server greets as over TCP
+    m_logger.log(Logger::LOG_NETWORK,"+ Connected to FMU server.\n");
+    return true;
+}
+
 void Client::disconnect(){
     //lw_eventpump_post_eventloop_exit(m_pump->getPump());
     //lw_stream_close(m_client,lw_true);
@@ -324,7 +1138,7 @@ void Client::disconnect(){
 
 void Client::getXml(int message_id, int fmuId) {
   // Construct message
-  fmitcp_message m;
+  fmitcp_message& m = newRequest();
   m.set_type(fmitcp_message_Type_type_get_xml_req);
 
   get_xml_req * req = m.mutable_get_xml_req();
@@ -333,12 +1147,12 @@ void Client::getXml(int message_id, int fmuId) {
 
   m_logger.log(Logger::LOG_NETWORK, "> get_xml_req(mid=%d,fmuId=%d)\n", message_id, fmuId);
 
-  sendMessage(&m);
+  sendRequest(message_id, &m);
 }
 
 void Client::fmi2_import_instantiate(int message_id) {
   // Construct message
-  fmitcp_message m;
+  fmitcp_message& m = newRequest();
   m.set_type(fmitcp_message_Type_type_fmi2_import_instantiate_req);
 
   fmi2_import_instantiate_req * req = m.mutable_fmi2_import_instantiate_req();
@@ -348,7 +1162,7 @@ void Client::fmi2_import_instantiate(int message_id) {
       "> fmi2_import_instantiate_slave_req(mid=%d)\n",
       message_id);
 
-  sendMessage(&m);
+  sendRequest(message_id, &m);
   /*string msg = "INSTANTIATEEEEE\n"; // TEST !? :)
   lw_stream_write(m_client,msg.c_str(), msg.size());*/
 }
@@ -356,7 +1170,7 @@ void Client::fmi2_import_instantiate(int message_id) {
 void Client::fmi2_import_initialize_slave(int message_id, int fmuId, bool toleranceDefined, double tolerance, double startTime,
     bool stopTimeDefined, double stopTime) {
     // Construct message
-    fmitcp_message m;
+    fmitcp_message& m = newRequest();
     m.set_type(fmitcp_message_Type_type_fmi2_import_initialize_slave_req);
 
     fmi2_import_initialize_slave_req * req = m.mutable_fmi2_import_initialize_slave_req();
@@ -372,11 +1186,11 @@ void Client::fmi2_import_initialize_slave(int message_id, int fmuId, bool tolera
         "startTime=%g,stopTimeDefined=%d,stopTime=%g)\n", message_id, fmuId, toleranceDefined, tolerance, startTime,
         stopTimeDefined, stopTime);
 
-    sendMessage(&m);
+    sendRequest(message_id, &m);
 }
 
 void Client::fmi2_import_terminate_slave(int message_id, int fmuId){
-    fmitcp_message m;
+    fmitcp_message& m = newRequest();
     m.set_type(fmitcp_message_Type_type_fmi2_import_terminate_slave_req);
 
     fmi2_import_terminate_slave_req * req = m.mutable_fmi2_import_terminate_slave_req();
@@ -388,43 +1202,49 @@ void Client::fmi2_import_terminate_slave(int message_id, int fmuId){
         message_id,
         fmuId);
 
-    sendMessage(&m);
+    sendRequest(message_id, &m);
 }
 
 void Client::fmi2_import_reset_slave(int message_id, int fmuId){
-    fmitcp_message m;
+    fmitcp_message& m = newRequest();
     m.set_type(fmitcp_message_Type_type_fmi2_import_reset_slave_req);
 
     fmi2_import_reset_slave_req * req = m.mutable_fmi2_import_reset_slave_req();
     req->set_message_id(message_id);
     req->set_fmuid(fmuId);
+    forgetValues(m_sentValues, fmuId);
 
     m_logger.log(Logger::LOG_NETWORK,
         "> fmi2_import_reset_slave_req(mid=%d,fmu=%d)\n",
         message_id,
         fmuId);
 
-    sendMessage(&m);
+    sendRequest(message_id, &m);
 }
 
 void Client::fmi2_import_free_slave_instance(int message_id,int fmuId){
-    fmitcp_message m;
+    fmitcp_message& m = newRequest();
     m.set_type(fmitcp_message_Type_type_fmi2_import_free_slave_instance_req);
 
     fmi2_import_free_slave_instance_req * req = m.mutable_fmi2_import_free_slave_instance_req();
     req->set_message_id(message_id);
     req->set_fmuid(fmuId);
 
+    // Values received are forgotten with the response, responses before it may still need them
+    forgetValues(m_sentValues, fmuId);
+    m_deltaSubscriptions.erase(fmuId);
+    addDeltaRequest(message_id, fmuId, -1, -1, -1, -1);
+
     m_logger.log(Logger::LOG_NETWORK, "> fmi2_import_free_slave_instance_req(mid=%d,fmu=%d)\n", message_id, fmuId);
 
-    sendMessage(&m);
+    sendRequest(message_id, &m);
 }
 
 void Client::fmi2_import_set_real_input_derivatives(int message_id, int fmuId,
                                                     std::vector<int> valueRefs,
                                                     std::vector<int> orders,
                                                     std::vector<double> values){
-    fmitcp_message m;
+    fmitcp_message& m = newRequest();
     m.set_type(fmitcp_message_Type_type_fmi2_import_set_real_input_derivatives_req);
 
     fmi2_import_set_real_input_derivatives_req * req = m.mutable_fmi2_import_set_real_input_derivatives_req();
@@ -435,11 +1255,11 @@ void Client::fmi2_import_set_real_input_derivatives(int message_id, int fmuId,
 
     m_logger.log(Logger::LOG_NETWORK, "> fmi2_import_set_real_input_derivatives_req(mid=%d,fmu=%d)\n", message_id, fmuId);
 
-    sendMessage(&m);
+    sendRequest(message_id, &m);
 }
 
 void Client::fmi2_import_get_real_output_derivatives(int message_id, int fmuId, std::vector<int> valueRefs, std::vector<int> orders){
-    fmitcp_message m;
+    fmitcp_message& m = newRequest();
     m.set_type(fmitcp_message_Type_type_fmi2_import_get_real_output_derivatives_req);
 
     fmi2_import_get_real_output_derivatives_req * req = m.mutable_fmi2_import_get_real_output_derivatives_req();
@@ -448,11 +1268,11 @@ void Client::fmi2_import_get_real_output_derivatives(int message_id, int fmuId,
 
     m_logger.log(Logger::LOG_NETWORK, "> fmi2_import_get_real_output_derivatives_req(mid=%d,fmu=%d)\n", message_id, fmuId);
 
-    sendMessage(&m);
+    sendRequest(message_id, &m);
 }
 
 void Client::fmi2_import_cancel_step(int message_id, int fmuId){
-    fmitcp_message m;
+    fmitcp_message& m = newRequest();
     m.set_type(fmitcp_message_Type_type_fmi2_import_cancel_step_req);
 
     fmi2_import_cancel_step_req * req = m.mutable_fmi2_import_cancel_step_req();
@@ -461,7 +1281,7 @@ void Client::fmi2_import_cancel_step(int message_id, int fmuId){
 
     m_logger.log(Logger::LOG_NETWORK, "> fmi2_import_cancel_step_req(mid=%d,fmu=%d)\n", message_id, fmuId);
 
-    sendMessage(&m);
+    sendRequest(message_id, &m);
 }
 
 void Client::fmi2_import_do_step(int message_id,
@@ -471,7 +1291,7 @@ void Client::fmi2_import_do_step(int message_id,
                                  bool newStep){
 
     // Construct message
-    fmitcp_message m;
+    fmitcp_message& m = newRequest();
     m.set_type(fmitcp_message_Type_type_fmi2_import_do_step_req);
 
     fmi2_import_do_step_req * req = m.mutable_fmi2_import_do_step_req();
@@ -480,6 +1300,8 @@ void Client::fmi2_import_do_step(int message_id,
     req->set_currentcommunicationpoint(currentCommunicationPoint);
     req->set_communicationstepsize(communicationStepSize);
     req->set_newstep(newStep);
+    if(m_deltaSubscriptions.count(fmuId))
+        addDeltaRequest(message_id, fmuId, 0, 0, 0, 0);
 
     m_logger.log(Logger::LOG_NETWORK,
         "> fmi2_import_do_step_req(mid=%d,fmu=%d,commPoint=%g,stepSize=%g,newStep=%d)\n",
@@ -489,12 +1311,12 @@ void Client::fmi2_import_do_step(int message_id,
         communicationStepSize,
         newStep);
 
-    sendMessage(&m);
+    sendRequest(message_id, &m);
 }
 
 void Client::fmi2_import_get_status(int message_id, int fmuId, fmitcp_proto::fmi2_status_kind_t s){
     // Construct message
-    fmitcp_message m;
+    fmitcp_message& m = newRequest();
     m.set_type(fmitcp_message_Type_type_fmi2_import_get_status_req);
 
     fmi2_import_get_status_req * req = m.mutable_fmi2_import_get_status_req();
@@ -508,12 +1330,12 @@ void Client::fmi2_import_get_status(int message_id, int fmuId, fmitcp_proto::fmi
         fmuId,
         s);
 
-    sendMessage(&m);
+    sendRequest(message_id, &m);
 }
 
 void Client::fmi2_import_get_real_status(int message_id, int fmuId, fmitcp_proto::fmi2_status_kind_t s){
     // Construct message
-    fmitcp_message m;
+    fmitcp_message& m = newRequest();
     m.set_type(fmitcp_message_Type_type_fmi2_import_get_real_status_req);
 
     fmi2_import_get_real_status_req * req = m.mutable_fmi2_import_get_real_status_req();
@@ -527,12 +1349,12 @@ void Client::fmi2_import_get_real_status(int message_id, int fmuId, fmitcp_proto
         fmuId,
         s);
 
-    sendMessage(&m);
+    sendRequest(message_id, &m);
 }
 
 void Client::fmi2_import_get_integer_status(int message_id, int fmuId, fmitcp_proto::fmi2_status_kind_t s){
     // Construct message
-    fmitcp_message m;
+    fmitcp_message& m = newRequest();
     m.set_type(fmitcp_message_Type_type_fmi2_import_get_integer_status_req);
 
     fmi2_import_get_integer_status_req * req = m.mutable_fmi2_import_get_integer_status_req();
@@ -542,13 +1364,13 @@ void Client::fmi2_import_get_integer_status(int message_id, int fmuId, fmitcp_pr
 
     m_logger.log(Logger::LOG_NETWORK, "> fmi2_import_get_integer_status_req(mid=%d,fmu=%d,kind=%d)\n", message_id, fmuId, s);
 
-    sendMessage(&m);
+    sendRequest(message_id, &m);
 }
 
 
 void Client::fmi2_import_get_boolean_status(int message_id, int fmuId, fmitcp_proto::fmi2_status_kind_t s){
     // Construct message
-    fmitcp_message m;
+    fmitcp_message& m = newRequest();
     m.set_type(fmitcp_message_Type_type_fmi2_import_get_boolean_status_req);
 
     fmi2_import_get_boolean_status_req * req = m.mutable_fmi2_import_get_boolean_status_req();
@@ -558,12 +1380,12 @@ void Client::fmi2_import_get_boolean_status(int message_id, int fmuId, fmitcp_pr
 
     m_logger.log(Logger::LOG_NETWORK, "> fmi2_import_get_boolean_status_req(mid=%d,fmu=%d,kind=%d)\n", message_id, fmuId, s);
 
-    sendMessage(&m);
+    sendRequest(message_id, &m);
 }
 
 void Client::fmi2_import_get_string_status(int message_id, int fmuId, fmitcp_proto::fmi2_status_kind_t s){
     // Construct message
-    fmitcp_message m;
+    fmitcp_message& m = newRequest();
     m.set_type(fmitcp_message_Type_type_fmi2_import_get_string_status_req);
 
     fmi2_import_get_string_status_req * req = m.mutable_fmi2_import_get_string_status_req();
@@ -573,12 +1395,12 @@ void Client::fmi2_import_get_string_status(int message_id, int fmuId, fmitcp_pro
 
     m_logger.log(Logger::LOG_NETWORK, "> fmi2_import_get_string_status_req(mid=%d,fmu=%d,kind=%d)\n", message_id, fmuId, s);
 
-    sendMessage(&m);
+    sendRequest(message_id, &m);
 }
 
 void Client::fmi2_import_get_version(int message_id, int fmuId){
     // Construct message
-    fmitcp_message m;
+    fmitcp_message& m = newRequest();
     m.set_type(fmitcp_message_Type_type_fmi2_import_get_version_req);
 
     fmi2_import_get_version_req * req = m.mutable_fmi2_import_get_version_req();
@@ -587,12 +1409,12 @@ void Client::fmi2_import_get_version(int message_id, int fmuId){
 
     m_logger.log(Logger::LOG_NETWORK, "> fmi2_import_get_version_req(mid=%d,fmu=%d)\n", message_id, fmuId);
 
-    sendMessage(&m);
+    sendRequest(message_id, &m);
 }
 
 void Client::fmi2_import_set_debug_logging(int message_id, int fmuId, bool loggingOn, const std::vector<string> categories){
     // Construct message
-    fmitcp_message m;
+    fmitcp_message& m = newRequest();
     m.set_type(fmitcp_message_Type_type_fmi2_import_set_debug_logging_req);
 
     fmi2_import_set_debug_logging_req * req = m.mutable_fmi2_import_set_debug_logging_req();
@@ -604,11 +1426,11 @@ void Client::fmi2_import_set_debug_logging(int message_id, int fmuId, bool loggi
 
     m_logger.log(Logger::LOG_NETWORK, "> fmi2_import_set_debug_logging_req(mid=%d,fmu=%d,categories=...)\n", message_id, fmuId);
 
-    sendMessage(&m);
+    sendRequest(message_id, &m);
 }
 
 void Client::fmi2_import_set_real(int message_id, int fmuId, const vector<int>& valueRefs, const vector<double>& values){
-    fmitcp_message m;
+    fmitcp_message& m = newRequest();
     m.set_type(fmitcp_message_Type_type_fmi2_import_set_real_req);
 
     fmi2_import_set_real_req * req = m.mutable_fmi2_import_set_real_req();
@@ -621,11 +1443,37 @@ void Client::fmi2_import_set_real(int message_id, int fmuId, const vector<int>&
 
     m_logger.log(Logger::LOG_NETWORK, "> fmi2_import_set_real_req(mid=%d,fmu=%d,vrs=...,values=...)\n", message_id, fmuId);
 
-    sendMessage(&m);
+    sendRequest(message_id, &m);
+}
+
+void Client::fmi2_import_set_real(int message_id, int fmuId, int valueReferenceSet, const vector<double>& values){
+    fmitcp_message& m = newRequest();
+    m.set_type(fmitcp_message_Type_type_fmi2_import_set_real_req);
+
+    fmi2_import_set_real_req * req = m.mutable_fmi2_import_set_real_req();
+    req->set_message_id(message_id);
+    req->set_fmuid(fmuId);
+    req->set_valuereferenceset(valueReferenceSet);
+    if(useDelta()){
+        // Only the changed values, once the server has all of them
+        vector<double>& sent = m_sentValues[make_pair(fmuId, valueReferenceSet)].reals;
+        bool delta = (sent.size() == values.size());
+        if(delta)
+            req->set_delta(true);
+        addInputs(values, !delta, m_realThreshold, &sent, req->mutable_indices(), req->mutable_values());
+        addDeltaRequest(message_id, fmuId, -1, -1, -1, -1);
+    } else {
+        for(int i=0; i<values.size(); i++)
+            req->add_values(values[i]);
+    }
+
+    m_logger.log(Logger::LOG_NETWORK, "> fmi2_import_set_real_req(mid=%d,fmu=%d,set=%d,values=...)\n", message_id, fmuId, valueReferenceSet);
+
+    sendRequest(message_id, &m);
 }
 
 void Client::fmi2_import_set_integer(int message_id, int fmuId, const vector<int>& valueRefs, const vector<int>& values){
-    fmitcp_message m;
+    fmitcp_message& m = newRequest();
     m.set_type(fmitcp_message_Type_type_fmi2_import_set_integer_req);
 
     fmi2_import_set_integer_req * req = m.mutable_fmi2_import_set_integer_req();
@@ -638,11 +1486,37 @@ void Client::fmi2_import_set_integer(int message_id, int fmuId, const vector<int
 
     m_logger.log(Logger::LOG_NETWORK, "> fmi2_import_set_integer_req(mid=%d,fmu=%d,vrs=...,values=...)\n", message_id, fmuId);
 
-    sendMessage(&m);
+    sendRequest(message_id, &m);
+}
+
+void Client::fmi2_import_set_integer(int message_id, int fmuId, int valueReferenceSet, const vector<int>& values){
+    fmitcp_message& m = newRequest();
+    m.set_type(fmitcp_message_Type_type_fmi2_import_set_integer_req);
+
+    fmi2_import_set_integer_req * req = m.mutable_fmi2_import_set_integer_req();
+    req->set_message_id(message_id);
+    req->set_fmuid(fmuId);
+    req->set_valuereferenceset(valueReferenceSet);
+    if(useDelta()){
+        // Only the changed values, once the server has all of them
+        vector<int>& sent = m_sentValues[make_pair(fmuId, valueReferenceSet)].integers;
+        bool delta = (sent.size() == values.size());
+        if(delta)
+            req->set_delta(true);
+        addInputs(values, !delta, m_realThreshold, &sent, req->mutable_indices(), req->mutable_values());
+        addDeltaRequest(message_id, fmuId, -1, -1, -1, -1);
+    } else {
+        for(int i=0; i<values.size(); i++)
+            req->add_values(values[i]);
+    }
+
+    m_logger.log(Logger::LOG_NETWORK, "> fmi2_import_set_integer_req(mid=%d,fmu=%d,set=%d,values=...)\n", message_id, fmuId, valueReferenceSet);
+
+    sendRequest(message_id, &m);
 }
 
 void Client::fmi2_import_set_boolean(int message_id, int fmuId, const vector<int>& valueRefs, const vector<bool>& values){
-    fmitcp_message m;
+    fmitcp_message& m = newRequest();
     m.set_type(fmitcp_message_Type_type_fmi2_import_set_boolean_req);
 
     fmi2_import_set_boolean_req * req = m.mutable_fmi2_import_set_boolean_req();
@@ -655,12 +1529,38 @@ void Client::fmi2_import_set_boolean(int message_id, int fmuId, const vector<int
 
     m_logger.log(Logger::LOG_NETWORK, "> fmi2_import_set_boolean_req(mid=%d,fmu=%d,vrs=...,values=...)\n", message_id, fmuId);
 
-    sendMessage(&m);
+    sendRequest(message_id, &m);
+}
+
+void Client::fmi2_import_set_boolean(int message_id, int fmuId, int valueReferenceSet, const vector<bool>& values){
+    fmitcp_message& m = newRequest();
+    m.set_type(fmitcp_message_Type_type_fmi2_import_set_boolean_req);
+
+    fmi2_import_set_boolean_req * req = m.mutable_fmi2_import_set_boolean_req();
+    req->set_message_id(message_id);
+    req->set_fmuid(fmuId);
+    req->set_valuereferenceset(valueReferenceSet);
+    if(useDelta()){
+        // Only the changed values, once the server has all of them
+        vector<bool>& sent = m_sentValues[make_pair(fmuId, valueReferenceSet)].booleans;
+        bool delta = (sent.size() == values.size());
+        if(delta)
+            req->set_delta(true);
+        addInputs(values, !delta, m_realThreshold, &sent, req->mutable_indices(), req->mutable_values());
+        addDeltaRequest(message_id, fmuId, -1, -1, -1, -1);
+    } else {
+        for(int i=0; i<values.size(); i++)
+            req->add_values(values[i]);
+    }
+
+    m_logger.log(Logger::LOG_NETWORK, "> fmi2_import_set_boolean_req(mid=%d,fmu=%d,set=%d,values=...)\n", message_id, fmuId, valueReferenceSet);
+
+    sendRequest(message_id, &m);
 }
 
 
 void Client::fmi2_import_set_string(int message_id, int fmuId, const vector<int>& valueRefs, const vector<string>& values){
-    fmitcp_message m;
+    fmitcp_message& m = newRequest();
     m.set_type(fmitcp_message_Type_type_fmi2_import_set_string_req);
 
     fmi2_import_set_string_req * req = m.mutable_fmi2_import_set_string_req();
@@ -673,11 +1573,37 @@ void Client::fmi2_import_set_string(int message_id, int fmuId, const vector<int>
 
     m_logger.log(Logger::LOG_NETWORK, "> fmi2_import_set_string_req(mid=%d,fmu=%d,vrs=...,values=...)\n", message_id, fmuId);
 
-    sendMessage(&m);
+    sendRequest(message_id, &m);
+}
+
+void Client::fmi2_import_set_string(int message_id, int fmuId, int valueReferenceSet, const vector<string>& values){
+    fmitcp_message& m = newRequest();
+    m.set_type(fmitcp_message_Type_type_fmi2_import_set_string_req);
+
+    fmi2_import_set_string_req * req = m.mutable_fmi2_import_set_string_req();
+    req->set_message_id(message_id);
+    req->set_fmuid(fmuId);
+    req->set_valuereferenceset(valueReferenceSet);
+    if(useDelta()){
+        // Only the changed values, once the server has all of them
+        vector<string>& sent = m_sentValues[make_pair(fmuId, valueReferenceSet)].strings;
+        bool delta = (sent.size() == values.size());
+        if(delta)
+            req->set_delta(true);
+        addInputs(values, !delta, m_realThreshold, &sent, req->mutable_indices(), req->mutable_values());
+        addDeltaRequest(message_id, fmuId, -1, -1, -1, -1);
+    } else {
+        for(int i=0; i<values.size(); i++)
+            req->add_values(values[i]);
+    }
+
+    m_logger.log(Logger::LOG_NETWORK, "> fmi2_import_set_string_req(mid=%d,fmu=%d,set=%d,values=...)\n", message_id, fmuId, valueReferenceSet);
+
+    sendRequest(message_id, &m);
 }
 
 void Client::fmi2_import_get_real(int message_id, int fmuId, const vector<int>& valueRefs){
-    fmitcp_message m;
+    fmitcp_message& m = newRequest();
     m.set_type(fmitcp_message_Type_type_fmi2_import_get_real_req);
 
     fmi2_import_get_real_req * req = m.mutable_fmi2_import_get_real_req();
@@ -688,12 +1614,31 @@ void Client::fmi2_import_get_real(int message_id, int fmuId, const vector<int>&
 
     m_logger.log(Logger::LOG_NETWORK, "> fmi2_import_get_real_req(mid=%d,fmu=%d,vrs=...)\n", message_id, fmuId);
 
-    sendMessage(&m);
+    sendRequest(message_id, &m);
+}
+
+void Client::fmi2_import_get_real(int message_id, int fmuId, int valueReferenceSet){
+    fmitcp_message& m = newRequest();
+    m.set_type(fmitcp_message_Type_type_fmi2_import_get_real_req);
+
+    fmi2_import_get_real_req * req = m.mutable_fmi2_import_get_real_req();
+    req->set_message_id(message_id);
+    req->set_fmuid(fmuId);
+    req->set_valuereferenceset(valueReferenceSet);
+    if(useDelta()){
+        req->set_delta(true);
+        req->set_realthreshold(m_realThreshold);
+        addDeltaRequest(message_id, fmuId, valueReferenceSet, -1, -1, -1);
+    }
+
+    m_logger.log(Logger::LOG_NETWORK, "> fmi2_import_get_real_req(mid=%d,fmu=%d,set=%d)\n", message_id, fmuId, valueReferenceSet);
+
+    sendRequest(message_id, &m);
 }
 
 void Client::fmi2_import_get_integer(int message_id, int fmuId, const vector<int>& valueRefs){
 
-    fmitcp_message m;
+    fmitcp_message& m = newRequest();
     m.set_type(fmitcp_message_Type_type_fmi2_import_get_integer_req);
 
     fmi2_import_get_integer_req * req = m.mutable_fmi2_import_get_integer_req();
@@ -704,11 +1649,29 @@ void Client::fmi2_import_get_integer(int message_id, int fmuId, const vector<int
 
     m_logger.log(Logger::LOG_NETWORK, "> fmi2_import_get_integer_req(mid=%d,fmu=%d,vrs=...)\n", message_id, fmuId);
 
-    sendMessage(&m);
+    sendRequest(message_id, &m);
+}
+
+void Client::fmi2_import_get_integer(int message_id, int fmuId, int valueReferenceSet){
+    fmitcp_message& m = newRequest();
+    m.set_type(fmitcp_message_Type_type_fmi2_import_get_integer_req);
+
+    fmi2_import_get_integer_req * req = m.mutable_fmi2_import_get_integer_req();
+    req->set_message_id(message_id);
+    req->set_fmuid(fmuId);
+    req->set_valuereferenceset(valueReferenceSet);
+    if(useDelta()){
+        req->set_delta(true);
+        addDeltaRequest(message_id, fmuId, -1, valueReferenceSet, -1, -1);
+    }
+
+    m_logger.log(Logger::LOG_NETWORK, "> fmi2_import_get_integer_req(mid=%d,fmu=%d,set=%d)\n", message_id, fmuId, valueReferenceSet);
+
+    sendRequest(message_id, &m);
 }
 
 void Client::fmi2_import_get_boolean(int message_id, int fmuId, const vector<int>& valueRefs){
-    fmitcp_message m;
+    fmitcp_message& m = newRequest();
     m.set_type(fmitcp_message_Type_type_fmi2_import_get_boolean_req);
 
     fmi2_import_get_boolean_req * req = m.mutable_fmi2_import_get_boolean_req();
@@ -719,11 +1682,29 @@ void Client::fmi2_import_get_boolean(int message_id, int fmuId, const vector<int
 
     m_logger.log(Logger::LOG_NETWORK, "> fmi2_import_get_boolean_req(mid=%d,fmu=%d,vrs=...)\n", message_id, fmuId);
 
-    sendMessage(&m);
+    sendRequest(message_id, &m);
+}
+
+void Client::fmi2_import_get_boolean(int message_id, int fmuId, int valueReferenceSet){
+    fmitcp_message& m = newRequest();
+    m.set_type(fmitcp_message_Type_type_fmi2_import_get_boolean_req);
+
+    fmi2_import_get_boolean_req * req = m.mutable_fmi2_import_get_boolean_req();
+    req->set_message_id(message_id);
+    req->set_fmuid(fmuId);
+    req->set_valuereferenceset(valueReferenceSet);
+    if(useDelta()){
+        req->set_delta(true);
+        addDeltaRequest(message_id, fmuId, -1, -1, valueReferenceSet, -1);
+    }
+
+    m_logger.log(Logger::LOG_NETWORK, "> fmi2_import_get_boolean_req(mid=%d,fmu=%d,set=%d)\n", message_id, fmuId, valueReferenceSet);
+
+    sendRequest(message_id, &m);
 }
 
 void Client::fmi2_import_get_string (int message_id, int fmuId, const vector<int>& valueRefs){
-    fmitcp_message m;
+    fmitcp_message& m = newRequest();
     m.set_type(fmitcp_message_Type_type_fmi2_import_get_string_req);
 
     fmi2_import_get_string_req * req = m.mutable_fmi2_import_get_string_req();
@@ -734,11 +1715,29 @@ void Client::fmi2_import_get_string (int message_id, int fmuId, const vector<int
 
     m_logger.log(Logger::LOG_NETWORK, "> fmi2_import_get_string_req(mid=%d,fmu=%d,vrs=...)\n", message_id, fmuId);
 
-    sendMessage(&m);
+    sendRequest(message_id, &m);
+}
+
+void Client::fmi2_import_get_string(int message_id, int fmuId, int valueReferenceSet){
+    fmitcp_message& m = newRequest();
+    m.set_type(fmitcp_message_Type_type_fmi2_import_get_string_req);
+
+    fmi2_import_get_string_req * req = m.mutable_fmi2_import_get_string_req();
+    req->set_message_id(message_id);
+    req->set_fmuid(fmuId);
+    req->set_valuereferenceset(valueReferenceSet);
+    if(useDelta()){
+        req->set_delta(true);
+        addDeltaRequest(message_id, fmuId, -1, -1, -1, valueReferenceSet);
+    }
+
+    m_logger.log(Logger::LOG_NETWORK, "> fmi2_import_get_string_req(mid=%d,fmu=%d,set=%d)\n", message_id, fmuId, valueReferenceSet);
+
+    sendRequest(message_id, &m);
 }
 
 void Client::fmi2_import_get_fmu_state(int message_id, int fmuId){
-    fmitcp_message m;
+    fmitcp_message& m = newRequest();
     m.set_type(fmitcp_message_Type_type_fmi2_import_get_fmu_state_req);
 
     fmi2_import_get_fmu_state_req * req = m.mutable_fmi2_import_get_fmu_state_req();
@@ -746,27 +1745,109 @@ void Client::fmi2_import_get_fmu_state(int message_id, int fmuId){
     req->set_fmuid(fmuId);
     m_logger.log(Logger::LOG_NETWORK, "> fmi2_import_get_fmu_state_req(mid=%d,fmu=%d)\n", message_id, fmuId);
 
-    sendMessage(&m);
+    sendRequest(message_id, &m);
 }
 
 void Client::fmi2_import_set_fmu_state(int message_id, int fmuId, int stateId){
-    fmitcp_message m;
+    fmitcp_message& m = newRequest();
     m.set_type(fmitcp_message_Type_type_fmi2_import_set_fmu_state_req);
 
     fmi2_import_set_fmu_state_req * req = m.mutable_fmi2_import_set_fmu_state_req();
     req->set_message_id(message_id);
     req->set_stateid(stateId);
     req->set_fmuid(fmuId);
+    forgetValues(m_sentValues, fmuId);
     m_logger.log(Logger::LOG_NETWORK, "> fmi2_import_set_fmu_state_req(mid=%d,fmu=%d,stateId=%d)\n", message_id, fmuId, stateId);
 
-    sendMessage(&m);
+    sendRequest(message_id, &m);
+}
+
+void Client::fmi2_import_free_fmu_state(int message_id, int fmuId, int stateId){
+    fmitcp_message& m = newRequest();
+    m.set_type(fmitcp_message_Type_type_fmi2_import_free_fmu_state_req);
+
+    fmi2_import_free_fmu_state_req * req = m.mutable_fmi2_import_free_fmu_state_req();
+    req->set_message_id(message_id);
+    req->set_fmuid(fmuId);
+    req->set_stateid(stateId);
+
+    m_logger.log(Logger::LOG_NETWORK, "> fmi2_import_free_fmu_state_req(mid=%d,fmu=%d,stateId=%d)\n", message_id, fmuId, stateId);
+
+    sendRequest(message_id, &m);
+}
+
+void Client::fmi2_import_serialized_fmu_state_size(int message_id, int fmuId, int stateId){
+    fmitcp_message& m = newRequest();
+    m.set_type(fmitcp_message_Type_type_fmi2_import_serialized_fmu_state_size_req);
+
+    fmi2_import_serialized_fmu_state_size_req * req = m.mutable_fmi2_import_serialized_fmu_state_size_req();
+    req->set_message_id(message_id);
+    req->set_fmuid(fmuId);
+    req->set_stateid(stateId);
+    m_logger.log(Logger::LOG_NETWORK, "> fmi2_import_serialized_fmu_state_size_req(mid=%d,fmu=%d,stateId=%d)\n", message_id, fmuId, stateId);
+
+    sendRequest(message_id, &m);
+}
+
+void Client::fmi2_import_serialize_fmu_state(int message_id, int fmuId, int stateId){
+    StateTransfer& transfer = m_stateTransfers[message_id];
+    transfer.step = TRANSFER_ONLY;
+    transfer.fmuId = fmuId;
+    transfer.stateId = stateId;
+    transfer.data.clear();
+    sendSerializeChunk(message_id, transfer);
+}
+
+void Client::sendSerializeChunk(int message_id, StateTransfer& transfer){
+    fmitcp_message& m = newRequest();
+    m.set_type(fmitcp_message_Type_type_fmi2_import_serialize_fmu_state_req);
+
+    fmi2_import_serialize_fmu_state_req * req = m.mutable_fmi2_import_serialize_fmu_state_req();
+    req->set_message_id(message_id);
+    req->set_fmuid(transfer.fmuId);
+    req->set_stateid(transfer.stateId);
+    req->set_offset(transfer.data.size());
+    req->set_maxchunksize(getStateChunkLimit());
+    m_logger.log(Logger::LOG_NETWORK, "> fmi2_import_serialize_fmu_state_req(mid=%d,fmu=%d,stateId=%d,offset=%lu)\n", message_id, transfer.fmuId, transfer.stateId, (unsigned long)transfer.data.size());
+
+    sendRequest(message_id, &m);
+}
+
+void Client::fmi2_import_de_serialize_fmu_state(int message_id, int fmuId, const string& state){
+    StateTransfer& transfer = m_stateTransfers[message_id];
+    transfer.step = TRANSFER_ONLY;
+    transfer.fmuId = fmuId;
+    transfer.stateId = 0;
+    transfer.data = state;
+    transfer.offset = 0;
+    sendDeSerializeChunk(message_id, transfer);
+}
+
+void Client::sendDeSerializeChunk(int message_id, StateTransfer& transfer){
+    size_t chunkSize = transfer.data.size() - transfer.offset;
+    if(chunkSize > (size_t)getStateChunkLimit())
+        chunkSize = getStateChunkLimit();
+
+    fmitcp_message& m = newRequest();
+    m.set_type(fmitcp_message_Type_type_fmi2_import_de_serialize_fmu_state_req);
+
+    fmi2_import_de_serialize_fmu_state_req * req = m.mutable_fmi2_import_de_serialize_fmu_state_req();
+    req->set_message_id(message_id);
+    req->set_fmuid(transfer.fmuId);
+    req->set_data(transfer.data.data() + transfer.offset, chunkSize);
+    req->set_offset(transfer.offset);
+    req->set_totalsize(transfer.data.size());
+    m_logger.log(Logger::LOG_NETWORK, "> fmi2_import_de_serialize_fmu_state_req(mid=%d,fmu=%d,offset=%lu,size=%lu)\n", message_id, transfer.fmuId, (unsigned long)transfer.offset, (unsigned long)chunkSize);
+
+    transfer.offset += chunkSize;
+    sendRequest(message_id, &m);
 }
 
 void Client::fmi2_import_get_directional_derivative(int message_id, int fmuId,
                                                     const vector<int>& v_ref,
                                                     const vector<int>& z_ref,
                                                     const vector<double>& dv){
-    fmitcp_message m;
+    fmitcp_message& m = newRequest();
     m.set_type(fmitcp_message_Type_type_fmi2_import_get_directional_derivative_req);
 
     fmi2_import_get_directional_derivative_req * req = m.mutable_fmi2_import_get_directional_derivative_req();
@@ -781,19 +1862,332 @@ void Client::fmi2_import_get_directional_derivative(int message_id, int fmuId,
 
     m_logger.log(Logger::LOG_NETWORK, "> fmi2_import_get_directional_derivative_req(mid=%d,fmu=%d,vref=...,zref=...,dv=...)\n", message_id, fmuId);
 
-    sendMessage(&m);
+    sendRequest(message_id, &m);
 }
 
 
 void Client::get_xml(int message_id, int fmuId){
-    fmitcp_message m;
+    fmitcp_message& m = newRequest();
     m.set_type(fmitcp_message_Type_type_get_xml_req);
 
     get_xml_req * req = m.mutable_get_xml_req();
     req->set_message_id(message_id);
     req->set_fmuid(fmuId);
 
-    m_logger.log(Logger::LOG_NETWORK, "> get_xml_req(mid=%d,fmu=%d)\n", message_id, fmuId);
+    // Pass the hash if the cached copy is there and intact, then the server does not send the XML again
+    string path = hasCapability(capability_xml_cache) ? xmlCachePath(m_serverHello.xmlhash()) : string();
+    FILE * file = path.empty() ? NULL : fopen(path.c_str(), "rb");
+    if(file){
+        string xml;
+        char buffer[65536];
+        size_t n;
+        while((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+            xml.append(buffer, n);
+        bool ok = !ferror(file);
+        fclose(file);
+        if(ok && contentHash(xml) == m_serverHello.xmlhash()){
+            req->set_xmlhash(m_serverHello.xmlhash());
+            m_cachedXml[message_id].swap(xml);
+        }
+    }
 
-    sendMessage(&m);
+    m_logger.log(Logger::LOG_NETWORK, "> get_xml_req(mid=%d,fmu=%d,cached=%d)\n", message_id, fmuId, req->has_xmlhash() ? 1 : 0);
+
+    sendRequest(message_id, &m);
+}
+
+void Client::fmi2_import_step_exchange(int message_id, int fmuId,
+                                       const vector<int>& realValueRefs, const vector<double>& realValues,
+                                       const vector<int>& integerValueRefs, const vector<int>& integerValues,
+                                       const vector<int>& booleanValueRefs, const vector<bool>& booleanValues,
+                                       const vector<int>& stringValueRefs, const vector<string>& stringValues,
+                                       double currentCommunicationPoint,
+                                       double communicationStepSize,
+                                       bool newStep,
+                                       const vector<int>& realOutputValueRefs,
+                                       const vector<int>& integerOutputValueRefs,
+                                       const vector<int>& booleanOutputValueRefs,
+                                       const vector<int>& stringOutputValueRefs){
+    fmitcp_message& m = newRequest();
+    m.set_type(fmitcp_message_Type_type_fmi2_import_step_exchange_req);
+
+    fmi2_import_step_exchange_req * req = m.mutable_fmi2_import_step_exchange_req();
+    req->set_message_id(message_id);
+    req->set_fmuid(fmuId);
+    for(int i=0; i<realValueRefs.size(); i++)
+        req->add_realvaluereferences(realValueRefs[i]);
+    for(int i=0; i<realValues.size(); i++)
+        req->add_realvalues(realValues[i]);
+    for(int i=0; i<integerValueRefs.size(); i++)
+        req->add_integervaluereferences(integerValueRefs[i]);
+    for(int i=0; i<integerValues.size(); i++)
+        req->add_integervalues(integerValues[i]);
+    for(int i=0; i<booleanValueRefs.size(); i++)
+        req->add_booleanvaluereferences(booleanValueRefs[i]);
+    for(int i=0; i<booleanValues.size(); i++)
+        req->add_booleanvalues(booleanValues[i]);
+    for(int i=0; i<stringValueRefs.size(); i++)
+        req->add_stringvaluereferences(stringValueRefs[i]);
+    for(int i=0; i<stringValues.size(); i++)
+        req->add_stringvalues(stringValues[i]);
+    req->set_currentcommunicationpoint(currentCommunicationPoint);
+    req->set_communicationstepsize(communicationStepSize);
+    req->set_newstep(newStep);
+    for(int i=0; i<realOutputValueRefs.size(); i++)
+        req->add_realoutputvaluereferences(realOutputValueRefs[i]);
+    for(int i=0; i<integerOutputValueRefs.size(); i++)
+        req->add_integeroutputvaluereferences(integerOutputValueRefs[i]);
+    for(int i=0; i<booleanOutputValueRefs.size(); i++)
+        req->add_booleanoutputvaluereferences(booleanOutputValueRefs[i]);
+    for(int i=0; i<stringOutputValueRefs.size(); i++)
+        req->add_stringoutputvaluereferences(stringOutputValueRefs[i]);
+
+    m_logger.log(Logger::LOG_NETWORK,
+        "> fmi2_import_step_exchange_req(mid=%d,fmu=%d,commPoint=%g,stepSize=%g,newStep=%d,vrs=...,values=...)\n",
+        message_id,
+        fmuId,
+        currentCommunicationPoint,
+        communicationStepSize,
+        newStep);
+
+    sendRequest(message_id, &m);
+}
+
+void Client::fmi2_import_step_exchange(int message_id, int fmuId,
+                                       int realValueReferenceSet, const vector<double>& realValues,
+                                       int integerValueReferenceSet, const vector<int>& integerValues,
+                                       int booleanValueReferenceSet, const vector<bool>& booleanValues,
+                                       int stringValueReferenceSet, const vector<string>& stringValues,
+                                       double currentCommunicationPoint,
+                                       double communicationStepSize,
+                                       bool newStep,
+                                       int realOutputValueReferenceSet,
+                                       int integerOutputValueReferenceSet,
+                                       int booleanOutputValueReferenceSet,
+                                       int stringOutputValueReferenceSet){
+    fmitcp_message& m = newRequest();
+    m.set_type(fmitcp_message_Type_type_fmi2_import_step_exchange_req);
+
+    // A set of 0 is left out, which means an empty list
+    fmi2_import_step_exchange_req * req = m.mutable_fmi2_import_step_exchange_req();
+    req->set_message_id(message_id);
+    req->set_fmuid(fmuId);
+    if(realValueReferenceSet)
+        req->set_realvaluereferenceset(realValueReferenceSet);
+    if(integerValueReferenceSet)
+        req->set_integervaluereferenceset(integerValueReferenceSet);
+    if(booleanValueReferenceSet)
+        req->set_booleanvaluereferenceset(booleanValueReferenceSet);
+    if(stringValueReferenceSet)
+        req->set_stringvaluereferenceset(stringValueReferenceSet);
+
+    // Only the changed inputs, once the server has all values of every list
+    bool delta = useDelta();
+    vector<double> * realSent = delta ? &m_sentValues[make_pair(fmuId, realValueReferenceSet)].reals : NULL;
+    vector<int> * integerSent = delta ? &m_sentValues[make_pair(fmuId, integerValueReferenceSet)].integers : NULL;
+    vector<bool> * booleanSent = delta ? &m_sentValues[make_pair(fmuId, booleanValueReferenceSet)].booleans : NULL;
+    vector<string> * stringSent = delta ? &m_sentValues[make_pair(fmuId, stringValueReferenceSet)].strings : NULL;
+    bool deltaInputs = delta &&
+        realSent->size() == realValues.size() && integerSent->size() == integerValues.size() &&
+        booleanSent->size() == booleanValues.size() && stringSent->size() == stringValues.size();
+    if(deltaInputs)
+        req->set_deltainputs(true);
+    addInputs(realValues, !deltaInputs, m_realThreshold, realSent, req->mutable_realindices(), req->mutable_realvalues());
+    addInputs(integerValues, !deltaInputs, 0, integerSent, req->mutable_integerindices(), req->mutable_integervalues());
+    addInputs(booleanValues, !deltaInputs, 0, booleanSent, req->mutable_booleanindices(), req->mutable_booleanvalues());
+    addInputs(stringValues, !deltaInputs, 0, stringSent, req->mutable_stringindices(), req->mutable_stringvalues());
+    req->set_currentcommunicationpoint(currentCommunicationPoint);
+    req->set_communicationstepsize(communicationStepSize);
+    req->set_newstep(newStep);
+    if(realOutputValueReferenceSet)
+        req->set_realoutputvaluereferenceset(realOutputValueReferenceSet);
+    if(integerOutputValueReferenceSet)
+        req->set_integeroutputvaluereferenceset(integerOutputValueReferenceSet);
+    if(booleanOutputValueReferenceSet)
+        req->set_booleanoutputvaluereferenceset(booleanOutputValueReferenceSet);
+    if(stringOutputValueReferenceSet)
+        req->set_stringoutputvaluereferenceset(stringOutputValueReferenceSet);
+    if(delta){
+        req->set_deltaoutputs(true);
+        req->set_realoutputthreshold(m_realThreshold);
+        addDeltaRequest(message_id, fmuId,
+            realOutputValueReferenceSet ? realOutputValueReferenceSet : -1,
+            integerOutputValueReferenceSet ? integerOutputValueReferenceSet : -1,
+            booleanOutputValueReferenceSet ? booleanOutputValueReferenceSet : -1,
+            stringOutputValueReferenceSet ? stringOutputValueReferenceSet : -1);
+    }
+
+    m_logger.log(Logger::LOG_NETWORK,
+        "> fmi2_import_step_exchange_req(mid=%d,fmu=%d,commPoint=%g,stepSize=%g,newStep=%d,sets=...,values=...)\n",
+        message_id, fmuId, currentCommunicationPoint, communicationStepSize, newStep ? 1 : 0);
+
+    sendRequest(message_id, &m);
+}
+
+void Client::prepare_value_references(int message_id, int fmuId, const vector<int>& valueRefs){
+    fmitcp_message& m = newRequest();
+    m.set_type(fmitcp_message_Type_type_prepare_value_references_req);
+
+    prepare_value_references_req * req = m.mutable_prepare_value_references_req();
+    req->set_message_id(message_id);
+    req->set_fmuid(fmuId);
+    for(int i=0; i<valueRefs.size(); i++)
+        req->add_valuereferences(valueRefs[i]);
+
+    m_logger.log(Logger::LOG_NETWORK, "> prepare_value_references_req(mid=%d,fmu=%d,vrs=%d)\n", message_id, fmuId, (int)valueRefs.size());
+
+    sendRequest(message_id, &m);
+}
+
+void Client::release_value_references(int message_id, int fmuId, int valueReferenceSet){
+    fmitcp_message& m = newRequest();
+    m.set_type(fmitcp_message_Type_type_release_value_references_req);
+
+    release_value_references_req * req = m.mutable_release_value_references_req();
+    req->set_message_id(message_id);
+    req->set_fmuid(fmuId);
+    req->set_valuereferenceset(valueReferenceSet);
+    m_sentValues.erase(make_pair(fmuId, valueReferenceSet));
+
+    m_logger.log(Logger::LOG_NETWORK, "> release_value_references_req(mid=%d,fmu=%d,set=%d)\n", message_id, fmuId, valueReferenceSet);
+
+    sendRequest(message_id, &m);
+}
+
+void Client::subscribe_outputs(int message_id, int fmuId,
+                               const vector<int>& realValueRefs,
+                               const vector<int>& integerValueRefs,
+                               const vector<int>& booleanValueRefs,
+                               const vector<int>& stringValueRefs){
+    fmitcp_message& m = newRequest();
+    m.set_type(fmitcp_message_Type_type_subscribe_outputs_req);
+
+    subscribe_outputs_req * req = m.mutable_subscribe_outputs_req();
+    req->set_message_id(message_id);
+    req->set_fmuid(fmuId);
+    for(int i=0; i<realValueRefs.size(); i++)
+        req->add_realvaluereferences(realValueRefs[i]);
+    for(int i=0; i<integerValueRefs.size(); i++)
+        req->add_integervaluereferences(integerValueRefs[i]);
+    for(int i=0; i<booleanValueRefs.size(); i++)
+        req->add_booleanvaluereferences(booleanValueRefs[i]);
+    for(int i=0; i<stringValueRefs.size(); i++)
+        req->add_stringvaluereferences(stringValueRefs[i]);
+    if(useDelta()){
+        req->set_delta(true);
+        req->set_realthreshold(m_realThreshold);
+        m_deltaSubscriptions.insert(fmuId);
+    } else
+        m_deltaSubscriptions.erase(fmuId);
+
+    m_logger.log(Logger::LOG_NETWORK, "> subscribe_outputs_req(mid=%d,fmu=%d,vrs=%d/%d/%d/%d)\n", message_id, fmuId,
+        (int)realValueRefs.size(), (int)integerValueRefs.size(), (int)booleanValueRefs.size(), (int)stringValueRefs.size());
+
+    sendRequest(message_id, &m);
+}
+
+void Client::get_jacobian(int message_id, int fmuId, const vector<int>& unknownValueRefs, const vector<int>& knownValueRefs, bool sparse,
+                          bool finiteDifferences, double currentCommunicationPoint, double communicationStepSize,
+                          double relativePerturbation){
+    fmitcp_message& m = newRequest();
+    m.set_type(fmitcp_message_Type_type_get_jacobian_req);
+
+    get_jacobian_req * req = m.mutable_get_jacobian_req();
+    req->set_message_id(message_id);
+    req->set_fmuid(fmuId);
+    for(int i=0; i<unknownValueRefs.size(); i++)
+        req->add_unknownvaluereferences(unknownValueRefs[i]);
+    for(int i=0; i<knownValueRefs.size(); i++)
+        req->add_knownvaluereferences(knownValueRefs[i]);
+    req->set_sparse(sparse);
+    if(finiteDifferences)
+        req->set_finitedifferences(true);
+    if(communicationStepSize > 0){
+        req->set_currentcommunicationpoint(currentCommunicationPoint);
+        req->set_communicationstepsize(communicationStepSize);
+    }
+    req->set_relativeperturbation(relativePerturbation);
+
+    m_logger.log(Logger::LOG_NETWORK, "> get_jacobian_req(mid=%d,fmu=%d,unknowns=%d,knowns=%d,sparse=%d,fd=%d,h=%g)\n", message_id, fmuId,
+        (int)unknownValueRefs.size(), (int)knownValueRefs.size(), sparse, finiteDifferences, communicationStepSize);
+
+    sendRequest(message_id, &m);
+}
+
+void Client::get_jacobian(int message_id, int fmuId, int unknownValueReferenceSet, int knownValueReferenceSet, bool sparse,
+                          bool finiteDifferences, double currentCommunicationPoint, double communicationStepSize,
+                          double relativePerturbation){
+    fmitcp_message& m = newRequest();
+    m.set_type(fmitcp_message_Type_type_get_jacobian_req);
+
+    get_jacobian_req * req = m.mutable_get_jacobian_req();
+    req->set_message_id(message_id);
+    req->set_fmuid(fmuId);
+    req->set_unknownvaluereferenceset(unknownValueReferenceSet);
+    req->set_knownvaluereferenceset(knownValueReferenceSet);
+    req->set_sparse(sparse);
+    if(finiteDifferences)
+        req->set_finitedifferences(true);
+    if(communicationStepSize > 0){
+        req->set_currentcommunicationpoint(currentCommunicationPoint);
+        req->set_communicationstepsize(communicationStepSize);
+    }
+    req->set_relativeperturbation(relativePerturbation);
+
+    m_logger.log(Logger::LOG_NETWORK, "> get_jacobian_req(mid=%d,fmu=%d,unknowns=set %d,knowns=set %d,sparse=%d,fd=%d,h=%g)\n", message_id, fmuId,
+        unknownValueReferenceSet, knownValueReferenceSet, sparse, finiteDifferences, communicationStepSize);
+
+    sendRequest(message_id, &m);
+}
+
+void Client::saveCheckpoint(int message_id, int fmuId, const string& path){
+    StateTransfer& transfer = m_stateTransfers[message_id];
+    transfer.step = SAVE_GET_STATE;
+    transfer.fmuId = fmuId;
+    transfer.stateId = 0;
+    transfer.data.clear();
+    transfer.path = path;
+    transfer.result = fmitcp_proto::fmi2_status_ok;
+    fmi2_import_get_fmu_state(message_id, fmuId);
+}
+
+void Client::restoreCheckpoint(int message_id, int fmuId, const string& path){
+    StateTransfer& transfer = m_stateTransfers[message_id];
+    transfer.step = RESTORE_DE_SERIALIZE;
+    transfer.fmuId = fmuId;
+    transfer.stateId = 0;
+    transfer.data.clear();
+    transfer.offset = 0;
+    transfer.path = path;
+    transfer.result = fmitcp_proto::fmi2_status_ok;
+
+    FILE * file = fopen(path.c_str(), "rb");
+    if(!file){
+        m_logger.log(Logger::LOG_ERROR,"Could not open checkpoint file %s.\n",path.c_str());
+        return finishCheckpoint(message_id, fmitcp_proto::fmi2_status_error);
+    }
+    char buffer[64 * 1024];
+    size_t size;
+    while((size = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        transfer.data.append(buffer, size);
+    bool failed = ferror(file) != 0;
+    fclose(file);
+    if(failed){
+        m_logger.log(Logger::LOG_ERROR,"Could not read checkpoint file %s.\n",path.c_str());
+        return finishCheckpoint(message_id, fmitcp_proto::fmi2_status_error);
+    }
+
+    sendDeSerializeChunk(message_id, transfer);
+}
+
+void Client::finishCheckpoint(int message_id, fmitcp_proto::fmi2_status_t status){
+    map<int,StateTransfer>::iterator it = m_stateTransfers.find(message_id);
+    if(it == m_stateTransfers.end())
+        return;
+    bool saving = it->second.step == SAVE_GET_STATE || it->second.step == SAVE_SERIALIZE || it->second.step == SAVE_FREE_STATE;
+    m_stateTransfers.erase(it);
+    if(saving)
+        onCheckpointSaved(message_id, status);
+    else
+        onCheckpointRestored(message_id, status);
 }
@@ -0,0 +1,177 @@
+#include "FmuStateStore.h"
+#include <string.h>
+#include <stdint.h>
+
+using namespace fmitcp;
+
+namespace {
+
+    /// Ends a serialized FMU state that has an integrator state appended, after the size of that
+    const uint32_t INTEGRATOR_MAGIC = 0x666d6969;
+
+    /// Integrator state without the nominals, and the size and marker after it
+    const size_t INTEGRATOR_FIXED_SIZE = 3 * sizeof(double) + 8 * sizeof(int32_t);
+    const size_t INTEGRATOR_FOOTER_SIZE = 2 * sizeof(uint32_t);
+
+    template<typename T>
+    void appendValue(std::string& data, T value){
+        data.append((const char*)&value, sizeof(value));
+    }
+
+    template<typename T>
+    T readValue(const char *& p){
+        T value;
+        memcpy(&value, p, sizeof(value));
+        p += sizeof(value);
+        return value;
+    }
+
+}
+
+FmuStateStore::FmuStateStore(){
+    m_nextStateId = 0;
+    m_capacity = DEFAULT_CAPACITY;
+    outgoingStateId = -1;
+    incomingSize = 0;
+}
+
+FmuStateStore::~FmuStateStore(){
+
+}
+
+int FmuStateStore::add(fmi2_FMU_state_t state, fmi2_FMU_state_t * evicted, const Integrator::Snapshot * integrator){
+    *evicted = NULL;
+    if(m_states.size() >= m_capacity && !m_lru.empty()){
+        int oldest = m_lru.back();
+        *evicted = remove(oldest);
+    }
+
+    int stateId = m_nextStateId++;
+    m_lru.push_front(stateId);
+    Entry& entry = m_states[stateId];
+    entry.state = state;
+    entry.lru = m_lru.begin();
+    entry.hasIntegrator = integrator != NULL;
+    if(integrator)
+        entry.integrator = *integrator;
+    return stateId;
+}
+
+fmi2_FMU_state_t FmuStateStore::get(int stateId){
+    std::map<int,Entry>::iterator it = m_states.find(stateId);
+    if(it == m_states.end())
+        return NULL;
+
+    // Move to the front of the LRU list
+    m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+    return it->second.state;
+}
+
+const Integrator::Snapshot * FmuStateStore::getIntegrator(int stateId) const {
+    std::map<int,Entry>::const_iterator it = m_states.find(stateId);
+    if(it == m_states.end() || !it->second.hasIntegrator)
+        return NULL;
+    return &it->second.integrator;
+}
+
+fmi2_FMU_state_t FmuStateStore::remove(int stateId){
+    std::map<int,Entry>::iterator it = m_states.find(stateId);
+    if(it == m_states.end())
+        return NULL;
+
+    if(stateId == outgoingStateId){
+        std::string().swap(outgoing);
+        outgoingStateId = -1;
+    }
+
+    fmi2_FMU_state_t state = it->second.state;
+    m_lru.erase(it->second.lru);
+    m_states.erase(it);
+    return state;
+}
+
+void FmuStateStore::removeAll(std::vector<fmi2_FMU_state_t>& states){
+    std::map<int,Entry>::iterator it;
+    for(it = m_states.begin(); it != m_states.end(); ++it)
+        states.push_back(it->second.state);
+    m_states.clear();
+    m_lru.clear();
+    clearTransfers();
+}
+
+void FmuStateStore::setCapacity(size_t capacity){
+    m_capacity = capacity;
+}
+
+size_t FmuStateStore::getCapacity() const {
+    return m_capacity;
+}
+
+size_t FmuStateStore::size() const {
+    return m_states.size();
+}
+
+void FmuStateStore::clearTransfers(){
+    // swap() instead of clear(), which would keep the memory
+    std::string().swap(outgoing);
+    std::string().swap(incoming);
+    outgoingStateId = -1;
+    incomingSize = 0;
+}
+
+size_t FmuStateStore::integratorSize(const Integrator::Snapshot& integrator){
+    return INTEGRATOR_FIXED_SIZE + integrator.nominals.size() * sizeof(double) + INTEGRATOR_FOOTER_SIZE;
+}
+
+void FmuStateStore::appendIntegrator(std::string& data, const Integrator::Snapshot& integrator){
+    size_t start = data.size();
+    appendValue<double>(data, integrator.stepSize);
+    appendValue<int32_t>(data, integrator.eventInfo.newDiscreteStatesNeeded);
+    appendValue<int32_t>(data, integrator.eventInfo.terminateSimulation);
+    appendValue<int32_t>(data, integrator.eventInfo.nominalsOfContinuousStatesChanged);
+    appendValue<int32_t>(data, integrator.eventInfo.valuesOfContinuousStatesChanged);
+    appendValue<int32_t>(data, integrator.eventInfo.nextEventTimeDefined);
+    appendValue<double>(data, integrator.eventInfo.nextEventTime);
+    appendValue<int32_t>(data, integrator.terminated);
+    appendValue<int32_t>(data, integrator.lastStatus);
+    appendValue<double>(data, integrator.lastSuccessfulTime);
+    appendValue<uint32_t>(data, (uint32_t)integrator.nominals.size());
+    for(size_t i=0; i<integrator.nominals.size(); i++)
+        appendValue<double>(data, integrator.nominals[i]);
+    appendValue<uint32_t>(data, (uint32_t)(data.size() - start));
+    appendValue<uint32_t>(data, INTEGRATOR_MAGIC);
+}
+
+bool FmuStateStore::takeIntegrator(std::string& data, Integrator::Snapshot& integrator){
+    if(data.size() < INTEGRATOR_FIXED_SIZE + INTEGRATOR_FOOTER_SIZE)
+        return false;
+    const char * footer = data.data() + data.size() - INTEGRATOR_FOOTER_SIZE;
+    uint32_t size = readValue<uint32_t>(footer);
+    uint32_t magic = readValue<uint32_t>(footer);
+    if(magic != INTEGRATOR_MAGIC || size < INTEGRATOR_FIXED_SIZE || size > data.size() - INTEGRATOR_FOOTER_SIZE)
+        return false;
+
+    size_t start = data.size() - INTEGRATOR_FOOTER_SIZE - size;
+    const char * p = data.data() + start;
+    Integrator::Snapshot s;
+    s.stepSize = readValue<double>(p);
+    s.eventInfo.newDiscreteStatesNeeded = readValue<int32_t>(p);
+    s.eventInfo.terminateSimulation = readValue<int32_t>(p);
+    s.eventInfo.nominalsOfContinuousStatesChanged = readValue<int32_t>(p);
+    s.eventInfo.valuesOfContinuousStatesChanged = readValue<int32_t>(p);
+    s.eventInfo.nextEventTimeDefined = readValue<int32_t>(p);
+    s.eventInfo.nextEventTime = readValue<double>(p);
+    s.terminated = readValue<int32_t>(p) != 0;
+    s.lastStatus = (fmi2_status_t)readValue<int32_t>(p);
+    s.lastSuccessfulTime = readValue<double>(p);
+    uint32_t numNominals = readValue<uint32_t>(p);
+    if((size - INTEGRATOR_FIXED_SIZE) % sizeof(double) != 0 || (size - INTEGRATOR_FIXED_SIZE) / sizeof(double) != numNominals)
+        return false;
+    s.nominals.resize(numNominals);
+    for(uint32_t i=0; i<numNominals; i++)
+        s.nominals[i] = readValue<double>(p);
+
+    integrator = s;
+    data.resize(start);
+    return true;
+}
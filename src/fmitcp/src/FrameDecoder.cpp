@@ -0,0 +1,129 @@
+#include "FrameDecoder.h"
+
+using namespace fmitcp;
+
+FrameDecoder::FrameDecoder(){
+    m_external = NULL;
+    m_externalSize = 0;
+    m_offset = 0;
+    m_maxFrameSize = DEFAULT_MAX_FRAME_SIZE;
+    m_error = false;
+}
+
+FrameDecoder::~FrameDecoder(){
+
+}
+
+void FrameDecoder::feed(const char * data, size_t size){
+    if(m_error)
+        return;
+
+    // The previous data was not drained, it is only valid until now
+    if(m_external)
+        keepExternal();
+
+    // Drop consumed bytes before appending, so the buffer only grows with incomplete frames
+    if(m_offset == m_buffer.size()){
+        // Nothing buffered: decode in place
+        m_buffer.clear();
+        m_offset = 0;
+        m_external = data;
+        m_externalSize = size;
+        return;
+    } else if(m_offset > 0){
+        m_buffer.erase(0, m_offset);
+        m_offset = 0;
+    }
+    m_buffer.append(data, size);
+}
+
+bool FrameDecoder::next(const char ** frame, size_t * size){
+    if(m_error)
+        return false;
+
+    const char * data = m_external ? m_external : m_buffer.data();
+    size_t dataSize = m_external ? m_externalSize : m_buffer.size();
+    const unsigned char * p = (const unsigned char *)data + m_offset;
+    size_t available = dataSize - m_offset;
+
+    // Decode the varint length prefix
+    size_t length = 0;
+    size_t headerSize = 0;
+    while(true){
+        if(headerSize == available){
+            // Header not complete yet
+            if(m_external)
+                keepExternal();
+            return false;
+        }
+        if(headerSize == MAX_HEADER_SIZE){
+            m_error = true;
+            return false;
+        }
+        unsigned char b = p[headerSize];
+        length |= (size_t)(b & 0x7F) << (7 * headerSize);
+        headerSize++;
+        if(!(b & 0x80))
+            break;
+    }
+
+    if(length > m_maxFrameSize){
+        m_error = true;
+        return false;
+    }
+
+    if(available - headerSize < length){
+        // Body not complete yet
+        if(m_external)
+            keepExternal();
+        return false;
+    }
+
+    *frame = (const char *)p + headerSize;
+    *size = length;
+    m_offset += headerSize + length;
+    return true;
+}
+
+bool FrameDecoder::hasError() const {
+    return m_error;
+}
+
+void FrameDecoder::keepExternal(){
+    m_buffer.assign(m_external + m_offset, m_externalSize - m_offset);
+    m_offset = 0;
+    m_external = NULL;
+    m_externalSize = 0;
+}
+
+void FrameDecoder::reset(){
+    m_external = NULL;
+    m_externalSize = 0;
+    m_buffer.clear();
+    m_offset = 0;
+    m_error = false;
+}
+
+void FrameDecoder::setMaxFrameSize(size_t maxFrameSize){
+    m_maxFrameSize = maxFrameSize;
+}
+
+size_t FrameDecoder::getMaxFrameSize() const {
+    return m_maxFrameSize;
+}
+
+size_t FrameDecoder::getBufferedSize() const {
+    if(m_external)
+        return m_externalSize - m_offset;
+    return m_buffer.size() - m_offset;
+}
+
+size_t FrameDecoder::encodeHeader(size_t size, char * header){
+    size_t n = 0;
+    while(size >= 0x80){
+        header[n++] = (char)((size & 0x7F) | 0x80);
+        size >>= 7;
+    }
+    header[n++] = (char)size;
+    return n;
+}
@@ -0,0 +1,442 @@
+#include "Integrator.h"
+#include <math.h>
+#include <algorithm>
+
+using namespace fmitcp;
+
+const double Integrator::DEFAULT_TOLERANCE = 1e-6;
+
+/// Smallest time difference that counts, relative to the time
+static const double TIME_RESOLUTION = 1e-12;
+
+/// Newton iterations of a BDF1 step before it is retried smaller, and how small the last correction must be,
+/// relative to the error tolerance
+static const int MAX_NEWTON_ITERATIONS = 5;
+static const double NEWTON_TOLERANCE = 0.1;
+
+/// Dormand-Prince coefficients: stages, nodes and the difference between the 5th and the 4th order solutions
+static const double RK45_A[6][6] = {
+    {1.0/5},
+    {3.0/40, 9.0/40},
+    {44.0/45, -56.0/15, 32.0/9},
+    {19372.0/6561, -25360.0/2187, 64448.0/6561, -212.0/729},
+    {9017.0/3168, -355.0/33, 46732.0/5247, 49.0/176, -5103.0/18656},
+    {35.0/384, 0.0, 500.0/1113, 125.0/192, -2187.0/6784, 11.0/84}
+};
+static const double RK45_C[7] = {0.0, 1.0/5, 3.0/10, 4.0/5, 8.0/9, 1.0, 1.0};
+static const double RK45_E[7] = {71.0/57600, 0.0, -71.0/16695, 71.0/1920, -17253.0/339200, 22.0/525, -1.0/40};
+
+static bool statusOk(fmi2_status_t status){
+    return status == fmi2_status_ok || status == fmi2_status_warning;
+}
+
+/// First element of a vector, or NULL if it is empty
+static double* data(std::vector<double>& v){
+    return v.empty() ? NULL : &v[0];
+}
+static const double* data(const std::vector<double>& v){
+    return v.empty() ? NULL : &v[0];
+}
+
+/// True if an event indicator changed between z > 0 and z <= 0
+static bool signChanged(const std::vector<double>& z, const std::vector<double>& zNew){
+    for(size_t i=0; i<z.size(); i++){
+        if((z[i] > 0) != (zNew[i] > 0))
+            return true;
+    }
+    return false;
+}
+
+/// LU factorization with partial pivoting of the n by n matrix a, row by row, in place. False if it is singular.
+static bool luFactor(std::vector<double>& a, int n, std::vector<int>& pivots){
+    pivots.resize(n);
+    for(int k=0; k<n; k++){
+        int p = k;
+        for(int i=k+1; i<n; i++){
+            if(fabs(a[i*n+k]) > fabs(a[p*n+k]))
+                p = i;
+        }
+        pivots[k] = p;
+        if(a[p*n+k] == 0.0)
+            return false;
+        if(p != k){
+            for(int j=0; j<n; j++)
+                std::swap(a[k*n+j], a[p*n+j]);
+        }
+        for(int i=k+1; i<n; i++){
+            double f = a[i*n+k] /= a[k*n+k];
+            for(int j=k+1; j<n; j++)
+                a[i*n+j] -= f * a[k*n+j];
+        }
+    }
+    return true;
+}
+
+/// Solve a x = b with the factorization of luFactor(). b is replaced by x.
+static void luSolve(const std::vector<double>& a, int n, const std::vector<int>& pivots, std::vector<double>& b){
+    for(int k=0; k<n; k++)
+        std::swap(b[k], b[pivots[k]]);
+    for(int i=0; i<n; i++){
+        for(int j=0; j<i; j++)
+            b[i] -= a[i*n+j] * b[j];
+    }
+    for(int i=n-1; i>=0; i--){
+        for(int j=i+1; j<n; j++)
+            b[i] -= a[i*n+j] * b[j];
+        b[i] /= a[i*n+i];
+    }
+}
+
+Integrator::Integrator(fmi2_import_t* fmu, Method method, double relativeTolerance){
+    m_fmu = fmu;
+    m_method = method;
+    m_relativeTolerance = relativeTolerance;
+    m_numStates = fmi2_import_get_number_of_continuous_states(fmu);
+    m_numIndicators = fmi2_import_get_number_of_event_indicators(fmu);
+
+    size_t n = m_numStates, nz = m_numIndicators;
+    m_x.resize(n); m_dx.resize(n); m_z.resize(nz);
+    m_xNew.resize(n); m_dxNew.resize(n); m_zNew.resize(nz);
+    m_xTry.resize(n); m_dxTry.resize(n); m_zTry.resize(nz);
+    for(int s=0; s<7; s++)
+        m_k[s].resize(n);
+    m_error.resize(n);
+    reset();
+}
+
+Integrator::~Integrator(){
+
+}
+
+void Integrator::reset(){
+    m_stepSize = 0;
+    m_terminated = false;
+    m_lastStatus = fmi2_status_ok;
+    m_lastSuccessfulTime = 0;
+    m_eventInfo.newDiscreteStatesNeeded = fmi2_false;
+    m_eventInfo.terminateSimulation = fmi2_false;
+    m_eventInfo.nominalsOfContinuousStatesChanged = fmi2_false;
+    m_eventInfo.valuesOfContinuousStatesChanged = fmi2_false;
+    m_eventInfo.nextEventTimeDefined = fmi2_false;
+    m_eventInfo.nextEventTime = 0;
+    m_nominals.assign(m_numStates, 1.0);
+}
+
+void Integrator::save(Snapshot& snapshot) const {
+    snapshot.stepSize = m_stepSize;
+    snapshot.eventInfo = m_eventInfo;
+    snapshot.terminated = m_terminated;
+    snapshot.lastStatus = m_lastStatus;
+    snapshot.lastSuccessfulTime = m_lastSuccessfulTime;
+    snapshot.nominals = m_nominals;
+}
+
+void Integrator::restore(const Snapshot& snapshot){
+    m_stepSize = snapshot.stepSize;
+    m_eventInfo = snapshot.eventInfo;
+    m_terminated = snapshot.terminated;
+    m_lastStatus = snapshot.lastStatus;
+    m_lastSuccessfulTime = snapshot.lastSuccessfulTime;
+    // A snapshot that came with a serialized state may be of another model
+    if(snapshot.nominals.size() == m_numStates)
+        m_nominals = snapshot.nominals;
+    else
+        m_nominals.assign(m_numStates, 1.0);
+}
+
+void Integrator::readNominals(){
+    if(m_numStates == 0)
+        return;
+    if(!statusOk(fmi2_import_get_nominals_of_continuous_states(m_fmu, data(m_nominals), m_numStates))){
+        m_nominals.assign(m_numStates, 1.0);
+        return;
+    }
+    for(size_t i=0; i<m_numStates; i++){
+        m_nominals[i] = fabs(m_nominals[i]);
+        if(m_nominals[i] == 0.0)
+            m_nominals[i] = 1.0;
+    }
+}
+
+fmi2_status_t Integrator::initialize(){
+    reset();
+    fmi2_status_t status = iterateEvent();
+    if(statusOk(status) && !m_terminated)
+        status = fmi2_import_enter_continuous_time_mode(m_fmu);
+    if(statusOk(status))
+        readNominals();
+    return status;
+}
+
+fmi2_status_t Integrator::iterateEvent(){
+    fmi2_status_t status = fmi2_status_ok;
+    m_eventInfo.newDiscreteStatesNeeded = fmi2_true;
+    m_eventInfo.terminateSimulation = fmi2_false;
+    bool valuesChanged = false, nominalsChanged = false;
+    while(m_eventInfo.newDiscreteStatesNeeded && !m_eventInfo.terminateSimulation && statusOk(status)){
+        status = fmi2_import_new_discrete_states(m_fmu, &m_eventInfo);
+        valuesChanged = valuesChanged || m_eventInfo.valuesOfContinuousStatesChanged;
+        nominalsChanged = nominalsChanged || m_eventInfo.nominalsOfContinuousStatesChanged;
+    }
+    // Of the whole iteration, not only its last round
+    m_eventInfo.valuesOfContinuousStatesChanged = valuesChanged ? fmi2_true : fmi2_false;
+    m_eventInfo.nominalsOfContinuousStatesChanged = nominalsChanged ? fmi2_true : fmi2_false;
+    if(m_eventInfo.terminateSimulation)
+        m_terminated = true;
+    return status;
+}
+
+fmi2_status_t Integrator::handleEvent(double time){
+    fmi2_status_t status = fmi2_import_enter_event_mode(m_fmu);
+    if(statusOk(status))
+        status = iterateEvent();
+    if(!statusOk(status) || m_terminated)
+        return status;
+    status = fmi2_import_enter_continuous_time_mode(m_fmu);
+    if(statusOk(status) && m_eventInfo.nominalsOfContinuousStatesChanged)
+        readNominals();
+
+    // The states may have been reinitialized
+    if(statusOk(status) && m_numStates > 0)
+        status = fmi2_import_get_continuous_states(m_fmu, data(m_x), m_numStates);
+    if(statusOk(status))
+        status = derivatives(time, m_x, m_dx);
+    if(statusOk(status) && m_numIndicators > 0)
+        status = fmi2_import_get_event_indicators(m_fmu, data(m_z), m_numIndicators);
+
+    // A time event that is due already would be handled over and over
+    if(m_eventInfo.nextEventTimeDefined && m_eventInfo.nextEventTime <= time + TIME_RESOLUTION * std::max(fabs(time), 1.0))
+        m_eventInfo.nextEventTimeDefined = fmi2_false;
+    return status;
+}
+
+fmi2_status_t Integrator::derivatives(double time, const std::vector<double>& states, std::vector<double>& derivatives){
+    fmi2_status_t status = fmi2_import_set_time(m_fmu, time);
+    if(statusOk(status) && m_numStates > 0)
+        status = fmi2_import_set_continuous_states(m_fmu, data(states), m_numStates);
+    if(statusOk(status) && m_numStates > 0)
+        status = fmi2_import_get_derivatives(m_fmu, data(derivatives), m_numStates);
+    return status;
+}
+
+double Integrator::errorNorm(const std::vector<double>& values, const std::vector<double>& states,
+                             const std::vector<double>& newStates) const {
+    if(m_numStates == 0)
+        return 0.0;
+    double sum = 0.0;
+    for(size_t i=0; i<m_numStates; i++){
+        // Absolute tolerance from the nominal value, plus relative tolerance
+        double scale = m_relativeTolerance * (m_nominals[i] + std::max(fabs(states[i]), fabs(newStates[i])));
+        double e = values[i] / scale;
+        sum += e * e;
+    }
+    return sqrt(sum / m_numStates);
+}
+
+fmi2_status_t Integrator::step(double time, const std::vector<double>& states, const std::vector<double>& derivatives,
+                               double h, std::vector<double>& newStates, std::vector<double>& newDerivatives, double* error){
+    if(m_method == METHOD_BDF1)
+        return stepBDF1(time, states, derivatives, h, newStates, newDerivatives, error);
+    return stepRK45(time, states, derivatives, h, newStates, newDerivatives, error);
+}
+
+fmi2_status_t Integrator::stepRK45(double time, const std::vector<double>& states, const std::vector<double>& derivatives,
+                                   double h, std::vector<double>& newStates, std::vector<double>& newDerivatives, double* error){
+    size_t n = m_numStates;
+    fmi2_status_t status = fmi2_status_ok;
+    m_k[0] = derivatives;
+    // The last stage is at the 5th order solution, so its derivatives start the next step
+    for(int s=1; s<7 && statusOk(status); s++){
+        for(size_t i=0; i<n; i++){
+            double sum = 0.0;
+            for(int j=0; j<s; j++)
+                sum += RK45_A[s-1][j] * m_k[j][i];
+            newStates[i] = states[i] + h * sum;
+        }
+        status = this->derivatives(time + RK45_C[s] * h, newStates, s == 6 ? newDerivatives : m_k[s]);
+    }
+    if(!statusOk(status))
+        return status;
+    m_k[6] = newDerivatives;
+
+    for(size_t i=0; i<n; i++){
+        double sum = 0.0;
+        for(int j=0; j<7; j++)
+            sum += RK45_E[j] * m_k[j][i];
+        m_error[i] = h * sum;
+    }
+    *error = errorNorm(m_error, states, newStates);
+    return status;
+}
+
+fmi2_status_t Integrator::stepBDF1(double time, const std::vector<double>& states, const std::vector<double>& derivatives,
+                                   double h, std::vector<double>& newStates, std::vector<double>& newDerivatives, double* error){
+    int n = (int)m_numStates;
+    double newTime = time + h;
+
+    // Predict with explicit Euler
+    for(int i=0; i<n; i++)
+        newStates[i] = states[i] + h * derivatives[i];
+    std::vector<double>& f = m_k[1];
+    fmi2_status_t status = this->derivatives(newTime, newStates, f);
+
+    // Iteration matrix I - h J, with the Jacobian of the derivatives at the prediction by forward differences
+    std::vector<double>& perturbed = m_k[2];
+    std::vector<double>& fPerturbed = m_k[3];
+    perturbed = newStates;
+    m_jacobian.resize(n * n);
+    for(int j=0; j<n && statusOk(status); j++){
+        double delta = 1e-7 * std::max(fabs(newStates[j]), m_nominals[j]);
+        perturbed[j] = newStates[j] + delta;
+        delta = perturbed[j] - newStates[j];
+        status = this->derivatives(newTime, perturbed, fPerturbed);
+        for(int i=0; i<n; i++)
+            m_jacobian[i*n+j] = (i == j ? 1.0 : 0.0) - h * (fPerturbed[i] - f[i]) / delta;
+        perturbed[j] = newStates[j];
+    }
+    if(!statusOk(status))
+        return status;
+    bool converged = luFactor(m_jacobian, n, m_pivots);
+
+    // Newton iterations on y - x - h f(t + h, y) = 0. f at the prediction is there already.
+    std::vector<double>& correction = m_k[4];
+    for(int it=0; converged && it<MAX_NEWTON_ITERATIONS && statusOk(status); it++){
+        if(it > 0)
+            status = this->derivatives(newTime, newStates, f);
+        for(int i=0; i<n; i++)
+            correction[i] = states[i] + h * f[i] - newStates[i];
+        luSolve(m_jacobian, n, m_pivots, correction);
+        for(int i=0; i<n; i++)
+            newStates[i] += correction[i];
+        if(errorNorm(correction, states, newStates) <= NEWTON_TOLERANCE)
+            break;
+        converged = it + 1 < MAX_NEWTON_ITERATIONS;
+    }
+    if(statusOk(status))
+        status = this->derivatives(newTime, newStates, newDerivatives);
+    if(!statusOk(status))
+        return status;
+    if(!converged){
+        // Retried with the smallest step size factor
+        *error = HUGE_VAL;
+        return status;
+    }
+
+    // The local error of implicit Euler is about h^2/2 x''
+    for(int i=0; i<n; i++)
+        m_error[i] = 0.5 * h * (newDerivatives[i] - derivatives[i]);
+    *error = errorNorm(m_error, states, newStates);
+    return status;
+}
+
+fmi2_status_t Integrator::doStep(double currentTime, double stepSize){
+    if(m_terminated)
+        return fmi2_status_error;
+
+    size_t n = m_numStates, nz = m_numIndicators;
+    double endTime = currentTime + stepSize;
+    double resolution = TIME_RESOLUTION * std::max(fabs(endTime), 1.0);
+    double order = m_method == METHOD_BDF1 ? 2.0 : 5.0;
+
+    // The client may have set the states or restored an FMU state since the last step
+    fmi2_status_t status = fmi2_import_set_time(m_fmu, currentTime);
+    if(statusOk(status) && n > 0)
+        status = fmi2_import_get_continuous_states(m_fmu, data(m_x), n);
+    if(statusOk(status))
+        status = derivatives(currentTime, m_x, m_dx);
+    if(statusOk(status) && nz > 0)
+        status = fmi2_import_get_event_indicators(m_fmu, data(m_z), nz);
+
+    double time = currentTime;
+    while(statusOk(status) && !m_terminated && endTime - time > resolution){
+        // A time event that is due
+        if(m_eventInfo.nextEventTimeDefined && m_eventInfo.nextEventTime <= time + resolution){
+            status = handleEvent(time);
+            continue;
+        }
+
+        // Stop at the next time event
+        double stopTime = endTime;
+        bool timeEvent = false;
+        if(m_eventInfo.nextEventTimeDefined && m_eventInfo.nextEventTime <= endTime){
+            stopTime = m_eventInfo.nextEventTime;
+            timeEvent = true;
+        }
+        double h = stopTime - time;
+        if(m_stepSize > 0 && m_stepSize < h)
+            h = m_stepSize;
+
+        double error = 0.0;
+        status = step(time, m_x, m_dx, h, m_xNew, m_dxNew, &error);
+        if(!statusOk(status))
+            break;
+        double factor = error > 0 ? 0.9 * pow(error, -1.0 / order) : 5.0;
+        factor = std::min(std::max(factor, 0.2), 5.0);
+        if(error > 1.0){
+            m_stepSize = h * factor;
+            if(m_stepSize < resolution){
+                status = fmi2_status_error;
+                break;
+            }
+            continue;
+        }
+        m_stepSize = h * factor;
+        double newTime = time + h;
+
+        // A state event in the step: bisect it down to the first sign change, redoing it from the start
+        bool stateEvent = false;
+        if(nz > 0){
+            status = fmi2_import_get_event_indicators(m_fmu, data(m_zNew), nz);
+            stateEvent = statusOk(status) && signChanged(m_z, m_zNew);
+        }
+        if(stateEvent){
+            double lo = 0.0, hi = h;
+            while(statusOk(status) && hi - lo > resolution){
+                double mid = 0.5 * (lo + hi);
+                double midError;
+                status = step(time, m_x, m_dx, mid, m_xTry, m_dxTry, &midError);
+                if(statusOk(status))
+                    status = fmi2_import_get_event_indicators(m_fmu, data(m_zTry), nz);
+                if(statusOk(status) && signChanged(m_z, m_zTry)){
+                    hi = mid;
+                    m_xNew.swap(m_xTry);
+                    m_dxNew.swap(m_dxTry);
+                    m_zNew.swap(m_zTry);
+                } else {
+                    lo = mid;
+                }
+            }
+            // Just past the event, where the FMU may not be after the last try
+            newTime = time + hi;
+            if(statusOk(status))
+                status = fmi2_import_set_time(m_fmu, newTime);
+            if(statusOk(status) && n > 0)
+                status = fmi2_import_set_continuous_states(m_fmu, data(m_xNew), n);
+            if(!statusOk(status))
+                break;
+        }
+
+        fmi2_boolean_t enterEventMode = fmi2_false, terminateSimulation = fmi2_false;
+        status = fmi2_import_completed_integrator_step(m_fmu, fmi2_false, &enterEventMode, &terminateSimulation);
+        if(!statusOk(status))
+            break;
+        time = newTime;
+        m_x.swap(m_xNew);
+        m_dx.swap(m_dxNew);
+        m_z.swap(m_zNew);
+        if(terminateSimulation){
+            m_terminated = true;
+            break;
+        }
+
+        bool timeEventReached = timeEvent && !stateEvent && stopTime - time <= resolution;
+        if(stateEvent || timeEventReached || enterEventMode)
+            status = handleEvent(time);
+    }
+
+    if(statusOk(status) && m_terminated)
+        status = fmi2_status_discard;
+    m_lastStatus = status;
+    m_lastSuccessfulTime = time;
+    return status;
+}
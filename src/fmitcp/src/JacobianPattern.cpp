@@ -0,0 +1,219 @@
+#include "JacobianPattern.h"
+#include <map>
+#include <set>
+#include <algorithm>
+#include <math.h>
+
+using namespace fmitcp;
+
+JacobianPattern::JacobianPattern(){
+    m_numRows = 0;
+    m_numColumns = 0;
+}
+
+JacobianPattern::~JacobianPattern(){
+
+}
+
+void JacobianPattern::setDense(int numRows, int numColumns){
+    m_numRows = numRows;
+    m_numColumns = numColumns;
+    m_rows.assign(numRows, std::vector<int>());
+    for(int i=0; i<numRows; i++){
+        m_rows[i].resize(numColumns);
+        for(int j=0; j<numColumns; j++)
+            m_rows[i][j] = j;
+    }
+    finish();
+}
+
+void JacobianPattern::setRows(int numColumns, const std::vector<std::vector<int> >& rows){
+    m_numRows = (int)rows.size();
+    m_numColumns = numColumns;
+    m_rows = rows;
+    for(int i=0; i<m_numRows; i++){
+        std::sort(m_rows[i].begin(), m_rows[i].end());
+        m_rows[i].erase(std::unique(m_rows[i].begin(), m_rows[i].end()), m_rows[i].end());
+    }
+    finish();
+}
+
+void JacobianPattern::build(fmi2_import_t* fmu, const fmi2_value_reference_t* unknowns, size_t numUnknowns,
+                            const fmi2_value_reference_t* knowns, size_t numKnowns){
+    m_numRows = (int)numUnknowns;
+    m_numColumns = (int)numKnowns;
+    m_rows.assign(numUnknowns, std::vector<int>());
+
+    // Rows and columns of each value reference. A value reference may be listed more than once.
+    std::map<fmi2_value_reference_t, std::vector<int> > rowsOf, columnsOf;
+    for(size_t i=0; i<numUnknowns; i++)
+        rowsOf[unknowns[i]].push_back((int)i);
+    for(size_t j=0; j<numKnowns; j++)
+        columnsOf[knowns[j]].push_back((int)j);
+
+    // Rows that get their dependencies below, the others stay dense
+    std::vector<bool> known(numUnknowns, false);
+
+    // Knowns that dependencies can name: inputs and states. The derivatives with respect to other variables, such as
+    // parameters, are not described, so their columns are dense.
+    std::set<fmi2_value_reference_t> described;
+
+    fmi2_import_variable_list_t* variables = fmi2_import_get_variable_list(fmu, 0);
+    size_t numVariables = fmi2_import_get_variable_list_size(variables);
+    for(size_t k=0; k<numVariables; k++){
+        fmi2_import_variable_t* v = fmi2_import_get_variable(variables, k);
+        if(fmi2_import_get_variable_base_type(v) != fmi2_base_type_real)
+            continue;
+        if(fmi2_import_get_causality(v) == fmi2_causality_enu_input){
+            described.insert(fmi2_import_get_variable_vr(v));
+        } else {
+            fmi2_import_variable_t* state = fmi2_import_get_real_variable_derivative_of(fmi2_import_get_variable_as_real(v));
+            if(state)
+                described.insert(fmi2_import_get_variable_vr(state));
+        }
+    }
+    for(int list=0; list<2; list++){
+        size_t *startIndex, *dependency;
+        char *factorKind;
+        fmi2_import_variable_list_t* unknownList;
+        if(list == 0){
+            unknownList = fmi2_import_get_outputs_list(fmu);
+            fmi2_import_get_outputs_dependencies(fmu, &startIndex, &dependency, &factorKind);
+        } else {
+            unknownList = fmi2_import_get_derivatives_list(fmu);
+            fmi2_import_get_derivatives_dependencies(fmu, &startIndex, &dependency, &factorKind);
+        }
+
+        size_t numListed = unknownList ? fmi2_import_get_variable_list_size(unknownList) : 0;
+        for(size_t k=0; startIndex && k<numListed; k++){
+            fmi2_import_variable_t* v = fmi2_import_get_variable(unknownList, k);
+            if(fmi2_import_get_variable_base_type(v) != fmi2_base_type_real)
+                continue;
+            std::map<fmi2_value_reference_t, std::vector<int> >::iterator rows = rowsOf.find(fmi2_import_get_variable_vr(v));
+            if(rows == rowsOf.end())
+                continue;
+
+            // Dependencies are 1-based indices of model variables. 0 means that they are not given.
+            std::vector<int> columns;
+            bool given = true;
+            for(size_t d=startIndex[k]; d<startIndex[k+1]; d++){
+                if(dependency[d] == 0 || dependency[d] > numVariables){
+                    given = false;
+                    break;
+                }
+                fmi2_import_variable_t* dv = fmi2_import_get_variable(variables, dependency[d] - 1);
+                if(fmi2_import_get_variable_base_type(dv) != fmi2_base_type_real)
+                    continue;
+                std::map<fmi2_value_reference_t, std::vector<int> >::iterator c = columnsOf.find(fmi2_import_get_variable_vr(dv));
+                if(c != columnsOf.end())
+                    columns.insert(columns.end(), c->second.begin(), c->second.end());
+            }
+            if(!given)
+                continue;
+
+            std::sort(columns.begin(), columns.end());
+            columns.erase(std::unique(columns.begin(), columns.end()), columns.end());
+            for(size_t r=0; r<rows->second.size(); r++){
+                m_rows[rows->second[r]] = columns;
+                known[rows->second[r]] = true;
+            }
+        }
+        if(unknownList)
+            fmi2_import_free_variable_list(unknownList);
+    }
+    fmi2_import_free_variable_list(variables);
+
+    std::vector<int> denseColumns;
+    for(size_t j=0; j<numKnowns; j++){
+        if(described.find(knowns[j]) == described.end())
+            denseColumns.push_back((int)j);
+    }
+
+    for(size_t i=0; i<numUnknowns; i++){
+        if(known[i]){
+            if(!denseColumns.empty()){
+                m_rows[i].insert(m_rows[i].end(), denseColumns.begin(), denseColumns.end());
+                std::sort(m_rows[i].begin(), m_rows[i].end());
+                m_rows[i].erase(std::unique(m_rows[i].begin(), m_rows[i].end()), m_rows[i].end());
+            }
+            continue;
+        }
+        m_rows[i].resize(numKnowns);
+        for(size_t j=0; j<numKnowns; j++)
+            m_rows[i][j] = (int)j;
+    }
+    finish();
+}
+
+void JacobianPattern::finish(){
+    m_columns.assign(m_numColumns, std::vector<int>());
+    for(int i=0; i<m_numRows; i++){
+        for(size_t k=0; k<m_rows[i].size(); k++)
+            m_columns[m_rows[i][k]].push_back(i);
+    }
+
+    // Greedy grouping: each column goes to the first group that none of its rows has a column in yet
+    m_groups.clear();
+    std::vector<std::vector<int> > rowGroups(m_numRows);
+    std::vector<bool> taken;
+    for(int j=0; j<m_numColumns; j++){
+        taken.assign(m_groups.size() + 1, false);
+        const std::vector<int>& rows = m_columns[j];
+        for(size_t r=0; r<rows.size(); r++){
+            const std::vector<int>& groups = rowGroups[rows[r]];
+            for(size_t g=0; g<groups.size(); g++)
+                taken[groups[g]] = true;
+        }
+        size_t group = 0;
+        while(taken[group])
+            group++;
+        if(group == m_groups.size())
+            m_groups.push_back(std::vector<int>());
+        m_groups[group].push_back(j);
+        for(size_t r=0; r<rows.size(); r++)
+            rowGroups[rows[r]].push_back((int)group);
+    }
+}
+
+fmi2_status_t JacobianPattern::finiteDifferences(Function& function, const double* knowns, double perturbation,
+                                                 double* jacobian, int* numSeeds) const {
+    *numSeeds = 0;
+    if(m_numRows == 0 || m_numColumns == 0)
+        return fmi2_status_ok;
+
+    std::vector<double> h(m_numColumns), z0(m_numRows), z(m_numRows);
+    std::vector<int> columns;
+    std::vector<double> values;
+    fmi2_status_t status = function.evaluate(columns, values, &z0[0]);
+    for(int g=0; g<getNumGroups() && (status == fmi2_status_ok || status == fmi2_status_warning); g++){
+        // Perturb the columns of the group together, the rows of each belong to it alone
+        columns = m_groups[g];
+        values.clear();
+        for(size_t k=0; k<columns.size(); k++){
+            int j = columns[k];
+            double x = knowns[j];
+            values.push_back(x + perturbation * std::max(fabs(x), 1.0));
+            // The step that is actually representable
+            h[j] = values.back() - x;
+        }
+        status = function.evaluate(columns, values, &z[0]);
+        (*numSeeds)++;
+        if(status != fmi2_status_ok && status != fmi2_status_warning)
+            break;
+
+        for(size_t k=0; k<columns.size(); k++){
+            int j = columns[k];
+            const std::vector<int>& rows = m_columns[j];
+            for(size_t r=0; r<rows.size(); r++)
+                jacobian[rows[r] * m_numColumns + j] = (z[rows[r]] - z0[rows[r]]) / h[j];
+        }
+    }
+    return status;
+}
+
+size_t JacobianPattern::getNumNonzeros() const {
+    size_t n = 0;
+    for(int i=0; i<m_numRows; i++)
+        n += m_rows[i].size();
+    return n;
+}
@@ -2,12 +2,124 @@
 #include "stdio.h"
 #include <string>
 #include <stdlib.h>
+#define lw_import
+#include <lacewing.h>
 
 using namespace fmitcp;
 
+namespace {
+
+    /**
+     * Collects formatted log lines and writes them to stdout from its own thread. The writer sleeps until a line is
+     * added to an empty buffer, and lines added while it writes are written together in its next round. So an idle
+     * writer never wakes up and a busy one writes in large chunks.
+     */
+    class LogSink {
+
+    private:
+
+        std::string m_buffer;
+        lw_sync m_sync;
+        lw_event m_wakeup;
+        lw_event m_writtenEvent;
+        lw_thread m_thread;
+        bool m_stopping;
+
+        /// Number of lines appended to, and written from, the buffer. Used by flush().
+        unsigned long m_appended;
+        unsigned long m_written;
+
+        static void * writerMain(void * tag){
+            ((LogSink*)tag)->writer();
+            return NULL;
+        }
+
+        void writer(){
+            std::string chunk;
+            bool stopping = false;
+            while(!stopping){
+                lw_event_wait(m_wakeup, -1);
+
+                lw_sync_lock(m_sync);
+                lw_event_unsignal(m_wakeup);
+                chunk.swap(m_buffer);
+                unsigned long appended = m_appended;
+                stopping = m_stopping;
+                lw_sync_release(m_sync);
+
+                if(!chunk.empty()){
+                    fwrite(chunk.data(), 1, chunk.size(), stdout);
+                    fflush(stdout);
+                    chunk.clear();
+                }
+
+                lw_sync_lock(m_sync);
+                m_written = appended;
+                lw_event_signal(m_writtenEvent);
+                lw_sync_release(m_sync);
+            }
+        }
+
+    public:
+
+        LogSink(){
+            m_sync = lw_sync_new();
+            m_wakeup = lw_event_new();
+            m_writtenEvent = lw_event_new();
+            m_stopping = false;
+            m_appended = 0;
+            m_written = 0;
+            m_thread = lw_thread_new("fmitcp logger", (void*)writerMain);
+            lw_thread_start(m_thread, this);
+        }
+
+        ~LogSink(){
+            lw_sync_lock(m_sync);
+            m_stopping = true;
+            lw_event_signal(m_wakeup);
+            lw_sync_release(m_sync);
+            lw_thread_join(m_thread);
+            lw_thread_delete(m_thread);
+            lw_event_delete(m_writtenEvent);
+            lw_event_delete(m_wakeup);
+            lw_sync_delete(m_sync);
+        }
+
+        void write(const std::string& prefix, const char * text, size_t size){
+            lw_sync_lock(m_sync);
+            // The writer empties the buffer and unsignals under the lock, so only the first line needs to wake it
+            if(m_buffer.empty())
+                lw_event_signal(m_wakeup);
+            m_buffer.append(prefix);
+            m_buffer.append(text, size);
+            m_appended++;
+            lw_sync_release(m_sync);
+        }
+
+        void flush(){
+            lw_sync_lock(m_sync);
+            unsigned long target = m_appended;
+            lw_event_signal(m_wakeup);
+            while(m_written < target){
+                lw_event_unsignal(m_writtenEvent);
+                lw_sync_release(m_sync);
+                lw_event_wait(m_writtenEvent, -1);
+                lw_sync_lock(m_sync);
+            }
+            lw_sync_release(m_sync);
+        }
+    };
+
+    LogSink& getSink(){
+        static LogSink sink;
+        return sink;
+    }
+}
+
 Logger::Logger(){
-    m_filter = ~0; // Log everything
+    m_filter = DEFAULT_FILTER;
     m_prefix = "";
+    getSink(); // Start the writer before anyone logs from a worker thread
 }
 
 Logger::~Logger(){
@@ -15,17 +127,28 @@ Logger::~Logger(){
 }
 
 void Logger::log(Logger::LogMessageType type, const char * format, ...){
-    // Print prefix
-    if(m_prefix != ""){
-        printf("%s",m_prefix.c_str());
-    }
+    if(!isEnabled(type))
+        return;
 
-    // Print message
+    // Format into a stack buffer, fall back to the heap for long messages
+    char text[512];
     va_list args;
     va_start(args, format);
-    vfprintf(stdout, format, args);
+    int size = vsnprintf(text, sizeof(text), format, args);
     va_end(args);
-    fflush(NULL);
+    if(size < 0)
+        return;
+
+    if((size_t)size < sizeof(text)){
+        getSink().write(m_prefix, text, size);
+    } else {
+        std::string longText;
+        longText.resize(size + 1);
+        va_start(args, format);
+        vsnprintf(&longText[0], size + 1, format, args);
+        va_end(args);
+        getSink().write(m_prefix, longText.data(), size);
+    }
 }
 
 void Logger::setFilter(int filter){
@@ -39,3 +162,7 @@ int Logger::getFilter() const {
 void Logger::setPrefix(std::string prefix){
     m_prefix = prefix;
 }
+
+void Logger::flush(){
+    getSink().flush();
+}
@@ -0,0 +1,192 @@
+#include "LoopbackTransport.h"
+#include "fmitcp.pb.h"
+#include <deque>
+#include <vector>
+#include <string>
+
+using namespace fmitcp;
+
+namespace fmitcp {
+
+    /// Bytes or a whole message, waiting to be delivered
+    struct LoopbackItem {
+        /// NULL for bytes
+        fmitcp_proto::fmitcp_message * message;
+        std::string data;
+    };
+
+    /// State shared by the two ends of a loopback connection. Only used on the pump thread.
+    struct LoopbackChannel {
+        lw_pump pump;
+
+        /// The ends, NULL once deleted
+        LoopbackTransport * ends[2];
+
+        /// Items to deliver to each end
+        std::deque<LoopbackItem> queues[2];
+
+        /// Delivered messages, ready to be reused
+        std::vector<fmitcp_proto::fmitcp_message*> freeMessages;
+
+        /// True while a delivery to an end is posted
+        bool posted[2];
+        bool closed;
+
+        /// Tags of the posted deliveries
+        struct Side {
+            LoopbackChannel * channel;
+            int index;
+        } sides[2];
+
+        /// Ends alive plus deliveries posted. The channel is deleted at 0.
+        int references;
+
+        ~LoopbackChannel() {
+            for (int i = 0; i < 2; i++) {
+                for (size_t j = 0; j < queues[i].size(); j++) {
+                    delete queues[i][j].message;
+                }
+            }
+            for (size_t i = 0; i < freeMessages.size(); i++) {
+                delete freeMessages[i];
+            }
+        }
+
+        void release() {
+            if (--references == 0) {
+                delete this;
+            }
+        }
+
+        /// Have the queue of an end delivered from the pump
+        void post(int side) {
+            if (posted[side]) {
+                return;
+            }
+            posted[side] = true;
+            references++;
+            lw_pump_post(pump, (void*)loopbackDeliver, &sides[side]);
+        }
+
+        static void loopbackDeliver(void * tag) {
+            Side * side = (Side*)tag;
+            LoopbackChannel * channel = side->channel;
+            channel->posted[side->index] = false;
+            if (channel->ends[side->index]) {
+                channel->ends[side->index]->deliver();
+            }
+            channel->release();
+        }
+    };
+
+}
+
+void LoopbackTransport::createPair(EventPump * pump, bool passMessages, LoopbackTransport ** first, LoopbackTransport ** second) {
+    LoopbackChannel * channel = new LoopbackChannel;
+    channel->pump = pump->getPump();
+    channel->closed = false;
+    channel->references = 2;
+    for (int i = 0; i < 2; i++) {
+        channel->posted[i] = false;
+        channel->sides[i].channel = channel;
+        channel->sides[i].index = i;
+        channel->ends[i] = new LoopbackTransport(channel, i, passMessages);
+    }
+    *first = channel->ends[0];
+    *second = channel->ends[1];
+}
+
+LoopbackTransport::LoopbackTransport(LoopbackChannel * channel, int side, bool passMessages) {
+    m_channel = channel;
+    m_side = side;
+    m_passMessages = passMessages;
+    m_closedNotified = false;
+}
+
+LoopbackTransport::~LoopbackTransport() {
+    m_channel->ends[m_side] = NULL;
+    if (!m_channel->closed) {
+        m_channel->closed = true;
+        m_channel->post(1 - m_side);
+    }
+    m_channel->release();
+}
+
+void LoopbackTransport::write(const char * data, size_t size) {
+    if (m_channel->closed) {
+        return;
+    }
+    // Append to the bytes at the end of the queue, if there are any
+    std::deque<LoopbackItem>& queue = m_channel->queues[1 - m_side];
+    if (queue.empty() || queue.back().message) {
+        queue.push_back(LoopbackItem());
+        queue.back().message = NULL;
+    }
+    queue.back().data.append(data, size);
+    m_channel->post(1 - m_side);
+}
+
+bool LoopbackTransport::passesMessages() const {
+    return m_passMessages;
+}
+
+bool LoopbackTransport::writeMessage(const fmitcp_proto::fmitcp_message& message) {
+    if (!m_passMessages) {
+        return false;
+    }
+    if (m_channel->closed) {
+        return true;
+    }
+    fmitcp_proto::fmitcp_message * copy;
+    if (m_channel->freeMessages.empty()) {
+        copy = new fmitcp_proto::fmitcp_message;
+    } else {
+        copy = m_channel->freeMessages.back();
+        m_channel->freeMessages.pop_back();
+    }
+    // Copied into a reused message, so its memory is kept between messages
+    copy->CopyFrom(message);
+    m_channel->queues[1 - m_side].push_back(LoopbackItem());
+    m_channel->queues[1 - m_side].back().message = copy;
+    m_channel->post(1 - m_side);
+    return true;
+}
+
+void LoopbackTransport::close() {
+    if (m_channel->closed) {
+        return;
+    }
+    m_channel->closed = true;
+    m_channel->post(0);
+    m_channel->post(1);
+}
+
+bool LoopbackTransport::isConnected() const {
+    return !m_channel->closed;
+}
+
+void LoopbackTransport::deliver() {
+    std::deque<LoopbackItem>& queue = m_channel->queues[m_side];
+    while (!queue.empty() && m_listener) {
+        // Taken off the queue first, the listener may write to the other end
+        LoopbackItem item;
+        item.message = queue.front().message;
+        item.data.swap(queue.front().data);
+        queue.pop_front();
+
+        if (item.message) {
+            m_listener->transportMessage(this, *item.message);
+            m_channel->freeMessages.push_back(item.message);
+        } else {
+            m_listener->transportData(this, item.data.data(), item.data.size());
+        }
+    }
+
+    if (m_channel->closed && !m_closedNotified && queue.empty()) {
+        m_closedNotified = true;
+        // May delete this
+        if (m_listener) {
+            m_listener->transportClosed(this);
+        }
+    }
+}
@@ -0,0 +1,772 @@
+#include "Master.h"
+#include "Client.h"
+#include "ModelDescription.h"
+#include <math.h>
+#include <sstream>
+
+using namespace std;
+using namespace fmitcp;
+
+namespace fmitcp {
+
+    /// Client of one slave. Passes the responses the master needs on to it.
+    class SlaveClient : public Client {
+
+    private:
+        Master * m_master;
+        int m_slave;
+
+    public:
+        SlaveClient(EventPump * pump, Master * master, int slave) : Client(pump) {
+            m_master = master;
+            m_slave = slave;
+        }
+
+        void onConnect(){
+            m_master->slaveConnected(m_slave);
+        }
+        void onDisconnect(){
+            m_master->slaveLost(m_slave, "Disconnected");
+        }
+        void onError(string message){
+            m_master->slaveLost(m_slave, message);
+        }
+        void on_error_res(int mid, const string& reason){
+            // The request was refused, which fails it like an error status
+            m_master->slaveStatus(m_slave, fmitcp_proto::fmi2_status_error);
+        }
+        void onGetXmlRes(int mid, fmitcp_proto::jm_log_level_enu_t logLevel, string xml){
+            m_master->slaveXml(m_slave, xml);
+        }
+        void on_fmi2_import_instantiate_res(int mid, fmitcp_proto::jm_status_enu_t status, int fmuId){
+            m_master->slaveInstantiated(m_slave, status, fmuId);
+        }
+        void on_prepare_value_references_res(int mid, fmitcp_proto::fmi2_status_t status, int valueReferenceSet){
+            m_master->slavePrepared(m_slave, mid, status, valueReferenceSet);
+        }
+        void on_fmi2_import_initialize_slave_res(int mid, fmitcp_proto::fmi2_status_t status){
+            m_master->slaveStatus(m_slave, status);
+        }
+        void on_fmi2_import_terminate_slave_res(int mid, fmitcp_proto::fmi2_status_t status){
+            m_master->slaveStatus(m_slave, status);
+        }
+        void on_fmi2_import_free_slave_instance_res(int mid){
+            m_master->slaveFreed(m_slave);
+        }
+        void on_fmi2_import_get_real_res(int mid, const vector<double>& values, fmitcp_proto::fmi2_status_t status){
+            m_master->slaveRealOutputs(m_slave, values, status);
+        }
+        void on_fmi2_import_get_integer_res(int mid, const vector<int>& values, fmitcp_proto::fmi2_status_t status){
+            m_master->slaveIntegerOutputs(m_slave, values, status);
+        }
+        void on_fmi2_import_get_boolean_res(int mid, const vector<bool>& values, fmitcp_proto::fmi2_status_t status){
+            m_master->slaveBooleanOutputs(m_slave, values, status);
+        }
+        void on_fmi2_import_get_string_res(int mid, const vector<string>& values, fmitcp_proto::fmi2_status_t status){
+            m_master->slaveStringOutputs(m_slave, values, status);
+        }
+        void on_fmi2_import_step_exchange_res(int mid, fmitcp_proto::fmi2_status_t status, const vector<double>& realValues, const vector<int>& integerValues, const vector<bool>& booleanValues, const vector<string>& stringValues){
+            m_master->slaveStepped(m_slave, status, realValues, integerValues, booleanValues, stringValues);
+        }
+    };
+
+};
+
+static bool statusOk(fmitcp_proto::fmi2_status_t status){
+    return status == fmitcp_proto::fmi2_status_ok || status == fmitcp_proto::fmi2_status_warning;
+}
+
+Master::Master(EventPump * pump){
+    m_pump = pump;
+    m_state = IDLE;
+    m_scheme = JACOBI;
+    m_delta = false;
+    m_realThreshold = 0;
+    m_level = 0;
+    m_numPending = 0;
+    m_failed = false;
+    m_startTime = 0;
+    m_stopTime = 0;
+    m_stepSize = 0;
+    m_time = 0;
+    m_step = 0;
+    m_numSteps = 0;
+}
+
+Master::~Master(){
+    for(size_t i=0; i<m_slaves.size(); i++){
+        delete m_slaves[i]->client;
+        delete m_slaves[i];
+    }
+}
+
+int Master::addSlave(string host, long port){
+    int index = (int)m_slaves.size();
+    Slave * slave = new Slave();
+    slave->client = new SlaveClient(m_pump, this, index);
+    slave->client->setDeltaEncoding(m_delta, m_realThreshold);
+    slave->client->setXmlCacheDir(m_xmlCacheDir);
+    slave->host = host;
+    slave->port = port;
+    slave->fmuId = 0;
+    slave->instantiated = false;
+    slave->nextMessageId = 0;
+    slave->lost = false;
+    slave->freePending = false;
+    slave->prepared = false;
+
+    ostringstream prefix;
+    prefix << "Slave " << index << ": ";
+    slave->client->getLogger()->setPrefix(prefix.str());
+
+    m_slaves.push_back(slave);
+    return index;
+}
+
+int Master::getNumSlaves() const {
+    return (int)m_slaves.size();
+}
+
+void Master::setScheme(Scheme scheme){
+    m_scheme = scheme;
+}
+
+Master::Scheme Master::getScheme() const {
+    return m_scheme;
+}
+
+void Master::setDeltaEncoding(bool delta, double realThreshold){
+    m_delta = delta;
+    m_realThreshold = realThreshold;
+    for(size_t i=0; i<m_slaves.size(); i++)
+        m_slaves[i]->client->setDeltaEncoding(delta, realThreshold);
+}
+
+void Master::setXmlCacheDir(const string& dir){
+    m_xmlCacheDir = dir;
+    for(size_t i=0; i<m_slaves.size(); i++)
+        m_slaves[i]->client->setXmlCacheDir(dir);
+}
+
+const vector<vector<int> >& Master::getLevels() const {
+    return m_levels;
+}
+
+int Master::addRef(vector<int>& refs, int valueRef){
+    int index = findRef(refs, valueRef);
+    if(index >= 0)
+        return index;
+    refs.push_back(valueRef);
+    return (int)refs.size() - 1;
+}
+
+vector<int>& Master::getRefList(Slave * slave, RefList list){
+    switch(list){
+    case REAL_INPUT_REFS:     return slave->realInputRefs;
+    case INTEGER_INPUT_REFS:  return slave->integerInputRefs;
+    case BOOLEAN_INPUT_REFS:  return slave->booleanInputRefs;
+    case STRING_INPUT_REFS:   return slave->stringInputRefs;
+    case REAL_OUTPUT_REFS:    return slave->realOutputRefs;
+    case INTEGER_OUTPUT_REFS: return slave->integerOutputRefs;
+    case BOOLEAN_OUTPUT_REFS: return slave->booleanOutputRefs;
+    default:                  return slave->stringOutputRefs;
+    }
+}
+
+int Master::findRef(const vector<int>& refs, int valueRef){
+    for(size_t i=0; i<refs.size(); i++){
+        if(refs[i] == valueRef)
+            return (int)i;
+    }
+    return -1;
+}
+
+void Master::connect(int fromSlave, int outputValueRef, int toSlave, int inputValueRef, ValueType type){
+    Slave * from = m_slaves[fromSlave];
+    Slave * to = m_slaves[toSlave];
+
+    Connection c;
+    c.type = type;
+    c.toSlave = toSlave;
+    switch(type){
+    case REAL:
+        c.fromIndex = addRef(from->realOutputRefs, outputValueRef);
+        c.toIndex = addRef(to->realInputRefs, inputValueRef);
+        to->realInputs.resize(to->realInputRefs.size());
+        break;
+    case INTEGER:
+        c.fromIndex = addRef(from->integerOutputRefs, outputValueRef);
+        c.toIndex = addRef(to->integerInputRefs, inputValueRef);
+        to->integerInputs.resize(to->integerInputRefs.size());
+        break;
+    case BOOLEAN:
+        c.fromIndex = addRef(from->booleanOutputRefs, outputValueRef);
+        c.toIndex = addRef(to->booleanInputRefs, inputValueRef);
+        to->booleanInputs.resize(to->booleanInputRefs.size());
+        break;
+    case STRING:
+        c.fromIndex = addRef(from->stringOutputRefs, outputValueRef);
+        c.toIndex = addRef(to->stringInputRefs, inputValueRef);
+        to->stringInputs.resize(to->stringInputRefs.size());
+        break;
+    }
+    from->connections.push_back(c);
+}
+
+void Master::addOutput(int slave, int outputValueRef, ValueType type){
+    Slave * s = m_slaves[slave];
+    switch(type){
+    case REAL:    addRef(s->realOutputRefs, outputValueRef);    break;
+    case INTEGER: addRef(s->integerOutputRefs, outputValueRef); break;
+    case BOOLEAN: addRef(s->booleanOutputRefs, outputValueRef); break;
+    case STRING:  addRef(s->stringOutputRefs, outputValueRef);  break;
+    }
+}
+
+double Master::getReal(int slave, int outputValueRef) const {
+    const Slave * s = m_slaves[slave];
+    int i = findRef(s->realOutputRefs, outputValueRef);
+    return (i >= 0 && i < (int)s->realOutputs.size()) ? s->realOutputs[i] : 0.0;
+}
+
+int Master::getInteger(int slave, int outputValueRef) const {
+    const Slave * s = m_slaves[slave];
+    int i = findRef(s->integerOutputRefs, outputValueRef);
+    return (i >= 0 && i < (int)s->integerOutputs.size()) ? s->integerOutputs[i] : 0;
+}
+
+bool Master::getBoolean(int slave, int outputValueRef) const {
+    const Slave * s = m_slaves[slave];
+    int i = findRef(s->booleanOutputRefs, outputValueRef);
+    return (i >= 0 && i < (int)s->booleanOutputs.size()) ? s->booleanOutputs[i] : false;
+}
+
+string Master::getString(int slave, int outputValueRef) const {
+    const Slave * s = m_slaves[slave];
+    int i = findRef(s->stringOutputRefs, outputValueRef);
+    return (i >= 0 && i < (int)s->stringOutputs.size()) ? s->stringOutputs[i] : string();
+}
+
+void Master::simulate(double startTime, double stopTime, double stepSize){
+    m_startTime = startTime;
+    m_stopTime = stopTime;
+    m_stepSize = stepSize;
+    m_time = startTime;
+    m_step = 0;
+
+    // Count the steps up front, so that rounding does not add or drop a step at the end
+    m_numSteps = stepSize > 0 ? (long)floor((stopTime - startTime) / stepSize + 0.5) : 0;
+    m_failed = false;
+
+    m_state = CONNECTING;
+    m_numPending = (int)m_slaves.size();
+    for(size_t i=0; i<m_slaves.size(); i++){
+        m_slaves[i]->lost = false;
+        m_slaves[i]->freePending = false;
+        m_slaves[i]->client->connect(m_slaves[i]->host, m_slaves[i]->port);
+    }
+    if(m_slaves.empty())
+        finish();
+}
+
+double Master::getTime() const {
+    return m_time;
+}
+
+Logger * Master::getLogger(){
+    return &m_logger;
+}
+
+void Master::responseDone(bool ok){
+    if(!ok)
+        m_failed = true;
+
+    // After a slave was lost, the others may still answer requests sent before the frees
+    if(m_state == FREEING)
+        return;
+    if(--m_numPending > 0)
+        return;
+    advance();
+}
+
+void Master::advance(){
+    switch(m_state){
+
+    case CONNECTING:
+        if(m_failed)
+            return finish();
+        if(m_scheme == GAUSS_SEIDEL){
+            // The model descriptions tell which outputs depend directly on inputs
+            m_state = READING_XML;
+            m_numPending = (int)m_slaves.size();
+            for(size_t i=0; i<m_slaves.size(); i++)
+                m_slaves[i]->client->get_xml(m_slaves[i]->nextMessageId++, 0);
+            return;
+        }
+        buildLevels();
+        instantiateSlaves();
+        break;
+
+    case READING_XML:
+        if(m_failed)
+            return finish();
+        buildLevels();
+        instantiateSlaves();
+        break;
+
+    case INSTANTIATING:
+        if(m_failed){
+            if(sendFreeInstances() == 0)
+                finish();
+            return;
+        }
+        prepareRefLists();
+        break;
+
+    case PREPARING:
+        if(m_failed){
+            if(sendFreeInstances() == 0)
+                finish();
+            return;
+        }
+        m_state = INITIALIZING;
+        m_numPending = (int)m_slaves.size();
+        for(size_t i=0; i<m_slaves.size(); i++){
+            Slave * s = m_slaves[i];
+            s->client->fmi2_import_initialize_slave(s->nextMessageId++, s->fmuId, false, 0, m_startTime, true, m_stopTime);
+        }
+        break;
+
+    case INITIALIZING:
+        if(m_failed){
+            if(sendFreeInstances() == 0)
+                finish();
+            return;
+        }
+
+        // Read the initial outputs, so that the first step gets consistent inputs
+        m_state = READING_OUTPUTS;
+        m_numPending = 0;
+        for(size_t i=0; i<m_slaves.size(); i++){
+            Slave * s = m_slaves[i];
+            if(!s->realOutputRefs.empty()){
+                if(s->prepared)
+                    s->client->fmi2_import_get_real(s->nextMessageId++, s->fmuId, s->refSets[REAL_OUTPUT_REFS]);
+                else
+                    s->client->fmi2_import_get_real(s->nextMessageId++, s->fmuId, s->realOutputRefs);
+                m_numPending++;
+            }
+            if(!s->integerOutputRefs.empty()){
+                if(s->prepared)
+                    s->client->fmi2_import_get_integer(s->nextMessageId++, s->fmuId, s->refSets[INTEGER_OUTPUT_REFS]);
+                else
+                    s->client->fmi2_import_get_integer(s->nextMessageId++, s->fmuId, s->integerOutputRefs);
+                m_numPending++;
+            }
+            if(!s->booleanOutputRefs.empty()){
+                if(s->prepared)
+                    s->client->fmi2_import_get_boolean(s->nextMessageId++, s->fmuId, s->refSets[BOOLEAN_OUTPUT_REFS]);
+                else
+                    s->client->fmi2_import_get_boolean(s->nextMessageId++, s->fmuId, s->booleanOutputRefs);
+                m_numPending++;
+            }
+            if(!s->stringOutputRefs.empty()){
+                if(s->prepared)
+                    s->client->fmi2_import_get_string(s->nextMessageId++, s->fmuId, s->refSets[STRING_OUTPUT_REFS]);
+                else
+                    s->client->fmi2_import_get_string(s->nextMessageId++, s->fmuId, s->stringOutputRefs);
+                m_numPending++;
+            }
+        }
+        if(m_numPending == 0)
+            advance();
+        break;
+
+    case READING_OUTPUTS:
+        for(size_t i=0; i<m_slaves.size(); i++)
+            routeOutputs(m_slaves[i]);
+        if(m_failed || m_step >= m_numSteps){
+            return terminateSlaves();
+        }
+        startStep();
+        break;
+
+    case STEPPING:
+        if(!m_failed && m_level + 1 < m_levels.size()){
+            // Next level, which gets the outputs the previous levels just routed
+            m_level++;
+            stepLevel();
+            return;
+        }
+        m_step++;
+        m_time = m_startTime + m_step * m_stepSize;
+        if(!m_failed)
+            onStepCompleted(m_time);
+        if(m_failed || m_step >= m_numSteps){
+            return terminateSlaves();
+        }
+        startStep();
+        break;
+
+    case TERMINATING:
+        if(sendFreeInstances() == 0)
+            finish();
+        break;
+
+    case FREEING:
+        finish();
+        break;
+
+    case IDLE:
+    case DONE:
+        break;
+    }
+}
+
+void Master::instantiateSlaves(){
+    m_state = INSTANTIATING;
+    m_numPending = (int)m_slaves.size();
+    for(size_t i=0; i<m_slaves.size(); i++)
+        m_slaves[i]->client->fmi2_import_instantiate(m_slaves[i]->nextMessageId++);
+}
+
+void Master::prepareRefLists(){
+    m_state = PREPARING;
+    m_numPending = 0;
+    for(size_t i=0; i<m_slaves.size(); i++){
+        Slave * s = m_slaves[i];
+        s->prepared = s->client->hasCapability(fmitcp_proto::capability_value_reference_sets);
+        if(!s->prepared)
+            continue;
+        for(int list=0; list<NUM_REF_LISTS; list++){
+            s->refSets[list] = 0;
+            const vector<int>& refs = getRefList(s, (RefList)list);
+            if(refs.empty())
+                continue;
+            s->preparing[s->nextMessageId] = (RefList)list;
+            s->client->prepare_value_references(s->nextMessageId++, s->fmuId, refs);
+            m_numPending++;
+        }
+    }
+    if(m_numPending == 0)
+        advance();
+}
+
+static fmi2_base_type_enu_t baseType(Master::ValueType type){
+    switch(type){
+    case Master::INTEGER: return fmi2_base_type_int;
+    case Master::BOOLEAN: return fmi2_base_type_bool;
+    case Master::STRING:  return fmi2_base_type_str;
+    default:              return fmi2_base_type_real;
+    }
+}
+
+void Master::buildLevels(){
+    int n = (int)m_slaves.size();
+    m_levels.clear();
+    if(m_scheme == JACOBI){
+        m_levels.push_back(vector<int>());
+        for(int i=0; i<n; i++)
+            m_levels.back().push_back(i);
+        return;
+    }
+
+    vector<ModelDescription*> models;
+    for(int i=0; i<n; i++){
+        models.push_back(new ModelDescription());
+        if(!models[i]->parse(m_slaves[i]->xml))
+            m_logger.log(Logger::LOG_DEBUG,"No model description for slave %d, assuming all outputs depend on inputs.\n",i);
+    }
+
+    // Cost of breaking the edge from slave a to slave b: -1 if there is no edge, 0 if no output of a on it depends
+    // directly on inputs, 1 otherwise. Such outputs only follow the states, so a value one step old costs little.
+    vector<vector<int> > cost(n, vector<int>(n, -1));
+    for(int a=0; a<n; a++){
+        Slave * from = m_slaves[a];
+        for(size_t i=0; i<from->connections.size(); i++){
+            const Connection& c = from->connections[i];
+            int b = c.toSlave;
+            if(b == a)
+                continue;
+
+            Slave * to = m_slaves[b];
+            int outputRef = 0, inputRef = 0;
+            switch(c.type){
+            case REAL:    outputRef = from->realOutputRefs[c.fromIndex];    inputRef = to->realInputRefs[c.toIndex];    break;
+            case INTEGER: outputRef = from->integerOutputRefs[c.fromIndex]; inputRef = to->integerInputRefs[c.toIndex]; break;
+            case BOOLEAN: outputRef = from->booleanOutputRefs[c.fromIndex]; inputRef = to->booleanInputRefs[c.toIndex]; break;
+            case STRING:  outputRef = from->stringOutputRefs[c.fromIndex];  inputRef = to->stringInputRefs[c.toIndex];  break;
+            }
+
+            fmi2_base_type_enu_t type = baseType(c.type);
+            if(models[a]->isParsed() && models[a]->getCausality(type, outputRef) != fmi2_causality_enu_output)
+                m_logger.log(Logger::LOG_ERROR,"Connected variable %d of slave %d is not an output.\n",outputRef,a);
+            if(models[b]->isParsed() && models[b]->getCausality(type, inputRef) != fmi2_causality_enu_input)
+                m_logger.log(Logger::LOG_ERROR,"Connected variable %d of slave %d is not an input.\n",inputRef,b);
+
+            int edgeCost = (!models[a]->isParsed() || models[a]->dependsOnInputs(type, outputRef)) ? 1 : 0;
+            if(edgeCost > cost[a][b])
+                cost[a][b] = edgeCost;
+        }
+    }
+
+    for(int i=0; i<n; i++)
+        delete models[i];
+
+    // Topological levels: a level is the slaves whose sources are all in earlier levels
+    vector<int> numSources(n, 0);
+    for(int a=0; a<n; a++){
+        for(int b=0; b<n; b++){
+            if(cost[a][b] >= 0)
+                numSources[b]++;
+        }
+    }
+    vector<bool> placed(n, false);
+    int numPlaced = 0;
+    while(numPlaced < n){
+        vector<int> level;
+        for(int i=0; i<n; i++){
+            if(!placed[i] && numSources[i] == 0)
+                level.push_back(i);
+        }
+
+        if(level.empty()){
+            // All slaves left are in loops. Break the cheapest edge between them.
+            int bestA = -1, bestB = -1;
+            for(int a=0; a<n; a++){
+                for(int b=0; b<n; b++){
+                    if(placed[a] || placed[b] || cost[a][b] < 0)
+                        continue;
+                    if(bestA < 0 || cost[a][b] < cost[bestA][bestB]){
+                        bestA = a;
+                        bestB = b;
+                    }
+                }
+            }
+            m_logger.log(Logger::LOG_DEBUG,"Breaking a loop: slave %d gets the outputs of slave %d from the previous step.\n",bestB,bestA);
+            cost[bestA][bestB] = -1;
+            numSources[bestB]--;
+            continue;
+        }
+
+        for(size_t i=0; i<level.size(); i++){
+            int a = level[i];
+            placed[a] = true;
+            numPlaced++;
+            for(int b=0; b<n; b++){
+                if(cost[a][b] >= 0)
+                    numSources[b]--;
+            }
+        }
+        m_levels.push_back(level);
+    }
+    m_logger.log(Logger::LOG_DEBUG,"Gauss-Seidel order: %d slaves in %d levels.\n",n,(int)m_levels.size());
+}
+
+void Master::startStep(){
+    m_level = 0;
+    stepLevel();
+}
+
+void Master::stepLevel(){
+    const vector<int>& level = m_levels[m_level];
+    m_state = STEPPING;
+    m_numPending = (int)level.size();
+
+    // All requests of the level go out before any response is handled, so the slaves of a level step at the same
+    // time on the same inputs. With one level, as in the Jacobi scheme, that is the outputs of the previous step.
+    for(size_t i=0; i<level.size(); i++){
+        Slave * s = m_slaves[level[i]];
+        if(s->prepared){
+            s->client->fmi2_import_step_exchange(s->nextMessageId++, s->fmuId,
+                                                 s->refSets[REAL_INPUT_REFS], s->realInputs,
+                                                 s->refSets[INTEGER_INPUT_REFS], s->integerInputs,
+                                                 s->refSets[BOOLEAN_INPUT_REFS], s->booleanInputs,
+                                                 s->refSets[STRING_INPUT_REFS], s->stringInputs,
+                                                 m_time, m_stepSize, true,
+                                                 s->refSets[REAL_OUTPUT_REFS],
+                                                 s->refSets[INTEGER_OUTPUT_REFS],
+                                                 s->refSets[BOOLEAN_OUTPUT_REFS],
+                                                 s->refSets[STRING_OUTPUT_REFS]);
+            continue;
+        }
+        s->client->fmi2_import_step_exchange(s->nextMessageId++, s->fmuId,
+                                             s->realInputRefs, s->realInputs,
+                                             s->integerInputRefs, s->integerInputs,
+                                             s->booleanInputRefs, s->booleanInputs,
+                                             s->stringInputRefs, s->stringInputs,
+                                             m_time, m_stepSize, true,
+                                             s->realOutputRefs,
+                                             s->integerOutputRefs,
+                                             s->booleanOutputRefs,
+                                             s->stringOutputRefs);
+    }
+}
+
+void Master::terminateSlaves(){
+    m_state = TERMINATING;
+    m_numPending = (int)m_slaves.size();
+    for(size_t i=0; i<m_slaves.size(); i++)
+        m_slaves[i]->client->fmi2_import_terminate_slave(m_slaves[i]->nextMessageId++, m_slaves[i]->fmuId);
+}
+
+int Master::sendFreeInstances(){
+    m_state = FREEING;
+    m_numPending = 0;
+    for(size_t i=0; i<m_slaves.size(); i++){
+        Slave * s = m_slaves[i];
+        if(!s->instantiated)
+            continue;
+        s->instantiated = false;
+        s->freePending = true;
+        s->client->fmi2_import_free_slave_instance(s->nextMessageId++, s->fmuId);
+        m_numPending++;
+    }
+    return m_numPending;
+}
+
+void Master::finish(){
+    m_state = DONE;
+    m_logger.log(Logger::LOG_DEBUG,"Simulation done at t=%g%s.\n",m_time,m_failed ? " with errors" : "");
+    onSimulationDone(!m_failed);
+}
+
+void Master::routeOutputs(Slave * slave){
+    for(size_t i=0; i<slave->connections.size(); i++){
+        const Connection& c = slave->connections[i];
+        Slave * to = m_slaves[c.toSlave];
+        switch(c.type){
+        case REAL:
+            if(c.fromIndex < (int)slave->realOutputs.size())
+                to->realInputs[c.toIndex] = slave->realOutputs[c.fromIndex];
+            break;
+        case INTEGER:
+            if(c.fromIndex < (int)slave->integerOutputs.size())
+                to->integerInputs[c.toIndex] = slave->integerOutputs[c.fromIndex];
+            break;
+        case BOOLEAN:
+            if(c.fromIndex < (int)slave->booleanOutputs.size())
+                to->booleanInputs[c.toIndex] = slave->booleanOutputs[c.fromIndex];
+            break;
+        case STRING:
+            if(c.fromIndex < (int)slave->stringOutputs.size())
+                to->stringInputs[c.toIndex] = slave->stringOutputs[c.fromIndex];
+            break;
+        }
+    }
+}
+
+void Master::slaveConnected(int slave){
+    if(m_state != CONNECTING)
+        return;
+    responseDone(true);
+}
+
+void Master::slaveLost(int slave, string message){
+    Slave * s = m_slaves[slave];
+    if(m_state == IDLE || m_state == DONE || s->lost)
+        return;
+
+    // Responses from the slave will never come, and its instance went with the connection
+    m_logger.log(Logger::LOG_ERROR,"Lost slave %d: %s\n",slave,message.c_str());
+    s->lost = true;
+    s->instantiated = false;
+    m_failed = true;
+    onError(message);
+
+    if(m_state == FREEING){
+        // The others are being freed already
+        if(s->freePending){
+            s->freePending = false;
+            if(--m_numPending == 0)
+                advance();
+        }
+        return;
+    }
+
+    // Stop the others and free their instances, so they are not left on their servers. The requests go behind the
+    // ones still in flight, whose responses are not waited for.
+    if(m_state == READING_OUTPUTS || m_state == STEPPING){
+        for(size_t i=0; i<m_slaves.size(); i++){
+            if(m_slaves[i]->instantiated)
+                m_slaves[i]->client->fmi2_import_terminate_slave(m_slaves[i]->nextMessageId++, m_slaves[i]->fmuId);
+        }
+    }
+    if(sendFreeInstances() == 0)
+        finish();
+}
+
+void Master::slaveXml(int slave, const string& xml){
+    m_slaves[slave]->xml = xml;
+    responseDone(true);
+}
+
+void Master::slaveInstantiated(int slave, fmitcp_proto::jm_status_enu_t status, int fmuId){
+    bool ok = (status != fmitcp_proto::jm_status_error);
+    if(ok){
+        m_slaves[slave]->fmuId = fmuId;
+        m_slaves[slave]->instantiated = true;
+    } else {
+        m_logger.log(Logger::LOG_ERROR,"Could not instantiate slave %d.\n",slave);
+    }
+    responseDone(ok);
+}
+
+void Master::slavePrepared(int slave, int mid, fmitcp_proto::fmi2_status_t status, int valueReferenceSet){
+    Slave * s = m_slaves[slave];
+    map<int, RefList>::iterator it = s->preparing.find(mid);
+    if(it != s->preparing.end()){
+        s->refSets[it->second] = valueReferenceSet;
+        s->preparing.erase(it);
+    }
+    slaveStatus(slave, status);
+}
+
+void Master::slaveStatus(int slave, fmitcp_proto::fmi2_status_t status){
+    if(!statusOk(status))
+        m_logger.log(Logger::LOG_ERROR,"Slave %d returned status %d.\n",slave,status);
+    responseDone(statusOk(status));
+}
+
+void Master::slaveFreed(int slave){
+    Slave * s = m_slaves[slave];
+    if(m_state != FREEING || !s->freePending)
+        return;
+    s->freePending = false;
+    if(--m_numPending == 0)
+        advance();
+}
+
+void Master::slaveRealOutputs(int slave, const vector<double>& values, fmitcp_proto::fmi2_status_t status){
+    m_slaves[slave]->realOutputs = values;
+    slaveStatus(slave, status);
+}
+
+void Master::slaveIntegerOutputs(int slave, const vector<int>& values, fmitcp_proto::fmi2_status_t status){
+    m_slaves[slave]->integerOutputs = values;
+    slaveStatus(slave, status);
+}
+
+void Master::slaveBooleanOutputs(int slave, const vector<bool>& values, fmitcp_proto::fmi2_status_t status){
+    m_slaves[slave]->booleanOutputs = values;
+    slaveStatus(slave, status);
+}
+
+void Master::slaveStringOutputs(int slave, const vector<string>& values, fmitcp_proto::fmi2_status_t status){
+    m_slaves[slave]->stringOutputs = values;
+    slaveStatus(slave, status);
+}
+
+void Master::slaveStepped(int slave, fmitcp_proto::fmi2_status_t status, const vector<double>& realValues, const vector<int>& integerValues, const vector<bool>& booleanValues, const vector<string>& stringValues){
+    Slave * s = m_slaves[slave];
+    if(statusOk(status)){
+        s->realOutputs = realValues;
+        s->integerOutputs = integerValues;
+        s->booleanOutputs = booleanValues;
+        s->stringOutputs = stringValues;
+
+        // Slaves in later levels get the new values in this step, the others in the next step
+        routeOutputs(s);
+    }
+    slaveStatus(slave, status);
+}
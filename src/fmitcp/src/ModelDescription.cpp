@@ -0,0 +1,132 @@
+#include "ModelDescription.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace fmitcp;
+
+void ModelDescription::logger(jm_callbacks* c, jm_string module, jm_log_level_enu_t logLevel, jm_string message){
+    ModelDescription * md = (ModelDescription*)c->context;
+    if(logLevel <= jm_log_level_error)
+        md->m_logger.log(Logger::LOG_ERROR,"module = %s, log level = %d: %s\n",module,logLevel,message);
+    else
+        md->m_logger.log(Logger::LOG_DEBUG,"module = %s, log level = %d: %s\n",module,logLevel,message);
+}
+
+ModelDescription::ModelDescription(){
+    m_callbacks.malloc = malloc;
+    m_callbacks.calloc = calloc;
+    m_callbacks.realloc = realloc;
+    m_callbacks.free = free;
+    m_callbacks.logger = logger;
+    m_callbacks.log_level = jm_log_level_warning;
+    m_callbacks.context = this;
+    m_context = NULL;
+    m_fmu = NULL;
+    m_variables = NULL;
+}
+
+ModelDescription::~ModelDescription(){
+    clear();
+}
+
+void ModelDescription::clear(){
+    if(m_variables){
+        fmi2_import_free_variable_list(m_variables);
+        m_variables = NULL;
+    }
+    if(m_fmu){
+        fmi2_import_free(m_fmu);
+        m_fmu = NULL;
+    }
+    if(m_context){
+        fmi_import_free_context(m_context);
+        m_context = NULL;
+    }
+}
+
+bool ModelDescription::parse(const std::string& xml){
+    clear();
+    if(xml.empty())
+        return false;
+
+    // FMILibrary parses from a directory, so the XML takes a short trip to disk
+    char* dir = fmi_import_mk_temp_dir(&m_callbacks, NULL, "fmitcp_xml_");
+    if(!dir){
+        m_logger.log(Logger::LOG_ERROR,"Could not create a directory for the model description.\n");
+        return false;
+    }
+
+    char* xmlPath = fmi_import_get_model_description_path(dir, &m_callbacks);
+    FILE * file = xmlPath ? fopen(xmlPath, "wb") : NULL;
+    bool written = file && fwrite(xml.data(), 1, xml.size(), file) == xml.size();
+    if(file && fclose(file) != 0)
+        written = false;
+
+    if(written){
+        m_context = fmi_import_allocate_context(&m_callbacks);
+        m_fmu = fmi2_import_parse_xml(m_context, dir, 0);
+    } else {
+        m_logger.log(Logger::LOG_ERROR,"Could not write the model description to %s.\n",dir);
+    }
+
+    // Everything is in memory now
+    m_callbacks.free(xmlPath);
+    fmi_import_rmdir(&m_callbacks, dir);
+    m_callbacks.free(dir);
+
+    if(!m_fmu){
+        clear();
+        return false;
+    }
+    m_variables = fmi2_import_get_variable_list(m_fmu, 0);
+    return true;
+}
+
+fmi2_import_variable_t* ModelDescription::getVariable(fmi2_base_type_enu_t type, int valueRef){
+    if(!m_fmu)
+        return NULL;
+    return fmi2_import_get_variable_by_vr(m_fmu, type, valueRef);
+}
+
+fmi2_causality_enu_t ModelDescription::getCausality(fmi2_base_type_enu_t type, int valueRef){
+    fmi2_import_variable_t* v = getVariable(type, valueRef);
+    return v ? fmi2_import_get_causality(v) : fmi2_causality_enu_unknown;
+}
+
+bool ModelDescription::dependsOnInputs(fmi2_base_type_enu_t type, int valueRef){
+    fmi2_import_variable_t* v = getVariable(type, valueRef);
+    if(!v)
+        return true;
+
+    size_t *startIndex, *dependency;
+    char *factorKind;
+    fmi2_import_get_outputs_dependencies(m_fmu, &startIndex, &dependency, &factorKind);
+    if(!startIndex)
+        return true;
+
+    // Find the output among the outputs, the dependencies are listed in the same order
+    fmi2_import_variable_list_t* outputs = fmi2_import_get_outputs_list(m_fmu);
+    size_t numOutputs = fmi2_import_get_variable_list_size(outputs);
+    bool depends = true;
+    for(size_t i=0; i<numOutputs; i++){
+        if(fmi2_import_get_variable(outputs, i) != v)
+            continue;
+
+        depends = false;
+        size_t numVariables = fmi2_import_get_variable_list_size(m_variables);
+        for(size_t j=startIndex[i]; j<startIndex[i+1]; j++){
+            // Dependencies are 1-based indices of model variables
+            size_t index = dependency[j];
+            if(index == 0 || index > numVariables)
+                continue;
+            fmi2_import_variable_t* d = fmi2_import_get_variable(m_variables, index - 1);
+            if(fmi2_import_get_causality(d) == fmi2_causality_enu_input){
+                depends = true;
+                break;
+            }
+        }
+        break;
+    }
+    fmi2_import_free_variable_list(outputs);
+    return depends;
+}
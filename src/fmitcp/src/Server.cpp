@@ -1,8 +1,13 @@
 #include <fstream>
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
 
 #include "Server.h"
 #include "Logger.h"
 #include "common.h"
+#include "ShmTransport.h"
+#include "UnixSocketTransport.h"
 #include "fmitcp.pb.h"
 
 using namespace fmitcp;
@@ -24,25 +29,248 @@ void serverOnError(lw_server s, lw_error error) {
   Server * server = (Server*)lw_server_tag(s);
   server->error(s,error);
 }
+void serverOnUnixSocketReady(void * tag) {
+  Server * server = (Server*)tag;
+  server->unixSocketReady();
+}
+
+namespace fmitcp {
+  /**
+   * Count of the jobs of a server that are with the workers or on their way back to the pump. Outlives the server
+   * while jobs are still posted to the pump when it is deleted, so they can tell and free themselves. Only touched
+   * on the pump thread.
+   */
+  struct ServerJobs {
+    /// NULL once the server is deleted
+    Server * server;
+    int outstanding;
+  };
+
+  /// A request handed to the worker pool. Jobs are recycled, so their messages and buffer keep their memory.
+  struct ServerJob {
+    Server * server;
+    ServerJobs * jobs;
+    lw_pump pump;
+    Transport * transport;
+    unsigned int connectionId;
+    int fmuId;
+    unsigned int clientId;
+    fmitcp_proto::fmitcp_message req;
+    fmitcp_proto::fmitcp_message res;
+
+    /// True if the transport takes bytes, so the worker serializes the response
+    bool serialize;
+
+    /// True if there is a response to send
+    bool hasResponse;
+
+    /// Serialized response
+    string frame;
+  };
+}
+
+/// Runs on the pump thread, after a worker has finished a job
+void serverSendJobResponse(void * data) {
+  ServerJob * job = (ServerJob*)data;
+  ServerJobs * jobs = job->jobs;
+  jobs->outstanding--;
+  if (jobs->server) {
+    jobs->server->workerResponse(job);
+    return;
+  }
+  // The server was deleted after the job finished
+  delete job;
+  if (jobs->outstanding == 0) {
+    delete jobs;
+  }
+}
+void serverRunJob(void * data) {
+  ServerJob * job = (ServerJob*)data;
+  job->res.Clear();
+  job->frame.clear();
+  job->hasResponse = job->server->handleMessage(job->req, job->res, job->fmuId, job->clientId);
+  if (job->hasResponse && job->serialize) {
+    // Serialize here so the pump thread only has to write
+    FMITCP_LOG(*job->server->getLogger(), Logger::LOG_NETWORK_DEBUG, "sendProtoBuffer(%s)\n", job->res.DebugString().c_str());
+    fmitcp::serializeFrame(&job->res, job->frame);
+  }
+  // The job goes back to the pump thread even without a response, to be recycled there
+  lw_pump_post(job->pump, (void*)serverSendJobResponse, job);
+}
+void serverDiscardJob(void * data) {
+  ServerJob * job = (ServerJob*)data;
+  job->jobs->outstanding--;
+  delete job;
+}
+
+namespace fmitcp {
+  /// Frees an instance of a closed connection, queued behind the requests that are still running on it
+  struct ServerFreeJob {
+    Server * server;
+    int fmuId;
+  };
+}
+
+void serverRunFreeJob(void * data) {
+  ServerFreeJob * job = (ServerFreeJob*)data;
+  job->server->freeLeftInstance(job->fmuId);
+  delete job;
+}
+void serverDiscardFreeJob(void * data) {
+  // The server is being deleted, and frees the instance itself
+  delete (ServerFreeJob*)data;
+}
+
+static unsigned int capabilityBit(fmitcp_proto::capability_t capability) {
+  return 1u << capability;
+}
+
+/// Capabilities that a get or set request uses
+template<typename R>
+static unsigned int valueCapabilities(const R& r) {
+  unsigned int capabilities = 0;
+  if (r.valuereferenceset() != 0) {
+    capabilities |= capabilityBit(fmitcp_proto::capability_value_reference_sets);
+  }
+  if (r.delta()) {
+    capabilities |= capabilityBit(fmitcp_proto::capability_delta_encoding);
+  }
+  return capabilities;
+}
+
+/// Capabilities that a request uses, as bits
+static unsigned int requestCapabilities(const fmitcp_proto::fmitcp_message& req) {
+  switch (req.type()) {
+  case fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_real_req:
+    return valueCapabilities(req.fmi2_import_set_real_req());
+  case fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_integer_req:
+    return valueCapabilities(req.fmi2_import_set_integer_req());
+  case fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_boolean_req:
+    return valueCapabilities(req.fmi2_import_set_boolean_req());
+  case fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_string_req:
+    return valueCapabilities(req.fmi2_import_set_string_req());
+  case fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_real_req:
+    return valueCapabilities(req.fmi2_import_get_real_req());
+  case fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_integer_req:
+    return valueCapabilities(req.fmi2_import_get_integer_req());
+  case fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_boolean_req:
+    return valueCapabilities(req.fmi2_import_get_boolean_req());
+  case fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_string_req:
+    return valueCapabilities(req.fmi2_import_get_string_req());
+  case fmitcp_proto::fmitcp_message_Type_type_fmi2_import_step_exchange_req: {
+    const fmitcp_proto::fmi2_import_step_exchange_req& r = req.fmi2_import_step_exchange_req();
+    unsigned int capabilities = 0;
+    if (r.realvaluereferenceset() != 0 || r.integervaluereferenceset() != 0 ||
+        r.booleanvaluereferenceset() != 0 || r.stringvaluereferenceset() != 0 ||
+        r.realoutputvaluereferenceset() != 0 || r.integeroutputvaluereferenceset() != 0 ||
+        r.booleanoutputvaluereferenceset() != 0 || r.stringoutputvaluereferenceset() != 0) {
+      capabilities |= capabilityBit(fmitcp_proto::capability_value_reference_sets);
+    }
+    if (r.deltainputs() || r.deltaoutputs()) {
+      capabilities |= capabilityBit(fmitcp_proto::capability_delta_encoding);
+    }
+    return capabilities;
+  }
+  case fmitcp_proto::fmitcp_message_Type_type_prepare_value_references_req:
+    return capabilityBit(fmitcp_proto::capability_value_reference_sets);
+  case fmitcp_proto::fmitcp_message_Type_type_release_value_references_req:
+    return capabilityBit(fmitcp_proto::capability_value_reference_sets);
+  case fmitcp_proto::fmitcp_message_Type_type_subscribe_outputs_req:
+    return capabilityBit(fmitcp_proto::capability_output_subscriptions);
+  case fmitcp_proto::fmitcp_message_Type_type_get_jacobian_req: {
+    const fmitcp_proto::get_jacobian_req& r = req.get_jacobian_req();
+    unsigned int capabilities = capabilityBit(fmitcp_proto::capability_jacobian);
+    if (r.unknownvaluereferenceset() != 0 || r.knownvaluereferenceset() != 0) {
+      capabilities |= capabilityBit(fmitcp_proto::capability_value_reference_sets);
+    }
+    return capabilities;
+  }
+  case fmitcp_proto::fmitcp_message_Type_type_get_xml_req:
+    return req.get_xml_req().xmlhash().empty() ? 0 : capabilityBit(fmitcp_proto::capability_xml_cache);
+  default:
+    return 0;
+  }
+}
+
+/// True if a file can be opened for reading
+static bool fileExists(const string& path) {
+  FILE* file = fopen(path.c_str(), "rb");
+  if (file) {
+    fclose(file);
+  }
+  return file != NULL;
+}
+
+/// True if a value differs from the one sent last. A real only counts if it moved more than threshold.
+static bool valueChanged(fmi2_real_t value, fmi2_real_t sent, double threshold) {
+  return !(fabs(value - sent) <= threshold);
+}
+static bool valueChanged(fmi2_integer_t value, fmi2_integer_t sent, double threshold) {
+  return value != sent;
+}
+static bool valueChanged(fmi2_string_t value, const string& sent, double threshold) {
+  return sent != value;
+}
+
+template<typename T, typename V>
+static void addValue(google::protobuf::RepeatedField<T>* out, V value) {
+  out->Add(value);
+}
+static void addValue(google::protobuf::RepeatedPtrField<string>* out, fmi2_string_t value) {
+  out->Add()->assign(value);
+}
+
+/**
+ * Add values to a response. Unless full, only the values that differ from sent are added, with their positions in
+ * indices, and sent must have one value per value. The added values are kept in sent, if given.
+ */
+template<typename T, typename S, typename F>
+static void addValues(const T* values, size_t n, bool full, double threshold, vector<S>* sent,
+                      google::protobuf::RepeatedField<google::protobuf::int32>* indices, F* out) {
+  if (full) {
+    for (size_t i = 0 ; i < n ; i++) {
+      addValue(out, values[i]);
+    }
+    if (sent) {
+      sent->assign(values, values + n);
+    }
+    return;
+  }
+  for (size_t i = 0 ; i < n ; i++) {
+    if (valueChanged(values[i], (*sent)[i], threshold)) {
+      indices->Add(i);
+      addValue(out, values[i]);
+      (*sent)[i] = values[i];
+    }
+  }
+}
+
+/// Relative perturbation of finite differences, if the request does not give one
+static const double DEFAULT_PERTURBATION = 1e-6;
 
 /*!
- * Callback function for FMILibrary. Logs the FMILibrary operations.
+ * Callback function for FMILibrary. Logs the FMILibrary operations to the logger of the server.
  */
 void jmCallbacksLogger(jm_callbacks* c, jm_string module, jm_log_level_enu_t log_level, jm_string message) {
-  printf("[module = %s][log level = %s] %s\n", module, jm_log_level_to_string(log_level), message);fflush(NULL);
+  Server * server = (Server*)c->context;
+  Logger::LogMessageType type = (log_level <= jm_log_level_error) ? Logger::LOG_ERROR : Logger::LOG_DEBUG;
+  server->getLogger()->log(type, "[module = %s][log level = %s] %s\n", module, jm_log_level_to_string(log_level), message);
 }
 
-Server::Server(string fmuPath, bool debugLogging, jm_log_level_enu_t logLevel, EventPump *pump) {
+Server::Server(string fmuPath, bool debugLogging, jm_log_level_enu_t logLevel, EventPump *pump, const string& unpackCacheDir) {
   m_fmuParsed = true;
   m_fmuPath = fmuPath;
+  m_unpackCacheDir = unpackCacheDir;
   m_debugLogging = debugLogging;
   m_logLevel = logLevel;
   init(pump);
 }
 
-Server::Server(string fmuPath, bool debugLogging, jm_log_level_enu_t logLevel, EventPump *pump, const Logger &logger) {
+Server::Server(string fmuPath, bool debugLogging, jm_log_level_enu_t logLevel, EventPump *pump, const Logger &logger,
+               const string& unpackCacheDir) {
   m_fmuParsed = true;
   m_fmuPath = fmuPath;
+  m_unpackCacheDir = unpackCacheDir;
   m_debugLogging = debugLogging;
   m_logLevel = logLevel;
   m_logger = logger;
@@ -51,12 +279,70 @@ Server::Server(string fmuPath, bool debugLogging, jm_log_level_enu_t logLevel, E
 
 Server::~Server() {
   lw_server_delete(m_server);
+  m_workers.stop();
+  for (size_t i = 0; i < m_freeJobs.size(); i++) {
+    delete m_freeJobs[i];
+  }
+  // Finished jobs still posted to the pump free themselves when it runs them
+  m_jobs->server = NULL;
+  if (m_jobs->outstanding == 0) {
+    delete m_jobs;
+  }
+  if (m_unixSocket >= 0) {
+    lw_pump_remove(m_pump->getPump(), m_unixSocketWatch);
+    UnixSocketTransport::closeListener(m_unixSocket, m_unixSocketPath);
+  }
+  map<Transport*, Connection>::iterator conn;
+  for (conn = m_connections.begin(); conn != m_connections.end(); ++conn) {
+    delete conn->first;
+  }
+
+  // Free the instances the clients left behind and the pool, then the shared model
+  m_instancePoolSize = 0;
+  while (!m_fmi2Instances.empty()) {
+    freeFmi2Instance(m_fmi2Instances.begin()->first);
+  }
+  for (size_t i = 0; i < m_instancePool.size(); i++) {
+    deleteFmi2Instance(m_instancePool[i]);
+  }
+  if (m_fmi2Model) {
+    fmi2_import_free_variable_list(m_fmi2Variables);
+    fmi2_import_destroy_dllfmu(m_fmi2Model);
+    fmi2_import_free(m_fmi2Model);
+    m_jmCallbacks.free(m_fmuLocation);
+    m_jmCallbacks.free(m_resourcePath);
+    fmi_import_free_context(m_context);
+    removeWorkingDir();
+  }
+  lw_sync_delete(m_instancesLock);
+  lw_sync_delete(m_contextLock);
 }
 
 void Server::init(EventPump * pump) {
   m_pump = pump;
   m_server = lw_server_new(pump->getPump());
   m_sendDummyResponses = false;
+  m_fmi2Model = NULL;
+  m_fmi2ModelInUse = false;
+  m_nextFmuId = 0;
+  m_instancePoolSize = 0;
+  m_modelExchange = false;
+  m_integratorMethod = Integrator::METHOD_RK45;
+  m_integratorTolerance = Integrator::DEFAULT_TOLERANCE;
+  m_instancesLock = lw_sync_new();
+  m_contextLock = lw_sync_new();
+  registerHandlers();
+  m_nextConnectionId = 0;
+  m_sharedMemory = true;
+  m_unixSocket = -1;
+  m_unixSocketWatch = NULL;
+  m_numWorkers = 0;
+  m_jobs = new ServerJobs;
+  m_jobs->server = this;
+  m_jobs->outstanding = 0;
+  m_maxFmuStates = FmuStateStore::DEFAULT_CAPACITY;
+  m_maxSerializedStateSize = FmuStateStore::DEFAULT_MAX_SERIALIZED_SIZE;
+  m_workingDirCached = false;
 
   if(m_fmuPath == "dummy"){
     m_sendDummyResponses = true;
@@ -72,43 +358,43 @@ void Server::init(EventPump * pump) {
   m_jmCallbacks.free = free;
   m_jmCallbacks.logger = jmCallbacksLogger;
   m_jmCallbacks.log_level = m_logLevel;
-  m_jmCallbacks.context = 0;
-  // working directory
-  char* dir = fmi_import_mk_temp_dir(&m_jmCallbacks, NULL, "fmitcp_");
-  m_workingDir = dir; // convert to std::string
-  free(dir);
+  m_jmCallbacks.context = this;
   // import allocate context
   m_context = fmi_import_allocate_context(&m_jmCallbacks);
-  // get FMU version
-  m_version = fmi_import_get_fmi_version(m_context, m_fmuPath.c_str(), m_workingDir.c_str());
+  // working directory and FMU version
+  unpackFmu();
   // Check version OK
   if ((m_version <= fmi_version_unknown_enu) || (m_version >= fmi_version_unsupported_enu)) {
     fmi_import_free_context(m_context);
-    fmi_import_rmdir(&m_jmCallbacks, m_workingDir.c_str());
+    removeWorkingDir();
     m_logger.log(Logger::LOG_ERROR, "Unsupported/unknown FMU version: '%s'.\n", fmi_version_to_string(m_version));
     m_fmuParsed = false;
     return;
   }
+  loadXml();
   if (m_version == fmi_version_2_0_enu) { // FMI 2.0
     // parse the xml file
-    m_fmi2Instance = fmi2_import_parse_xml(m_context, m_workingDir.c_str(), 0);
-    if(!m_fmi2Instance) {
+    m_fmi2Model = fmi2_import_parse_xml(m_context, m_workingDir.c_str(), 0);
+    if(!m_fmi2Model) {
       fmi_import_free_context(m_context);
-      fmi_import_rmdir(&m_jmCallbacks, m_workingDir.c_str());
+      removeWorkingDir();
       m_logger.log(Logger::LOG_ERROR, "Error parsing the modelDescription.xml file contained in %s\n", m_workingDir.c_str());
       m_fmuParsed = false;
       return;
     }
     // check FMU kind
-    fmi2_fmu_kind_enu_t fmuType = fmi2_import_get_fmu_kind(m_fmi2Instance);
-    if(fmuType != fmi2_fmu_kind_cs && fmuType != fmi2_fmu_kind_me_and_cs) {
-      fmi2_import_free(m_fmi2Instance);
+    m_fmuKind = fmi2_import_get_fmu_kind(m_fmi2Model);
+    if(m_fmuKind != fmi2_fmu_kind_cs && m_fmuKind != fmi2_fmu_kind_me_and_cs && m_fmuKind != fmi2_fmu_kind_me) {
+      fmi2_import_free(m_fmi2Model);
+      m_fmi2Model = NULL;
       fmi_import_free_context(m_context);
-      fmi_import_rmdir(&m_jmCallbacks, m_workingDir.c_str());
-      m_logger.log(Logger::LOG_ERROR, "Only FMI Co-Simulation 2.0 is supported.\n");
+      removeWorkingDir();
+      m_logger.log(Logger::LOG_ERROR, "Unknown FMU kind.\n");
       m_fmuParsed = false;
       return;
     }
+    // Co-Simulation if the FMU has it, otherwise Model Exchange with an integrator on the server
+    m_modelExchange = (m_fmuKind == fmi2_fmu_kind_me);
     // FMI callback functions
     m_fmi2CallbackFunctions.logger = fmi2_log_forwarding;
     m_fmi2CallbackFunctions.allocateMemory = calloc;
@@ -116,16 +402,17 @@ void Server::init(EventPump * pump) {
     m_fmi2CallbackFunctions.stepFinished = 0;
     m_fmi2CallbackFunctions.componentEnvironment = 0;
     // Load the binary (dll/so)
-    jm_status_enu_t status = fmi2_import_create_dllfmu(m_fmi2Instance, fmuType, &m_fmi2CallbackFunctions);
+    jm_status_enu_t status = fmi2_import_create_dllfmu(m_fmi2Model, m_fmuKind, &m_fmi2CallbackFunctions);
     if (status == jm_status_error) {
-      fmi2_import_free(m_fmi2Instance);
+      fmi2_import_free(m_fmi2Model);
+      m_fmi2Model = NULL;
       fmi_import_free_context(m_context);
-      fmi_import_rmdir(&m_jmCallbacks, m_workingDir.c_str());
+      removeWorkingDir();
       m_logger.log(Logger::LOG_ERROR, "There was an error loading the FMU binary. Turn on logging (-l) for more info.\n");
       m_fmuParsed = false;
       return;
     }
-    m_instanceName = fmi2_import_get_model_name(m_fmi2Instance);
+    m_instanceName = fmi2_import_get_model_name(m_fmi2Model);
     m_fmuLocation = fmi_import_create_URL_from_abs_path(&m_jmCallbacks, m_fmuPath.c_str());
     m_resourcePath = fmi_import_create_URL_from_abs_path(&m_jmCallbacks, m_workingDir.c_str());
 
@@ -136,884 +423,2543 @@ void Server::init(EventPump * pump) {
      * 2 sorted by types/value references.
      */
     int sortOrder = 0;
-    m_fmi2Variables = fmi2_import_get_variable_list(m_fmi2Instance, sortOrder);
+    m_fmi2Variables = fmi2_import_get_variable_list(m_fmi2Model, sortOrder);
   } else {
     // todo add FMI 1.0 later on.
     fmi_import_free_context(m_context);
-    fmi_import_rmdir(&m_jmCallbacks, m_workingDir.c_str());
-    m_logger.log(Logger::LOG_ERROR, "Only FMI Co-Simulation 2.0 is supported.\n");
+    removeWorkingDir();
+    m_logger.log(Logger::LOG_ERROR, "Only FMI 2.0 is supported.\n");
     m_fmuParsed = false;
     return;
   }
 }
 
-void Server::clientConnected(lw_client c) {
-  m_logger.log(Logger::LOG_NETWORK,"+ Client connected.\n");
-  string msg = "connected\n";
-  lw_stream_write(c,msg.c_str(),msg.size());
-  m_logger.log(Logger::LOG_DEBUG,"Sent connected message to new client.\n");
-  onClientConnect();
-}
-
-void Server::clientDisconnected(lw_client c) {
-  m_logger.log(Logger::LOG_NETWORK,"- Client disconnected.\n");
-  /*
-  lw_stream_close(c,true);
-  lw_stream_delete(c);
-  fflush(NULL);
-  */
-
- /*
-  lw_server_delete(m_server);
-  lw_pump_remove_user(m_pump->getPump());
-  init(m_pump);
-  */
-  onClientDisconnect();
-}
-
-void Server::clientData(lw_client c, const char *data, size_t size) {
-  string data2(data, size);
+void Server::unpackFmu() {
+  m_workingDirCached = false;
+  string cachedDir;
+  if (!m_unpackCacheDir.empty()) {
+    string hash;
+    if (fileContentHash(m_fmuPath, &hash)) {
+      cachedDir = m_unpackCacheDir + "/" + hash;
+    } else {
+      m_logger.log(Logger::LOG_ERROR, "Could not read %s.\n", m_fmuPath.c_str());
+    }
+  }
 
-  if(data2 == "\n")
+  // Only FMI 2.0 FMUs are put in the cache, so the version of one found there is known
+  if (!cachedDir.empty() && fileExists(cachedDir + "/modelDescription.xml")) {
+    m_logger.log(Logger::LOG_DEBUG, "Using the FMU unpacked in %s\n", cachedDir.c_str());
+    m_workingDir = cachedDir;
+    m_workingDirCached = true;
+    m_version = fmi_version_2_0_enu;
     return;
+  }
 
-  // Construct message
-  fmitcp_proto::fmitcp_message req;
-  //string data2 = fmitcp::dataToString(data,size);
-  bool parseStatus = req.ParseFromString(data2);
-  fmitcp_proto::fmitcp_message_Type type = req.type();
-
-  m_logger.log(Logger::LOG_DEBUG,"Parse status: %d\n", parseStatus);
-
-  fmitcp_proto::fmitcp_message res;
-  bool sendResponse = true;
-
-  if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_instantiate_req) {
-
-    // Unpack message
-    fmitcp_proto::fmi2_import_instantiate_req * r = req.mutable_fmi2_import_instantiate_req();
-    int messageId = r->message_id();
-
-    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_instantiate_req(mid=%d)\n",messageId);
-
-    jm_status_enu_t status = jm_status_success;
-    if (!m_sendDummyResponses) {
-      // instantiate FMU
-      fmi2_boolean_t visible = fmi2_false;
-      status = fmi2_import_instantiate(m_fmi2Instance, m_instanceName, fmi2_cosimulation, m_resourcePath, visible);
+  // Unpack into a new directory. For the cache, it is made in the cache directory and renamed when complete, so
+  // other servers never see it half done.
+  char* dir = fmi_import_mk_temp_dir(&m_jmCallbacks, cachedDir.empty() ? NULL : m_unpackCacheDir.c_str(), "fmitcp_");
+  m_workingDir = dir; // convert to std::string
+  free(dir);
+  m_version = fmi_import_get_fmi_version(m_context, m_fmuPath.c_str(), m_workingDir.c_str());
+  if (cachedDir.empty() || m_version != fmi_version_2_0_enu) {
+    return;
+  }
+  if (rename(m_workingDir.c_str(), cachedDir.c_str()) != 0) {
+    // Another server may have unpacked the same FMU at the same time
+    if (!fileExists(cachedDir + "/modelDescription.xml")) {
+      m_logger.log(Logger::LOG_ERROR, "Could not move the unpacked FMU to %s.\n", cachedDir.c_str());
+      return;
     }
+    fmi_import_rmdir(&m_jmCallbacks, m_workingDir.c_str());
+  }
+  m_workingDir = cachedDir;
+  m_workingDirCached = true;
+}
 
-    // Create response message
-    res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_instantiate_res);
-    fmitcp_proto::fmi2_import_instantiate_res * instantiateRes = res.mutable_fmi2_import_instantiate_res();
-    instantiateRes->set_message_id(messageId);
-    instantiateRes->set_status(fmiJMStatusToProtoJMStatus(status));
-    m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_instantiate_slave_res(mid=%d,status=%d)\n",messageId,instantiateRes->status());
-
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_initialize_slave_req) {
-
-    // Unpack message
-    fmitcp_proto::fmi2_import_initialize_slave_req * r = req.mutable_fmi2_import_initialize_slave_req();
-    int messageId = r->message_id();
-    int fmuId = r->fmuid();
-    bool toleranceDefined = r->has_tolerancedefined();
-    double tolerance = r->tolerance();
-    double starttime = r->starttime();
-    bool stopTimeDefined = r->has_stoptimedefined();
-    double stoptime = r->stoptime();
-
-    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_initialize_slave_req(mid=%d)\n",messageId);
+void Server::removeWorkingDir() {
+  // An FMU in the unpack cache is kept for the next server
+  if (!m_workingDirCached) {
+    fmi_import_rmdir(&m_jmCallbacks, m_workingDir.c_str());
+  }
+}
 
-    fmi2_status_t status = fmi2_status_ok;
-    if (!m_sendDummyResponses) {
-      // initialize FMU
-      /*!
-       * \todo
-       * We should set all variable start values (of "ScalarVariable / <type> / start").
-       * fmiSetReal/Integer/Boolean/String(s1, ...);
-       */
-      /*!
-       * \todo
-       * What about FMUs internal experiment values e.g tolerance ????
-       */
-//      fmi2_boolean_t toleranceControlled = fmi2_false;
-//      fmi2_real_t relativeTolerance = fmi2_import_get_default_experiment_tolerance(m_fmi2Instance);
-
-      /*!
-       * \todo
-       * We need to set the input values at time = startTime after fmiEnterInitializationMode and before fmiExitInitializationMode.
-       * fmiSetReal/Integer/Boolean/String(s1, ...);
-       */
-      if (fmi2StatusOkOrWarning(status =  fmi2_import_setup_experiment(m_fmi2Instance, toleranceDefined, tolerance,
-          starttime, stopTimeDefined, stoptime)) &&
-          fmi2StatusOkOrWarning(status = fmi2_import_enter_initialization_mode(m_fmi2Instance)) &&
-          fmi2StatusOkOrWarning(fmi2_import_exit_initialization_mode(m_fmi2Instance))) {
-        // do nothing
-      }
+void Server::loadXml() {
+  char* xmlFilePath = fmi_import_get_model_description_path(m_workingDir.c_str(), &m_jmCallbacks);
+  m_logger.log(Logger::LOG_DEBUG,"xmlFilePath=%s\n",xmlFilePath);
+  ifstream xmlFile(xmlFilePath, ios::in | ios::binary);
+  if (xmlFile.is_open()) {
+    // Read in one go, it is sent as it is
+    xmlFile.seekg(0, ios::end);
+    m_xml.resize((size_t)xmlFile.tellg());
+    xmlFile.seekg(0, ios::beg);
+    if (!m_xml.empty()) {
+      xmlFile.read(&m_xml[0], m_xml.size());
     }
+    m_xmlHash = contentHash(m_xml);
+  } else {
+    m_logger.log(Logger::LOG_ERROR, "Error opening the %s file.\n", xmlFilePath);
+  }
+  free(xmlFilePath);
+}
 
-    // Create response message
-    res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_initialize_slave_res);
-    fmitcp_proto::fmi2_import_initialize_slave_res * initializeRes = res.mutable_fmi2_import_initialize_slave_res();
-    initializeRes->set_message_id(messageId);
-    initializeRes->set_status(fmi2StatusToProtofmi2Status(status));
-    m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_initialize_slave_res(mid=%d,status=%d)\n",messageId,initializeRes->status());
-
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_terminate_slave_req) {
-
-    // Unpack message
-    fmitcp_proto::fmi2_import_terminate_slave_req * r = req.mutable_fmi2_import_terminate_slave_req();
-    int fmuId = r->fmuid();
-    int messageId = r->message_id();
-
-    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_terminate_slave_req(mid=%d,fmuId=%d)\n",messageId,fmuId);
+fmi2_import_t* Server::getFmi2Import(int fmuId, fmi2_status_t* status) {
+  fmi2_import_t* fmu = NULL;
+  lw_sync_lock(m_instancesLock);
+  map<int, fmi2_import_t*>::iterator it = m_fmi2Instances.find(fmuId);
+  if (it != m_fmi2Instances.end()) {
+    fmu = it->second;
+  }
+  lw_sync_release(m_instancesLock);
 
-    fmi2_status_t status = fmi2_status_ok;
-    if (!m_sendDummyResponses) {
-      // terminate FMU
-      status = fmi2_import_terminate(m_fmi2Instance);
+  if (!fmu) {
+    m_logger.log(Logger::LOG_ERROR, "No FMU instance with fmuId=%d.\n", fmuId);
+    if (status) {
+      *status = fmi2_status_error;
     }
+  }
+  return fmu;
+}
 
-    // Create response message
-    res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_terminate_slave_res);
-    fmitcp_proto::fmi2_import_terminate_slave_res * terminateRes = res.mutable_fmi2_import_terminate_slave_res();
-    terminateRes->set_message_id(messageId);
-    terminateRes->set_status(fmi2StatusToProtofmi2Status(status));
-    m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_terminate_slave_res(mid=%d,status=%d)\n",messageId,terminateRes->status());
-
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_reset_slave_req) {
-
-    // Unpack message
-    fmitcp_proto::fmi2_import_reset_slave_req * r = req.mutable_fmi2_import_reset_slave_req();
-    int fmuId = r->fmuid();
-    int messageId = r->message_id();
+FmuStateStore* Server::getFmuStateStore(int fmuId, fmi2_status_t* status) {
+  FmuStateStore* store = NULL;
+  lw_sync_lock(m_instancesLock);
+  map<int, FmuStateStore>::iterator it = m_fmuStates.find(fmuId);
+  if (it != m_fmuStates.end()) {
+    store = &it->second;
+  }
+  lw_sync_release(m_instancesLock);
 
-    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_reset_slave_req(fmuId=%d)\n",fmuId);
+  if (!store && status) {
+    *status = fmi2_status_error;
+  }
+  return store;
+}
 
-    fmi2_status_t status = fmi2_status_ok;
-    if (!m_sendDummyResponses) {
-      // reset FMU
-      status = fmi2_import_reset(m_fmi2Instance);
+Server::ValueReferenceSets* Server::getValueReferenceSets(int fmuId, bool create) {
+  ValueReferenceSets* sets = NULL;
+  lw_sync_lock(m_instancesLock);
+  if (create) {
+    sets = &m_valueReferenceSets[fmuId];
+  } else {
+    map<int, ValueReferenceSets>::iterator it = m_valueReferenceSets.find(fmuId);
+    if (it != m_valueReferenceSets.end()) {
+      sets = &it->second;
     }
+  }
+  lw_sync_release(m_instancesLock);
+  return sets;
+}
 
-    // Create response message
-    res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_reset_slave_res);
-    fmitcp_proto::fmi2_import_reset_slave_res * resetRes = res.mutable_fmi2_import_reset_slave_res();
-    resetRes->set_message_id(messageId);
-    resetRes->set_status(fmi2StatusToProtofmi2Status(status));
-    m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_reset_slave_res(mid=%d,status=%d)\n",messageId,resetRes->status());
-
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_free_slave_instance_req) {
-
-    // Unpack message
-    fmitcp_proto::fmi2_import_free_slave_instance_req * r = req.mutable_fmi2_import_free_slave_instance_req();
-    int fmuId = r->fmuid(),
-        messageId = r->message_id();
-
-    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_free_slave_instance_req(fmuId=%d)\n",fmuId);
-
-    // Create response message
-    res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_free_slave_instance_res);
-    fmitcp_proto::fmi2_import_free_slave_instance_res * resetRes = res.mutable_fmi2_import_free_slave_instance_res();
-    resetRes->set_message_id(messageId);
-
-    if (!m_sendDummyResponses) {
-      // Interact with FMU
-      fmi2_import_free(m_fmi2Instance);
-      fmi_import_free_context(m_context);
-      fmi_import_rmdir(&m_jmCallbacks, m_workingDir.c_str());
+bool Server::resolveValueReferences(int fmuId, int valueReferenceSet,
+                                    const google::protobuf::RepeatedField<google::protobuf::int32>& valueReferences,
+                                    int numValues, fmi2_value_reference_t* buffer,
+                                    const fmi2_value_reference_t** vr, size_t* nvr, fmi2_status_t* status) {
+  if (valueReferenceSet == 0) {
+    for (int i = 0 ; i < valueReferences.size() ; i++) {
+      buffer[i] = valueReferences.Get(i);
     }
+    *vr = buffer;
+    *nvr = valueReferences.size();
+  } else {
+    // Passed to the FMU as it is, without a copy
+    ValueReferenceSets* sets = getValueReferenceSets(fmuId, false);
+    map<int, vector<fmi2_value_reference_t> >::const_iterator it;
+    if (!sets || (it = sets->sets.find(valueReferenceSet)) == sets->sets.end()) {
+      m_logger.log(Logger::LOG_ERROR, "No value reference set %d for fmuId=%d.\n", valueReferenceSet, fmuId);
+      *vr = buffer;
+      *nvr = 0;
+      *status = fmi2_status_error;
+      return false;
+    }
+    *vr = it->second.empty() ? buffer : &it->second[0];
+    *nvr = it->second.size();
+  }
 
-    m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_free_slave_instance_res(mid=%d)\n",messageId);
-
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_real_input_derivatives_req) {
-
-    // Unpack message
-    fmitcp_proto::fmi2_import_set_real_input_derivatives_req * r = req.mutable_fmi2_import_set_real_input_derivatives_req();
-    int messageId = r->message_id();
-    int fmuId = r->fmuid();
-    fmi2_value_reference_t vr[r->valuereferences_size()];
-    fmi2_integer_t order[r->orders_size()];
-    fmi2_real_t value[r->values_size()];
+  if (numValues >= 0 && (size_t)numValues != *nvr) {
+    m_logger.log(Logger::LOG_ERROR, "Got %d values for %d value references.\n", numValues, (int)*nvr);
+    *nvr = 0;
+    *status = fmi2_status_error;
+    return false;
+  }
+  return true;
+}
 
-    for (int i = 0 ; i < r->valuereferences_size() ; i++) {
-      vr[i] = r->valuereferences(i);
-      order[i] = r->orders(i);
-      value[i] = r->values(i);
+bool Server::selectValueReferences(const google::protobuf::RepeatedField<google::protobuf::int32>& indices, int numValues,
+                                   fmi2_value_reference_t* buffer, const fmi2_value_reference_t** vr, size_t* nvr,
+                                   fmi2_status_t* status) {
+  bool ok = (indices.size() == numValues);
+  for (int i = 0 ; ok && i < indices.size() ; i++) {
+    ok = indices.Get(i) >= 0 && (size_t)indices.Get(i) < *nvr;
+    if (ok) {
+      buffer[i] = (*vr)[indices.Get(i)];
     }
-    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_set_real_input_derivatives_req(mid=%d,fmuId=%d,vrs=%s,orders=%s,values=%s)\n",messageId,fmuId,
-        arrayToString(vr, r->valuereferences_size()).c_str(), arrayToString(order, r->orders_size()).c_str(), arrayToString(value, r->values_size()).c_str());
+  }
+  if (!ok) {
+    m_logger.log(Logger::LOG_ERROR, "Got %d values for %d indices into %d value references.\n", numValues, indices.size(), (int)*nvr);
+    *nvr = 0;
+    *status = fmi2_status_error;
+    return false;
+  }
+  *vr = buffer;
+  *nvr = indices.size();
+  return true;
+}
 
-    fmi2_status_t status = fmi2_status_ok;
-    if (!m_sendDummyResponses) {
-      // interact with FMU
-      status = fmi2_import_set_real_input_derivatives(m_fmi2Instance, vr, r->valuereferences_size(), order, value);
-    }
+Server::SentValues* Server::getSentValues(int fmuId, int valueReferenceSet, bool delta) {
+  if (!delta || valueReferenceSet == 0) {
+    return NULL;
+  }
+  ValueReferenceSets* sets = getValueReferenceSets(fmuId, false);
+  if (!sets || sets->sets.find(valueReferenceSet) == sets->sets.end()) {
+    return NULL;
+  }
+  return &sets->sent[make_pair(getRequestConnection(fmuId), valueReferenceSet)];
+}
 
-    // Create response
-    fmitcp_proto::fmi2_import_set_real_input_derivatives_res * setRealInputDerivativesRes = res.mutable_fmi2_import_set_real_input_derivatives_res();
-    res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_real_input_derivatives_res);
-    setRealInputDerivativesRes->set_message_id(messageId);
-    setRealInputDerivativesRes->set_status(fmi2StatusToProtofmi2Status(status));
-    m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_set_real_input_derivatives_res(mid=%d,status=%d)\n",messageId, setRealInputDerivativesRes->status());
-
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_real_output_derivatives_req) {
-
-    // Unpack message
-    fmitcp_proto::fmi2_import_get_real_output_derivatives_req * r = req.mutable_fmi2_import_get_real_output_derivatives_req();
-    int messageId = r->message_id();
-    int fmuId = r->fmuid();
-    fmi2_value_reference_t vr[r->valuereferences_size()];
-    fmi2_integer_t order[r->orders_size()];
-    fmi2_real_t value[r->valuereferences_size()];
-
-    for (int i = 0 ; i < r->valuereferences_size() ; i++) {
-      vr[i] = r->valuereferences(i);
-      order[i] = r->orders(i);
-    }
-    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_real_output_derivatives_req(mid=%d,fmuId=%d,vrs=%s,orders=%s)\n",messageId,fmuId,
-        arrayToString(vr, r->valuereferences_size()).c_str(), arrayToString(order, r->orders_size()).c_str());
+bool Server::deltaInputsValid(int fmuId, int valueReferenceSet, fmi2_status_t* status) {
+  ValueReferenceSets* sets = getValueReferenceSets(fmuId, false);
+  if (sets && sets->lostInputs.count(make_pair(getRequestConnection(fmuId), valueReferenceSet))) {
+    m_logger.log(Logger::LOG_ERROR, "Changed values for list %d of fmuId=%d after a set failed.\n", valueReferenceSet, fmuId);
+    *status = fmi2_status_error;
+    return false;
+  }
+  return true;
+}
 
-    fmi2_status_t status = fmi2_status_ok;
-    if (!m_sendDummyResponses) {
-      // interact with FMU
-      status = fmi2_import_get_real_output_derivatives(m_fmi2Instance, vr, r->valuereferences_size(), order, value);
+void Server::trackInputs(int fmuId, int valueReferenceSet, bool delta, bool set) {
+  if (!set) {
+    // Only a defined list of a live instance can be sent as a delta later, so nothing is kept for the others
+    ValueReferenceSets* sets = valueReferenceSet != 0 ? getValueReferenceSets(fmuId, false) : NULL;
+    if (sets && sets->sets.count(valueReferenceSet)) {
+      sets->lostInputs.insert(make_pair(getRequestConnection(fmuId), valueReferenceSet));
     }
-
-    // Create response
-    fmitcp_proto::fmi2_import_get_real_output_derivatives_res * getRealOutputDerivativesRes = res.mutable_fmi2_import_get_real_output_derivatives_res();
-    res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_real_output_derivatives_res);
-    getRealOutputDerivativesRes->set_message_id(messageId);
-    getRealOutputDerivativesRes->set_status(fmi2StatusToProtofmi2Status(status));
-    for (int i = 0 ; i < r->valuereferences_size() ; i++) {
-      getRealOutputDerivativesRes->add_values(value[i]);
+  } else if (!delta) {
+    // All values are set again
+    ValueReferenceSets* sets = getValueReferenceSets(fmuId, false);
+    if (sets && !sets->lostInputs.empty()) {
+      sets->lostInputs.erase(make_pair(getRequestConnection(fmuId), valueReferenceSet));
     }
-    m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_get_real_output_derivatives_res(mid=%d,status=%d,values=%s)\n",getRealOutputDerivativesRes->message_id(),getRealOutputDerivativesRes->status(),arrayToString(value, r->valuereferences_size()).c_str());
-
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_cancel_step_req) {
-
-    // Unpack message
-    fmitcp_proto::fmi2_import_cancel_step_req * r = req.mutable_fmi2_import_cancel_step_req();
-    int fmuId = r->fmuid(),
-        messageId = r->message_id();
-
-    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_cancel_step_req(mid=%d,fmuId=%d)\n",messageId,fmuId);
+  }
+}
 
-    fmi2_status_t status = fmi2_status_ok;
-    if (!m_sendDummyResponses) {
-      // Interact with FMU
-      status = fmi2_import_cancel_step(m_fmi2Instance);
-    }
+unsigned int Server::getRequestConnection(int fmuId) {
+  unsigned int connectionId = 0;
+  lw_sync_lock(m_instancesLock);
+  map<int, unsigned int>::const_iterator it = m_requestConnections.find(fmuId);
+  if (it != m_requestConnections.end()) {
+    connectionId = it->second;
+  }
+  lw_sync_release(m_instancesLock);
+  return connectionId;
+}
 
-    // Create response
-    res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_cancel_step_res);
-    fmitcp_proto::fmi2_import_cancel_step_res * cancelStepRes = res.mutable_fmi2_import_cancel_step_res();
-    cancelStepRes->set_message_id(messageId);
-    cancelStepRes->set_status(fmi2StatusToProtofmi2Status(status));
+Server::OutputSubscription* Server::getOutputSubscription(int fmuId) {
+  OutputSubscription* subscription = NULL;
+  lw_sync_lock(m_instancesLock);
+  map<int, OutputSubscription>::iterator it = m_outputSubscriptions.find(fmuId);
+  if (it != m_outputSubscriptions.end()) {
+    subscription = &it->second;
+  }
+  lw_sync_release(m_instancesLock);
+  return subscription;
+}
 
-    m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_cancel_step_res(mid=%d,status=%d)\n",messageId,cancelStepRes->status());
+Integrator* Server::getIntegrator(int fmuId) {
+  Integrator* integrator = NULL;
+  lw_sync_lock(m_instancesLock);
+  map<int, Integrator*>::iterator it = m_integrators.find(fmuId);
+  if (it != m_integrators.end()) {
+    integrator = it->second;
+  }
+  lw_sync_release(m_instancesLock);
+  return integrator;
+}
 
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_do_step_req) {
+fmi2_status_t Server::doStep(int fmuId, fmi2_import_t* fmu, double currentCommunicationPoint, double communicationStepSize, bool newStep) {
+  Integrator* integrator = getIntegrator(fmuId);
+  if (integrator) {
+    return integrator->doStep(currentCommunicationPoint, communicationStepSize);
+  }
+  return fmi2_import_do_step(fmu, currentCommunicationPoint, communicationStepSize, newStep);
+}
 
-    // Unpack message
-    fmitcp_proto::fmi2_import_do_step_req * r = req.mutable_fmi2_import_do_step_req();
-    int fmuId = r->fmuid();
-    double currentCommunicationPoint = r->currentcommunicationpoint(),
-        communicationStepSize = r->communicationstepsize();
-    bool newStep = r->newstep();
-    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_do_step_req(fmuId=%d,commPoint=%g,stepSize=%g,newStep=%d)\n",fmuId,currentCommunicationPoint,communicationStepSize,newStep?1:0);
+bool Server::getCapability(fmi2_import_t* fmu, fmi2_capabilities_enu_t csCapability, fmi2_capabilities_enu_t meCapability) {
+  return fmi2_import_get_capability(fmu, m_modelExchange ? meCapability : csCapability) != 0;
+}
 
-    fmi2_status_t status = fmi2_status_ok;
-    if (!m_sendDummyResponses) {
-      // Step the FMU
-      status = fmi2_import_do_step(m_fmi2Instance, currentCommunicationPoint, communicationStepSize, newStep);
+fmi2_status_t Server::directionalJacobian(fmi2_import_t* fmu, const JacobianPattern& pattern,
+                                          const fmi2_value_reference_t* unknowns, const fmi2_value_reference_t* knowns,
+                                          fmi2_real_t* jacobian, int* numSeeds) {
+  int nz = pattern.getNumRows(), nv = pattern.getNumColumns();
+  *numSeeds = 0;
+  if (nz == 0 || nv == 0) {
+    return fmi2_status_ok;
+  }
+  vector<fmi2_real_t> dv(nv, 0.0), dz(nz, 0.0);
+  fmi2_status_t status = fmi2_status_ok;
+  for (int g = 0 ; g < pattern.getNumGroups() && fmi2StatusOkOrWarning(status) ; g++) {
+    // The columns of a group have no row in common, so each row of dz belongs to at most one of them
+    const vector<int>& group = pattern.getGroup(g);
+    for (size_t k = 0 ; k < group.size() ; k++) {
+      dv[group[k]] = 1.0;
     }
+    status = fmi2_import_get_directional_derivative(fmu, knowns, nv, unknowns, nz, &dv[0], &dz[0]);
+    (*numSeeds)++;
+    for (size_t k = 0 ; k < group.size() ; k++) {
+      int j = group[k];
+      const vector<int>& rows = pattern.getColumn(j);
+      for (size_t r = 0 ; r < rows.size() ; r++) {
+        jacobian[rows[r] * nv + j] = dz[rows[r]];
+      }
+      dv[j] = 0.0;
+    }
+  }
+  return status;
+}
 
-    // Create response
-    fmitcp_proto::fmi2_import_do_step_res * doStepRes = res.mutable_fmi2_import_do_step_res();
-    res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_do_step_res);
-    doStepRes->set_message_id(r->message_id());
-    doStepRes->set_status(fmi2StatusToProtofmi2Status(status));
-    m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_do_step_res(status=%d)\n",doStepRes->status());
-
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_status_req) {
-
-    // Unpack message
-    fmitcp_proto::fmi2_import_get_status_req * r = req.mutable_fmi2_import_get_status_req();
-    int fmuId = r->fmuid();
-    fmitcp_proto::fmi2_status_kind_t statusKind = r->status();
-    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_status_req(fmuId=%d,status=%d)\n",fmuId, statusKind);
+fmi2_status_t Server::evaluateUnknowns(int fmuId, fmi2_import_t* fmu, const fmi2_value_reference_t* unknowns, size_t nz,
+                                       double currentTime, double stepSize, fmi2_real_t* values) {
+  fmi2_status_t status = fmi2_status_ok;
+  if (stepSize > 0) {
+    status = doStep(fmuId, fmu, currentTime, stepSize, true);
+  }
+  if (fmi2StatusOkOrWarning(status)) {
+    status = fmi2_import_get_real(fmu, unknowns, nz, values);
+  }
+  return status;
+}
 
+class Server::InstanceFunction : public JacobianPattern::Function {
+public:
+  Server* server;
+  int fmuId;
+  fmi2_import_t* fmu;
+  const fmi2_value_reference_t* unknowns;
+  const fmi2_value_reference_t* knowns;
+  size_t nz;
+  double currentTime;
+  double stepSize;
+
+  /// Where each evaluation starts from
+  fmi2_FMU_state_t state;
+  Integrator* integrator;
+  Integrator::Snapshot snapshot;
+
+  fmi2_status_t evaluate(const vector<int>& columns, const vector<double>& values, double* z) {
     fmi2_status_t status = fmi2_status_ok;
-    if (!m_sendDummyResponses) {
-      // get the FMU status
-      fmi2_import_get_status(m_fmi2Instance, protoStatusKindToFmiStatusKind(statusKind), &status);
+    if (!columns.empty()) {
+      vector<fmi2_value_reference_t> vr(columns.size());
+      for (size_t k = 0 ; k < columns.size() ; k++) {
+        vr[k] = knowns[columns[k]];
+      }
+      status = fmi2_import_set_real(fmu, &vr[0], vr.size(), &values[0]);
     }
-
-    // Create response
-    fmitcp_proto::fmi2_import_get_status_res * getStatusRes = res.mutable_fmi2_import_get_status_res();
-    res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_status_res);
-    getStatusRes->set_message_id(r->message_id());
-    getStatusRes->set_value(fmi2StatusToProtofmi2Status(status));
-    m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_get_status_res(value=%d)\n",getStatusRes->value());
-
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_real_status_req) {
-
-    // Unpack message
-    fmitcp_proto::fmi2_import_get_real_status_req * r = req.mutable_fmi2_import_get_real_status_req();
-    int fmuId = r->fmuid();
-    fmitcp_proto::fmi2_status_kind_t statusKind = r->kind();
-    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_real_status_req(fmuId=%d,status=%d)\n",fmuId, statusKind);
-
-    fmi2_real_t value = 0.0;
-    if (!m_sendDummyResponses) {
-      // get the FMU real status
-      fmi2_import_get_real_status(m_fmi2Instance, protoStatusKindToFmiStatusKind(statusKind), &value);
+    if (server->fmi2StatusOkOrWarning(status)) {
+      status = server->evaluateUnknowns(fmuId, fmu, unknowns, nz, currentTime, stepSize, z);
     }
-
-    // Create response
-    fmitcp_proto::fmi2_import_get_real_status_res * getRealStatusRes = res.mutable_fmi2_import_get_real_status_res();
-    res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_real_status_res);
-    getRealStatusRes->set_message_id(r->message_id());
-    getRealStatusRes->set_value(value);
-    m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_get_real_status_res(value=%g)\n",getRealStatusRes->value());
-
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_integer_status_req) {
-
-    // Unpack message
-    fmitcp_proto::fmi2_import_get_integer_status_req * r = req.mutable_fmi2_import_get_integer_status_req();
-    int fmuId = r->fmuid();
-    fmitcp_proto::fmi2_status_kind_t statusKind = r->kind();
-    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_integer_status_req(fmuId=%d,status=%d)\n",fmuId, statusKind);
-
-    fmi2_integer_t value = 0;
-    if (!m_sendDummyResponses) {
-      // get the FMU integer status
-      fmi2_import_get_integer_status(m_fmi2Instance, protoStatusKindToFmiStatusKind(statusKind), &value);
+    // Without a step or a perturbation, nothing changed
+    if (columns.empty() && stepSize <= 0) {
+      return status;
     }
-
-    // Create response
-    fmitcp_proto::fmi2_import_get_integer_status_res * getIntegerStatusRes = res.mutable_fmi2_import_get_integer_status_res();
-    res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_integer_status_res);
-    getIntegerStatusRes->set_message_id(r->message_id());
-    getIntegerStatusRes->set_value(value);
-    m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_get_integer_status_res(value=%d)\n",getIntegerStatusRes->value());
-
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_boolean_status_req) {
-
-    // Unpack message
-    fmitcp_proto::fmi2_import_get_boolean_status_req * r = req.mutable_fmi2_import_get_boolean_status_req();
-    int fmuId = r->fmuid();
-    fmitcp_proto::fmi2_status_kind_t statusKind = r->kind();
-    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_boolean_status_req(mid=%d,fmuId=%d,status=%d)\n",r->message_id(), fmuId, statusKind);
-
-    fmi2_boolean_t value = 0;
-    if (!m_sendDummyResponses) {
-      // get the FMU boolean status
-      fmi2_import_get_boolean_status(m_fmi2Instance, protoStatusKindToFmiStatusKind(statusKind), &value);
+    // Stepping changes the integrator too, it goes back along with the FMU
+    fmi2_status_t restored = fmi2_import_set_fmu_state(fmu, state);
+    if (integrator) {
+      integrator->restore(snapshot);
     }
+    return server->fmi2StatusOkOrWarning(status) ? restored : status;
+  }
+};
+
+fmi2_status_t Server::finiteDifferenceJacobian(int fmuId, fmi2_import_t* fmu, const JacobianPattern& pattern,
+                                               const fmi2_value_reference_t* unknowns, const fmi2_value_reference_t* knowns,
+                                               double currentTime, double stepSize, double perturbation,
+                                               fmi2_real_t* jacobian, int* numSeeds) {
+  int nz = pattern.getNumRows(), nv = pattern.getNumColumns();
+  *numSeeds = 0;
+  if (nz == 0 || nv == 0) {
+    return fmi2_status_ok;
+  }
+  InstanceFunction function;
+  function.server = this;
+  function.fmuId = fmuId;
+  function.fmu = fmu;
+  function.unknowns = unknowns;
+  function.knowns = knowns;
+  function.nz = nz;
+  function.currentTime = currentTime;
+  function.stepSize = stepSize;
+  function.state = NULL;
+  fmi2_status_t status = fmi2_import_get_fmu_state(fmu, &function.state);
+  if (!fmi2StatusOkOrWarning(status)) {
+    return status;
+  }
+  function.integrator = getIntegrator(fmuId);
+  if (function.integrator) {
+    function.integrator->save(function.snapshot);
+  }
 
-    // Create response
-    fmitcp_proto::fmi2_import_get_boolean_status_res * getBooleanStatusRes = res.mutable_fmi2_import_get_boolean_status_res();
-    res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_boolean_status_res);
-    getBooleanStatusRes->set_message_id(r->message_id());
-    getBooleanStatusRes->set_value(value);
-    m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_get_boolean_status_res(mid=%d,value=%d)\n",getBooleanStatusRes->message_id(),getBooleanStatusRes->value());
-
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_string_status_req) {
-
-    // Unpack message
-    fmitcp_proto::fmi2_import_get_string_status_req * r = req.mutable_fmi2_import_get_string_status_req();
-    int fmuId = r->fmuid();
-    fmitcp_proto::fmi2_status_kind_t statusKind = r->kind();
-    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_string_status_req(mid=%d,fmuId=%d,status=%d)\n",r->message_id(), fmuId, statusKind);
-
-    fmi2_string_t value = "";
-    if (!m_sendDummyResponses) {
-      // TODO: Step the FMU
-      fmi2_import_get_string_status(m_fmi2Instance, protoStatusKindToFmiStatusKind(statusKind), &value);
-    }
+  vector<fmi2_real_t> x(nv);
+  status = fmi2_import_get_real(fmu, knowns, nv, &x[0]);
+  if (fmi2StatusOkOrWarning(status)) {
+    status = pattern.finiteDifferences(function, &x[0], perturbation, jacobian, numSeeds);
+  }
+  fmi2_import_free_fmu_state(fmu, &function.state);
+  return status;
+}
 
-    // Create response
-    fmitcp_proto::fmi2_import_get_string_status_res * getStringStatusRes = res.mutable_fmi2_import_get_string_status_res();
-    res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_string_status_res);
-    getStringStatusRes->set_message_id(r->message_id());
-    getStringStatusRes->set_value(value);
-    m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_get_string_status_res(mid=%d,value=%s)\n",getStringStatusRes->message_id(),getStringStatusRes->value().c_str());
-
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_instantiate_model_req){
-    // TODO
-    sendResponse = false;
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_free_model_instance_req){
-    // TODO
-    sendResponse = false;
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_time_req){
-    // TODO
-    sendResponse = false;
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_continuous_states_req){
-    // TODO
-    sendResponse = false;
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_completed_integrator_step_req){
-    // TODO
-    sendResponse = false;
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_initialize_model_req){
-    // TODO
-    sendResponse = false;
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_derivatives_req){
-    // TODO
-    sendResponse = false;
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_event_indicators_req){
-    // TODO
-    sendResponse = false;
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_eventUpdate_req){
-    // TODO
-    sendResponse = false;
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_completed_event_iteration_req){
-    // TODO
-    sendResponse = false;
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_continuous_states_req){
-    // TODO
-    sendResponse = false;
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_nominal_continuous_states_req){
-    // TODO
-    sendResponse = false;
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_terminate_req){
-    // TODO
-    sendResponse = false;
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_version_req) {
-
-    // Unpack message
-    fmitcp_proto::fmi2_import_get_version_req * r = req.mutable_fmi2_import_get_version_req();
-    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_version_req(mid=%d,fmuId=%d)\n",r->message_id(),r->fmuid());
-
-    const char* version = "VeRsIoN";
-    if (!m_sendDummyResponses) {
-      // get FMU version
-      version = fmi2_import_get_version(m_fmi2Instance);
-    }
+void Server::getSubscribedOutputs(fmi2_import_t* fmu, OutputSubscription& subscription, unsigned int connection,
+                                  fmitcp_proto::fmi2_import_do_step_res* res, fmi2_status_t* status) {
+  size_t nReal = subscription.realValueReferences.size(),
+      nInteger = subscription.integerValueReferences.size(),
+      nBoolean = subscription.booleanValueReferences.size(),
+      nString = subscription.stringValueReferences.size();
 
-    // Create response
-    fmitcp_proto::fmi2_import_get_version_res * getVersionRes = res.mutable_fmi2_import_get_version_res();
-    res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_version_res);
-    getVersionRes->set_message_id(r->message_id());
-    getVersionRes->set_version(version);
-    m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_get_version_res(mid=%d,version=%s)\n",getVersionRes->message_id(),getVersionRes->version().c_str());
+  fmi2_real_t realValue[nReal];
+  for (size_t i = 0 ; i < nReal ; i++) {
+    realValue[i] = 0.0;
+  }
+  fmi2_integer_t integerValue[nInteger];
+  for (size_t i = 0 ; i < nInteger ; i++) {
+    integerValue[i] = 0;
+  }
+  fmi2_boolean_t booleanValue[nBoolean];
+  for (size_t i = 0 ; i < nBoolean ; i++) {
+    booleanValue[i] = fmi2_false;
+  }
+  fmi2_string_t stringValue[nString];
+  for (size_t i = 0 ; i < nString ; i++) {
+    stringValue[i] = "";
+  }
 
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_debug_logging_req) {
+  if (fmu) {
+    // Empty lists are skipped, the other lists are passed to the FMU as they are
+    if (!((nReal == 0 || fmi2StatusOkOrWarning(*status = fmi2_import_get_real(fmu, &subscription.realValueReferences[0], nReal, realValue))) &&
+          (nInteger == 0 || fmi2StatusOkOrWarning(*status = fmi2_import_get_integer(fmu, &subscription.integerValueReferences[0], nInteger, integerValue))) &&
+          (nBoolean == 0 || fmi2StatusOkOrWarning(*status = fmi2_import_get_boolean(fmu, &subscription.booleanValueReferences[0], nBoolean, booleanValue))) &&
+          (nString == 0 || fmi2StatusOkOrWarning(*status = fmi2_import_get_string(fmu, &subscription.stringValueReferences[0], nString, stringValue))))) {
+      return;
+    }
+  }
 
-    // Unpack message
-    fmitcp_proto::fmi2_import_set_debug_logging_req * r = req.mutable_fmi2_import_set_debug_logging_req();
-    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_set_debug_logging_req(mid=%d,fmuId=%d,loggingOn=%d,categories=...)\n",r->message_id(),r->fmuid(),r->loggingon());
+  // Only the changes, once the client has all values
+  SentValues* sent = subscription.delta ? &subscription.sent[connection] : NULL;
+  bool delta = sent && sent->reals.size() == nReal && sent->integers.size() == nInteger &&
+      sent->booleans.size() == nBoolean && sent->strings.size() == nString;
+  if (delta) {
+    res->set_delta(true);
+  }
+  addValues(realValue, nReal, !delta, subscription.realThreshold, sent ? &sent->reals : NULL, res->mutable_realindices(), res->mutable_realvalues());
+  addValues(integerValue, nInteger, !delta, 0, sent ? &sent->integers : NULL, res->mutable_integerindices(), res->mutable_integervalues());
+  addValues(booleanValue, nBoolean, !delta, 0, sent ? &sent->booleans : NULL, res->mutable_booleanindices(), res->mutable_booleanvalues());
+  addValues(stringValue, nString, !delta, 0, sent ? &sent->strings : NULL, res->mutable_stringindices(), res->mutable_stringvalues());
+}
 
-    fmi2_status_t status = fmi2_status_ok;
-    if (!m_sendDummyResponses) {
-      // set the debug logging for FMU
-      // fetch the logging categories from the FMU
-      size_t nCategories = fmi2_import_get_log_categories_num(m_fmi2Instance);
-      fmi2_string_t categories[nCategories];
-      int i;
-      for (i = 0 ; i < nCategories ; i++) {
-        categories[i] = fmi2_import_get_log_category(m_fmi2Instance, i);
-      }
-      // set debug logging. We don't care about its result.
-      status = fmi2_import_set_debug_logging(m_fmi2Instance, m_debugLogging, nCategories, categories);
+jm_status_enu_t Server::instantiateFmi2(int* fmuId) {
+  fmi2_import_t* fmu = NULL;
+  jm_status_enu_t status = jm_status_success;
+  lw_sync_lock(m_instancesLock);
+  if (!m_instancePool.empty()) {
+    // Reset when it was freed, so it is like a new instance
+    fmu = m_instancePool.back();
+    m_instancePool.pop_back();
+  }
+  lw_sync_release(m_instancesLock);
+  if (!fmu) {
+    status = newFmi2Instance(&fmu);
+    if (status == jm_status_error) {
+      return status;
     }
+  }
+  Integrator* integrator = m_modelExchange ? new Integrator(fmu, m_integratorMethod, m_integratorTolerance) : NULL;
+
+  lw_sync_lock(m_instancesLock);
+  *fmuId = m_nextFmuId++;
+  m_fmi2Instances[*fmuId] = fmu;
+  m_fmuStates[*fmuId].setCapacity(m_maxFmuStates);
+  if (integrator) {
+    m_integrators[*fmuId] = integrator;
+  }
+  lw_sync_release(m_instancesLock);
+  return status;
+}
 
-    // Create response
-    fmitcp_proto::fmi2_import_set_debug_logging_res * getStatusRes = res.mutable_fmi2_import_set_debug_logging_res();
-    res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_debug_logging_res);
-    getStatusRes->set_message_id(r->message_id());
-    getStatusRes->set_status(fmi2StatusToProtofmi2Status(status));
-    m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_set_debug_logging_res(mid=%d,status=%d)\n",getStatusRes->message_id(),getStatusRes->status());
-
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_real_req) {
-
-    // Unpack message
-    fmitcp_proto::fmi2_import_set_real_req * r = req.mutable_fmi2_import_set_real_req();
-    int messageId = r->message_id();
-    int fmuId = r->fmuid();
-    fmi2_value_reference_t vr[r->valuereferences_size()];
-    fmi2_real_t value[r->values_size()];
-
-    for (int i = 0 ; i < r->valuereferences_size() ; i++) {
-      vr[i] = r->valuereferences(i);
-      value[i] = r->values(i);
-    }
+jm_status_enu_t Server::newFmi2Instance(fmi2_import_t** instance) {
+  if (!m_fmi2Model) {
+    m_logger.log(Logger::LOG_ERROR, "No FMU loaded.\n");
+    return jm_status_error;
+  }
 
-    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_set_real_req(mid=%d,fmuId=%d,vrs=%s,values=%s)\n",r->message_id(),r->fmuid(),
-        arrayToString(vr, r->valuereferences_size()).c_str(), arrayToString(value, r->values_size()).c_str());
+  // The first instance lives in the model parsed by init(). Take it while holding the lock, so that no other
+  // instance is made in it meanwhile. An FMU that can only be instantiated once never has any other instance.
+  bool once = getCapability(m_fmi2Model, fmi2_cs_canBeInstantiatedOnlyOncePerProcess, fmi2_me_canBeInstantiatedOnlyOncePerProcess);
+  lw_sync_lock(m_instancesLock);
+  bool inUse = m_fmi2ModelInUse;
+  if (!inUse) {
+    m_fmi2ModelInUse = true;
+  }
+  lw_sync_release(m_instancesLock);
+  if (once && inUse) {
+    m_logger.log(Logger::LOG_ERROR, "The FMU can only be instantiated once per process.\n");
+    return jm_status_error;
+  }
 
-    fmi2_status_t status = fmi2_status_ok;
-    if (!m_sendDummyResponses) {
-      // interact with FMU
-       status = fmi2_import_set_real(m_fmi2Instance, vr, r->valuereferences_size(), value);
+  fmi2_import_t* fmu;
+  if (!inUse) {
+    fmu = m_fmi2Model;
+  } else {
+    // FMILibrary keeps one component per import, so every further instance needs its own. It is parsed from the
+    // already unpacked FMU, and loading the binary again only bumps the reference count of the shared library.
+    lw_sync_lock(m_contextLock);
+    fmu = fmi2_import_parse_xml(m_context, m_workingDir.c_str(), 0);
+    if (fmu && fmi2_import_create_dllfmu(fmu, m_fmuKind, &m_fmi2CallbackFunctions) == jm_status_error) {
+      fmi2_import_free(fmu);
+      lw_sync_release(m_contextLock);
+      m_logger.log(Logger::LOG_ERROR, "There was an error loading the FMU binary.\n");
+      return jm_status_error;
     }
-
-    // Create response
-    fmitcp_proto::fmi2_import_set_real_res * setRealRes = res.mutable_fmi2_import_set_real_res();
-    res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_real_res);
-    setRealRes->set_message_id(r->message_id());
-    setRealRes->set_status(fmi2StatusToProtofmi2Status(status));
-    m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_set_real_res(mid=%d,status=%d)\n",setRealRes->message_id(),setRealRes->status());
-
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_integer_req) {
-
-    // Unpack message
-    fmitcp_proto::fmi2_import_set_integer_req * r = req.mutable_fmi2_import_set_integer_req();
-    int messageId = r->message_id();
-    int fmuId = r->fmuid();
-    fmi2_value_reference_t vr[r->valuereferences_size()];
-    fmi2_integer_t value[r->values_size()];
-
-    for (int i = 0 ; i < r->valuereferences_size() ; i++) {
-      vr[i] = r->valuereferences(i);
-      value[i] = r->values(i);
+    lw_sync_release(m_contextLock);
+    if (!fmu) {
+      m_logger.log(Logger::LOG_ERROR, "Error parsing the modelDescription.xml file contained in %s\n", m_workingDir.c_str());
+      return jm_status_error;
     }
-    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_set_integer_req(mid=%d,fmuId=%d,vrs=%s,values=%s)\n",r->message_id(),r->fmuid(),
-        arrayToString(vr, r->valuereferences_size()).c_str(), arrayToString(value, r->values_size()).c_str());
+  }
 
-    fmi2_status_t status = fmi2_status_ok;
-    if (!m_sendDummyResponses) {
-      // interact with FMU
-      status = fmi2_import_set_integer(m_fmi2Instance, vr, r->valuereferences_size(), value);
+  fmi2_boolean_t visible = fmi2_false;
+  jm_status_enu_t status = fmi2_import_instantiate(fmu, m_instanceName, m_modelExchange ? fmi2_model_exchange : fmi2_cosimulation,
+                                                   m_resourcePath, visible);
+  if (status == jm_status_error) {
+    if (fmu == m_fmi2Model) {
+      lw_sync_lock(m_instancesLock);
+      m_fmi2ModelInUse = false;
+      lw_sync_release(m_instancesLock);
+    } else {
+      lw_sync_lock(m_contextLock);
+      fmi2_import_destroy_dllfmu(fmu);
+      fmi2_import_free(fmu);
+      lw_sync_release(m_contextLock);
     }
+    return status;
+  }
 
-    // Create response
-    fmitcp_proto::fmi2_import_set_integer_res * setIntegerRes = res.mutable_fmi2_import_set_integer_res();
-    res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_integer_res);
-    setIntegerRes->set_message_id(r->message_id());
-    setIntegerRes->set_status(fmi2StatusToProtofmi2Status(status));
-    m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_set_integer_res(mid=%d,status=%d)\n",setIntegerRes->message_id(),setIntegerRes->status());
-
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_boolean_req) {
-
-    // Unpack message
-    fmitcp_proto::fmi2_import_set_boolean_req * r = req.mutable_fmi2_import_set_boolean_req();
-    int messageId = r->message_id();
-    int fmuId = r->fmuid();
-    fmi2_value_reference_t vr[r->valuereferences_size()];
-    fmi2_boolean_t value[r->values_size()];
-
-    for (int i = 0 ; i < r->valuereferences_size() ; i++) {
-      vr[i] = r->valuereferences(i);
-      value[i] = r->values(i);
-    }
-    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_set_boolean_req(mid=%d,fmuId=%d,vrs=%s,values=%s)\n",r->message_id(),r->fmuid(),
-        arrayToString(vr, r->valuereferences_size()).c_str(), arrayToString(value, r->values_size()).c_str());
+  *instance = fmu;
+  return status;
+}
 
-    fmi2_status_t status = fmi2_status_ok;
-    if (!m_sendDummyResponses) {
-      // interact with FMU
-      status = fmi2_import_set_boolean(m_fmi2Instance, vr, r->valuereferences_size(), value);
-    }
+void Server::freeFmi2Instance(int fmuId) {
+  // Take the instance out of the tables. No other request runs on it meanwhile, since this one is in its queue.
+  vector<fmi2_FMU_state_t> states;
+  Integrator* integrator = NULL;
+  lw_sync_lock(m_instancesLock);
+  map<int, fmi2_import_t*>::iterator it = m_fmi2Instances.find(fmuId);
+  if (it == m_fmi2Instances.end()) {
+    lw_sync_release(m_instancesLock);
+    m_logger.log(Logger::LOG_ERROR, "No FMU instance with fmuId=%d.\n", fmuId);
+    return;
+  }
+  fmi2_import_t* fmu = it->second;
+  m_fmi2Instances.erase(it);
+  m_fmuStates[fmuId].removeAll(states);
+  m_fmuStates.erase(fmuId);
+  m_valueReferenceSets.erase(fmuId);
+  m_outputSubscriptions.erase(fmuId);
+  m_requestConnections.erase(fmuId);
+  m_instanceOwners.erase(fmuId);
+  map<int, Integrator*>::iterator integratorIt = m_integrators.find(fmuId);
+  if (integratorIt != m_integrators.end()) {
+    integrator = integratorIt->second;
+    m_integrators.erase(integratorIt);
+  }
+  bool room = m_instancePool.size() < m_instancePoolSize;
+  lw_sync_release(m_instancesLock);
 
-    // Create response
-    fmitcp_proto::fmi2_import_set_boolean_res * setBooleanRes = res.mutable_fmi2_import_set_boolean_res();
-    res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_boolean_res);
-    setBooleanRes->set_message_id(r->message_id());
-    setBooleanRes->set_status(fmi2StatusToProtofmi2Status(status));
-    m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_set_boolean_res(mid=%d,status=%d)\n",setBooleanRes->message_id(),setBooleanRes->status());
-
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_string_req) {
-
-    // Unpack message
-    fmitcp_proto::fmi2_import_set_string_req * r = req.mutable_fmi2_import_set_string_req();
-    int messageId = r->message_id();
-    int fmuId = r->fmuid();
-    fmi2_value_reference_t vr[r->valuereferences_size()];
-    fmi2_string_t value[r->values_size()];
-
-    for (int i = 0 ; i < r->valuereferences_size() ; i++) {
-      vr[i] = r->valuereferences(i);
-      value[i] = r->values(i).c_str();
+  // Free the saved states while the instance is still there
+  for (size_t i = 0; i < states.size(); i++) {
+    fmi2_import_free_fmu_state(fmu, &states[i]);
+  }
+  delete integrator;
+
+  // Keep it for the next instantiate if there is room and it resets
+  bool pooled = false;
+  if (room && fmi2_import_reset(fmu) == fmi2_status_ok) {
+    lw_sync_lock(m_instancesLock);
+    pooled = m_instancePool.size() < m_instancePoolSize;
+    if (pooled) {
+      m_instancePool.push_back(fmu);
     }
-    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_set_string_req(mid=%d,fmuId=%d,vrs=%s,values=%s)\n",r->message_id(),r->fmuid(),
-        arrayToString(vr, r->valuereferences_size()).c_str(), arrayToString(value, r->values_size()).c_str());
+    lw_sync_release(m_instancesLock);
+  }
+  if (!pooled) {
+    deleteFmi2Instance(fmu);
+  }
+}
 
-    fmi2_status_t status = fmi2_status_ok;
-    if (!m_sendDummyResponses) {
-      // interact with FMU
-      status = fmi2_import_set_string(m_fmi2Instance, vr, r->valuereferences_size(), value);
-    }
+void Server::deleteFmi2Instance(fmi2_import_t* fmu) {
+  fmi2_import_free_instance(fmu);
+  if (fmu == m_fmi2Model) {
+    // Keep the model, it is shared with the other instances
+    lw_sync_lock(m_instancesLock);
+    m_fmi2ModelInUse = false;
+    lw_sync_release(m_instancesLock);
+  } else {
+    lw_sync_lock(m_contextLock);
+    fmi2_import_destroy_dllfmu(fmu);
+    fmi2_import_free(fmu);
+    lw_sync_release(m_contextLock);
+  }
+}
 
-    // Create response
-    fmitcp_proto::fmi2_import_set_string_res * getStatusRes = res.mutable_fmi2_import_set_string_res();
-    res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_string_res);
-    getStatusRes->set_message_id(r->message_id());
-    getStatusRes->set_status(fmi2StatusToProtofmi2Status(status));
-    m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_set_string_res(mid=%d,status=%d)\n",getStatusRes->message_id(),getStatusRes->status());
+void Server::clientConnected(lw_client c) {
+  TcpTransport * transport = new TcpTransport(c);
+  m_tcpTransports[c] = transport;
+  addConnection(transport);
+}
 
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_real_req) {
+void Server::addConnection(Transport * transport) {
+  m_logger.log(Logger::LOG_NETWORK,"+ Client connected.\n");
+  transport->setListener(this);
+  openConnection(transport);
+  sendHello(transport);
+  onClientConnect();
+}
 
-    // Unpack message
-    fmitcp_proto::fmi2_import_get_real_req * r = req.mutable_fmi2_import_get_real_req();
-    int messageId = r->message_id();
-    int fmuId = r->fmuid();
-    fmi2_value_reference_t vr[r->valuereferences_size()];
-    fmi2_real_t value[r->valuereferences_size()];
+void Server::sendHello(Transport * transport) {
+  m_response.Clear();
+  m_response.set_type(fmitcp_proto::fmitcp_message_Type_type_server_hello);
+  fmitcp_proto::server_hello * hello = m_response.mutable_server_hello();
+  hello->set_message_id(0);
+  hello->set_protocolversion(FMITCP_PROTOCOL_VERSION);
+  Connection& connection = m_connections[transport];
+  hello->set_maxframesize(connection.decoder.getMaxFrameSize());
+  hello->add_capabilities(fmitcp_proto::capability_pipelining);
+  hello->add_capabilities(fmitcp_proto::capability_value_reference_sets);
+  hello->add_capabilities(fmitcp_proto::capability_output_subscriptions);
+  hello->add_capabilities(fmitcp_proto::capability_delta_encoding);
+
+  // A Jacobian needs directional derivatives, or FMU states to restore between finite differences
+  if (m_sendDummyResponses || (m_fmi2Model &&
+      (getCapability(m_fmi2Model, fmi2_cs_providesDirectionalDerivatives, fmi2_me_providesDirectionalDerivatives) ||
+       getCapability(m_fmi2Model, fmi2_cs_canGetAndSetFMUstate, fmi2_me_canGetAndSetFMUstate)))) {
+    hello->add_capabilities(fmitcp_proto::capability_jacobian);
+  }
+  if (!m_sendDummyResponses && !m_xmlHash.empty()) {
+    hello->add_capabilities(fmitcp_proto::capability_xml_cache);
+    hello->set_xmlhash(m_xmlHash);
+  }
+  if (m_sharedMemory && ShmTransport::isSupported()) {
+    hello->add_capabilities(fmitcp_proto::capability_shared_memory);
+  }
+  hello->set_numworkers(m_workers.getNumThreads());
+  connection.offered = 0;
+  for (int i = 0 ; i < hello->capabilities_size() ; i++) {
+    connection.offered |= capabilityBit(hello->capabilities(i));
+  }
 
-    for (int i = 0 ; i < r->valuereferences_size() ; i++) {
-      vr[i] = r->valuereferences(i);
-    }
-    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_real_req(mid=%d,fmuId=%d,vrs=%s)\n",r->message_id(),r->fmuid(),arrayToString(vr, r->valuereferences_size()).c_str());
+  lw_sync_lock(m_instancesLock);
+  hello->set_numinstances(m_fmi2Instances.size());
+  lw_sync_release(m_instancesLock);
+  bool once = m_fmi2Model && getCapability(m_fmi2Model, fmi2_cs_canBeInstantiatedOnlyOncePerProcess, fmi2_me_canBeInstantiatedOnlyOncePerProcess);
+  hello->set_maxinstances(once ? 1 : 0);
 
-    // Create response
-    fmitcp_proto::fmi2_import_get_real_res * getRealRes = res.mutable_fmi2_import_get_real_res();
-    res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_real_res);
-    getRealRes->set_message_id(r->message_id());
+  m_logger.log(Logger::LOG_NETWORK,"> server_hello(version=%d,workers=%d,instances=%d)\n",hello->protocolversion(),hello->numworkers(),hello->numinstances());
+  sendMessage(transport, &m_response);
+}
 
-    fmi2_status_t status = fmi2_status_ok;
-    if (!m_sendDummyResponses) {
-        // interact with FMU
-        status = fmi2_import_get_real(m_fmi2Instance, vr, r->valuereferences_size(), value);
-        getRealRes->set_status(fmi2StatusToProtofmi2Status(status));
-        for (int i = 0 ; i < r->valuereferences_size() ; i++) {
-          getRealRes->add_values(value[i]);
-        }
-    } else {
-        // Set dummy values
-        for (int i = 0 ; i < r->valuereferences_size() ; i++) {
-            getRealRes->add_values(0.0);
-        }
-        getRealRes->set_status(fmi2StatusToProtofmi2Status(fmi2_status_ok));
-    }
+void Server::clientDisconnected(lw_client c) {
+  map<lw_client, TcpTransport*>::iterator it = m_tcpTransports.find(c);
+  if (it == m_tcpTransports.end()) {
+    return;
+  }
+  TcpTransport * transport = it->second;
+  m_tcpTransports.erase(it);
+  transport->onDisconnect();
+  /*
+  lw_stream_close(c,true);
+  lw_stream_delete(c);
+  fflush(NULL);
+  */
 
-    m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_get_real_res(mid=%d,status=%d,values=%s)\n",getRealRes->message_id(),getRealRes->status(),arrayToString(value, r->valuereferences_size()).c_str());
+ /*
+  lw_server_delete(m_server);
+  lw_pump_remove_user(m_pump->getPump());
+  init(m_pump);
+  */
+}
+
+void Server::clientData(lw_client c, const char *data, size_t size) {
+  map<lw_client, TcpTransport*>::iterator it = m_tcpTransports.find(c);
+  if (it != m_tcpTransports.end()) {
+    it->second->onData(data, size);
+  }
+}
 
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_integer_req) {
+Server::Connection& Server::openConnection(Transport * transport) {
+  Connection& connection = m_connections[transport];
+  connection.id = m_nextConnectionId++;
+  connection.decoder.reset();
+  connection.shm = NULL;
+  connection.control = NULL;
+  connection.protocolVersion = 0;
+  connection.offered = 0;
+  connection.capabilities = 0;
+  return connection;
+}
+
+void Server::transportData(Transport * transport, const char *data, size_t size) {
+  map<Transport*, Connection>::iterator it = m_connections.find(transport);
+  if (it == m_connections.end()) {
+    return;
+  }
+  FrameDecoder & decoder = it->second.decoder;
+  decoder.feed(data, size);
+
+  // One chunk may hold any number of messages, and the last one may be incomplete
+  const char * frame;
+  size_t frameSize;
+  while (decoder.next(&frame, &frameSize)) {
+    clientMessage(transport, frame, frameSize);
+  }
 
-    // Unpack message
-    fmitcp_proto::fmi2_import_get_integer_req * r = req.mutable_fmi2_import_get_integer_req();
-    int messageId = r->message_id();
-    int fmuId = r->fmuid();
-    fmi2_value_reference_t vr[r->valuereferences_size()];
-    fmi2_integer_t value[r->valuereferences_size()];
+  if (decoder.hasError()) {
+    m_logger.log(Logger::LOG_ERROR,"Invalid frame from client, closing the connection.\n");
+    decoder.reset();
+    transport->close();
+  }
+}
 
-    for (int i = 0 ; i < r->valuereferences_size() ; i++) {
-      vr[i] = r->valuereferences(i);
+void Server::transportClosed(Transport * transport) {
+  map<Transport*, Connection>::iterator it = m_connections.find(transport);
+  if (it == m_connections.end()) {
+    return;
+  }
+  Transport * shm = it->second.shm;
+  Transport * control = it->second.control;
+  unsigned int id = it->second.id;
+  m_connections.erase(it);
+
+  if (control) {
+    // The shared memory of a client that is still connected over its socket, or that is on its way out
+    m_logger.log(Logger::LOG_NETWORK,"- Client left shared memory.\n");
+    it = m_connections.find(control);
+    if (it != m_connections.end() && it->second.shm == transport) {
+      it->second.shm = NULL;
     }
-    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_integer_req(mid=%d,fmuId=%d,vrs=%s)\n",r->message_id(),r->fmuid(),arrayToString(vr, r->valuereferences_size()).c_str());
+    delete transport;
+    return;
+  }
 
-    fmi2_status_t status = fmi2_status_ok;
-    if (!m_sendDummyResponses) {
-      // interact with FMU
-      status = fmi2_import_get_integer(m_fmi2Instance, vr, r->valuereferences_size(), value);
+  m_logger.log(Logger::LOG_NETWORK,"- Client disconnected.\n");
+  if (shm) {
+    shm->close();
+  }
+  delete transport;
+  freeInstancesOf(id);
+  onClientDisconnect();
+}
+
+void Server::instanceMade(const fmitcp_proto::fmitcp_message& res, unsigned int clientId) {
+  if (res.type() != fmitcp_proto::fmitcp_message_Type_type_fmi2_import_instantiate_res ||
+      res.fmi2_import_instantiate_res().status() == fmitcp_proto::jm_status_error) {
+    return;
+  }
+  lw_sync_lock(m_instancesLock);
+  m_instanceOwners[res.fmi2_import_instantiate_res().fmuid()] = clientId;
+  lw_sync_release(m_instancesLock);
+
+  // A worker may have made it after the client went away
+  map<Transport*, Connection>::iterator it;
+  for (it = m_connections.begin(); it != m_connections.end(); ++it) {
+    if (it->second.id == clientId) {
+      return;
     }
+  }
+  freeInstancesOf(clientId);
+}
 
-    // Create response
-    fmitcp_proto::fmi2_import_get_integer_res * getIntegerRes = res.mutable_fmi2_import_get_integer_res();
-    res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_integer_res);
-    getIntegerRes->set_message_id(r->message_id());
-    getIntegerRes->set_status(fmi2StatusToProtofmi2Status(status));
-    for (int i = 0 ; i < r->valuereferences_size() ; i++) {
-      getIntegerRes->add_values(value[i]);
+void Server::freeInstancesOf(unsigned int clientId) {
+  vector<int> fmuIds;
+  lw_sync_lock(m_instancesLock);
+  map<int, unsigned int>::iterator it;
+  for (it = m_instanceOwners.begin(); it != m_instanceOwners.end(); ++it) {
+    if (it->second == clientId) {
+      fmuIds.push_back(it->first);
     }
-    m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_get_integer_res(mid=%d,status=%d,values=%s)\n",getIntegerRes->message_id(),getIntegerRes->status(),arrayToString(value, r->valuereferences_size()).c_str());
+  }
+  lw_sync_release(m_instancesLock);
+
+  for (size_t i = 0; i < fmuIds.size(); i++) {
+    if (m_workers.getNumThreads() > 0) {
+      ServerFreeJob * job = new ServerFreeJob;
+      job->server = this;
+      job->fmuId = fmuIds[i];
+      m_workers.post(job->fmuId, serverRunFreeJob, serverDiscardFreeJob, job);
+    } else {
+      freeLeftInstance(fmuIds[i]);
+    }
+  }
+}
+
+void Server::freeLeftInstance(int fmuId) {
+  lw_sync_lock(m_instancesLock);
+  bool left = m_instanceOwners.erase(fmuId) > 0;
+  lw_sync_release(m_instancesLock);
+  if (!left) {
+    return;
+  }
 
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_boolean_req) {
+  m_logger.log(Logger::LOG_NETWORK,"Freeing instance %d, its client has disconnected.\n",fmuId);
+  if (!m_sendDummyResponses) {
+    freeFmi2Instance(fmuId);
+  } else {
+    lw_sync_lock(m_instancesLock);
+    m_valueReferenceSets.erase(fmuId);
+    m_outputSubscriptions.erase(fmuId);
+    m_requestConnections.erase(fmuId);
+    lw_sync_release(m_instancesLock);
+  }
+}
 
-    // Unpack message
-    fmitcp_proto::fmi2_import_get_boolean_req * r = req.mutable_fmi2_import_get_boolean_req();
-    int messageId = r->message_id();
-    int fmuId = r->fmuid();
-    fmi2_value_reference_t vr[r->valuereferences_size()];
-    fmi2_boolean_t value[r->valuereferences_size()];
+void Server::transportError(Transport * transport, const string& message) {
+  onError(message);
+}
 
-    for (int i = 0 ; i < r->valuereferences_size() ; i++) {
-      vr[i] = r->valuereferences(i);
+void Server::clientMessage(Transport * transport, const char *data, size_t size) {
+  // Parse straight from the frame into the reused request
+  bool parseStatus = m_request.ParseFromArray(data, size);
+  m_logger.log(Logger::LOG_DEBUG,"Parse status: %d\n", parseStatus);
+  clientRequest(transport, m_request);
+}
+
+void Server::transportMessage(Transport * transport, fmitcp_proto::fmitcp_message& message) {
+  clientRequest(transport, message);
+}
+
+void Server::clientRequest(Transport * transport, fmitcp_proto::fmitcp_message& req) {
+  if (handleConnectionMessage(transport, req) || !allowRequest(transport, req)) {
+    return;
+  }
+
+  // A client keeps its values over shared memory, so requests on either transport count as from its socket connection
+  const Connection& connection = m_connections[transport];
+  unsigned int clientId = connection.control ? m_connections[connection.control].id : connection.id;
+  int fmuId = getFmuId(req);
+
+  if (m_workers.getNumThreads() > 0) {
+    ServerJob * job;
+    if (m_freeJobs.empty()) {
+      job = new ServerJob;
+      job->server = this;
+      job->jobs = m_jobs;
+      job->pump = m_pump->getPump();
+    } else {
+      job = m_freeJobs.back();
+      m_freeJobs.pop_back();
     }
-    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_boolean_req(mid=%d,fmuId=%d,vrs=%s)\n",r->message_id(),r->fmuid(),arrayToString(vr, r->valuereferences_size()).c_str());
+    job->transport = transport;
+    job->connectionId = connection.id;
+    job->fmuId = fmuId;
+    job->clientId = clientId;
+    job->serialize = !transport->passesMessages();
+
+    // Swap rather than copy; the caller gets the old request of the job to reuse
+    job->req.Swap(&req);
+
+    // Queue the request behind the earlier requests to the same FMU instance
+    m_jobs->outstanding++;
+    m_workers.post(job->fmuId, serverRunJob, serverDiscardJob, job);
+    return;
+  }
 
-    fmi2_status_t status = fmi2_status_ok;
-    if (!m_sendDummyResponses) {
-      // interact with FMU
-      status = fmi2_import_get_boolean(m_fmi2Instance, vr, r->valuereferences_size(), value);
+  m_response.Clear();
+  if (handleMessage(req, m_response, fmuId, clientId)) {
+    instanceMade(m_response, clientId);
+    sendMessage(transport, &m_response);
+  }
+}
+
+bool Server::handleConnectionMessage(Transport * transport, fmitcp_proto::fmitcp_message& req) {
+  if (req.type() == fmitcp_proto::fmitcp_message_Type_type_client_hello) {
+    const fmitcp_proto::client_hello& hello = req.client_hello();
+    m_logger.log(Logger::LOG_NETWORK,"< client_hello(version=%d)\n",hello.protocolversion());
+    Connection& connection = m_connections[transport];
+    connection.protocolVersion = hello.protocolversion();
+    if (hello.protocolversion() != FMITCP_PROTOCOL_VERSION) {
+      // Every request after this one is refused, until the client goes away
+      char reason[100];
+      snprintf(reason, sizeof(reason), "Protocol version %d is not supported, this server uses %d.", hello.protocolversion(), FMITCP_PROTOCOL_VERSION);
+      m_logger.log(Logger::LOG_ERROR, "%s\n", reason);
+      sendError(transport, 0, reason);
+      return true;
     }
 
-    // Create response
-    fmitcp_proto::fmi2_import_get_boolean_res * getBooleanRes = res.mutable_fmi2_import_get_boolean_res();
-    res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_boolean_res);
-    getBooleanRes->set_message_id(r->message_id());
-    getBooleanRes->set_status(fmi2StatusToProtofmi2Status(status));
-    for (int i = 0 ; i < r->valuereferences_size() ; i++) {
-      getBooleanRes->add_values(value[i]);
+    // Only what both ends listed is used on this connection
+    unsigned int requested = 0;
+    for (int i = 0 ; i < hello.capabilities_size() ; i++) {
+      requested |= capabilityBit(hello.capabilities(i));
+    }
+    connection.capabilities = connection.offered & requested;
+    return true;
+  }
+  if (req.type() != fmitcp_proto::fmitcp_message_Type_type_shm_connect_req) {
+    return false;
+  }
+  const fmitcp_proto::shm_connect_req& r = req.shm_connect_req();
+  m_logger.log(Logger::LOG_NETWORK,"< shm_connect_req(mid=%d,name=%s)\n",r.message_id(),r.name().c_str());
+
+  // Only a socket connection can move, and only once
+  bool ok = false;
+  Connection& connection = m_connections[transport];
+  if ((connection.capabilities & capabilityBit(fmitcp_proto::capability_shared_memory)) && !connection.control && !connection.shm) {
+    ShmTransport * shm = ShmTransport::open(m_pump, r.name());
+    if (shm) {
+      shm->setListener(this);
+      // The same client, with what was agreed on in the hellos
+      Connection& shmConnection = openConnection(shm);
+      shmConnection.control = transport;
+      shmConnection.protocolVersion = connection.protocolVersion;
+      shmConnection.offered = connection.offered;
+      shmConnection.capabilities = connection.capabilities;
+      connection.shm = shm;
+      shm->start();
+      ok = true;
+    } else {
+      m_logger.log(Logger::LOG_ERROR,"Could not open shared memory %s, staying on TCP.\n",r.name().c_str());
     }
-    m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_get_boolean_res(mid=%d,status=%d,values=%s)\n",getBooleanRes->message_id(),getBooleanRes->status(),arrayToString(value, r->valuereferences_size()).c_str());
+  }
+
+  // The answer goes over the socket, after that the client only uses the shared memory
+  m_response.Clear();
+  m_response.set_type(fmitcp_proto::fmitcp_message_Type_type_shm_connect_res);
+  fmitcp_proto::shm_connect_res * res = m_response.mutable_shm_connect_res();
+  res->set_message_id(r.message_id());
+  res->set_ok(ok);
+  m_logger.log(Logger::LOG_NETWORK,"> shm_connect_res(mid=%d,ok=%d)\n",res->message_id(),res->ok());
+  sendMessage(transport, &m_response);
+  return true;
+}
 
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_string_req) {
+void Server::sendError(Transport * transport, int messageId, const string& reason) {
+  m_response.Clear();
+  m_response.set_type(fmitcp_proto::fmitcp_message_Type_type_error_res);
+  fmitcp_proto::error_res * res = m_response.mutable_error_res();
+  res->set_message_id(messageId);
+  res->set_reason(reason);
+  m_logger.log(Logger::LOG_NETWORK,"> error_res(mid=%d,reason=%s)\n",messageId,reason.c_str());
+  sendMessage(transport, &m_response);
+}
 
-    // Unpack message
-    fmitcp_proto::fmi2_import_get_string_req * r = req.mutable_fmi2_import_get_string_req();
-    int messageId = r->message_id();
-    int fmuId = r->fmuid();
-    fmi2_value_reference_t vr[r->valuereferences_size()];
-    fmi2_string_t value[r->valuereferences_size()];
+bool Server::allowRequest(Transport * transport, const fmitcp_proto::fmitcp_message& req) {
+  const Connection& connection = m_connections[transport];
+  if (connection.protocolVersion != 0 && connection.protocolVersion != FMITCP_PROTOCOL_VERSION) {
+    sendError(transport, getMessageId(req), "The protocol version of the client is not supported.");
+    return false;
+  }
+  unsigned int needed = requestCapabilities(req);
+  if ((needed & connection.capabilities) != needed) {
+    int messageId = getMessageId(req);
+    m_logger.log(Logger::LOG_ERROR,"Request %d uses a capability that is not in both hellos.\n",messageId);
+    sendError(transport, messageId, "The request uses a capability that is not in both hellos.");
+    return false;
+  }
+  return true;
+}
 
-    for (int i = 0 ; i < r->valuereferences_size() ; i++) {
-      vr[i] = r->valuereferences(i);
+bool Server::handleMessage(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res, int fmuId, unsigned int clientId) {
+  if (fmuId >= 0) {
+    lw_sync_lock(m_instancesLock);
+    m_requestConnections[fmuId] = clientId;
+    lw_sync_release(m_instancesLock);
+  }
+
+  fmitcp_proto::fmitcp_message_Type type = req.type();
+  MessageHandler handler = NULL;
+  if (type >= 0 && type < (int)m_handlers.size()) {
+    handler = m_handlers[type];
+  }
+  if (!handler) {
+    m_logger.log(Logger::LOG_ERROR,"Message type not recognized: %d.\n",type);
+    return false;
+  }
+  return (this->*handler)(req, res);
+}
+
+void Server::setHandler(fmitcp_proto::fmitcp_message_Type type, MessageHandler handler) {
+  m_handlers[type] = handler;
+}
+
+void Server::registerHandlers() {
+  m_handlers.assign(fmitcp_proto::fmitcp_message_Type_Type_MAX + 1, (MessageHandler)NULL);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_instantiate_req, &Server::handle_fmi2_import_instantiate_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_initialize_slave_req, &Server::handle_fmi2_import_initialize_slave_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_terminate_slave_req, &Server::handle_fmi2_import_terminate_slave_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_reset_slave_req, &Server::handle_fmi2_import_reset_slave_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_free_slave_instance_req, &Server::handle_fmi2_import_free_slave_instance_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_real_input_derivatives_req, &Server::handle_fmi2_import_set_real_input_derivatives_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_real_output_derivatives_req, &Server::handle_fmi2_import_get_real_output_derivatives_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_cancel_step_req, &Server::handle_fmi2_import_cancel_step_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_do_step_req, &Server::handle_fmi2_import_do_step_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_status_req, &Server::handle_fmi2_import_get_status_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_real_status_req, &Server::handle_fmi2_import_get_real_status_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_integer_status_req, &Server::handle_fmi2_import_get_integer_status_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_boolean_status_req, &Server::handle_fmi2_import_get_boolean_status_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_string_status_req, &Server::handle_fmi2_import_get_string_status_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_version_req, &Server::handle_fmi2_import_get_version_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_debug_logging_req, &Server::handle_fmi2_import_set_debug_logging_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_real_req, &Server::handle_fmi2_import_set_real_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_integer_req, &Server::handle_fmi2_import_set_integer_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_boolean_req, &Server::handle_fmi2_import_set_boolean_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_string_req, &Server::handle_fmi2_import_set_string_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_real_req, &Server::handle_fmi2_import_get_real_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_integer_req, &Server::handle_fmi2_import_get_integer_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_boolean_req, &Server::handle_fmi2_import_get_boolean_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_string_req, &Server::handle_fmi2_import_get_string_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_fmu_state_req, &Server::handle_fmi2_import_get_fmu_state_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_fmu_state_req, &Server::handle_fmi2_import_set_fmu_state_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_free_fmu_state_req, &Server::handle_fmi2_import_free_fmu_state_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_directional_derivative_req, &Server::handle_fmi2_import_get_directional_derivative_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_get_xml_req, &Server::handle_get_xml_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_step_exchange_req, &Server::handle_fmi2_import_step_exchange_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_prepare_value_references_req, &Server::handle_prepare_value_references_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_release_value_references_req, &Server::handle_release_value_references_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_subscribe_outputs_req, &Server::handle_subscribe_outputs_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_get_jacobian_req, &Server::handle_get_jacobian_req);
+
+  // Not implemented yet, these requests get no response
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_instantiate_model_req, &Server::handleUnimplemented);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_free_model_instance_req, &Server::handleUnimplemented);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_time_req, &Server::handleUnimplemented);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_continuous_states_req, &Server::handleUnimplemented);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_completed_integrator_step_req, &Server::handleUnimplemented);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_initialize_model_req, &Server::handleUnimplemented);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_derivatives_req, &Server::handleUnimplemented);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_event_indicators_req, &Server::handleUnimplemented);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_eventUpdate_req, &Server::handleUnimplemented);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_completed_event_iteration_req, &Server::handleUnimplemented);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_continuous_states_req, &Server::handleUnimplemented);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_nominal_continuous_states_req, &Server::handleUnimplemented);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_terminate_req, &Server::handleUnimplemented);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_serialized_fmu_state_size_req, &Server::handle_fmi2_import_serialized_fmu_state_size_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_serialize_fmu_state_req, &Server::handle_fmi2_import_serialize_fmu_state_req);
+  setHandler(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_de_serialize_fmu_state_req, &Server::handle_fmi2_import_de_serialize_fmu_state_req);
+}
+
+bool Server::handleUnimplemented(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  return false;
+}
+
+bool Server::handle_fmi2_import_instantiate_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::fmi2_import_instantiate_req * r = req.mutable_fmi2_import_instantiate_req();
+  int messageId = r->message_id();
+
+  m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_instantiate_req(mid=%d)\n",messageId);
+
+  jm_status_enu_t status = jm_status_success;
+  int fmuId = -1;
+  if (!m_sendDummyResponses) {
+    // instantiate FMU
+    status = instantiateFmi2(&fmuId);
+  } else {
+    lw_sync_lock(m_instancesLock);
+    fmuId = m_nextFmuId++;
+    lw_sync_release(m_instancesLock);
+  }
+
+  // Create response message
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_instantiate_res);
+  fmitcp_proto::fmi2_import_instantiate_res * instantiateRes = res.mutable_fmi2_import_instantiate_res();
+  instantiateRes->set_message_id(messageId);
+  instantiateRes->set_status(fmiJMStatusToProtoJMStatus(status));
+  instantiateRes->set_fmuid(fmuId);
+  m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_instantiate_slave_res(mid=%d,status=%d,fmuId=%d)\n",messageId,instantiateRes->status(),fmuId);
+
+  return true;
+}
+
+bool Server::handle_fmi2_import_initialize_slave_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::fmi2_import_initialize_slave_req * r = req.mutable_fmi2_import_initialize_slave_req();
+  int messageId = r->message_id();
+  int fmuId = r->fmuid();
+  bool toleranceDefined = r->has_tolerancedefined();
+  double tolerance = r->tolerance();
+  double starttime = r->starttime();
+  bool stopTimeDefined = r->has_stoptimedefined();
+  double stoptime = r->stoptime();
+
+  m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_initialize_slave_req(mid=%d)\n",messageId);
+
+  fmi2_status_t status = fmi2_status_ok;
+  fmi2_import_t* fmu = m_sendDummyResponses ? NULL : getFmi2Import(fmuId, &status);
+  if (fmu) {
+    // initialize FMU
+    /*!
+     * \todo
+     * We should set all variable start values (of "ScalarVariable / <type> / start").
+     * fmiSetReal/Integer/Boolean/String(s1, ...);
+     */
+    /*!
+     * \todo
+     * What about FMUs internal experiment values e.g tolerance ????
+     */
+//      fmi2_boolean_t toleranceControlled = fmi2_false;
+//      fmi2_real_t relativeTolerance = fmi2_import_get_default_experiment_tolerance(fmu);
+
+    /*!
+     * \todo
+     * We need to set the input values at time = startTime after fmiEnterInitializationMode and before fmiExitInitializationMode.
+     * fmiSetReal/Integer/Boolean/String(s1, ...);
+     */
+    if (fmi2StatusOkOrWarning(status =  fmi2_import_setup_experiment(fmu, toleranceDefined, tolerance,
+        starttime, stopTimeDefined, stoptime)) &&
+        fmi2StatusOkOrWarning(status = fmi2_import_enter_initialization_mode(fmu)) &&
+        fmi2StatusOkOrWarning(status = fmi2_import_exit_initialization_mode(fmu))) {
+      // A Model Exchange FMU is in event mode now, the integrator takes it to continuous time mode
+      Integrator* integrator = getIntegrator(fmuId);
+      if (integrator) {
+        if (toleranceDefined) {
+          integrator->setRelativeTolerance(tolerance);
+        }
+        status = integrator->initialize();
+      }
     }
-    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_string_req(mid=%d,fmuId=%d,vrs=%s)\n",r->message_id(),r->fmuid(),arrayToString(vr, r->valuereferences_size()).c_str());
+  }
 
-    fmi2_status_t status = fmi2_status_ok;
-    if (!m_sendDummyResponses) {
-      // interact with FMU
-      status = fmi2_import_get_string(m_fmi2Instance, vr, r->valuereferences_size(), value);
+  // Create response message
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_initialize_slave_res);
+  fmitcp_proto::fmi2_import_initialize_slave_res * initializeRes = res.mutable_fmi2_import_initialize_slave_res();
+  initializeRes->set_message_id(messageId);
+  initializeRes->set_status(fmi2StatusToProtofmi2Status(status));
+  m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_initialize_slave_res(mid=%d,status=%d)\n",messageId,initializeRes->status());
+
+  return true;
+}
+
+bool Server::handle_fmi2_import_terminate_slave_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::fmi2_import_terminate_slave_req * r = req.mutable_fmi2_import_terminate_slave_req();
+  int fmuId = r->fmuid();
+  int messageId = r->message_id();
+
+  m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_terminate_slave_req(mid=%d,fmuId=%d)\n",messageId,fmuId);
+
+  fmi2_status_t status = fmi2_status_ok;
+  fmi2_import_t* fmu = m_sendDummyResponses ? NULL : getFmi2Import(fmuId, &status);
+  if (fmu) {
+    // terminate FMU
+    status = fmi2_import_terminate(fmu);
+  }
+
+  // Create response message
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_terminate_slave_res);
+  fmitcp_proto::fmi2_import_terminate_slave_res * terminateRes = res.mutable_fmi2_import_terminate_slave_res();
+  terminateRes->set_message_id(messageId);
+  terminateRes->set_status(fmi2StatusToProtofmi2Status(status));
+  m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_terminate_slave_res(mid=%d,status=%d)\n",messageId,terminateRes->status());
+
+  return true;
+}
+
+bool Server::handle_fmi2_import_reset_slave_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::fmi2_import_reset_slave_req * r = req.mutable_fmi2_import_reset_slave_req();
+  int fmuId = r->fmuid();
+  int messageId = r->message_id();
+
+  m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_reset_slave_req(fmuId=%d)\n",fmuId);
+
+  fmi2_status_t status = fmi2_status_ok;
+  fmi2_import_t* fmu = m_sendDummyResponses ? NULL : getFmi2Import(fmuId, &status);
+  if (fmu) {
+    // reset FMU
+    status = fmi2_import_reset(fmu);
+    Integrator* integrator = getIntegrator(fmuId);
+    if (integrator) {
+      integrator->reset();
     }
+  }
+
+  // Create response message
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_reset_slave_res);
+  fmitcp_proto::fmi2_import_reset_slave_res * resetRes = res.mutable_fmi2_import_reset_slave_res();
+  resetRes->set_message_id(messageId);
+  resetRes->set_status(fmi2StatusToProtofmi2Status(status));
+  m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_reset_slave_res(mid=%d,status=%d)\n",messageId,resetRes->status());
 
-    // Create response
-    fmitcp_proto::fmi2_import_get_string_res * getStringRes = res.mutable_fmi2_import_get_string_res();
-    res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_string_res);
-    getStringRes->set_message_id(r->message_id());
-    getStringRes->set_status(fmi2StatusToProtofmi2Status(status));
-    for (int i = 0 ; i < r->valuereferences_size() ; i++) {
-      getStringRes->add_values(value[i]);
+  return true;
+}
+
+bool Server::handle_fmi2_import_free_slave_instance_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::fmi2_import_free_slave_instance_req * r = req.mutable_fmi2_import_free_slave_instance_req();
+  int fmuId = r->fmuid(),
+      messageId = r->message_id();
+
+  m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_free_slave_instance_req(fmuId=%d)\n",fmuId);
+
+  // Create response message
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_free_slave_instance_res);
+  fmitcp_proto::fmi2_import_free_slave_instance_res * resetRes = res.mutable_fmi2_import_free_slave_instance_res();
+  resetRes->set_message_id(messageId);
+
+  if (!m_sendDummyResponses) {
+    // Interact with FMU
+    freeFmi2Instance(fmuId);
+  } else {
+    lw_sync_lock(m_instancesLock);
+    m_valueReferenceSets.erase(fmuId);
+    m_outputSubscriptions.erase(fmuId);
+    m_requestConnections.erase(fmuId);
+    m_instanceOwners.erase(fmuId);
+    lw_sync_release(m_instancesLock);
+  }
+
+  m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_free_slave_instance_res(mid=%d)\n",messageId);
+
+  return true;
+}
+
+bool Server::handle_fmi2_import_set_real_input_derivatives_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::fmi2_import_set_real_input_derivatives_req * r = req.mutable_fmi2_import_set_real_input_derivatives_req();
+  int messageId = r->message_id();
+  int fmuId = r->fmuid();
+  fmi2_value_reference_t vr[r->valuereferences_size()];
+  fmi2_integer_t order[r->orders_size()];
+  fmi2_real_t value[r->values_size()];
+
+  for (int i = 0 ; i < r->valuereferences_size() ; i++) {
+    vr[i] = r->valuereferences(i);
+    order[i] = r->orders(i);
+    value[i] = r->values(i);
+  }
+  FMITCP_LOG(m_logger, Logger::LOG_NETWORK,"< fmi2_import_set_real_input_derivatives_req(mid=%d,fmuId=%d,vrs=%s,orders=%s,values=%s)\n",messageId,fmuId,
+      arrayToString(vr, r->valuereferences_size()).c_str(), arrayToString(order, r->orders_size()).c_str(), arrayToString(value, r->values_size()).c_str());
+
+  fmi2_status_t status = fmi2_status_ok;
+  fmi2_import_t* fmu = m_sendDummyResponses ? NULL : getFmi2Import(fmuId, &status);
+  if (fmu && m_modelExchange) {
+    m_logger.log(Logger::LOG_ERROR, "fmi2SetRealInputDerivatives is not available for a Model Exchange FMU.\n");
+    status = fmi2_status_error;
+  } else if (fmu) {
+    // interact with FMU
+    status = fmi2_import_set_real_input_derivatives(fmu, vr, r->valuereferences_size(), order, value);
+  }
+
+  // Create response
+  fmitcp_proto::fmi2_import_set_real_input_derivatives_res * setRealInputDerivativesRes = res.mutable_fmi2_import_set_real_input_derivatives_res();
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_real_input_derivatives_res);
+  setRealInputDerivativesRes->set_message_id(messageId);
+  setRealInputDerivativesRes->set_status(fmi2StatusToProtofmi2Status(status));
+  m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_set_real_input_derivatives_res(mid=%d,status=%d)\n",messageId, setRealInputDerivativesRes->status());
+
+  return true;
+}
+
+bool Server::handle_fmi2_import_get_real_output_derivatives_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::fmi2_import_get_real_output_derivatives_req * r = req.mutable_fmi2_import_get_real_output_derivatives_req();
+  int messageId = r->message_id();
+  int fmuId = r->fmuid();
+  fmi2_value_reference_t vr[r->valuereferences_size()];
+  fmi2_integer_t order[r->orders_size()];
+  fmi2_real_t value[r->valuereferences_size()];
+
+  for (int i = 0 ; i < r->valuereferences_size() ; i++) {
+    vr[i] = r->valuereferences(i);
+    order[i] = r->orders(i);
+    value[i] = 0.0;
+  }
+  FMITCP_LOG(m_logger, Logger::LOG_NETWORK,"< fmi2_import_get_real_output_derivatives_req(mid=%d,fmuId=%d,vrs=%s,orders=%s)\n",messageId,fmuId,
+      arrayToString(vr, r->valuereferences_size()).c_str(), arrayToString(order, r->orders_size()).c_str());
+
+  fmi2_status_t status = fmi2_status_ok;
+  fmi2_import_t* fmu = m_sendDummyResponses ? NULL : getFmi2Import(fmuId, &status);
+  if (fmu && m_modelExchange) {
+    m_logger.log(Logger::LOG_ERROR, "fmi2GetRealOutputDerivatives is not available for a Model Exchange FMU.\n");
+    status = fmi2_status_error;
+  } else if (fmu) {
+    // interact with FMU
+    status = fmi2_import_get_real_output_derivatives(fmu, vr, r->valuereferences_size(), order, value);
+  }
+
+  // Create response
+  fmitcp_proto::fmi2_import_get_real_output_derivatives_res * getRealOutputDerivativesRes = res.mutable_fmi2_import_get_real_output_derivatives_res();
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_real_output_derivatives_res);
+  getRealOutputDerivativesRes->set_message_id(messageId);
+  getRealOutputDerivativesRes->set_status(fmi2StatusToProtofmi2Status(status));
+  for (int i = 0 ; i < r->valuereferences_size() ; i++) {
+    getRealOutputDerivativesRes->add_values(value[i]);
+  }
+  FMITCP_LOG(m_logger, Logger::LOG_NETWORK,"> fmi2_import_get_real_output_derivatives_res(mid=%d,status=%d,values=%s)\n",getRealOutputDerivativesRes->message_id(),getRealOutputDerivativesRes->status(),arrayToString(value, r->valuereferences_size()).c_str());
+
+  return true;
+}
+
+bool Server::handle_fmi2_import_cancel_step_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::fmi2_import_cancel_step_req * r = req.mutable_fmi2_import_cancel_step_req();
+  int fmuId = r->fmuid(),
+      messageId = r->message_id();
+
+  m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_cancel_step_req(mid=%d,fmuId=%d)\n",messageId,fmuId);
+
+  fmi2_status_t status = fmi2_status_ok;
+  fmi2_import_t* fmu = m_sendDummyResponses ? NULL : getFmi2Import(fmuId, &status);
+  if (fmu && m_modelExchange) {
+    // The integrator steps synchronously, there is never a step to cancel
+    m_logger.log(Logger::LOG_ERROR, "fmi2CancelStep is not available for a Model Exchange FMU.\n");
+    status = fmi2_status_error;
+  } else if (fmu) {
+    // Interact with FMU
+    status = fmi2_import_cancel_step(fmu);
+  }
+
+  // Create response
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_cancel_step_res);
+  fmitcp_proto::fmi2_import_cancel_step_res * cancelStepRes = res.mutable_fmi2_import_cancel_step_res();
+  cancelStepRes->set_message_id(messageId);
+  cancelStepRes->set_status(fmi2StatusToProtofmi2Status(status));
+
+  m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_cancel_step_res(mid=%d,status=%d)\n",messageId,cancelStepRes->status());
+
+  return true;
+}
+
+bool Server::handle_fmi2_import_do_step_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::fmi2_import_do_step_req * r = req.mutable_fmi2_import_do_step_req();
+  int fmuId = r->fmuid();
+  double currentCommunicationPoint = r->currentcommunicationpoint(),
+      communicationStepSize = r->communicationstepsize();
+  bool newStep = r->newstep();
+  m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_do_step_req(fmuId=%d,commPoint=%g,stepSize=%g,newStep=%d)\n",fmuId,currentCommunicationPoint,communicationStepSize,newStep?1:0);
+
+  fmi2_status_t status = fmi2_status_ok;
+  fmi2_import_t* fmu = m_sendDummyResponses ? NULL : getFmi2Import(fmuId, &status);
+  if (fmu) {
+    // Step the FMU
+    status = doStep(fmuId, fmu, currentCommunicationPoint, communicationStepSize, newStep);
+  }
+
+  // Create response
+  fmitcp_proto::fmi2_import_do_step_res * doStepRes = res.mutable_fmi2_import_do_step_res();
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_do_step_res);
+  doStepRes->set_message_id(r->message_id());
+
+  // Send the subscribed outputs along, so the client does not have to ask for them
+  OutputSubscription* subscription = getOutputSubscription(fmuId);
+  if (subscription && fmi2StatusOkOrWarning(status)) {
+    getSubscribedOutputs(fmu, *subscription, getRequestConnection(fmuId), doStepRes, &status);
+  }
+  doStepRes->set_status(fmi2StatusToProtofmi2Status(status));
+  m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_do_step_res(status=%d,outputs=%d)\n",doStepRes->status(),
+      doStepRes->realvalues_size() + doStepRes->integervalues_size() + doStepRes->booleanvalues_size() + doStepRes->stringvalues_size());
+
+  return true;
+}
+
+bool Server::handle_fmi2_import_get_status_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::fmi2_import_get_status_req * r = req.mutable_fmi2_import_get_status_req();
+  int fmuId = r->fmuid();
+  fmitcp_proto::fmi2_status_kind_t statusKind = r->status();
+  m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_status_req(fmuId=%d,status=%d)\n",fmuId, statusKind);
+
+  fmi2_status_t status = fmi2_status_ok;
+  fmi2_import_t* fmu = m_sendDummyResponses ? NULL : getFmi2Import(fmuId, &status);
+  if (fmu && m_modelExchange) {
+    // Answer for the integrator, which steps synchronously
+    Integrator* integrator = getIntegrator(fmuId);
+    if (integrator && protoStatusKindToFmiStatusKind(statusKind) == fmi2_do_step_status) {
+      status = integrator->getLastStatus();
+    } else {
+      m_logger.log(Logger::LOG_ERROR, "fmi2GetStatus(%d) is not available for a Model Exchange FMU.\n", statusKind);
+      status = fmi2_status_error;
     }
-    m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_get_string_res(mid=%d,status=%d,values=%s)\n",getStringRes->message_id(),getStringRes->status(),arrayToString(value, r->valuereferences_size()).c_str());
+  } else if (fmu) {
+    // get the FMU status
+    fmi2_import_get_status(fmu, protoStatusKindToFmiStatusKind(statusKind), &status);
+  }
+
+  // Create response
+  fmitcp_proto::fmi2_import_get_status_res * getStatusRes = res.mutable_fmi2_import_get_status_res();
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_status_res);
+  getStatusRes->set_message_id(r->message_id());
+  getStatusRes->set_value(fmi2StatusToProtofmi2Status(status));
+  m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_get_status_res(value=%d)\n",getStatusRes->value());
+
+  return true;
+}
+
+bool Server::handle_fmi2_import_get_real_status_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::fmi2_import_get_real_status_req * r = req.mutable_fmi2_import_get_real_status_req();
+  int fmuId = r->fmuid();
+  fmitcp_proto::fmi2_status_kind_t statusKind = r->kind();
+  m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_real_status_req(fmuId=%d,status=%d)\n",fmuId, statusKind);
+
+  fmi2_real_t value = 0.0;
+  fmi2_import_t* fmu = m_sendDummyResponses ? NULL : getFmi2Import(fmuId, NULL);
+  if (fmu && m_modelExchange) {
+    Integrator* integrator = getIntegrator(fmuId);
+    if (integrator && protoStatusKindToFmiStatusKind(statusKind) == fmi2_last_successful_time) {
+      value = integrator->getLastSuccessfulTime();
+    } else {
+      m_logger.log(Logger::LOG_ERROR, "fmi2GetRealStatus(%d) is not available for a Model Exchange FMU.\n", statusKind);
+    }
+  } else if (fmu) {
+    // get the FMU real status
+    fmi2_import_get_real_status(fmu, protoStatusKindToFmiStatusKind(statusKind), &value);
+  }
+
+  // Create response
+  fmitcp_proto::fmi2_import_get_real_status_res * getRealStatusRes = res.mutable_fmi2_import_get_real_status_res();
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_real_status_res);
+  getRealStatusRes->set_message_id(r->message_id());
+  getRealStatusRes->set_value(value);
+  m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_get_real_status_res(value=%g)\n",getRealStatusRes->value());
 
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_fmu_state_req){
+  return true;
+}
 
-    // Unpack message
-    fmitcp_proto::fmi2_import_get_fmu_state_req * r = req.mutable_fmi2_import_get_fmu_state_req();
-    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_fmu_state_req(mid=%d,fmuId=%d)\n",r->message_id(),r->fmuid());
+bool Server::handle_fmi2_import_get_integer_status_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::fmi2_import_get_integer_status_req * r = req.mutable_fmi2_import_get_integer_status_req();
+  int fmuId = r->fmuid();
+  fmitcp_proto::fmi2_status_kind_t statusKind = r->kind();
+  m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_integer_status_req(fmuId=%d,status=%d)\n",fmuId, statusKind);
+
+  fmi2_integer_t value = 0;
+  fmi2_import_t* fmu = m_sendDummyResponses ? NULL : getFmi2Import(fmuId, NULL);
+  if (fmu && m_modelExchange) {
+    m_logger.log(Logger::LOG_ERROR, "fmi2GetIntegerStatus is not available for a Model Exchange FMU.\n");
+  } else if (fmu) {
+    // get the FMU integer status
+    fmi2_import_get_integer_status(fmu, protoStatusKindToFmiStatusKind(statusKind), &value);
+  }
 
-    fmitcp_proto::fmi2_import_get_fmu_state_res * getStatusRes = res.mutable_fmi2_import_get_fmu_state_res();
-    res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_fmu_state_res);
-    getStatusRes->set_message_id(r->message_id());
-    getStatusRes->set_status(fmitcp_proto::fmi2_status_ok);
-    getStatusRes->set_stateid(0); // TODO
+  // Create response
+  fmitcp_proto::fmi2_import_get_integer_status_res * getIntegerStatusRes = res.mutable_fmi2_import_get_integer_status_res();
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_integer_status_res);
+  getIntegerStatusRes->set_message_id(r->message_id());
+  getIntegerStatusRes->set_value(value);
+  m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_get_integer_status_res(value=%d)\n",getIntegerStatusRes->value());
 
-    if(!m_sendDummyResponses){
-      // TODO: interact with FMU
+  return true;
+}
+
+bool Server::handle_fmi2_import_get_boolean_status_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::fmi2_import_get_boolean_status_req * r = req.mutable_fmi2_import_get_boolean_status_req();
+  int fmuId = r->fmuid();
+  fmitcp_proto::fmi2_status_kind_t statusKind = r->kind();
+  m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_boolean_status_req(mid=%d,fmuId=%d,status=%d)\n",r->message_id(), fmuId, statusKind);
+
+  fmi2_boolean_t value = 0;
+  fmi2_import_t* fmu = m_sendDummyResponses ? NULL : getFmi2Import(fmuId, NULL);
+  if (fmu && m_modelExchange) {
+    Integrator* integrator = getIntegrator(fmuId);
+    if (integrator && protoStatusKindToFmiStatusKind(statusKind) == fmi2_terminated) {
+      value = integrator->isTerminated() ? fmi2_true : fmi2_false;
+    } else {
+      m_logger.log(Logger::LOG_ERROR, "fmi2GetBooleanStatus(%d) is not available for a Model Exchange FMU.\n", statusKind);
     }
+  } else if (fmu) {
+    // get the FMU boolean status
+    fmi2_import_get_boolean_status(fmu, protoStatusKindToFmiStatusKind(statusKind), &value);
+  }
+
+  // Create response
+  fmitcp_proto::fmi2_import_get_boolean_status_res * getBooleanStatusRes = res.mutable_fmi2_import_get_boolean_status_res();
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_boolean_status_res);
+  getBooleanStatusRes->set_message_id(r->message_id());
+  getBooleanStatusRes->set_value(value);
+  m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_get_boolean_status_res(mid=%d,value=%d)\n",getBooleanStatusRes->message_id(),getBooleanStatusRes->value());
+
+  return true;
+}
 
-    // Create response
-    m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_get_fmu_state_res(mid=%d,stateId=%d,status=%d)\n",getStatusRes->message_id(),getStatusRes->stateid(),getStatusRes->status());
+bool Server::handle_fmi2_import_get_string_status_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::fmi2_import_get_string_status_req * r = req.mutable_fmi2_import_get_string_status_req();
+  int fmuId = r->fmuid();
+  fmitcp_proto::fmi2_status_kind_t statusKind = r->kind();
+  m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_string_status_req(mid=%d,fmuId=%d,status=%d)\n",r->message_id(), fmuId, statusKind);
+
+  fmi2_string_t value = "";
+  fmi2_import_t* fmu = m_sendDummyResponses ? NULL : getFmi2Import(fmuId, NULL);
+  if (fmu && m_modelExchange) {
+    m_logger.log(Logger::LOG_ERROR, "fmi2GetStringStatus is not available for a Model Exchange FMU.\n");
+  } else if (fmu) {
+    // TODO: Step the FMU
+    fmi2_import_get_string_status(fmu, protoStatusKindToFmiStatusKind(statusKind), &value);
+  }
+
+  // Create response
+  fmitcp_proto::fmi2_import_get_string_status_res * getStringStatusRes = res.mutable_fmi2_import_get_string_status_res();
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_string_status_res);
+  getStringStatusRes->set_message_id(r->message_id());
+  getStringStatusRes->set_value(value);
+  m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_get_string_status_res(mid=%d,value=%s)\n",getStringStatusRes->message_id(),getStringStatusRes->value().c_str());
+
+  return true;
+}
+
+bool Server::handle_fmi2_import_get_version_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::fmi2_import_get_version_req * r = req.mutable_fmi2_import_get_version_req();
+  m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_version_req(mid=%d,fmuId=%d)\n",r->message_id(),r->fmuid());
 
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_fmu_state_req){
+  const char* version = "VeRsIoN";
+  if (!m_sendDummyResponses) {
+    // get FMU version
+    version = fmi2_import_get_version(m_fmi2Model);
+  }
 
-    // Unpack message
-    fmitcp_proto::fmi2_import_set_fmu_state_req * r = req.mutable_fmi2_import_set_fmu_state_req();
-    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_set_fmu_state_req(mid=%d,fmuId=%d,stateId=%d)\n",r->message_id(),r->fmuid(),r->stateid());
+  // Create response
+  fmitcp_proto::fmi2_import_get_version_res * getVersionRes = res.mutable_fmi2_import_get_version_res();
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_version_res);
+  getVersionRes->set_message_id(r->message_id());
+  getVersionRes->set_version(version);
+  m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_get_version_res(mid=%d,version=%s)\n",getVersionRes->message_id(),getVersionRes->version().c_str());
 
-    fmitcp_proto::fmi2_import_set_fmu_state_res * getStatusRes = res.mutable_fmi2_import_set_fmu_state_res();
-    res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_fmu_state_res);
-    getStatusRes->set_message_id(r->message_id());
-    getStatusRes->set_status(fmitcp_proto::fmi2_status_ok);
+  return true;
+}
 
-    if(!m_sendDummyResponses){
-      // TODO: interact with FMU
+bool Server::handle_fmi2_import_set_debug_logging_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::fmi2_import_set_debug_logging_req * r = req.mutable_fmi2_import_set_debug_logging_req();
+  m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_set_debug_logging_req(mid=%d,fmuId=%d,loggingOn=%d,categories=...)\n",r->message_id(),r->fmuid(),r->loggingon());
+
+  fmi2_status_t status = fmi2_status_ok;
+  fmi2_import_t* fmu = m_sendDummyResponses ? NULL : getFmi2Import(r->fmuid(), &status);
+  if (fmu) {
+    // set the debug logging for FMU
+    // fetch the logging categories from the FMU
+    size_t nCategories = fmi2_import_get_log_categories_num(fmu);
+    fmi2_string_t categories[nCategories];
+    int i;
+    for (i = 0 ; i < nCategories ; i++) {
+      categories[i] = fmi2_import_get_log_category(fmu, i);
     }
+    // set debug logging. We don't care about its result.
+    status = fmi2_import_set_debug_logging(fmu, m_debugLogging, nCategories, categories);
+  }
+
+  // Create response
+  fmitcp_proto::fmi2_import_set_debug_logging_res * getStatusRes = res.mutable_fmi2_import_set_debug_logging_res();
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_debug_logging_res);
+  getStatusRes->set_message_id(r->message_id());
+  getStatusRes->set_status(fmi2StatusToProtofmi2Status(status));
+  m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_set_debug_logging_res(mid=%d,status=%d)\n",getStatusRes->message_id(),getStatusRes->status());
+
+  return true;
+}
+
+bool Server::handle_fmi2_import_set_real_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::fmi2_import_set_real_req * r = req.mutable_fmi2_import_set_real_req();
+  int messageId = r->message_id();
+  int fmuId = r->fmuid();
+  fmi2_status_t status = fmi2_status_ok;
+  fmi2_value_reference_t listVr[r->valuereferences_size()];
+  const fmi2_value_reference_t* vr;
+  size_t nvr;
+  bool resolved = resolveValueReferences(fmuId, r->valuereferenceset(), r->valuereferences(), r->delta() ? -1 : r->values_size(), listVr, &vr, &nvr, &status);
+  fmi2_value_reference_t changedVr[r->indices_size()];
+  if (resolved && r->delta()) {
+    // Only the changed values, the other variables keep theirs
+    resolved = selectValueReferences(r->indices(), r->values_size(), changedVr, &vr, &nvr, &status) &&
+        deltaInputsValid(fmuId, r->valuereferenceset(), &status);
+  }
+  fmi2_real_t value[r->values_size()];
+  for (int i = 0 ; i < r->values_size() ; i++) {
+    value[i] = r->values(i);
+  }
+
+  FMITCP_LOG(m_logger, Logger::LOG_NETWORK,"< fmi2_import_set_real_req(mid=%d,fmuId=%d,vrs=%s,values=%s)\n",r->message_id(),r->fmuid(),
+      arrayToString(vr, nvr).c_str(), arrayToString(value, r->values_size()).c_str());
+
+  fmi2_import_t* fmu = (m_sendDummyResponses || !resolved) ? NULL : getFmi2Import(fmuId, &status);
+  if (fmu) {
+    // interact with FMU
+     status = fmi2_import_set_real(fmu, vr, nvr, value);
+  }
+  trackInputs(fmuId, r->valuereferenceset(), r->delta(), resolved && fmi2StatusOkOrWarning(status));
+
+  // Create response
+  fmitcp_proto::fmi2_import_set_real_res * setRealRes = res.mutable_fmi2_import_set_real_res();
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_real_res);
+  setRealRes->set_message_id(r->message_id());
+  setRealRes->set_status(fmi2StatusToProtofmi2Status(status));
+  m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_set_real_res(mid=%d,status=%d)\n",setRealRes->message_id(),setRealRes->status());
 
-    // Create response
-    m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_set_fmu_state_res(mid=%d,status=%d)\n",getStatusRes->message_id(),getStatusRes->status());
+  return true;
+}
+
+bool Server::handle_fmi2_import_set_integer_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::fmi2_import_set_integer_req * r = req.mutable_fmi2_import_set_integer_req();
+  int messageId = r->message_id();
+  int fmuId = r->fmuid();
+  fmi2_status_t status = fmi2_status_ok;
+  fmi2_value_reference_t listVr[r->valuereferences_size()];
+  const fmi2_value_reference_t* vr;
+  size_t nvr;
+  bool resolved = resolveValueReferences(fmuId, r->valuereferenceset(), r->valuereferences(), r->delta() ? -1 : r->values_size(), listVr, &vr, &nvr, &status);
+  fmi2_value_reference_t changedVr[r->indices_size()];
+  if (resolved && r->delta()) {
+    // Only the changed values, the other variables keep theirs
+    resolved = selectValueReferences(r->indices(), r->values_size(), changedVr, &vr, &nvr, &status) &&
+        deltaInputsValid(fmuId, r->valuereferenceset(), &status);
+  }
+  fmi2_integer_t value[r->values_size()];
+  for (int i = 0 ; i < r->values_size() ; i++) {
+    value[i] = r->values(i);
+  }
+  FMITCP_LOG(m_logger, Logger::LOG_NETWORK,"< fmi2_import_set_integer_req(mid=%d,fmuId=%d,vrs=%s,values=%s)\n",r->message_id(),r->fmuid(),
+      arrayToString(vr, nvr).c_str(), arrayToString(value, r->values_size()).c_str());
+
+  fmi2_import_t* fmu = (m_sendDummyResponses || !resolved) ? NULL : getFmi2Import(fmuId, &status);
+  if (fmu) {
+    // interact with FMU
+    status = fmi2_import_set_integer(fmu, vr, nvr, value);
+  }
+  trackInputs(fmuId, r->valuereferenceset(), r->delta(), resolved && fmi2StatusOkOrWarning(status));
+
+  // Create response
+  fmitcp_proto::fmi2_import_set_integer_res * setIntegerRes = res.mutable_fmi2_import_set_integer_res();
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_integer_res);
+  setIntegerRes->set_message_id(r->message_id());
+  setIntegerRes->set_status(fmi2StatusToProtofmi2Status(status));
+  m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_set_integer_res(mid=%d,status=%d)\n",setIntegerRes->message_id(),setIntegerRes->status());
+
+  return true;
+}
+
+bool Server::handle_fmi2_import_set_boolean_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::fmi2_import_set_boolean_req * r = req.mutable_fmi2_import_set_boolean_req();
+  int messageId = r->message_id();
+  int fmuId = r->fmuid();
+  fmi2_status_t status = fmi2_status_ok;
+  fmi2_value_reference_t listVr[r->valuereferences_size()];
+  const fmi2_value_reference_t* vr;
+  size_t nvr;
+  bool resolved = resolveValueReferences(fmuId, r->valuereferenceset(), r->valuereferences(), r->delta() ? -1 : r->values_size(), listVr, &vr, &nvr, &status);
+  fmi2_value_reference_t changedVr[r->indices_size()];
+  if (resolved && r->delta()) {
+    // Only the changed values, the other variables keep theirs
+    resolved = selectValueReferences(r->indices(), r->values_size(), changedVr, &vr, &nvr, &status) &&
+        deltaInputsValid(fmuId, r->valuereferenceset(), &status);
+  }
+  fmi2_boolean_t value[r->values_size()];
+  for (int i = 0 ; i < r->values_size() ; i++) {
+    value[i] = r->values(i);
+  }
+  FMITCP_LOG(m_logger, Logger::LOG_NETWORK,"< fmi2_import_set_boolean_req(mid=%d,fmuId=%d,vrs=%s,values=%s)\n",r->message_id(),r->fmuid(),
+      arrayToString(vr, nvr).c_str(), arrayToString(value, r->values_size()).c_str());
+
+  fmi2_import_t* fmu = (m_sendDummyResponses || !resolved) ? NULL : getFmi2Import(fmuId, &status);
+  if (fmu) {
+    // interact with FMU
+    status = fmi2_import_set_boolean(fmu, vr, nvr, value);
+  }
+  trackInputs(fmuId, r->valuereferenceset(), r->delta(), resolved && fmi2StatusOkOrWarning(status));
+
+  // Create response
+  fmitcp_proto::fmi2_import_set_boolean_res * setBooleanRes = res.mutable_fmi2_import_set_boolean_res();
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_boolean_res);
+  setBooleanRes->set_message_id(r->message_id());
+  setBooleanRes->set_status(fmi2StatusToProtofmi2Status(status));
+  m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_set_boolean_res(mid=%d,status=%d)\n",setBooleanRes->message_id(),setBooleanRes->status());
+
+  return true;
+}
+
+bool Server::handle_fmi2_import_set_string_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::fmi2_import_set_string_req * r = req.mutable_fmi2_import_set_string_req();
+  int messageId = r->message_id();
+  int fmuId = r->fmuid();
+  fmi2_status_t status = fmi2_status_ok;
+  fmi2_value_reference_t listVr[r->valuereferences_size()];
+  const fmi2_value_reference_t* vr;
+  size_t nvr;
+  bool resolved = resolveValueReferences(fmuId, r->valuereferenceset(), r->valuereferences(), r->delta() ? -1 : r->values_size(), listVr, &vr, &nvr, &status);
+  fmi2_value_reference_t changedVr[r->indices_size()];
+  if (resolved && r->delta()) {
+    // Only the changed values, the other variables keep theirs
+    resolved = selectValueReferences(r->indices(), r->values_size(), changedVr, &vr, &nvr, &status) &&
+        deltaInputsValid(fmuId, r->valuereferenceset(), &status);
+  }
+  fmi2_string_t value[r->values_size()];
+  for (int i = 0 ; i < r->values_size() ; i++) {
+    value[i] = r->values(i).c_str();
+  }
+  FMITCP_LOG(m_logger, Logger::LOG_NETWORK,"< fmi2_import_set_string_req(mid=%d,fmuId=%d,vrs=%s,values=%s)\n",r->message_id(),r->fmuid(),
+      arrayToString(vr, nvr).c_str(), arrayToString(value, r->values_size()).c_str());
+
+  fmi2_import_t* fmu = (m_sendDummyResponses || !resolved) ? NULL : getFmi2Import(fmuId, &status);
+  if (fmu) {
+    // interact with FMU
+    status = fmi2_import_set_string(fmu, vr, nvr, value);
+  }
+  trackInputs(fmuId, r->valuereferenceset(), r->delta(), resolved && fmi2StatusOkOrWarning(status));
+
+  // Create response
+  fmitcp_proto::fmi2_import_set_string_res * getStatusRes = res.mutable_fmi2_import_set_string_res();
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_string_res);
+  getStatusRes->set_message_id(r->message_id());
+  getStatusRes->set_status(fmi2StatusToProtofmi2Status(status));
+  m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_set_string_res(mid=%d,status=%d)\n",getStatusRes->message_id(),getStatusRes->status());
+
+  return true;
+}
+
+bool Server::handle_fmi2_import_get_real_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::fmi2_import_get_real_req * r = req.mutable_fmi2_import_get_real_req();
+  int messageId = r->message_id();
+  int fmuId = r->fmuid();
+  fmi2_status_t status = fmi2_status_ok;
+  fmi2_value_reference_t listVr[r->valuereferences_size()];
+  const fmi2_value_reference_t* vr;
+  size_t nvr;
+  bool resolved = resolveValueReferences(fmuId, r->valuereferenceset(), r->valuereferences(), -1, listVr, &vr, &nvr, &status);
+  fmi2_real_t value[nvr];
+  for (size_t i = 0 ; i < nvr ; i++) {
+    value[i] = 0.0;
+  }
+  FMITCP_LOG(m_logger, Logger::LOG_NETWORK,"< fmi2_import_get_real_req(mid=%d,fmuId=%d,vrs=%s)\n",r->message_id(),r->fmuid(),arrayToString(vr, nvr).c_str());
+
+  fmi2_import_t* fmu = (m_sendDummyResponses || !resolved) ? NULL : getFmi2Import(fmuId, &status);
+  if (fmu) {
+    // interact with FMU
+    status = fmi2_import_get_real(fmu, vr, nvr, value);
+  }
+
+  // Create response
+  fmitcp_proto::fmi2_import_get_real_res * getRealRes = res.mutable_fmi2_import_get_real_res();
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_real_res);
+  getRealRes->set_message_id(r->message_id());
+  getRealRes->set_status(fmi2StatusToProtofmi2Status(status));
+
+  // Only the changed values if the client asks for them, once it has all
+  SentValues* sent = fmi2StatusOkOrWarning(status) ? getSentValues(fmuId, r->valuereferenceset(), r->delta()) : NULL;
+  bool delta = sent && sent->reals.size() == nvr;
+  if (delta) {
+    getRealRes->set_delta(true);
+  }
+  addValues(value, nvr, !delta, r->realthreshold(), sent ? &sent->reals : NULL, getRealRes->mutable_indices(), getRealRes->mutable_values());
+  FMITCP_LOG(m_logger, Logger::LOG_NETWORK,"> fmi2_import_get_real_res(mid=%d,status=%d,values=%s)\n",getRealRes->message_id(),getRealRes->status(),arrayToString(value, nvr).c_str());
+
+  return true;
+}
+
+bool Server::handle_fmi2_import_get_integer_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::fmi2_import_get_integer_req * r = req.mutable_fmi2_import_get_integer_req();
+  int messageId = r->message_id();
+  int fmuId = r->fmuid();
+  fmi2_status_t status = fmi2_status_ok;
+  fmi2_value_reference_t listVr[r->valuereferences_size()];
+  const fmi2_value_reference_t* vr;
+  size_t nvr;
+  bool resolved = resolveValueReferences(fmuId, r->valuereferenceset(), r->valuereferences(), -1, listVr, &vr, &nvr, &status);
+  fmi2_integer_t value[nvr];
+  for (size_t i = 0 ; i < nvr ; i++) {
+    value[i] = 0;
+  }
+  FMITCP_LOG(m_logger, Logger::LOG_NETWORK,"< fmi2_import_get_integer_req(mid=%d,fmuId=%d,vrs=%s)\n",r->message_id(),r->fmuid(),arrayToString(vr, nvr).c_str());
+
+  fmi2_import_t* fmu = (m_sendDummyResponses || !resolved) ? NULL : getFmi2Import(fmuId, &status);
+  if (fmu) {
+    // interact with FMU
+    status = fmi2_import_get_integer(fmu, vr, nvr, value);
+  }
+
+  // Create response
+  fmitcp_proto::fmi2_import_get_integer_res * getIntegerRes = res.mutable_fmi2_import_get_integer_res();
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_integer_res);
+  getIntegerRes->set_message_id(r->message_id());
+  getIntegerRes->set_status(fmi2StatusToProtofmi2Status(status));
+
+  // Only the changed values if the client asks for them, once it has all
+  SentValues* sent = fmi2StatusOkOrWarning(status) ? getSentValues(fmuId, r->valuereferenceset(), r->delta()) : NULL;
+  bool delta = sent && sent->integers.size() == nvr;
+  if (delta) {
+    getIntegerRes->set_delta(true);
+  }
+  addValues(value, nvr, !delta, 0, sent ? &sent->integers : NULL, getIntegerRes->mutable_indices(), getIntegerRes->mutable_values());
+  FMITCP_LOG(m_logger, Logger::LOG_NETWORK,"> fmi2_import_get_integer_res(mid=%d,status=%d,values=%s)\n",getIntegerRes->message_id(),getIntegerRes->status(),arrayToString(value, nvr).c_str());
+
+  return true;
+}
+
+bool Server::handle_fmi2_import_get_boolean_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::fmi2_import_get_boolean_req * r = req.mutable_fmi2_import_get_boolean_req();
+  int messageId = r->message_id();
+  int fmuId = r->fmuid();
+  fmi2_status_t status = fmi2_status_ok;
+  fmi2_value_reference_t listVr[r->valuereferences_size()];
+  const fmi2_value_reference_t* vr;
+  size_t nvr;
+  bool resolved = resolveValueReferences(fmuId, r->valuereferenceset(), r->valuereferences(), -1, listVr, &vr, &nvr, &status);
+  fmi2_boolean_t value[nvr];
+  for (size_t i = 0 ; i < nvr ; i++) {
+    value[i] = fmi2_false;
+  }
+  FMITCP_LOG(m_logger, Logger::LOG_NETWORK,"< fmi2_import_get_boolean_req(mid=%d,fmuId=%d,vrs=%s)\n",r->message_id(),r->fmuid(),arrayToString(vr, nvr).c_str());
+
+  fmi2_import_t* fmu = (m_sendDummyResponses || !resolved) ? NULL : getFmi2Import(fmuId, &status);
+  if (fmu) {
+    // interact with FMU
+    status = fmi2_import_get_boolean(fmu, vr, nvr, value);
+  }
+
+  // Create response
+  fmitcp_proto::fmi2_import_get_boolean_res * getBooleanRes = res.mutable_fmi2_import_get_boolean_res();
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_boolean_res);
+  getBooleanRes->set_message_id(r->message_id());
+  getBooleanRes->set_status(fmi2StatusToProtofmi2Status(status));
+
+  // Only the changed values if the client asks for them, once it has all
+  SentValues* sent = fmi2StatusOkOrWarning(status) ? getSentValues(fmuId, r->valuereferenceset(), r->delta()) : NULL;
+  bool delta = sent && sent->booleans.size() == nvr;
+  if (delta) {
+    getBooleanRes->set_delta(true);
+  }
+  addValues(value, nvr, !delta, 0, sent ? &sent->booleans : NULL, getBooleanRes->mutable_indices(), getBooleanRes->mutable_values());
+  FMITCP_LOG(m_logger, Logger::LOG_NETWORK,"> fmi2_import_get_boolean_res(mid=%d,status=%d,values=%s)\n",getBooleanRes->message_id(),getBooleanRes->status(),arrayToString(value, nvr).c_str());
+
+  return true;
+}
+
+bool Server::handle_fmi2_import_get_string_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::fmi2_import_get_string_req * r = req.mutable_fmi2_import_get_string_req();
+  int messageId = r->message_id();
+  int fmuId = r->fmuid();
+  fmi2_status_t status = fmi2_status_ok;
+  fmi2_value_reference_t listVr[r->valuereferences_size()];
+  const fmi2_value_reference_t* vr;
+  size_t nvr;
+  bool resolved = resolveValueReferences(fmuId, r->valuereferenceset(), r->valuereferences(), -1, listVr, &vr, &nvr, &status);
+  fmi2_string_t value[nvr];
+  for (size_t i = 0 ; i < nvr ; i++) {
+    value[i] = "";
+  }
+  FMITCP_LOG(m_logger, Logger::LOG_NETWORK,"< fmi2_import_get_string_req(mid=%d,fmuId=%d,vrs=%s)\n",r->message_id(),r->fmuid(),arrayToString(vr, nvr).c_str());
 
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_free_fmu_state_req){
+  fmi2_import_t* fmu = (m_sendDummyResponses || !resolved) ? NULL : getFmi2Import(fmuId, &status);
+  if (fmu) {
+    // interact with FMU
+    status = fmi2_import_get_string(fmu, vr, nvr, value);
+  }
 
-    // Unpack message
-    fmitcp_proto::fmi2_import_free_fmu_state_req * r = req.mutable_fmi2_import_free_fmu_state_req();
-    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_free_fmu_state_req(mid=%d,stateId=%d)\n",r->message_id(),r->stateid());
+  // Create response
+  fmitcp_proto::fmi2_import_get_string_res * getStringRes = res.mutable_fmi2_import_get_string_res();
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_string_res);
+  getStringRes->set_message_id(r->message_id());
+  getStringRes->set_status(fmi2StatusToProtofmi2Status(status));
+
+  // Only the changed values if the client asks for them, once it has all
+  SentValues* sent = fmi2StatusOkOrWarning(status) ? getSentValues(fmuId, r->valuereferenceset(), r->delta()) : NULL;
+  bool delta = sent && sent->strings.size() == nvr;
+  if (delta) {
+    getStringRes->set_delta(true);
+  }
+  addValues(value, nvr, !delta, 0, sent ? &sent->strings : NULL, getStringRes->mutable_indices(), getStringRes->mutable_values());
+  FMITCP_LOG(m_logger, Logger::LOG_NETWORK,"> fmi2_import_get_string_res(mid=%d,status=%d,values=%s)\n",getStringRes->message_id(),getStringRes->status(),arrayToString(value, nvr).c_str());
 
-    fmitcp_proto::fmi2_import_free_fmu_state_res * getStatusRes = res.mutable_fmi2_import_free_fmu_state_res();
-    res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_free_fmu_state_res);
-    getStatusRes->set_message_id(r->message_id());
-    getStatusRes->set_status(fmitcp_proto::fmi2_status_ok);
+  return true;
+}
 
-    if(!m_sendDummyResponses){
-      // TODO: interact with FMU
+bool Server::handle_fmi2_import_get_fmu_state_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::fmi2_import_get_fmu_state_req * r = req.mutable_fmi2_import_get_fmu_state_req();
+  m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_fmu_state_req(mid=%d,fmuId=%d)\n",r->message_id(),r->fmuid());
+
+  fmi2_status_t status = fmi2_status_ok;
+  int stateId = 0;
+  fmi2_import_t* fmu = m_sendDummyResponses ? NULL : getFmi2Import(r->fmuid(), &status);
+  if (fmu) {
+    // Save the state of the FMU in the store of the instance
+    FmuStateStore* store = getFmuStateStore(r->fmuid(), &status);
+    fmi2_FMU_state_t state = NULL;
+    if (store && fmi2StatusOkOrWarning(status = fmi2_import_get_fmu_state(fmu, &state))) {
+      // The integrator of a Model Exchange FMU has state of its own
+      Integrator* integrator = getIntegrator(r->fmuid());
+      Integrator::Snapshot snapshot;
+      if (integrator) {
+        integrator->save(snapshot);
+      }
+      fmi2_FMU_state_t evicted;
+      stateId = store->add(state, &evicted, integrator ? &snapshot : NULL);
+      if (evicted) {
+        m_logger.log(Logger::LOG_DEBUG,"Too many FMU states for fmuId=%d, freeing the least recently used one.\n",r->fmuid());
+        fmi2_import_free_fmu_state(fmu, &evicted);
+      }
     }
+  }
 
-    // Create response
-    m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_free_fmu_state_res(mid=%d,status=%d)\n",getStatusRes->message_id(),getStatusRes->status());
-
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_serialized_fmu_state_size_req){
-    // TODO
-    sendResponse = false;
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_serialize_fmu_state_req){
-    // TODO
-    sendResponse = false;
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_de_serialize_fmu_state_req){
-    // TODO
-    sendResponse = false;
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_directional_derivative_req) {
-
-    // Unpack message
-    fmitcp_proto::fmi2_import_get_directional_derivative_req * r = req.mutable_fmi2_import_get_directional_derivative_req();
-    int messageId = r->message_id();
-    int fmuId = r->fmuid();
-    fmi2_value_reference_t v_ref[r->v_ref_size()];
-    fmi2_value_reference_t z_ref[r->z_ref_size()];
-    fmi2_real_t dv[r->dv_size()], dz[r->z_ref_size()];
-
-    for (int i = 0 ; i < r->v_ref_size() ; i++) {
-      v_ref[i] = r->v_ref(i);
+  // Create response
+  fmitcp_proto::fmi2_import_get_fmu_state_res * getStatusRes = res.mutable_fmi2_import_get_fmu_state_res();
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_fmu_state_res);
+  getStatusRes->set_message_id(r->message_id());
+  getStatusRes->set_status(fmi2StatusToProtofmi2Status(status));
+  getStatusRes->set_stateid(stateId);
+  m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_get_fmu_state_res(mid=%d,stateId=%d,status=%d)\n",getStatusRes->message_id(),getStatusRes->stateid(),getStatusRes->status());
+
+  return true;
+}
+
+bool Server::handle_fmi2_import_set_fmu_state_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::fmi2_import_set_fmu_state_req * r = req.mutable_fmi2_import_set_fmu_state_req();
+  m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_set_fmu_state_req(mid=%d,fmuId=%d,stateId=%d)\n",r->message_id(),r->fmuid(),r->stateid());
+
+  fmi2_status_t status = fmi2_status_ok;
+  fmi2_import_t* fmu = m_sendDummyResponses ? NULL : getFmi2Import(r->fmuid(), &status);
+  if (fmu) {
+    // Roll the FMU back to a saved state
+    FmuStateStore* store = getFmuStateStore(r->fmuid(), &status);
+    fmi2_FMU_state_t state = store ? store->get(r->stateid()) : NULL;
+    if (state) {
+      status = fmi2_import_set_fmu_state(fmu, state);
+      Integrator* integrator = getIntegrator(r->fmuid());
+      const Integrator::Snapshot* snapshot = store->getIntegrator(r->stateid());
+      if (integrator && fmi2StatusOkOrWarning(status)) {
+        // Without a snapshot, what the integrator knows is of another point in time
+        if (snapshot) {
+          integrator->restore(*snapshot);
+        } else {
+          integrator->reset();
+        }
+      }
+    } else {
+      m_logger.log(Logger::LOG_ERROR,"No FMU state with stateId=%d for fmuId=%d.\n",r->stateid(),r->fmuid());
+      status = fmi2_status_error;
     }
-    for (int i = 0 ; i < r->z_ref_size() ; i++) {
-      z_ref[i] = r->z_ref(i);
+  }
+
+  // Create response
+  fmitcp_proto::fmi2_import_set_fmu_state_res * getStatusRes = res.mutable_fmi2_import_set_fmu_state_res();
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_set_fmu_state_res);
+  getStatusRes->set_message_id(r->message_id());
+  getStatusRes->set_status(fmi2StatusToProtofmi2Status(status));
+  m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_set_fmu_state_res(mid=%d,status=%d)\n",getStatusRes->message_id(),getStatusRes->status());
+
+  return true;
+}
+
+bool Server::handle_fmi2_import_free_fmu_state_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::fmi2_import_free_fmu_state_req * r = req.mutable_fmi2_import_free_fmu_state_req();
+  m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_free_fmu_state_req(mid=%d,fmuId=%d,stateId=%d)\n",r->message_id(),r->fmuid(),r->stateid());
+
+  fmi2_status_t status = fmi2_status_ok;
+  fmi2_import_t* fmu = m_sendDummyResponses ? NULL : getFmi2Import(r->fmuid(), &status);
+  if (fmu) {
+    // Free a saved state. States that were evicted are already gone.
+    FmuStateStore* store = getFmuStateStore(r->fmuid(), &status);
+    fmi2_FMU_state_t state = store ? store->remove(r->stateid()) : NULL;
+    if (state) {
+      status = fmi2_import_free_fmu_state(fmu, &state);
+    } else {
+      m_logger.log(Logger::LOG_ERROR,"No FMU state with stateId=%d for fmuId=%d.\n",r->stateid(),r->fmuid());
+      status = fmi2_status_error;
     }
-    for (int i = 0 ; i < r->dv_size() ; i++) {
-      dv[i] = r->dv(i);
+  }
+
+  // Create response
+  fmitcp_proto::fmi2_import_free_fmu_state_res * getStatusRes = res.mutable_fmi2_import_free_fmu_state_res();
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_free_fmu_state_res);
+  getStatusRes->set_message_id(r->message_id());
+  getStatusRes->set_status(fmi2StatusToProtofmi2Status(status));
+  m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_free_fmu_state_res(mid=%d,status=%d)\n",getStatusRes->message_id(),getStatusRes->status());
+
+  return true;
+}
+
+bool Server::handle_fmi2_import_serialized_fmu_state_size_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::fmi2_import_serialized_fmu_state_size_req * r = req.mutable_fmi2_import_serialized_fmu_state_size_req();
+  m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_serialized_fmu_state_size_req(mid=%d,fmuId=%d,stateId=%d)\n",r->message_id(),r->fmuid(),r->stateid());
+
+  fmi2_status_t status = fmi2_status_ok;
+  size_t size = 0;
+  fmi2_import_t* fmu = m_sendDummyResponses ? NULL : getFmi2Import(r->fmuid(), &status);
+  if (fmu) {
+    FmuStateStore* store = getFmuStateStore(r->fmuid(), &status);
+    fmi2_FMU_state_t state = store ? store->get(r->stateid()) : NULL;
+    if (state) {
+      status = fmi2_import_serialized_fmu_state_size(fmu, state, &size);
+      const Integrator::Snapshot* snapshot = store->getIntegrator(r->stateid());
+      if (snapshot) {
+        size += FmuStateStore::integratorSize(*snapshot);
+      }
+    } else {
+      m_logger.log(Logger::LOG_ERROR,"No FMU state with stateId=%d for fmuId=%d.\n",r->stateid(),r->fmuid());
+      status = fmi2_status_error;
     }
-    m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_get_directional_derivative_req(mid=%d,fmuId=%d,vref=%s,zref=%s,dv=%s)\n",r->message_id(),r->fmuid(),
-        arrayToString(v_ref, r->v_ref_size()).c_str(), arrayToString(z_ref, r->z_ref_size()).c_str(), arrayToString(dv, r->dv_size()).c_str());
+  }
 
-    fmi2_status_t status = fmi2_status_ok;
-    if (!m_sendDummyResponses) {
-      // interact with FMU
-      status = fmi2_import_get_directional_derivative(m_fmi2Instance, v_ref, r->v_ref_size(), z_ref, r->z_ref_size(), dv, dz);
+  // Create response
+  fmitcp_proto::fmi2_import_serialized_fmu_state_size_res * sizeRes = res.mutable_fmi2_import_serialized_fmu_state_size_res();
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_serialized_fmu_state_size_res);
+  sizeRes->set_message_id(r->message_id());
+  sizeRes->set_status(fmi2StatusToProtofmi2Status(status));
+  sizeRes->set_size(size);
+  m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_serialized_fmu_state_size_res(mid=%d,size=%lu,status=%d)\n",sizeRes->message_id(),(unsigned long)size,sizeRes->status());
+
+  return true;
+}
+
+bool Server::handle_fmi2_import_serialize_fmu_state_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::fmi2_import_serialize_fmu_state_req * r = req.mutable_fmi2_import_serialize_fmu_state_req();
+  m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_serialize_fmu_state_req(mid=%d,fmuId=%d,stateId=%d,offset=%ld)\n",r->message_id(),r->fmuid(),r->stateid(),(long)r->offset());
+
+  // Create response
+  fmitcp_proto::fmi2_import_serialize_fmu_state_res * serializeRes = res.mutable_fmi2_import_serialize_fmu_state_res();
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_serialize_fmu_state_res);
+  serializeRes->set_message_id(r->message_id());
+  serializeRes->set_offset(r->offset());
+  serializeRes->set_totalsize(0);
+
+  fmi2_status_t status = fmi2_status_ok;
+  fmi2_import_t* fmu = m_sendDummyResponses ? NULL : getFmi2Import(r->fmuid(), &status);
+  if (fmu) {
+    FmuStateStore* store = getFmuStateStore(r->fmuid(), &status);
+    if (store && (r->offset() == 0 || store->outgoingStateId != r->stateid())) {
+      // First chunk: serialize the whole state once, the following chunks are cut from the copy
+      store->clearTransfers();
+      fmi2_FMU_state_t state = store->get(r->stateid());
+      size_t size = 0;
+      if (!state) {
+        m_logger.log(Logger::LOG_ERROR,"No FMU state with stateId=%d for fmuId=%d.\n",r->stateid(),r->fmuid());
+        status = fmi2_status_error;
+      } else if (fmi2StatusOkOrWarning(status = fmi2_import_serialized_fmu_state_size(fmu, state, &size))) {
+        store->outgoing.resize(size);
+        status = fmi2_import_serialize_fmu_state(fmu, state, size ? (fmi2_byte_t*)&store->outgoing[0] : NULL, size);
+        if (fmi2StatusOkOrWarning(status)) {
+          // The integrator of a Model Exchange FMU goes along, so that de-serializing restores it too
+          const Integrator::Snapshot* snapshot = store->getIntegrator(r->stateid());
+          if (snapshot) {
+            FmuStateStore::appendIntegrator(store->outgoing, *snapshot);
+          }
+          store->outgoingStateId = r->stateid();
+        } else {
+          store->clearTransfers();
+        }
+      }
     }
 
-    // Create response
-    fmitcp_proto::fmi2_import_get_directional_derivative_res * getDirectionalDerivativesRes = res.mutable_fmi2_import_get_directional_derivative_res();
-    res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_directional_derivative_res);
-    getDirectionalDerivativesRes->set_message_id(r->message_id());
-    getDirectionalDerivativesRes->set_status(fmi2StatusToProtofmi2Status(status));
-    for (int i = 0 ; i < r->z_ref_size() ; i++) {
-      getDirectionalDerivativesRes->add_dz(dz[i]);
+    if (store && store->outgoingStateId == r->stateid()) {
+      const string& data = store->outgoing;
+      size_t offset = (size_t)r->offset();
+      if (r->offset() < 0 || offset > data.size()) {
+        m_logger.log(Logger::LOG_ERROR,"Offset %ld is outside the serialized state of size %lu.\n",(long)r->offset(),(unsigned long)data.size());
+        status = fmi2_status_error;
+      } else {
+        size_t chunkSize = data.size() - offset;
+        if (r->maxchunksize() > 0 && chunkSize > (size_t)r->maxchunksize()) {
+          chunkSize = r->maxchunksize();
+        }
+        serializeRes->set_data(data.data() + offset, chunkSize);
+        serializeRes->set_totalsize(data.size());
+        if (offset + chunkSize == data.size()) {
+          // Last chunk sent
+          store->clearTransfers();
+        }
+      }
     }
-    m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_get_directional_derivative_res(mid=%d,status=%d,dz=%s)\n",getDirectionalDerivativesRes->message_id(),getDirectionalDerivativesRes->status(),arrayToString(dz, r->z_ref_size()).c_str());
-
-  } else if(type == fmitcp_proto::fmitcp_message_Type_type_get_xml_req) {
-
-    // Unpack message
-    fmitcp_proto::get_xml_req * r = req.mutable_get_xml_req();
-    m_logger.log(Logger::LOG_NETWORK,"< get_xml_req(mid=%d,fmuId=%d)\n",r->message_id(),r->fmuid());
-
-    string xml = "";
-    if (!m_sendDummyResponses) {
-      // interact with FMU
-      string line;
-      char* xmlFilePath = fmi_import_get_model_description_path(m_workingDir.c_str(), &m_jmCallbacks);
-      m_logger.log(Logger::LOG_DEBUG,"xmlFilePath=%s\n",xmlFilePath);
-      ifstream xmlFile (xmlFilePath);
-      if (xmlFile.is_open()) {
-        while (getline(xmlFile, line)) {
-          xml.append(line).append("\n");
+  }
+
+  serializeRes->set_status(fmi2StatusToProtofmi2Status(status));
+  m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_serialize_fmu_state_res(mid=%d,offset=%ld,size=%lu,totalSize=%ld,status=%d)\n",serializeRes->message_id(),(long)serializeRes->offset(),(unsigned long)serializeRes->data().size(),(long)serializeRes->totalsize(),serializeRes->status());
+
+  return true;
+}
+
+bool Server::handle_fmi2_import_de_serialize_fmu_state_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::fmi2_import_de_serialize_fmu_state_req * r = req.mutable_fmi2_import_de_serialize_fmu_state_req();
+  m_logger.log(Logger::LOG_NETWORK,"< fmi2_import_de_serialize_fmu_state_req(mid=%d,fmuId=%d,offset=%ld,size=%lu,totalSize=%ld)\n",r->message_id(),r->fmuid(),(long)r->offset(),(unsigned long)r->data().size(),(long)r->totalsize());
+
+  fmi2_status_t status = fmi2_status_ok;
+  bool lastChunk = r->offset() + (long long)r->data().size() == r->totalsize();
+  int stateId = 0;
+  fmi2_import_t* fmu = m_sendDummyResponses ? NULL : getFmi2Import(r->fmuid(), &status);
+  if (fmu) {
+    FmuStateStore* store = getFmuStateStore(r->fmuid(), &status);
+    if (store) {
+      string& data = store->incoming;
+      if (r->offset() == 0) {
+        data.clear();
+        store->incomingSize = r->totalsize() > 0 ? (size_t)r->totalsize() : 0;
+      }
+      if (r->totalsize() < 0 || (unsigned long long)r->totalsize() > m_maxSerializedStateSize) {
+        m_logger.log(Logger::LOG_ERROR,"Refusing a serialized state of %ld bytes, the max is %lu bytes.\n",(long)r->totalsize(),(unsigned long)m_maxSerializedStateSize);
+        store->clearTransfers();
+        status = fmi2_status_error;
+      } else if (r->offset() != (long long)data.size() || (size_t)r->totalsize() != store->incomingSize ||
+                 r->offset() + (long long)r->data().size() > r->totalsize()) {
+        m_logger.log(Logger::LOG_ERROR,"Serialized state chunk at offset %ld does not follow the previous chunk.\n",(long)r->offset());
+        store->clearTransfers();
+        status = fmi2_status_error;
+      } else {
+        data.append(r->data());
+        if (lastChunk) {
+          // All chunks are here, make a state of them and keep it with the others, along with the integrator's
+          Integrator::Snapshot snapshot;
+          bool hasSnapshot = getIntegrator(r->fmuid()) && FmuStateStore::takeIntegrator(data, snapshot);
+          fmi2_FMU_state_t state = NULL;
+          status = fmi2_import_de_serialize_fmu_state(fmu, data.empty() ? NULL : (const fmi2_byte_t*)data.data(), data.size(), &state);
+          store->clearTransfers();
+          if (fmi2StatusOkOrWarning(status)) {
+            fmi2_FMU_state_t evicted;
+            stateId = store->add(state, &evicted, hasSnapshot ? &snapshot : NULL);
+            if (evicted) {
+              m_logger.log(Logger::LOG_DEBUG,"Too many FMU states for fmuId=%d, freeing the least recently used one.\n",r->fmuid());
+              fmi2_import_free_fmu_state(fmu, &evicted);
+            }
+          }
         }
-        xmlFile.close();
+      }
+    }
+  }
+
+  // Create response
+  fmitcp_proto::fmi2_import_de_serialize_fmu_state_res * deSerializeRes = res.mutable_fmi2_import_de_serialize_fmu_state_res();
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_de_serialize_fmu_state_res);
+  deSerializeRes->set_message_id(r->message_id());
+  deSerializeRes->set_status(fmi2StatusToProtofmi2Status(status));
+  if (lastChunk && fmi2StatusOkOrWarning(status)) {
+    deSerializeRes->set_stateid(stateId);
+  }
+  m_logger.log(Logger::LOG_NETWORK,"> fmi2_import_de_serialize_fmu_state_res(mid=%d,stateId=%d,status=%d)\n",deSerializeRes->message_id(),deSerializeRes->stateid(),deSerializeRes->status());
+
+  return true;
+}
+
+bool Server::handle_fmi2_import_get_directional_derivative_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::fmi2_import_get_directional_derivative_req * r = req.mutable_fmi2_import_get_directional_derivative_req();
+  int messageId = r->message_id();
+  int fmuId = r->fmuid();
+  fmi2_value_reference_t v_ref[r->v_ref_size()];
+  fmi2_value_reference_t z_ref[r->z_ref_size()];
+  fmi2_real_t dv[r->dv_size()], dz[r->z_ref_size()];
+
+  for (int i = 0 ; i < r->v_ref_size() ; i++) {
+    v_ref[i] = r->v_ref(i);
+  }
+  for (int i = 0 ; i < r->z_ref_size() ; i++) {
+    z_ref[i] = r->z_ref(i);
+  }
+  for (int i = 0 ; i < r->dv_size() ; i++) {
+    dv[i] = r->dv(i);
+  }
+  FMITCP_LOG(m_logger, Logger::LOG_NETWORK,"< fmi2_import_get_directional_derivative_req(mid=%d,fmuId=%d,vref=%s,zref=%s,dv=%s)\n",r->message_id(),r->fmuid(),
+      arrayToString(v_ref, r->v_ref_size()).c_str(), arrayToString(z_ref, r->z_ref_size()).c_str(), arrayToString(dv, r->dv_size()).c_str());
+
+  fmi2_status_t status = fmi2_status_ok;
+  fmi2_import_t* fmu = m_sendDummyResponses ? NULL : getFmi2Import(fmuId, &status);
+  if (fmu) {
+    // interact with FMU
+    status = fmi2_import_get_directional_derivative(fmu, v_ref, r->v_ref_size(), z_ref, r->z_ref_size(), dv, dz);
+  }
+
+  // Create response
+  fmitcp_proto::fmi2_import_get_directional_derivative_res * getDirectionalDerivativesRes = res.mutable_fmi2_import_get_directional_derivative_res();
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_get_directional_derivative_res);
+  getDirectionalDerivativesRes->set_message_id(r->message_id());
+  getDirectionalDerivativesRes->set_status(fmi2StatusToProtofmi2Status(status));
+  for (int i = 0 ; i < r->z_ref_size() ; i++) {
+    getDirectionalDerivativesRes->add_dz(dz[i]);
+  }
+  FMITCP_LOG(m_logger, Logger::LOG_NETWORK,"> fmi2_import_get_directional_derivative_res(mid=%d,status=%d,dz=%s)\n",getDirectionalDerivativesRes->message_id(),getDirectionalDerivativesRes->status(),arrayToString(dz, r->z_ref_size()).c_str());
+
+  return true;
+}
+
+bool Server::handle_get_xml_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::get_xml_req * r = req.mutable_get_xml_req();
+  m_logger.log(Logger::LOG_NETWORK,"< get_xml_req(mid=%d,fmuId=%d)\n",r->message_id(),r->fmuid());
+
+  // The XML was read when the FMU was unpacked. A client with the same copy gets only the hash back.
+  bool haveXml = !m_sendDummyResponses && !m_xmlHash.empty();
+  bool cached = haveXml && r->has_xmlhash() && r->xmlhash() == m_xmlHash;
+
+  // Create response
+  fmitcp_proto::get_xml_res * getXmlRes = res.mutable_get_xml_res();
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_get_xml_res);
+  getXmlRes->set_message_id(r->message_id());
+  getXmlRes->set_loglevel(fmiJMLogLevelToProtoJMLogLevel(m_logLevel));
+  if (cached || !haveXml) {
+    getXmlRes->set_xml("");
+  } else {
+    getXmlRes->set_xml(m_xml);
+  }
+  if (haveXml) {
+    getXmlRes->set_xmlhash(m_xmlHash);
+    getXmlRes->set_cached(cached);
+  }
+  // only printing the first 38 characters of xml.
+  m_logger.log(Logger::LOG_NETWORK,"> get_xml_res(mid=%d,logLevel=%d,xml=%.*s)\n",getXmlRes->message_id(), getXmlRes->loglevel(), 38, getXmlRes->xml().c_str());
+
+  return true;
+}
+
+bool Server::handle_fmi2_import_step_exchange_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::fmi2_import_step_exchange_req * r = req.mutable_fmi2_import_step_exchange_req();
+  int messageId = r->message_id();
+  int fmuId = r->fmuid();
+  double currentCommunicationPoint = r->currentcommunicationpoint(),
+      communicationStepSize = r->communicationstepsize();
+  bool newStep = r->newstep();
+
+  // Inputs and outputs, from prepared lists or from the request. Stops at the first list that does not resolve.
+  fmi2_status_t status = fmi2_status_ok;
+  fmi2_value_reference_t realListVr[r->realvaluereferences_size()];
+  fmi2_value_reference_t integerListVr[r->integervaluereferences_size()];
+  fmi2_value_reference_t booleanListVr[r->booleanvaluereferences_size()];
+  fmi2_value_reference_t stringListVr[r->stringvaluereferences_size()];
+  fmi2_value_reference_t realOutputListVr[r->realoutputvaluereferences_size()];
+  fmi2_value_reference_t integerOutputListVr[r->integeroutputvaluereferences_size()];
+  fmi2_value_reference_t booleanOutputListVr[r->booleanoutputvaluereferences_size()];
+  fmi2_value_reference_t stringOutputListVr[r->stringoutputvaluereferences_size()];
+  const fmi2_value_reference_t *realVr = NULL, *integerVr = NULL, *booleanVr = NULL, *stringVr = NULL,
+      *realOutputVr = NULL, *integerOutputVr = NULL, *booleanOutputVr = NULL, *stringOutputVr = NULL;
+  size_t nRealVr = 0, nIntegerVr = 0, nBooleanVr = 0, nStringVr = 0,
+      nRealOutputVr = 0, nIntegerOutputVr = 0, nBooleanOutputVr = 0, nStringOutputVr = 0;
+  bool deltaInputs = r->deltainputs();
+  bool resolved =
+      resolveValueReferences(fmuId, r->realvaluereferenceset(), r->realvaluereferences(), deltaInputs ? -1 : r->realvalues_size(), realListVr, &realVr, &nRealVr, &status) &&
+      resolveValueReferences(fmuId, r->integervaluereferenceset(), r->integervaluereferences(), deltaInputs ? -1 : r->integervalues_size(), integerListVr, &integerVr, &nIntegerVr, &status) &&
+      resolveValueReferences(fmuId, r->booleanvaluereferenceset(), r->booleanvaluereferences(), deltaInputs ? -1 : r->booleanvalues_size(), booleanListVr, &booleanVr, &nBooleanVr, &status) &&
+      resolveValueReferences(fmuId, r->stringvaluereferenceset(), r->stringvaluereferences(), deltaInputs ? -1 : r->stringvalues_size(), stringListVr, &stringVr, &nStringVr, &status) &&
+      resolveValueReferences(fmuId, r->realoutputvaluereferenceset(), r->realoutputvaluereferences(), -1, realOutputListVr, &realOutputVr, &nRealOutputVr, &status) &&
+      resolveValueReferences(fmuId, r->integeroutputvaluereferenceset(), r->integeroutputvaluereferences(), -1, integerOutputListVr, &integerOutputVr, &nIntegerOutputVr, &status) &&
+      resolveValueReferences(fmuId, r->booleanoutputvaluereferenceset(), r->booleanoutputvaluereferences(), -1, booleanOutputListVr, &booleanOutputVr, &nBooleanOutputVr, &status) &&
+      resolveValueReferences(fmuId, r->stringoutputvaluereferenceset(), r->stringoutputvaluereferences(), -1, stringOutputListVr, &stringOutputVr, &nStringOutputVr, &status);
+
+  // Only the changed inputs, the other variables keep theirs
+  fmi2_value_reference_t realChangedVr[r->realindices_size()];
+  fmi2_value_reference_t integerChangedVr[r->integerindices_size()];
+  fmi2_value_reference_t booleanChangedVr[r->booleanindices_size()];
+  fmi2_value_reference_t stringChangedVr[r->stringindices_size()];
+  if (resolved && deltaInputs) {
+    resolved =
+        selectValueReferences(r->realindices(), r->realvalues_size(), realChangedVr, &realVr, &nRealVr, &status) &&
+        selectValueReferences(r->integerindices(), r->integervalues_size(), integerChangedVr, &integerVr, &nIntegerVr, &status) &&
+        selectValueReferences(r->booleanindices(), r->booleanvalues_size(), booleanChangedVr, &booleanVr, &nBooleanVr, &status) &&
+        selectValueReferences(r->stringindices(), r->stringvalues_size(), stringChangedVr, &stringVr, &nStringVr, &status) &&
+        deltaInputsValid(fmuId, r->realvaluereferenceset(), &status) &&
+        deltaInputsValid(fmuId, r->integervaluereferenceset(), &status) &&
+        deltaInputsValid(fmuId, r->booleanvaluereferenceset(), &status) &&
+        deltaInputsValid(fmuId, r->stringvaluereferenceset(), &status);
+  }
+  if (!resolved) {
+    // No outputs are sent back for a failed request
+    nRealOutputVr = nIntegerOutputVr = nBooleanOutputVr = nStringOutputVr = 0;
+  }
+
+  fmi2_real_t realValue[r->realvalues_size()];
+  for (int i = 0 ; i < r->realvalues_size() ; i++) {
+    realValue[i] = r->realvalues(i);
+  }
+  fmi2_integer_t integerValue[r->integervalues_size()];
+  for (int i = 0 ; i < r->integervalues_size() ; i++) {
+    integerValue[i] = r->integervalues(i);
+  }
+  fmi2_boolean_t booleanValue[r->booleanvalues_size()];
+  for (int i = 0 ; i < r->booleanvalues_size() ; i++) {
+    booleanValue[i] = r->booleanvalues(i);
+  }
+  fmi2_string_t stringValue[r->stringvalues_size()];
+  for (int i = 0 ; i < r->stringvalues_size() ; i++) {
+    stringValue[i] = r->stringvalues(i).c_str();
+  }
+
+  fmi2_real_t realOutput[nRealOutputVr];
+  for (size_t i = 0 ; i < nRealOutputVr ; i++) {
+    realOutput[i] = 0.0;
+  }
+  fmi2_integer_t integerOutput[nIntegerOutputVr];
+  for (size_t i = 0 ; i < nIntegerOutputVr ; i++) {
+    integerOutput[i] = 0;
+  }
+  fmi2_boolean_t booleanOutput[nBooleanOutputVr];
+  for (size_t i = 0 ; i < nBooleanOutputVr ; i++) {
+    booleanOutput[i] = fmi2_false;
+  }
+  fmi2_string_t stringOutput[nStringOutputVr];
+  for (size_t i = 0 ; i < nStringOutputVr ; i++) {
+    stringOutput[i] = "";
+  }
+
+  FMITCP_LOG(m_logger, Logger::LOG_NETWORK,"< fmi2_import_step_exchange_req(mid=%d,fmuId=%d,commPoint=%g,stepSize=%g,newStep=%d,realVrs=%s,realValues=%s)\n",
+      messageId,fmuId,currentCommunicationPoint,communicationStepSize,newStep?1:0,
+      arrayToString(realVr, nRealVr).c_str(), arrayToString(realValue, r->realvalues_size()).c_str());
+
+  fmi2_import_t* fmu = (m_sendDummyResponses || !resolved) ? NULL : getFmi2Import(fmuId, &status);
+  bool inputsSet = resolved && fmi2StatusOkOrWarning(status);
+  if (fmu) {
+    // Set inputs, step and get outputs, stopping at the first failing call
+    inputsSet =
+        fmi2StatusOkOrWarning(status = fmi2_import_set_real(fmu, realVr, nRealVr, realValue)) &&
+        fmi2StatusOkOrWarning(status = fmi2_import_set_integer(fmu, integerVr, nIntegerVr, integerValue)) &&
+        fmi2StatusOkOrWarning(status = fmi2_import_set_boolean(fmu, booleanVr, nBooleanVr, booleanValue)) &&
+        fmi2StatusOkOrWarning(status = fmi2_import_set_string(fmu, stringVr, nStringVr, stringValue));
+    if (inputsSet &&
+        fmi2StatusOkOrWarning(status = doStep(fmuId, fmu, currentCommunicationPoint, communicationStepSize, newStep)) &&
+        fmi2StatusOkOrWarning(status = fmi2_import_get_real(fmu, realOutputVr, nRealOutputVr, realOutput)) &&
+        fmi2StatusOkOrWarning(status = fmi2_import_get_integer(fmu, integerOutputVr, nIntegerOutputVr, integerOutput)) &&
+        fmi2StatusOkOrWarning(status = fmi2_import_get_boolean(fmu, booleanOutputVr, nBooleanOutputVr, booleanOutput)) &&
+        fmi2StatusOkOrWarning(status = fmi2_import_get_string(fmu, stringOutputVr, nStringOutputVr, stringOutput))) {
+      // do nothing
+    }
+  }
+  trackInputs(fmuId, r->realvaluereferenceset(), deltaInputs, inputsSet);
+  trackInputs(fmuId, r->integervaluereferenceset(), deltaInputs, inputsSet);
+  trackInputs(fmuId, r->booleanvaluereferenceset(), deltaInputs, inputsSet);
+  trackInputs(fmuId, r->stringvaluereferenceset(), deltaInputs, inputsSet);
+
+  // Create response
+  fmitcp_proto::fmi2_import_step_exchange_res * stepExchangeRes = res.mutable_fmi2_import_step_exchange_res();
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_fmi2_import_step_exchange_res);
+  stepExchangeRes->set_message_id(messageId);
+  stepExchangeRes->set_status(fmi2StatusToProtofmi2Status(status));
+
+  // Only the changed outputs if the client asks for them, once it has all values of every list
+  bool deltaOutputs = r->deltaoutputs() && fmi2StatusOkOrWarning(status);
+  SentValues* realSent = getSentValues(fmuId, r->realoutputvaluereferenceset(), deltaOutputs);
+  SentValues* integerSent = getSentValues(fmuId, r->integeroutputvaluereferenceset(), deltaOutputs);
+  SentValues* booleanSent = getSentValues(fmuId, r->booleanoutputvaluereferenceset(), deltaOutputs);
+  SentValues* stringSent = getSentValues(fmuId, r->stringoutputvaluereferenceset(), deltaOutputs);
+  bool delta = deltaOutputs &&
+      (nRealOutputVr == 0 || (realSent && realSent->reals.size() == nRealOutputVr)) &&
+      (nIntegerOutputVr == 0 || (integerSent && integerSent->integers.size() == nIntegerOutputVr)) &&
+      (nBooleanOutputVr == 0 || (booleanSent && booleanSent->booleans.size() == nBooleanOutputVr)) &&
+      (nStringOutputVr == 0 || (stringSent && stringSent->strings.size() == nStringOutputVr));
+  if (delta) {
+    stepExchangeRes->set_delta(true);
+  }
+  addValues(realOutput, nRealOutputVr, !delta, r->realoutputthreshold(), realSent ? &realSent->reals : NULL,
+            stepExchangeRes->mutable_realindices(), stepExchangeRes->mutable_realvalues());
+  addValues(integerOutput, nIntegerOutputVr, !delta, 0, integerSent ? &integerSent->integers : NULL,
+            stepExchangeRes->mutable_integerindices(), stepExchangeRes->mutable_integervalues());
+  addValues(booleanOutput, nBooleanOutputVr, !delta, 0, booleanSent ? &booleanSent->booleans : NULL,
+            stepExchangeRes->mutable_booleanindices(), stepExchangeRes->mutable_booleanvalues());
+  addValues(stringOutput, nStringOutputVr, !delta, 0, stringSent ? &stringSent->strings : NULL,
+            stepExchangeRes->mutable_stringindices(), stepExchangeRes->mutable_stringvalues());
+  FMITCP_LOG(m_logger, Logger::LOG_NETWORK,"> fmi2_import_step_exchange_res(mid=%d,status=%d,realValues=%s)\n",messageId,stepExchangeRes->status(),
+      arrayToString(realOutput, nRealOutputVr).c_str());
+
+  return true;
+}
+
+bool Server::handle_prepare_value_references_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::prepare_value_references_req * r = req.mutable_prepare_value_references_req();
+  int messageId = r->message_id();
+  int fmuId = r->fmuid();
+  FMITCP_LOG(m_logger, Logger::LOG_NETWORK,"< prepare_value_references_req(mid=%d,fmuId=%d,vrs=%d)\n",messageId,fmuId,r->valuereferences_size());
+
+  fmi2_status_t status = fmi2_status_ok;
+  int valueReferenceSet = 0;
+  if (m_sendDummyResponses || getFmi2Import(fmuId, &status)) {
+    ValueReferenceSets* sets = getValueReferenceSets(fmuId, true);
+    valueReferenceSet = sets->nextId++;
+    sets->sets[valueReferenceSet].assign(r->valuereferences().begin(), r->valuereferences().end());
+  }
+
+  // Create response
+  fmitcp_proto::prepare_value_references_res * prepareRes = res.mutable_prepare_value_references_res();
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_prepare_value_references_res);
+  prepareRes->set_message_id(messageId);
+  prepareRes->set_status(fmi2StatusToProtofmi2Status(status));
+  if (valueReferenceSet) {
+    prepareRes->set_valuereferenceset(valueReferenceSet);
+  }
+  m_logger.log(Logger::LOG_NETWORK,"> prepare_value_references_res(mid=%d,status=%d,set=%d)\n",messageId,prepareRes->status(),valueReferenceSet);
+
+  return true;
+}
+
+bool Server::handle_release_value_references_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::release_value_references_req * r = req.mutable_release_value_references_req();
+  int messageId = r->message_id();
+  int fmuId = r->fmuid();
+  m_logger.log(Logger::LOG_NETWORK,"< release_value_references_req(mid=%d,fmuId=%d,set=%d)\n",messageId,fmuId,r->valuereferenceset());
+
+  fmi2_status_t status = fmi2_status_ok;
+  ValueReferenceSets* sets = getValueReferenceSets(fmuId, false);
+  if (sets) {
+    // The values of the list, for every connection
+    for (map<pair<unsigned int, int>, SentValues>::iterator it = sets->sent.begin(); it != sets->sent.end(); ) {
+      if (it->first.second == r->valuereferenceset()) {
+        sets->sent.erase(it++);
+      } else {
+        ++it;
+      }
+    }
+    for (set<pair<unsigned int, int> >::iterator it = sets->lostInputs.begin(); it != sets->lostInputs.end(); ) {
+      if (it->second == r->valuereferenceset()) {
+        sets->lostInputs.erase(it++);
       } else {
-        m_logger.log(Logger::LOG_ERROR, "Error opening the %s file.\n", xmlFilePath);
+        ++it;
       }
-      free(xmlFilePath);
     }
+  }
+  if (!sets || sets->sets.erase(r->valuereferenceset()) == 0) {
+    m_logger.log(Logger::LOG_ERROR, "No value reference set %d for fmuId=%d.\n", r->valuereferenceset(), fmuId);
+    status = fmi2_status_error;
+  }
+
+  // Create response
+  fmitcp_proto::release_value_references_res * releaseRes = res.mutable_release_value_references_res();
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_release_value_references_res);
+  releaseRes->set_message_id(messageId);
+  releaseRes->set_status(fmi2StatusToProtofmi2Status(status));
+  m_logger.log(Logger::LOG_NETWORK,"> release_value_references_res(mid=%d,status=%d)\n",messageId,releaseRes->status());
 
-    // Create response
-    fmitcp_proto::get_xml_res * getXmlRes = res.mutable_get_xml_res();
-    res.set_type(fmitcp_proto::fmitcp_message_Type_type_get_xml_res);
-    getXmlRes->set_message_id(r->message_id());
-    getXmlRes->set_loglevel(fmiJMLogLevelToProtoJMLogLevel(m_logLevel));
-    getXmlRes->set_xml(xml);
-    // only printing the first 38 characters of xml.
-    m_logger.log(Logger::LOG_NETWORK,"> get_xml_res(mid=%d,logLevel=%d,xml=%.*s)\n",getXmlRes->message_id(), getXmlRes->loglevel(), 38, getXmlRes->xml().c_str());
+  return true;
+}
 
+bool Server::handle_subscribe_outputs_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::subscribe_outputs_req * r = req.mutable_subscribe_outputs_req();
+  int messageId = r->message_id();
+  int fmuId = r->fmuid();
+  m_logger.log(Logger::LOG_NETWORK,"< subscribe_outputs_req(mid=%d,fmuId=%d,vrs=%d/%d/%d/%d)\n",messageId,fmuId,
+      r->realvaluereferences_size(),r->integervaluereferences_size(),r->booleanvaluereferences_size(),r->stringvaluereferences_size());
+
+  fmi2_status_t status = fmi2_status_ok;
+  if (m_sendDummyResponses || getFmi2Import(fmuId, &status)) {
+    bool empty = r->realvaluereferences_size() == 0 && r->integervaluereferences_size() == 0 &&
+        r->booleanvaluereferences_size() == 0 && r->stringvaluereferences_size() == 0;
+    lw_sync_lock(m_instancesLock);
+    if (empty) {
+      m_outputSubscriptions.erase(fmuId);
+    } else {
+      OutputSubscription& subscription = m_outputSubscriptions[fmuId];
+      subscription.realValueReferences.assign(r->realvaluereferences().begin(), r->realvaluereferences().end());
+      subscription.integerValueReferences.assign(r->integervaluereferences().begin(), r->integervaluereferences().end());
+      subscription.booleanValueReferences.assign(r->booleanvaluereferences().begin(), r->booleanvaluereferences().end());
+      subscription.stringValueReferences.assign(r->stringvaluereferences().begin(), r->stringvaluereferences().end());
+      subscription.delta = r->delta();
+      subscription.realThreshold = r->realthreshold();
+      subscription.sent.clear();
+    }
+    lw_sync_release(m_instancesLock);
+  }
+
+  // Create response
+  fmitcp_proto::subscribe_outputs_res * subscribeRes = res.mutable_subscribe_outputs_res();
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_subscribe_outputs_res);
+  subscribeRes->set_message_id(messageId);
+  subscribeRes->set_status(fmi2StatusToProtofmi2Status(status));
+  m_logger.log(Logger::LOG_NETWORK,"> subscribe_outputs_res(mid=%d,status=%d)\n",messageId,subscribeRes->status());
+
+  return true;
+}
+
+bool Server::handle_get_jacobian_req(fmitcp_proto::fmitcp_message& req, fmitcp_proto::fmitcp_message& res) {
+  // Unpack message
+  fmitcp_proto::get_jacobian_req * r = req.mutable_get_jacobian_req();
+  int messageId = r->message_id();
+  int fmuId = r->fmuid();
+  fmi2_status_t status = fmi2_status_ok;
+  fmi2_value_reference_t unknownListVr[r->unknownvaluereferences_size()], knownListVr[r->knownvaluereferences_size()];
+  const fmi2_value_reference_t *unknownVr = unknownListVr, *knownVr = knownListVr;
+  size_t nUnknownVr, nKnownVr;
+  bool resolved =
+      resolveValueReferences(fmuId, r->unknownvaluereferenceset(), r->unknownvaluereferences(), -1, unknownListVr, &unknownVr, &nUnknownVr, &status) &&
+      resolveValueReferences(fmuId, r->knownvaluereferenceset(), r->knownvaluereferences(), -1, knownListVr, &knownVr, &nKnownVr, &status);
+  if (!resolved) {
+    nUnknownVr = nKnownVr = 0;
+  }
+  FMITCP_LOG(m_logger, Logger::LOG_NETWORK,"< get_jacobian_req(mid=%d,fmuId=%d,unknowns=%s,knowns=%s,sparse=%d,fd=%d,h=%g)\n",messageId,fmuId,
+      arrayToString(unknownVr, nUnknownVr).c_str(),arrayToString(knownVr, nKnownVr).c_str(),r->sparse(),r->finitedifferences(),r->communicationstepsize());
+
+  fmi2_import_t* fmu = (m_sendDummyResponses || !resolved) ? NULL : getFmi2Import(fmuId, &status);
+  // Directional derivatives do not give the outputs after a step, and not every FMU provides them
+  bool finiteDifferences = fmu && (r->finitedifferences() || r->communicationstepsize() > 0 ||
+                                   !getCapability(fmu, fmi2_cs_providesDirectionalDerivatives, fmi2_me_providesDirectionalDerivatives));
+  JacobianPattern pattern;
+  if (fmu && !(finiteDifferences && r->communicationstepsize() > 0)) {
+    pattern.build(fmu, unknownVr, nUnknownVr, knownVr, nKnownVr);
   } else {
-    // Something is wrong.
-    sendResponse = false;
-    m_logger.log(Logger::LOG_ERROR,"Message type not recognized: %d.\n",type);
+    pattern.setDense(nUnknownVr, nKnownVr);
+  }
+  vector<fmi2_real_t> jacobian(nUnknownVr * nKnownVr, 0.0);
+  fmi2_real_t* values = jacobian.empty() ? NULL : &jacobian[0];
+  int numSeeds = 0;
+  if (finiteDifferences && !getCapability(fmu, fmi2_cs_canGetAndSetFMUstate, fmi2_me_canGetAndSetFMUstate)) {
+    m_logger.log(Logger::LOG_ERROR, "Finite differences need an FMU that can get and set its state.\n");
+    status = fmi2_status_error;
+  } else if (finiteDifferences) {
+    double perturbation = r->relativeperturbation() > 0 ? r->relativeperturbation() : DEFAULT_PERTURBATION;
+    status = finiteDifferenceJacobian(fmuId, fmu, pattern, unknownVr, knownVr, r->currentcommunicationpoint(),
+                                      r->communicationstepsize(), perturbation, values, &numSeeds);
+  } else if (fmu) {
+    status = directionalJacobian(fmu, pattern, unknownVr, knownVr, values, &numSeeds);
   }
 
-  if (sendResponse) {
-    sendMessage(c, &res);
+  // Create response
+  fmitcp_proto::get_jacobian_res * jacobianRes = res.mutable_get_jacobian_res();
+  res.set_type(fmitcp_proto::fmitcp_message_Type_type_get_jacobian_res);
+  jacobianRes->set_message_id(messageId);
+  jacobianRes->set_status(fmi2StatusToProtofmi2Status(status));
+  jacobianRes->set_numseeds(numSeeds);
+  if (finiteDifferences) {
+    jacobianRes->set_finitedifferences(true);
   }
+  if (fmi2StatusOkOrWarning(status)) {
+    if (r->sparse()) {
+      jacobianRes->set_sparse(true);
+      for (int i = 0 ; i < pattern.getNumRows() ; i++) {
+        const vector<int>& row = pattern.getRow(i);
+        for (size_t k = 0 ; k < row.size() ; k++) {
+          jacobianRes->add_rows(i);
+          jacobianRes->add_columns(row[k]);
+          jacobianRes->add_values(jacobian[i * nKnownVr + row[k]]);
+        }
+      }
+    } else {
+      jacobianRes->mutable_values()->Reserve(jacobian.size());
+      for (size_t i = 0 ; i < jacobian.size() ; i++) {
+        jacobianRes->add_values(jacobian[i]);
+      }
+    }
+  }
+  FMITCP_LOG(m_logger, Logger::LOG_NETWORK,"> get_jacobian_res(mid=%d,status=%d,values=%d,seeds=%d)\n",messageId,jacobianRes->status(),jacobianRes->values_size(),numSeeds);
+
+  return true;
+}
+
+void Server::workerResponse(ServerJob * job) {
+  if (job->hasResponse) {
+    instanceMade(job->res, job->clientId);
+    map<Transport*, Connection>::iterator it = m_connections.find(job->transport);
+    if (it == m_connections.end() || it->second.id != job->connectionId) {
+      m_logger.log(Logger::LOG_DEBUG,"Dropping a response, the client has disconnected.\n");
+    } else if (job->serialize) {
+      job->transport->write(job->frame.data(), job->frame.size());
+    } else {
+      job->transport->writeMessage(job->res);
+    }
+  }
+  m_freeJobs.push_back(job);
 }
 
 void Server::error(lw_server s, lw_error error) {
@@ -1038,13 +2984,97 @@ void Server::host(string hostName, long port) {
   lw_server_host_filter(m_server, filter);
   lw_filter_delete(filter);
 
+  m_workers.start(m_numWorkers);
+
   m_logger.log(Logger::LOG_NETWORK,"Listening to %s:%ld\n",hostName.c_str(),port);
 }
 
+bool Server::hostUnix(string path) {
+  if (m_unixSocket >= 0) {
+    m_logger.log(Logger::LOG_ERROR,"Already listening to %s\n",m_unixSocketPath.c_str());
+    return false;
+  }
+  m_unixSocket = UnixSocketTransport::listen(path);
+  if (m_unixSocket < 0) {
+    m_logger.log(Logger::LOG_ERROR,"Could not listen to the Unix domain socket %s\n",path.c_str());
+    return false;
+  }
+  m_unixSocketPath = path;
+  m_unixSocketWatch = lw_pump_add(m_pump->getPump(), m_unixSocket, this, serverOnUnixSocketReady, NULL, lw_true);
+
+  m_workers.start(m_numWorkers);
+
+  m_logger.log(Logger::LOG_NETWORK,"Listening to %s\n",path.c_str());
+  return true;
+}
+
+void Server::unixSocketReady() {
+  // Edge triggered, so take every client that is waiting
+  UnixSocketTransport * transport;
+  while ((transport = UnixSocketTransport::accept(m_pump, m_unixSocket)) != NULL) {
+    addConnection(transport);
+  }
+}
+
+void Server::setNumWorkers(int numWorkers) {
+  m_numWorkers = numWorkers;
+}
+
+void Server::setMaxFmuStates(size_t maxFmuStates) {
+  m_maxFmuStates = maxFmuStates > 0 ? maxFmuStates : 1;
+}
+
+void Server::setMaxSerializedStateSize(size_t maxSize) {
+  m_maxSerializedStateSize = maxSize;
+}
+
+void Server::setIntegrator(Integrator::Method method, double relativeTolerance) {
+  m_integratorMethod = method;
+  m_integratorTolerance = relativeTolerance > 0 ? relativeTolerance : Integrator::DEFAULT_TOLERANCE;
+}
+
+void Server::setInstancePoolSize(size_t poolSize) {
+  vector<fmi2_import_t*> extra;
+  lw_sync_lock(m_instancesLock);
+  m_instancePoolSize = poolSize;
+  while (m_instancePool.size() > poolSize) {
+    extra.push_back(m_instancePool.back());
+    m_instancePool.pop_back();
+  }
+  size_t missing = poolSize - m_instancePool.size();
+  lw_sync_release(m_instancesLock);
+  for (size_t i = 0; i < extra.size(); i++) {
+    deleteFmi2Instance(extra[i]);
+  }
+
+  // Instantiate up front, so that the first clients do not wait either. The lock is only taken to add each one.
+  for (; m_fmi2Model && !m_sendDummyResponses && missing > 0; missing--) {
+    fmi2_import_t* fmu;
+    if (newFmi2Instance(&fmu) == jm_status_error) {
+      break;
+    }
+    lw_sync_lock(m_instancesLock);
+    bool room = m_instancePool.size() < m_instancePoolSize;
+    if (room) {
+      m_instancePool.push_back(fmu);
+    }
+    lw_sync_release(m_instancesLock);
+    if (!room) {
+      deleteFmi2Instance(fmu);
+      break;
+    }
+  }
+}
+
+void Server::setSharedMemory(bool sharedMemory) {
+  m_sharedMemory = sharedMemory;
+}
+
 void Server::sendDummyResponses(bool sendDummyResponses) {
   m_sendDummyResponses = sendDummyResponses;
 }
 
-void Server::sendMessage(lw_client c, fmitcp_proto::fmitcp_message* message) {
-  fmitcp::sendProtoBuffer(c,message);
+void Server::sendMessage(Transport * transport, fmitcp_proto::fmitcp_message* message) {
+  FMITCP_LOG(m_logger, Logger::LOG_NETWORK_DEBUG, "sendProtoBuffer(%s)\n", message->DebugString().c_str());
+  fmitcp::sendProtoBuffer(transport,message,m_sendBuffer);
 }
@@ -0,0 +1,440 @@
+#include "ShmTransport.h"
+
+using namespace fmitcp;
+
+#ifdef __linux__
+
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+namespace {
+
+    const uint32_t SHM_MAGIC = 0x666d6974;
+    const char SHM_PREFIX[] = "/fmitcp-";
+
+    /// Longest and shortest time the reader thread spins on its doorbell before it goes to sleep, in nanoseconds
+    const int64_t MAX_SPIN_NS = 50000;
+    const int64_t MIN_SPIN_NS = 2000;
+
+    /// Spinning only pays off if the other end runs on another core at the same time
+    bool canSpin() {
+        static bool spin = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+        return spin;
+    }
+
+    int64_t nowNs() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+    /// Ring buffer for one direction. Head and tail count bytes since the start and wrap around.
+    struct Ring {
+        /// Only moved by the writer
+        volatile uint32_t head;
+        char pad0[60];
+
+        /// Only moved by the reader
+        volatile uint32_t tail;
+
+        /// Set by the writer when the ring is full, so the reader rings back when it has made room
+        volatile int32_t writerWaiting;
+        char pad1[56];
+    };
+
+    void cpuRelax() {
+#if defined(__i386__) || defined(__x86_64__)
+        __asm__ __volatile__("pause");
+#endif
+    }
+
+    void futexWait(volatile int32_t * address, int32_t value) {
+        // Not FUTEX_WAIT_PRIVATE, the word is shared with the other process
+        syscall(SYS_futex, address, FUTEX_WAIT, value, NULL, NULL, 0);
+    }
+
+    void futexWake(volatile int32_t * address) {
+        syscall(SYS_futex, address, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+
+}
+
+namespace fmitcp {
+
+    /// Start of the segment. The data of the two rings follows it.
+    struct ShmHeader {
+        uint32_t magic;
+        uint32_t ringSize;
+
+        /// Set by the end that closes
+        volatile int32_t closed;
+        char pad0[52];
+
+        /// Rung to wake up the reader thread of each end. Futex words.
+        volatile int32_t doorbell[2];
+
+        /// True while the reader thread of each end sleeps on its doorbell
+        volatile int32_t sleeping[2];
+        char pad1[48];
+
+        /// Ring written by each end
+        Ring rings[2];
+    };
+
+    /// Posted to the pump by the reader thread. Outlives the transport if it is still queued when the transport is deleted.
+    struct ShmWakeup {
+        ShmTransport * transport;
+        volatile int32_t posted;
+    };
+
+}
+
+void shmTransportWakeup(void * data) {
+    ShmWakeup * wakeup = (ShmWakeup*)data;
+    if (!wakeup->transport) {
+        delete wakeup;
+        return;
+    }
+    wakeup->transport->wakeup();
+}
+
+void * shmTransportMain(void * tag) {
+    ShmTransport * transport = (ShmTransport*)tag;
+    transport->run();
+    return NULL;
+}
+
+bool ShmTransport::isSupported() {
+    return true;
+}
+
+ShmTransport * ShmTransport::create(EventPump * pump, size_t ringSize) {
+    // A power of two, so the wrapping counters stay valid
+    size_t size = 4096;
+    while (size < ringSize && size < (1u << 30)) {
+        size <<= 1;
+    }
+
+    static volatile int32_t counter = 0;
+    char name[64];
+    snprintf(name, sizeof(name), "%s%d-%d", SHM_PREFIX, (int)getpid(), (int)__sync_fetch_and_add(&counter, 1));
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        return NULL;
+    }
+    size_t total = sizeof(ShmHeader) + 2 * size;
+    void * memory = MAP_FAILED;
+    if (ftruncate(fd, total) == 0) {
+        memory = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (memory == MAP_FAILED) {
+        shm_unlink(name);
+        return NULL;
+    }
+
+    // The new segment is zero filled
+    ShmHeader * header = (ShmHeader*)memory;
+    header->ringSize = size;
+    __sync_synchronize();
+    header->magic = SHM_MAGIC;
+    return new ShmTransport(pump, name, 0, memory, total);
+}
+
+ShmTransport * ShmTransport::open(EventPump * pump, const std::string& name) {
+    // The name comes from the other end, so only segments made by create() are opened
+    if (name.compare(0, sizeof(SHM_PREFIX) - 1, SHM_PREFIX) != 0 || name.find('/', 1) != std::string::npos) {
+        return NULL;
+    }
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    void * memory = MAP_FAILED;
+    size_t total = 0;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(ShmHeader)) {
+        total = st.st_size;
+        memory = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    shm_unlink(name.c_str());
+    if (memory == MAP_FAILED) {
+        return NULL;
+    }
+
+    ShmHeader * header = (ShmHeader*)memory;
+    size_t ringSize = header->ringSize;
+    __sync_synchronize();
+    if (header->magic != SHM_MAGIC || ringSize == 0 || (ringSize & (ringSize - 1)) != 0 ||
+        total != sizeof(ShmHeader) + 2 * ringSize) {
+        munmap(memory, total);
+        return NULL;
+    }
+    return new ShmTransport(pump, name, 1, memory, total);
+}
+
+ShmTransport::ShmTransport(EventPump * pump, const std::string& name, int side, void * memory, size_t size) {
+    m_pump = pump;
+    m_name = name;
+    m_side = side;
+    m_header = (ShmHeader*)memory;
+    m_size = size;
+    m_ringSize = m_header->ringSize;
+    char * data = (char*)memory + sizeof(ShmHeader);
+    m_out = data + side * m_ringSize;
+    m_in = data + (1 - side) * m_ringSize;
+    m_thread = NULL;
+    m_stopping = 0;
+    m_wakeup = new ShmWakeup;
+    m_wakeup->transport = this;
+    m_wakeup->posted = 0;
+    m_closing = false;
+    m_closedNotified = false;
+}
+
+ShmTransport::~ShmTransport() {
+    m_listener = NULL;
+
+    // Let the other end know
+    if (!m_closing) {
+        m_header->closed = 1;
+        ring(1 - m_side);
+    }
+
+    if (m_thread) {
+        m_stopping = 1;
+        ring(m_side);
+        lw_thread_join(m_thread);
+        lw_thread_delete(m_thread);
+    }
+
+    // A wakeup still in the pump queue deletes itself
+    if (m_wakeup->posted) {
+        m_wakeup->transport = NULL;
+    } else {
+        delete m_wakeup;
+    }
+    munmap(m_header, m_size);
+}
+
+void ShmTransport::unlink() {
+    shm_unlink(m_name.c_str());
+}
+
+void ShmTransport::start() {
+    if (m_thread) {
+        return;
+    }
+    m_thread = lw_thread_new("fmitcp shm", (void*)shmTransportMain);
+    lw_thread_start(m_thread, this);
+}
+
+void ShmTransport::run() {
+    volatile int32_t * doorbell = &m_header->doorbell[m_side];
+    int32_t seen = *doorbell;
+    __sync_synchronize();
+    int64_t spinNs = canSpin() ? MAX_SPIN_NS : 0;
+
+    // Anything written before the thread started
+    post();
+
+    while (true) {
+        // Spin for a while, timed rather than counted since a pause takes from a few to over a hundred cycles
+        if (spinNs > 0 && *doorbell == seen && !m_stopping) {
+            int64_t deadline = nowNs() + spinNs;
+            for (int spins = 1 ; *doorbell == seen && !m_stopping ; spins++) {
+                cpuRelax();
+                if ((spins & 63) == 0 && nowNs() >= deadline) {
+                    break;
+                }
+            }
+        }
+        bool slept = false;
+        while (*doorbell == seen && !m_stopping) {
+            m_header->sleeping[m_side] = 1;
+            __sync_synchronize();
+            if (*doorbell == seen && !m_stopping) {
+                futexWait(doorbell, seen);
+            }
+            m_header->sleeping[m_side] = 0;
+            slept = true;
+        }
+        if (m_stopping) {
+            break;
+        }
+
+        // The other end answering within the spin means it is busy, so spin longer. Having to sleep means it is
+        // not, so spin shorter and burn less of a core on an idle connection.
+        if (spinNs > 0) {
+            spinNs = slept ? std::max(spinNs / 2, MIN_SPIN_NS) : std::min(spinNs * 2, MAX_SPIN_NS);
+        }
+
+        // Read the doorbell before the pump looks at the rings, so a ring after that is not missed
+        seen = *doorbell;
+        __sync_synchronize();
+        post();
+    }
+}
+
+void ShmTransport::post() {
+    if (__sync_bool_compare_and_swap(&m_wakeup->posted, 0, 1)) {
+        lw_pump_post(m_pump->getPump(), (void*)shmTransportWakeup, m_wakeup);
+    }
+}
+
+void ShmTransport::ring(int side) {
+    __sync_fetch_and_add(&m_header->doorbell[side], 1);
+    if (m_header->sleeping[side]) {
+        futexWake(&m_header->doorbell[side]);
+    }
+}
+
+void ShmTransport::wakeup() {
+    // From here on, a new ring posts again
+    m_wakeup->posted = 0;
+    __sync_synchronize();
+
+    // Hand the data to the listener straight from the ring. Data that wraps around comes in two pieces.
+    Ring& in = m_header->rings[1 - m_side];
+    while (!m_closing) {
+        uint32_t tail = in.tail;
+        uint32_t head = in.head;
+        __sync_synchronize();
+        if (head == tail) {
+            break;
+        }
+        size_t offset = tail & (m_ringSize - 1);
+        size_t size = head - tail;
+        if (size > m_ringSize - offset) {
+            size = m_ringSize - offset;
+        }
+        if (m_listener) {
+            m_listener->transportData(this, m_in + offset, size);
+        }
+        __sync_synchronize();
+        in.tail = tail + size;
+    }
+    __sync_synchronize();
+    if (in.writerWaiting) {
+        in.writerWaiting = 0;
+        ring(1 - m_side);
+    }
+
+    flushOutbox();
+
+    if (!m_closedNotified && (m_closing || m_header->closed)) {
+        m_closedNotified = true;
+        // May delete this
+        if (m_listener) {
+            m_listener->transportClosed(this);
+        }
+    }
+}
+
+size_t ShmTransport::writeRing(const char * data, size_t size) {
+    Ring& out = m_header->rings[m_side];
+    uint32_t head = out.head;
+    uint32_t tail = out.tail;
+    __sync_synchronize();
+
+    size_t space = m_ringSize - (uint32_t)(head - tail);
+    if (size > space) {
+        size = space;
+    }
+    if (size == 0) {
+        return 0;
+    }
+    size_t offset = head & (m_ringSize - 1);
+    size_t first = size < m_ringSize - offset ? size : m_ringSize - offset;
+    memcpy(m_out + offset, data, first);
+    memcpy(m_out, data + first, size - first);
+    __sync_synchronize();
+    out.head = head + size;
+    ring(1 - m_side);
+    return size;
+}
+
+void ShmTransport::flushOutbox() {
+    while (!m_outbox.empty()) {
+        size_t written = writeRing(m_outbox.data(), m_outbox.size());
+        if (written == 0) {
+            // Full. Ask the reader to ring back, and try once more in case it made room just now.
+            m_header->rings[m_side].writerWaiting = 1;
+            __sync_synchronize();
+            written = writeRing(m_outbox.data(), m_outbox.size());
+            if (written == 0) {
+                return;
+            }
+        }
+        m_outbox.erase(0, written);
+    }
+}
+
+void ShmTransport::write(const char * data, size_t size) {
+    if (m_closing || m_header->closed) {
+        return;
+    }
+    // Keep the order: nothing goes into the ring while older data waits in the outbox
+    if (m_outbox.empty()) {
+        size_t written = writeRing(data, size);
+        data += written;
+        size -= written;
+    }
+    if (size > 0) {
+        m_outbox.append(data, size);
+        flushOutbox();
+    }
+}
+
+void ShmTransport::close() {
+    if (m_closing) {
+        return;
+    }
+    m_closing = true;
+    m_header->closed = 1;
+    ring(1 - m_side);
+
+    // The listener hears about it from wakeup(), like when the other end closes
+    post();
+}
+
+bool ShmTransport::isConnected() const {
+    return !m_closing && !m_header->closed;
+}
+
+#else
+
+bool ShmTransport::isSupported() {
+    return false;
+}
+
+ShmTransport * ShmTransport::create(EventPump * pump, size_t ringSize) {
+    return NULL;
+}
+
+ShmTransport * ShmTransport::open(EventPump * pump, const std::string& name) {
+    return NULL;
+}
+
+ShmTransport::~ShmTransport() {}
+void ShmTransport::unlink() {}
+void ShmTransport::start() {}
+void ShmTransport::write(const char * data, size_t size) {}
+void ShmTransport::close() {}
+bool ShmTransport::isConnected() const {return false;}
+void ShmTransport::wakeup() {}
+void ShmTransport::run() {}
+
+#endif
@@ -0,0 +1,83 @@
+#include "TcpTransport.h"
+
+using namespace fmitcp;
+
+void tcpTransportOnConnect(lw_client c) {
+    TcpTransport * transport = (TcpTransport*)lw_stream_tag(c);
+    transport->onConnect();
+}
+void tcpTransportOnData(lw_client c, const char* data, long size) {
+    TcpTransport * transport = (TcpTransport*)lw_stream_tag(c);
+    transport->onData(data,size);
+}
+void tcpTransportOnDisconnect(lw_client c) {
+    TcpTransport * transport = (TcpTransport*)lw_stream_tag(c);
+    transport->onDisconnect();
+}
+void tcpTransportOnError(lw_client c, lw_error error) {
+    TcpTransport * transport = (TcpTransport*)lw_stream_tag(c);
+    transport->onError(error);
+}
+
+TcpTransport::TcpTransport(EventPump * pump){
+    m_client = lw_client_new(pump->getPump());
+    m_clientEnd = true;
+    //lw_fdstream_nagle(m_client,lw_false);
+}
+
+TcpTransport::TcpTransport(lw_client client){
+    m_client = client;
+    m_clientEnd = false;
+}
+
+TcpTransport::~TcpTransport(){
+    // No events while going away
+    m_listener = NULL;
+    if(m_clientEnd){
+        lw_stream_close(m_client,lw_true);
+        lw_stream_delete(m_client);
+    }
+}
+
+void TcpTransport::connect(const std::string& host, long port){
+    lw_stream_set_tag(m_client, (void*)this);
+    lw_client_on_connect(   m_client, tcpTransportOnConnect);
+    lw_client_on_data(      m_client, tcpTransportOnData);
+    lw_client_on_disconnect(m_client, tcpTransportOnDisconnect);
+    lw_client_on_error(     m_client, tcpTransportOnError);
+    lw_client_connect(m_client, host.c_str(), port);
+}
+
+void TcpTransport::write(const char * data, size_t size){
+    lw_stream_write(m_client, data, size);
+}
+
+void TcpTransport::close(){
+    lw_stream_close(m_client, lw_true);
+}
+
+bool TcpTransport::isConnected() const {
+    if(m_clientEnd)
+        return lw_client_connected(m_client);
+    return true;
+}
+
+void TcpTransport::onConnect(){
+    if(m_listener)
+        m_listener->transportConnected(this);
+}
+
+void TcpTransport::onData(const char * data, size_t size){
+    if(m_listener)
+        m_listener->transportData(this, data, size);
+}
+
+void TcpTransport::onDisconnect(){
+    if(m_listener)
+        m_listener->transportClosed(this);
+}
+
+void TcpTransport::onError(lw_error error){
+    if(m_listener)
+        m_listener->transportError(this, lw_error_tostring(error));
+}
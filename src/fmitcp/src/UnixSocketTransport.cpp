@@ -0,0 +1,156 @@
+#include "UnixSocketTransport.h"
+
+using namespace fmitcp;
+
+#ifndef _WIN32
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+void unixSocketOnData(lw_stream stream, void * tag, const char * data, size_t size) {
+    UnixSocketTransport * transport = (UnixSocketTransport*)tag;
+    transport->onData(data, size);
+}
+void unixSocketOnClose(lw_stream stream, void * tag) {
+    UnixSocketTransport * transport = (UnixSocketTransport*)tag;
+    transport->onClose();
+}
+
+/// Fill in a socket address. Returns false if the path does not fit.
+static bool unixSocketAddress(const std::string& path, struct sockaddr_un * address) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address->sun_path)) {
+        return false;
+    }
+    memcpy(address->sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+UnixSocketTransport::UnixSocketTransport(EventPump * pump, int fd) {
+    m_closed = false;
+    m_stream = lw_fdstream_new(pump->getPump());
+    lw_stream_add_hook_data(m_stream, unixSocketOnData, this);
+    lw_stream_add_hook_close(m_stream, unixSocketOnClose, this);
+    lw_fdstream_set_fd(m_stream, fd, NULL, lw_true);
+    lw_stream_read(m_stream, (size_t)-1);
+}
+
+UnixSocketTransport::~UnixSocketTransport() {
+    // No events while going away
+    m_listener = NULL;
+    lw_stream_close(m_stream, lw_true);
+    lw_stream_delete(m_stream);
+}
+
+UnixSocketTransport * UnixSocketTransport::connect(EventPump * pump, const std::string& path) {
+    struct sockaddr_un address;
+    if (!unixSocketAddress(path, &address)) {
+        return NULL;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    // A local connect does not wait for the other end, so it can be done before going non-blocking
+    if (::connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        ::close(fd);
+        return NULL;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return new UnixSocketTransport(pump, fd);
+}
+
+int UnixSocketTransport::listen(const std::string& path) {
+    struct sockaddr_un address;
+    if (!unixSocketAddress(path, &address)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    // A socket file left by a server that did not shut down would make bind fail
+    ::unlink(path.c_str());
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || ::listen(fd, SOMAXCONN) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+UnixSocketTransport * UnixSocketTransport::accept(EventPump * pump, int listenFd) {
+    int fd;
+    do {
+        fd = ::accept(listenFd, NULL, NULL);
+    } while (fd < 0 && errno == EINTR);
+    if (fd < 0) {
+        return NULL;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return new UnixSocketTransport(pump, fd);
+}
+
+void UnixSocketTransport::closeListener(int listenFd, const std::string& path) {
+    ::close(listenFd);
+    ::unlink(path.c_str());
+}
+
+void UnixSocketTransport::write(const char * data, size_t size) {
+    lw_stream_write(m_stream, data, size);
+}
+
+void UnixSocketTransport::close() {
+    lw_stream_close(m_stream, lw_true);
+}
+
+bool UnixSocketTransport::isConnected() const {
+    return !m_closed;
+}
+
+void UnixSocketTransport::onData(const char * data, size_t size) {
+    if (m_listener) {
+        m_listener->transportData(this, data, size);
+    }
+}
+
+void UnixSocketTransport::onClose() {
+    if (m_closed) {
+        return;
+    }
+    m_closed = true;
+    // May delete this
+    if (m_listener) {
+        m_listener->transportClosed(this);
+    }
+}
+
+#else
+
+UnixSocketTransport::~UnixSocketTransport() {}
+
+UnixSocketTransport * UnixSocketTransport::connect(EventPump * pump, const std::string& path) {
+    return NULL;
+}
+
+int UnixSocketTransport::listen(const std::string& path) {
+    return -1;
+}
+
+UnixSocketTransport * UnixSocketTransport::accept(EventPump * pump, int listenFd) {
+    return NULL;
+}
+
+void UnixSocketTransport::closeListener(int listenFd, const std::string& path) {}
+void UnixSocketTransport::write(const char * data, size_t size) {}
+void UnixSocketTransport::close() {}
+bool UnixSocketTransport::isConnected() const {return false;}
+void UnixSocketTransport::onData(const char * data, size_t size) {}
+void UnixSocketTransport::onClose() {}
+
+#endif
@@ -0,0 +1,123 @@
+#include "WorkerPool.h"
+
+using namespace fmitcp;
+
+WorkerPool::WorkerPool(){
+    m_sync = lw_sync_new();
+    m_wakeup = lw_event_new();
+    m_stopping = false;
+}
+
+WorkerPool::~WorkerPool(){
+    stop();
+    lw_event_delete(m_wakeup);
+    lw_sync_delete(m_sync);
+}
+
+void * WorkerPool::workerMain(void * tag){
+    WorkerPool * pool = (WorkerPool*)tag;
+    pool->work();
+    return NULL;
+}
+
+void WorkerPool::start(int numThreads){
+    if(!m_threads.empty())
+        return;
+
+    m_stopping = false;
+    for(int i=0; i<numThreads; i++){
+        lw_thread thread = lw_thread_new("fmitcp worker", (void*)workerMain);
+        lw_thread_start(thread, this);
+        m_threads.push_back(thread);
+    }
+}
+
+void WorkerPool::stop(){
+    if(m_threads.empty())
+        return;
+
+    lw_sync_lock(m_sync);
+    m_stopping = true;
+    lw_event_signal(m_wakeup);
+    lw_sync_release(m_sync);
+
+    for(size_t i=0; i<m_threads.size(); i++){
+        lw_thread_join(m_threads[i]);
+        lw_thread_delete(m_threads[i]);
+    }
+    m_threads.clear();
+
+    // Drop the jobs that never ran
+    std::map<int,Queue>::iterator it;
+    for(it = m_queues.begin(); it != m_queues.end(); ++it){
+        std::deque<Job>& jobs = it->second.jobs;
+        for(size_t i=0; i<jobs.size(); i++){
+            if(jobs[i].discard)
+                jobs[i].discard(jobs[i].data);
+        }
+    }
+    m_queues.clear();
+    m_ready.clear();
+    lw_event_unsignal(m_wakeup);
+}
+
+void WorkerPool::post(int queueId, JobFunction run, JobFunction discard, void * data){
+    Job job;
+    job.run = run;
+    job.discard = discard;
+    job.data = data;
+
+    lw_sync_lock(m_sync);
+    Queue& queue = m_queues[queueId];
+    queue.jobs.push_back(job);
+    if(!queue.running && queue.jobs.size() == 1){
+        m_ready.push_back(queueId);
+        lw_event_signal(m_wakeup);
+    }
+    lw_sync_release(m_sync);
+}
+
+void WorkerPool::work(){
+    while(true){
+        lw_event_wait(m_wakeup, -1);
+
+        lw_sync_lock(m_sync);
+        if(m_stopping){
+            lw_sync_release(m_sync);
+            return;
+        }
+        if(m_ready.empty()){
+            // Another worker got here first
+            lw_sync_release(m_sync);
+            continue;
+        }
+
+        int queueId = m_ready.front();
+        m_ready.pop_front();
+        if(m_ready.empty())
+            lw_event_unsignal(m_wakeup);
+
+        Queue& queue = m_queues[queueId];
+        Job job = queue.jobs.front();
+        queue.jobs.pop_front();
+        queue.running = true;
+        lw_sync_release(m_sync);
+
+        job.run(job.data);
+
+        lw_sync_lock(m_sync);
+        Queue& done = m_queues[queueId];
+        done.running = false;
+        if(done.jobs.empty()){
+            m_queues.erase(queueId);
+        } else {
+            m_ready.push_back(queueId);
+            lw_event_signal(m_wakeup);
+        }
+        lw_sync_release(m_sync);
+    }
+}
+
+int WorkerPool::getNumThreads() const {
+    return (int)m_threads.size();
+}
@@ -1,17 +1,138 @@
 #include "common.h"
+#include "FrameDecoder.h"
 #include <vector>
 #include <string>
+#include <stdio.h>
+#include <string.h>
+
+void fmitcp::serializeFrame(fmitcp_proto::fmitcp_message * message, std::string& frame){
+    // Serialize the length prefix and the message into one buffer so they go out in a single write
+    int size = message->ByteSize();
+    frame.resize(FrameDecoder::MAX_HEADER_SIZE + size);
+    size_t headerSize = FrameDecoder::encodeHeader(size, &frame[0]);
+    message->SerializeWithCachedSizesToArray((google::protobuf::uint8*)&frame[headerSize]);
+    frame.resize(headerSize + size);
+}
+
+typedef std::vector<std::pair<const google::protobuf::FieldDescriptor*, const google::protobuf::FieldDescriptor*> > RequestFields;
+
+/// Get an int32 field of the request in a message, or -1 if the request does not have one
+static int getRequestField(const fmitcp_proto::fmitcp_message& message, const char * name, RequestFields& fields){
+    using google::protobuf::FieldDescriptor;
+
+    // For each message type: the field holding the request, and the named field of the request. The request field
+    // is named like the type, without the "type_" prefix. Looked up on the first call.
+    if(fields.empty()){
+        const google::protobuf::EnumDescriptor * types = fmitcp_proto::fmitcp_message_Type_descriptor();
+        fields.resize(fmitcp_proto::fmitcp_message_Type_Type_MAX + 1);
+        for(int i=0; i<types->value_count(); i++){
+            const std::string& typeName = types->value(i)->name();
+            const FieldDescriptor * request = message.GetDescriptor()->FindFieldByName(typeName.substr(5));
+            if(!request || request->cpp_type() != FieldDescriptor::CPPTYPE_MESSAGE)
+                continue;
+            const FieldDescriptor * field = request->message_type()->FindFieldByName(name);
+            if(field && field->cpp_type() == FieldDescriptor::CPPTYPE_INT32)
+                fields[types->value(i)->number()] = std::make_pair(request, field);
+        }
+    }
+
+    const FieldDescriptor * request = fields[message.type()].first;
+    const FieldDescriptor * field = fields[message.type()].second;
+    const google::protobuf::Reflection * reflection = message.GetReflection();
+    if(!request || !reflection->HasField(message, request))
+        return -1;
+    const google::protobuf::Message& r = reflection->GetMessage(message, request);
+    return r.GetReflection()->GetInt32(r, field);
+}
+
+int fmitcp::getFmuId(const fmitcp_proto::fmitcp_message& message){
+    static RequestFields fields;
+    return getRequestField(message, "fmuId", fields);
+}
+
+int fmitcp::getMessageId(const fmitcp_proto::fmitcp_message& message){
+    static RequestFields fields;
+    return getRequestField(message, "message_id", fields);
+}
 
 void fmitcp::sendProtoBuffer(lw_client c, fmitcp_proto::fmitcp_message * message){
     std::string s;
-    bool status = message->SerializeToString(&s);
-    //printf("serialize status=%d\n", status);
-    lw_stream_write(c, s.c_str(), s.size());
-    //std::string newline = "\n";
-    //lw_stream_write(c, newline.c_str(),newline.size());
-    //fflush(NULL);
-    //
-    printf("sendProtoBuffer(%s)\n", message->DebugString().c_str());
+    sendProtoBuffer(c, message, s);
+}
+
+void fmitcp::sendProtoBuffer(lw_client c, fmitcp_proto::fmitcp_message * message, std::string& buffer){
+    serializeFrame(message, buffer);
+    lw_stream_write(c, buffer.data(), buffer.size());
+}
+
+/// Put the length prefix and the body of a frame into one buffer, so they go out in a single write
+static void frameBuffer(const char* data, size_t size, std::string& frame){
+    frame.resize(fmitcp::FrameDecoder::MAX_HEADER_SIZE + size);
+    size_t headerSize = fmitcp::FrameDecoder::encodeHeader(size, &frame[0]);
+    if(size > 0)
+        memcpy(&frame[headerSize], data, size);
+    frame.resize(headerSize + size);
+}
+
+void fmitcp::sendFrame(lw_client c, const char* data, size_t size){
+    std::string frame;
+    frameBuffer(data, size, frame);
+    lw_stream_write(c, frame.data(), frame.size());
+}
+
+void fmitcp::sendProtoBuffer(Transport * transport, fmitcp_proto::fmitcp_message * message, std::string& buffer){
+    if(transport->writeMessage(*message))
+        return;
+    serializeFrame(message, buffer);
+    transport->write(buffer.data(), buffer.size());
+}
+
+void fmitcp::sendFrame(Transport * transport, const char* data, size_t size){
+    std::string frame;
+    frameBuffer(data, size, frame);
+    transport->write(frame.data(), frame.size());
+}
+
+// 64-bit FNV-1a
+static const unsigned long long HASH_START = 14695981039346656037ULL;
+
+static unsigned long long hashUpdate(unsigned long long hash, const char* data, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    hash ^= (unsigned char)data[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+/// The size is appended to make collisions between different lengths impossible
+static string hashText(unsigned long long hash, unsigned long long size) {
+  char text[48];
+  snprintf(text, sizeof(text), "%016llx-%llu", hash, size);
+  return text;
+}
+
+string fmitcp::contentHash(const string& data) {
+  return hashText(hashUpdate(HASH_START, data.data(), data.size()), data.size());
+}
+
+bool fmitcp::fileContentHash(const string& path, string* hash) {
+  FILE* file = fopen(path.c_str(), "rb");
+  if (!file) {
+    return false;
+  }
+  unsigned long long h = HASH_START, size = 0;
+  char buffer[65536];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    h = hashUpdate(h, buffer, n);
+    size += n;
+  }
+  bool ok = !ferror(file);
+  fclose(file);
+  if (ok) {
+    *hash = hashText(h, size);
+  }
+  return ok;
 }
 
 string fmitcp::dataToString(const char* data, long size) {
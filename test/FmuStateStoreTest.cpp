@@ -0,0 +1,131 @@
+#include <fmitcp/FmuStateStore.h>
+#include <vector>
+#include <stdio.h>
+#include <assert.h>
+
+using namespace fmitcp;
+
+/// The store only keeps the handles, so any distinct pointers will do
+static char handles[10];
+#define STATE(i) ((fmi2_FMU_state_t)&handles[i])
+
+static void testEvictsLeastRecentlyUsed(){
+    FmuStateStore store;
+    store.setCapacity(3);
+    fmi2_FMU_state_t evicted;
+    int a = store.add(STATE(0), &evicted);
+    assert(evicted == NULL);
+    int b = store.add(STATE(1), &evicted);
+    int c = store.add(STATE(2), &evicted);
+    assert(evicted == NULL && store.size() == 3);
+    assert(a != b && b != c && a != c);
+
+    // Using a makes b the least recently used
+    assert(store.get(a) == STATE(0));
+    int d = store.add(STATE(3), &evicted);
+    assert(evicted == STATE(1) && store.size() == 3);
+    assert(store.get(b) == NULL);
+
+    // Then c, then a
+    store.add(STATE(4), &evicted);
+    assert(evicted == STATE(2));
+    store.add(STATE(5), &evicted);
+    assert(evicted == STATE(0));
+    assert(store.get(d) == STATE(3));
+}
+
+static void testRemove(){
+    FmuStateStore store;
+    store.setCapacity(2);
+    fmi2_FMU_state_t evicted;
+    int a = store.add(STATE(0), &evicted);
+    int b = store.add(STATE(1), &evicted);
+    assert(store.remove(a) == STATE(0));
+    assert(store.remove(a) == NULL && store.get(a) == NULL);
+
+    // The removed state left room, so nothing is evicted
+    store.add(STATE(2), &evicted);
+    assert(evicted == NULL && store.size() == 2);
+    store.add(STATE(3), &evicted);
+    assert(evicted == STATE(1));
+    assert(store.get(b) == NULL);
+
+    // Removing the state that is being sent drops the transfer
+    int c = store.add(STATE(4), &evicted);
+    store.outgoing = "serialized";
+    store.outgoingStateId = c;
+    store.remove(c);
+    assert(store.outgoing.empty() && store.outgoingStateId == -1);
+
+    std::vector<fmi2_FMU_state_t> states;
+    store.removeAll(states);
+    assert(states.size() == 1 && store.size() == 0);
+}
+
+static void testIntegratorSnapshot(){
+    FmuStateStore store;
+    fmi2_FMU_state_t evicted;
+    Integrator::Snapshot snapshot;
+    snapshot.stepSize = 0.25;
+    snapshot.terminated = false;
+    snapshot.lastStatus = fmi2_status_ok;
+    snapshot.lastSuccessfulTime = 2;
+    snapshot.nominals.push_back(1);
+    int withIntegrator = store.add(STATE(0), &evicted, &snapshot);
+    int withoutIntegrator = store.add(STATE(1), &evicted);
+
+    // A copy is kept
+    snapshot.stepSize = 0;
+    const Integrator::Snapshot * saved = store.getIntegrator(withIntegrator);
+    assert(saved && saved->stepSize == 0.25 && saved->nominals.size() == 1);
+    assert(store.getIntegrator(withoutIntegrator) == NULL);
+}
+
+static void testSerializedIntegrator(){
+    Integrator::Snapshot snapshot;
+    snapshot.stepSize = 0.125;
+    snapshot.eventInfo.newDiscreteStatesNeeded = fmi2_false;
+    snapshot.eventInfo.terminateSimulation = fmi2_false;
+    snapshot.eventInfo.nominalsOfContinuousStatesChanged = fmi2_false;
+    snapshot.eventInfo.valuesOfContinuousStatesChanged = fmi2_true;
+    snapshot.eventInfo.nextEventTimeDefined = fmi2_true;
+    snapshot.eventInfo.nextEventTime = 2.5;
+    snapshot.terminated = true;
+    snapshot.lastStatus = fmi2_status_discard;
+    snapshot.lastSuccessfulTime = 1.75;
+    snapshot.nominals.push_back(1);
+    snapshot.nominals.push_back(1000);
+
+    std::string fmuState("serialized by the FMU", 21);
+    std::string data = fmuState;
+    FmuStateStore::appendIntegrator(data, snapshot);
+    assert(data.size() == fmuState.size() + FmuStateStore::integratorSize(snapshot));
+
+    Integrator::Snapshot taken;
+    assert(FmuStateStore::takeIntegrator(data, taken));
+    assert(data == fmuState);
+    assert(taken.stepSize == 0.125 && taken.terminated && taken.lastStatus == fmi2_status_discard);
+    assert(taken.lastSuccessfulTime == 1.75);
+    assert(taken.eventInfo.nextEventTimeDefined && taken.eventInfo.nextEventTime == 2.5);
+    assert(taken.eventInfo.valuesOfContinuousStatesChanged && !taken.eventInfo.newDiscreteStatesNeeded);
+    assert(taken.nominals.size() == 2 && taken.nominals[1] == 1000);
+
+    // A state without one is left alone, also when it is short or its end looks almost right
+    assert(!FmuStateStore::takeIntegrator(data, taken) && data == fmuState);
+    std::string empty;
+    assert(!FmuStateStore::takeIntegrator(empty, taken));
+    std::string broken = fmuState;
+    FmuStateStore::appendIntegrator(broken, snapshot);
+    broken[broken.size() - 8] ^= 1;
+    std::string copy = broken;
+    assert(!FmuStateStore::takeIntegrator(broken, taken) && broken == copy);
+}
+
+int main(int argc, char const *argv[]){
+    testEvictsLeastRecentlyUsed();
+    testRemove();
+    testIntegratorSnapshot();
+    testSerializedIntegrator();
+    printf("FmuStateStore tests passed.\n");
+    return 0;
+}
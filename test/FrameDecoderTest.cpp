@@ -0,0 +1,152 @@
+#include <fmitcp/FrameDecoder.h>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <assert.h>
+
+using namespace fmitcp;
+
+/// A frame with its length prefix, as it goes on the wire
+static std::string frame(const std::string& body){
+    char header[FrameDecoder::MAX_HEADER_SIZE];
+    size_t headerSize = FrameDecoder::encodeHeader(body.size(), header);
+    return std::string(header, headerSize) + body;
+}
+
+/// A body of the given size, with bytes that tell where they are
+static std::string body(size_t size, char seed){
+    std::string s(size, 0);
+    for(size_t i=0; i<size; i++)
+        s[i] = (char)(seed + i * 7);
+    return s;
+}
+
+/// Take all complete frames out of the decoder. They are copied, since feed() may invalidate them.
+static std::vector<std::string> drain(FrameDecoder& decoder){
+    std::vector<std::string> frames;
+    const char * data;
+    size_t size;
+    while(decoder.next(&data, &size))
+        frames.push_back(std::string(data, size));
+    return frames;
+}
+
+static void testHeaderSizes(){
+    // Sizes around the varint byte boundaries
+    size_t sizes[] = {0, 1, 127, 128, 16383, 16384, 2097151, 2097152};
+    char header[FrameDecoder::MAX_HEADER_SIZE];
+    size_t expected[] = {1, 1, 1, 2, 2, 3, 3, 4};
+    for(size_t i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++)
+        assert(FrameDecoder::encodeHeader(sizes[i], header) == expected[i]);
+
+    for(size_t i=0; i<6; i++){
+        FrameDecoder decoder;
+        std::string b = body(sizes[i], (char)i);
+        std::string f = frame(b);
+        decoder.feed(f.data(), f.size());
+        std::vector<std::string> frames = drain(decoder);
+        assert(frames.size() == 1 && frames[0] == b);
+        assert(decoder.getBufferedSize() == 0 && !decoder.hasError());
+    }
+}
+
+static void testSeveralFramesInOneRead(){
+    std::string a = body(3, 'a'), b = body(0, 'b'), c = body(200, 'c');
+    std::string data = frame(a) + frame(b) + frame(c);
+
+    FrameDecoder decoder;
+    decoder.feed(data.data(), data.size());
+    std::vector<std::string> frames = drain(decoder);
+    assert(frames.size() == 3);
+    assert(frames[0] == a && frames[1] == b && frames[2] == c);
+    assert(decoder.getBufferedSize() == 0);
+}
+
+static void testSplitReads(){
+    // Two frames with two byte headers, split at every possible point, also inside the headers
+    std::string a = body(130, 'a'), b = body(300, 'b');
+    std::string data = frame(a) + frame(b);
+    for(size_t split=0; split<=data.size(); split++){
+        FrameDecoder decoder;
+        std::string first = data.substr(0, split), second = data.substr(split);
+        decoder.feed(first.data(), first.size());
+        std::vector<std::string> frames = drain(decoder);
+        // Nothing may be lost when the caller reuses its read buffer
+        first.assign(first.size(), '\xff');
+        decoder.feed(second.data(), second.size());
+        std::vector<std::string> rest = drain(decoder);
+        frames.insert(frames.end(), rest.begin(), rest.end());
+        assert(frames.size() == 2 && frames[0] == a && frames[1] == b);
+        assert(decoder.getBufferedSize() == 0 && !decoder.hasError());
+    }
+}
+
+static void testByteByByte(){
+    std::string a = body(20000, 'a'), b = body(1, 'b');
+    std::string data = frame(a) + frame(b);
+    FrameDecoder decoder;
+    std::vector<std::string> frames;
+    size_t pending = 0;
+    for(size_t i=0; i<data.size(); i++){
+        char byte = data[i];
+        decoder.feed(&byte, 1);
+        std::vector<std::string> got = drain(decoder);
+        frames.insert(frames.end(), got.begin(), got.end());
+        // Bytes are kept until their frame is complete, and no longer
+        pending = got.empty() ? pending + 1 : 0;
+        assert(decoder.getBufferedSize() == pending);
+    }
+    assert(frames.size() == 2 && frames[0] == a && frames[1] == b);
+}
+
+static void testPartialHeader(){
+    // The first byte of a three byte header says more is coming
+    std::string f = frame(body(20000, 'x'));
+    FrameDecoder decoder;
+    decoder.feed(f.data(), 1);
+    const char * data;
+    size_t size;
+    assert(!decoder.next(&data, &size) && !decoder.hasError());
+    assert(decoder.getBufferedSize() == 1);
+    decoder.feed(f.data() + 1, f.size() - 1);
+    assert(decoder.next(&data, &size) && size == 20000);
+}
+
+static void testOversizedFrame(){
+    FrameDecoder decoder;
+    decoder.setMaxFrameSize(100);
+    std::string ok = frame(body(100, 'o'));
+    std::string tooLarge = frame(body(101, 't'));
+    std::string data = ok + tooLarge;
+    decoder.feed(data.data(), data.size());
+    const char * frameData;
+    size_t size;
+    assert(decoder.next(&frameData, &size) && size == 100);
+
+    // Refused as soon as the header is there, without waiting for the body
+    assert(!decoder.next(&frameData, &size) && decoder.hasError());
+    decoder.feed(ok.data(), ok.size());
+    assert(!decoder.next(&frameData, &size));
+
+    decoder.reset();
+    assert(!decoder.hasError() && decoder.getBufferedSize() == 0);
+    decoder.feed(ok.data(), ok.size());
+    assert(decoder.next(&frameData, &size) && size == 100);
+
+    // A length that does not fit any header is corrupt as well
+    FrameDecoder corrupt;
+    std::string header(FrameDecoder::MAX_HEADER_SIZE + 1, '\x80');
+    corrupt.feed(header.data(), header.size());
+    assert(!corrupt.next(&frameData, &size) && corrupt.hasError());
+}
+
+int main(int argc, char const *argv[]){
+    testHeaderSizes();
+    testSeveralFramesInOneRead();
+    testSplitReads();
+    testByteByByte();
+    testPartialHeader();
+    testOversizedFrame();
+    printf("FrameDecoder tests passed.\n");
+    return 0;
+}
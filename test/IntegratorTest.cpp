@@ -0,0 +1,307 @@
+#include <fmitcp/Integrator.h>
+#include <math.h>
+#include <stdio.h>
+#include <assert.h>
+
+using namespace fmitcp;
+
+/*
+ * The Model Exchange functions of the FMI Library that the integrator calls, faked with a few test models instead of
+ * an FMU. This executable is not linked with the FMI Library.
+ */
+
+enum Kind {
+    /// x' = -lambda x
+    DECAY,
+
+    /// h' = v, v' = -g. When h gets to 0, v = -0.8 v. Event indicator h.
+    BALL,
+
+    /// x' = 1, until a time event at 0.25 sets x to 10. Terminates there if terminateAtEvent.
+    TIMER,
+
+    /// No states and no event indicators
+    EMPTY
+};
+
+static struct Model {
+    Kind kind;
+    double time;
+    double x[2];
+    double lambda;
+    bool terminateAtEvent;
+    bool failDerivatives;
+
+    /// Event iterations after initialization, and the time of the last one
+    int events;
+    double eventTime;
+    bool initialized;
+
+    /// Bounces of the ball, and the time of the last one
+    int bounces;
+    double bounceTime;
+} model;
+
+static void setModel(Kind kind){
+    model.kind = kind;
+    model.time = 0;
+    model.x[0] = kind == BALL ? 1 : kind == DECAY ? 1 : 0;
+    model.x[1] = 0;
+    model.lambda = 1;
+    model.terminateAtEvent = false;
+    model.failDerivatives = false;
+    model.events = 0;
+    model.eventTime = -1;
+    model.initialized = false;
+    model.bounces = 0;
+    model.bounceTime = -1;
+}
+
+static const double G = 9.81;
+static fmi2_import_t* const FMU = (fmi2_import_t*)&model;
+
+size_t fmi2_import_get_number_of_continuous_states(fmi2_import_t* fmu){
+    return model.kind == BALL ? 2 : model.kind == EMPTY ? 0 : 1;
+}
+
+size_t fmi2_import_get_number_of_event_indicators(fmi2_import_t* fmu){
+    return model.kind == BALL ? 1 : 0;
+}
+
+fmi2_status_t fmi2_import_set_time(fmi2_import_t* fmu, fmi2_real_t time){
+    model.time = time;
+    return fmi2_status_ok;
+}
+
+fmi2_status_t fmi2_import_set_continuous_states(fmi2_import_t* fmu, const fmi2_real_t x[], size_t nx){
+    assert(nx == fmi2_import_get_number_of_continuous_states(fmu));
+    for(size_t i=0; i<nx; i++)
+        model.x[i] = x[i];
+    return fmi2_status_ok;
+}
+
+fmi2_status_t fmi2_import_get_continuous_states(fmi2_import_t* fmu, fmi2_real_t x[], size_t nx){
+    assert(nx == fmi2_import_get_number_of_continuous_states(fmu));
+    for(size_t i=0; i<nx; i++)
+        x[i] = model.x[i];
+    return fmi2_status_ok;
+}
+
+fmi2_status_t fmi2_import_get_derivatives(fmi2_import_t* fmu, fmi2_real_t derivatives[], size_t nx){
+    assert(nx == fmi2_import_get_number_of_continuous_states(fmu));
+    if(model.failDerivatives)
+        return fmi2_status_error;
+    switch(model.kind){
+    case DECAY: derivatives[0] = -model.lambda * model.x[0]; break;
+    case BALL: derivatives[0] = model.x[1]; derivatives[1] = -G; break;
+    case TIMER: derivatives[0] = 1; break;
+    case EMPTY: break;
+    }
+    return fmi2_status_ok;
+}
+
+fmi2_status_t fmi2_import_get_event_indicators(fmi2_import_t* fmu, fmi2_real_t eventIndicators[], size_t ni){
+    assert(ni == 1 && model.kind == BALL);
+    eventIndicators[0] = model.x[0];
+    return fmi2_status_ok;
+}
+
+fmi2_status_t fmi2_import_get_nominals_of_continuous_states(fmi2_import_t* fmu, fmi2_real_t x_nominal[], size_t nx){
+    for(size_t i=0; i<nx; i++)
+        x_nominal[i] = 1;
+    return fmi2_status_ok;
+}
+
+fmi2_status_t fmi2_import_enter_event_mode(fmi2_import_t* fmu){
+    return fmi2_status_ok;
+}
+
+fmi2_status_t fmi2_import_enter_continuous_time_mode(fmi2_import_t* fmu){
+    model.initialized = true;
+    return fmi2_status_ok;
+}
+
+fmi2_status_t fmi2_import_completed_integrator_step(fmi2_import_t* fmu, fmi2_boolean_t noSetFMUStatePriorToCurrentPoint,
+                                                    fmi2_boolean_t* enterEventMode, fmi2_boolean_t* terminateSimulation){
+    *enterEventMode = fmi2_false;
+    *terminateSimulation = fmi2_false;
+    return fmi2_status_ok;
+}
+
+fmi2_status_t fmi2_import_new_discrete_states(fmi2_import_t* fmu, fmi2_event_info_t* eventInfo){
+    eventInfo->newDiscreteStatesNeeded = fmi2_false;
+    eventInfo->terminateSimulation = fmi2_false;
+    eventInfo->nominalsOfContinuousStatesChanged = fmi2_false;
+    eventInfo->valuesOfContinuousStatesChanged = fmi2_false;
+    eventInfo->nextEventTimeDefined = fmi2_false;
+    eventInfo->nextEventTime = 0;
+    if(model.initialized){
+        model.events++;
+        model.eventTime = model.time;
+    }
+
+    if(model.kind == BALL && model.initialized && model.x[0] <= 0){
+        model.x[0] = 0;
+        model.x[1] = -0.8 * model.x[1];
+        model.bounces++;
+        model.bounceTime = model.time;
+        eventInfo->valuesOfContinuousStatesChanged = fmi2_true;
+    } else if(model.kind == TIMER){
+        if(!model.initialized){
+            eventInfo->nextEventTimeDefined = fmi2_true;
+            eventInfo->nextEventTime = 0.25;
+        } else if(model.terminateAtEvent){
+            eventInfo->terminateSimulation = fmi2_true;
+        } else {
+            model.x[0] = 10;
+            eventInfo->valuesOfContinuousStatesChanged = fmi2_true;
+        }
+    }
+    return fmi2_status_ok;
+}
+
+/// Take steps of stepSize from 0 to endTime, returning the status of the last one
+static fmi2_status_t simulate(Integrator& integrator, double endTime, double stepSize){
+    fmi2_status_t status = fmi2_status_ok;
+    for(int i=0; i * stepSize < endTime - 1e-9 && status == fmi2_status_ok; i++)
+        status = integrator.doStep(i * stepSize, stepSize);
+    return status;
+}
+
+static void testDecay(){
+    Integrator::Method methods[] = {Integrator::METHOD_RK45, Integrator::METHOD_BDF1};
+    double tolerances[] = {1e-6, 1e-3};
+    for(int m=0; m<2; m++){
+        setModel(DECAY);
+        Integrator integrator(FMU, methods[m], 1e-6);
+        assert(integrator.initialize() == fmi2_status_ok);
+        assert(simulate(integrator, 1, 0.1) == fmi2_status_ok);
+        assert(fabs(model.x[0] - exp(-1.0)) < tolerances[m]);
+        assert(fabs(integrator.getLastSuccessfulTime() - 1) < 1e-9);
+        assert(model.events == 0);
+    }
+}
+
+static void testStiff(){
+    // The implicit method gets to the end with steps far larger than 1 / lambda
+    setModel(DECAY);
+    model.lambda = 1e5;
+    Integrator integrator(FMU, Integrator::METHOD_BDF1, 1e-4);
+    assert(integrator.initialize() == fmi2_status_ok);
+    assert(simulate(integrator, 1, 0.1) == fmi2_status_ok);
+    assert(fabs(model.x[0]) < 1e-6);
+}
+
+static void testStateEvent(){
+    setModel(BALL);
+    Integrator integrator(FMU, Integrator::METHOD_RK45, 1e-8);
+    assert(integrator.initialize() == fmi2_status_ok);
+    assert(simulate(integrator, 1, 0.1) == fmi2_status_ok);
+
+    // One bounce, located where the ball reaches the ground
+    double impact = sqrt(2 / G), v = 0.8 * G * impact, dt = 1 - impact;
+    assert(model.bounces == 1);
+    assert(fabs(model.bounceTime - impact) < 1e-6);
+    assert(fabs(model.x[0] - (v * dt - 0.5 * G * dt * dt)) < 1e-5);
+    assert(fabs(model.x[1] - (v - G * dt)) < 1e-5);
+}
+
+static void testTimeEvent(){
+    setModel(TIMER);
+    Integrator integrator(FMU, Integrator::METHOD_RK45, 1e-6);
+    assert(integrator.initialize() == fmi2_status_ok);
+    assert(simulate(integrator, 0.5, 0.1) == fmi2_status_ok);
+
+    // Handled exactly at its time, inside a communication step
+    assert(model.events == 1 && fabs(model.eventTime - 0.25) < 1e-12);
+    assert(fabs(model.x[0] - 10.25) < 1e-9);
+}
+
+static void testTerminate(){
+    setModel(TIMER);
+    model.terminateAtEvent = true;
+    Integrator integrator(FMU, Integrator::METHOD_RK45, 1e-6);
+    assert(integrator.initialize() == fmi2_status_ok);
+    assert(simulate(integrator, 0.5, 0.1) == fmi2_status_discard);
+    assert(integrator.isTerminated());
+    assert(integrator.getLastStatus() == fmi2_status_discard);
+    assert(fabs(integrator.getLastSuccessfulTime() - 0.25) < 1e-12);
+
+    // No more steps after that
+    assert(integrator.doStep(0.3, 0.1) == fmi2_status_error);
+}
+
+static void testNoStates(){
+    setModel(EMPTY);
+    Integrator integrator(FMU, Integrator::METHOD_BDF1, 1e-6);
+    assert(integrator.initialize() == fmi2_status_ok);
+    assert(simulate(integrator, 1, 0.1) == fmi2_status_ok);
+    assert(fabs(integrator.getLastSuccessfulTime() - 1) < 1e-9);
+}
+
+static void testFailingModel(){
+    setModel(DECAY);
+    Integrator integrator(FMU, Integrator::METHOD_RK45, 1e-6);
+    assert(integrator.initialize() == fmi2_status_ok);
+    model.failDerivatives = true;
+    assert(integrator.doStep(0, 0.1) == fmi2_status_error);
+    assert(integrator.getLastStatus() == fmi2_status_error);
+    assert(integrator.getLastSuccessfulTime() == 0);
+}
+
+static void testSnapshot(){
+    setModel(TIMER);
+    Integrator integrator(FMU, Integrator::METHOD_RK45, 1e-6);
+    assert(integrator.initialize() == fmi2_status_ok);
+    assert(integrator.doStep(0, 0.1) == fmi2_status_ok);
+    Integrator::Snapshot snapshot;
+    integrator.save(snapshot);
+    double x = model.x[0];
+
+    // Past the time event, then back to before it, like a rollback with FMU states
+    assert(simulate(integrator, 0.5, 0.1) == fmi2_status_ok && model.events == 1);
+    integrator.restore(snapshot);
+    model.x[0] = x;
+    assert(integrator.getLastSuccessfulTime() == snapshot.lastSuccessfulTime);
+
+    // The time event is still ahead
+    assert(integrator.doStep(0.1, 0.2) == fmi2_status_ok);
+    assert(model.events == 2 && fabs(model.eventTime - 0.25) < 1e-12);
+    assert(fabs(model.x[0] - 10.05) < 1e-9);
+}
+
+static void testRestoreWithoutSnapshot(){
+    // A state set without a snapshot of the integrator, after the simulation terminated: the server resets it
+    setModel(TIMER);
+    model.terminateAtEvent = true;
+    Integrator integrator(FMU, Integrator::METHOD_RK45, 1e-6);
+    assert(integrator.initialize() == fmi2_status_ok);
+    assert(simulate(integrator, 0.5, 0.1) == fmi2_status_discard);
+    integrator.reset();
+    model.x[0] = 0;
+    assert(!integrator.isTerminated());
+    assert(integrator.doStep(0, 0.1) == fmi2_status_ok);
+    assert(fabs(model.x[0] - 0.1) < 1e-9);
+
+    // A snapshot from a model with other states does not bring its nominals along
+    Integrator::Snapshot snapshot;
+    integrator.save(snapshot);
+    snapshot.nominals.resize(5, 0.0);
+    integrator.restore(snapshot);
+    assert(integrator.doStep(0.1, 0.1) == fmi2_status_ok);
+    assert(fabs(model.x[0] - 0.2) < 1e-9);
+}
+
+int main(int argc, char const *argv[]){
+    testDecay();
+    testStiff();
+    testStateEvent();
+    testTimeEvent();
+    testTerminate();
+    testNoStates();
+    testFailingModel();
+    testSnapshot();
+    testRestoreWithoutSnapshot();
+    printf("Integrator tests passed.\n");
+    return 0;
+}
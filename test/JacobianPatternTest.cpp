@@ -0,0 +1,152 @@
+#include <fmitcp/JacobianPattern.h>
+#include <vector>
+#include <math.h>
+#include <stdio.h>
+#include <assert.h>
+
+using namespace fmitcp;
+
+/// Every column is in exactly one group, and no row has two columns in the same group
+static void checkGroups(const JacobianPattern& pattern){
+    std::vector<int> groupOf(pattern.getNumColumns(), -1);
+    for(int g=0; g<pattern.getNumGroups(); g++){
+        const std::vector<int>& group = pattern.getGroup(g);
+        assert(!group.empty());
+        for(size_t k=0; k<group.size(); k++){
+            assert(groupOf[group[k]] == -1);
+            groupOf[group[k]] = g;
+        }
+    }
+    for(int j=0; j<pattern.getNumColumns(); j++)
+        assert(groupOf[j] != -1);
+
+    for(int i=0; i<pattern.getNumRows(); i++){
+        std::vector<bool> seen(pattern.getNumGroups(), false);
+        const std::vector<int>& row = pattern.getRow(i);
+        for(size_t k=0; k<row.size(); k++){
+            assert(!seen[groupOf[row[k]]]);
+            seen[groupOf[row[k]]] = true;
+        }
+    }
+}
+
+static void testDense(){
+    JacobianPattern pattern;
+    pattern.setDense(3, 4);
+    assert(pattern.getNumNonzeros() == 12);
+    assert(pattern.getNumGroups() == 4);
+    checkGroups(pattern);
+}
+
+static void testDiagonal(){
+    std::vector<std::vector<int> > rows(5);
+    for(int i=0; i<5; i++)
+        rows[i].push_back(i);
+    JacobianPattern pattern;
+    pattern.setRows(5, rows);
+    assert(pattern.getNumGroups() == 1);
+    assert(pattern.getGroup(0).size() == 5);
+    checkGroups(pattern);
+}
+
+static void testTridiagonal(){
+    int n = 8;
+    std::vector<std::vector<int> > rows(n);
+    for(int i=0; i<n; i++){
+        // Unsorted, with a duplicate
+        if(i < n - 1)
+            rows[i].push_back(i + 1);
+        rows[i].push_back(i);
+        if(i > 0)
+            rows[i].push_back(i - 1);
+        rows[i].push_back(i);
+    }
+    JacobianPattern pattern;
+    pattern.setRows(n, rows);
+    assert(pattern.getNumNonzeros() == (size_t)(3 * n - 2));
+    assert(pattern.getRow(1).size() == 3 && pattern.getRow(1)[0] == 0 && pattern.getRow(1)[2] == 2);
+    assert(pattern.getColumn(0).size() == 2 && pattern.getColumn(0)[1] == 1);
+    assert(pattern.getNumGroups() == 3);
+    checkGroups(pattern);
+}
+
+static void testDenseRowAndEmptyColumn(){
+    // Row 0 sees every column, so nothing can be grouped with anything. Column 3 is in no row.
+    std::vector<std::vector<int> > rows(3);
+    rows[0].push_back(0); rows[0].push_back(1); rows[0].push_back(2);
+    rows[1].push_back(0);
+    rows[2].push_back(2);
+    JacobianPattern pattern;
+    pattern.setRows(4, rows);
+    assert(pattern.getColumn(3).empty());
+    assert(pattern.getNumGroups() == 3);
+    checkGroups(pattern);
+}
+
+/// z0 = x0^2 + x1, z1 = sin(x2), z2 = x1 * x2, failing after a number of evaluations if asked to
+class TestFunction : public JacobianPattern::Function {
+public:
+    std::vector<double> x;
+    int evaluations;
+    int failAfter;
+
+    TestFunction() : x(3), evaluations(0), failAfter(-1) {
+        x[0] = 3; x[1] = -2; x[2] = 0.5;
+    }
+
+    fmi2_status_t evaluate(const std::vector<int>& columns, const std::vector<double>& values, double* z){
+        if(evaluations++ == failAfter)
+            return fmi2_status_error;
+        std::vector<double> v = x;
+        for(size_t k=0; k<columns.size(); k++)
+            v[columns[k]] = values[k];
+        z[0] = v[0] * v[0] + v[1];
+        z[1] = sin(v[2]);
+        z[2] = v[1] * v[2];
+        return fmi2_status_ok;
+    }
+};
+
+static void testFiniteDifferences(){
+    std::vector<std::vector<int> > rows(3);
+    rows[0].push_back(0); rows[0].push_back(1);
+    rows[1].push_back(2);
+    rows[2].push_back(1); rows[2].push_back(2);
+    JacobianPattern pattern;
+    pattern.setRows(3, rows);
+    checkGroups(pattern);
+
+    TestFunction function;
+    // Entries outside the pattern are left as they are
+    std::vector<double> jacobian(9, 42.0);
+    int numSeeds;
+    assert(pattern.finiteDifferences(function, &function.x[0], 1e-6, &jacobian[0], &numSeeds) == fmi2_status_ok);
+    assert(numSeeds == pattern.getNumGroups() && function.evaluations == numSeeds + 1);
+
+    double expected[9] = {2 * function.x[0], 1, 42,
+                          42, 42, cos(function.x[2]),
+                          42, function.x[2], function.x[1]};
+    for(int i=0; i<9; i++)
+        assert(fabs(jacobian[i] - expected[i]) < 1e-4);
+
+    // A larger perturbation gives a larger error on the nonlinear entries
+    std::vector<double> coarse(9, 42.0);
+    pattern.finiteDifferences(function, &function.x[0], 1e-2, &coarse[0], &numSeeds);
+    assert(fabs(coarse[0] - expected[0]) > fabs(jacobian[0] - expected[0]));
+
+    // Stops at the first failure
+    TestFunction failing;
+    failing.failAfter = 1;
+    assert(pattern.finiteDifferences(failing, &failing.x[0], 1e-6, &coarse[0], &numSeeds) == fmi2_status_error);
+    assert(numSeeds == 1 && failing.evaluations == 2);
+}
+
+int main(int argc, char const *argv[]){
+    testDense();
+    testDiagonal();
+    testTridiagonal();
+    testDenseRowAndEmptyColumn();
+    testFiniteDifferences();
+    printf("JacobianPattern tests passed.\n");
+    return 0;
+}
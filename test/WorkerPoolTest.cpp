@@ -0,0 +1,160 @@
+#include <fmitcp/WorkerPool.h>
+#include <vector>
+#include <stdio.h>
+#include <assert.h>
+
+using namespace fmitcp;
+
+static const int NUM_QUEUES = 8;
+static const int JOBS_PER_QUEUE = 200;
+
+/// What the jobs of one queue saw
+struct QueueLog {
+    /// Sequence numbers of the jobs, in the order they ran
+    std::vector<int> order;
+
+    /// Jobs of the queue running right now, must never be more than 1
+    int running;
+    bool overlapped;
+};
+
+struct TestJob {
+    QueueLog* log;
+    lw_sync sync;
+    int sequence;
+};
+
+static void runJob(void * data){
+    TestJob* job = (TestJob*)data;
+    lw_sync_lock(job->sync);
+    if(++job->log->running > 1)
+        job->log->overlapped = true;
+    lw_sync_release(job->sync);
+
+    // Some work, so that jobs of different queues run side by side
+    volatile double x = 0;
+    for(int i=0; i<1000; i++)
+        x += i;
+
+    lw_sync_lock(job->sync);
+    job->log->order.push_back(job->sequence);
+    job->log->running--;
+    lw_sync_release(job->sync);
+    delete job;
+}
+
+static void discardJob(void * data){
+    delete (TestJob*)data;
+}
+
+static void testOrderPerQueue(){
+    WorkerPool pool;
+    pool.start(4);
+    assert(pool.getNumThreads() == 4);
+
+    lw_sync sync = lw_sync_new();
+    std::vector<QueueLog> logs(NUM_QUEUES);
+    for(int q=0; q<NUM_QUEUES; q++){
+        logs[q].running = 0;
+        logs[q].overlapped = false;
+    }
+
+    // Interleaved, so that every queue has jobs waiting while the others run
+    for(int i=0; i<JOBS_PER_QUEUE; i++){
+        for(int q=0; q<NUM_QUEUES; q++){
+            TestJob* job = new TestJob;
+            job->log = &logs[q];
+            job->sync = sync;
+            job->sequence = i;
+            pool.post(q, runJob, discardJob, job);
+        }
+    }
+
+    // Wait until all jobs ran
+    lw_event idle = lw_event_new();
+    bool done = false;
+    while(!done){
+        lw_event_wait(idle, 1);
+        done = true;
+        lw_sync_lock(sync);
+        for(int q=0; q<NUM_QUEUES; q++)
+            done = done && logs[q].order.size() == (size_t)JOBS_PER_QUEUE;
+        lw_sync_release(sync);
+    }
+    lw_event_delete(idle);
+    pool.stop();
+    assert(pool.getNumThreads() == 0);
+
+    for(int q=0; q<NUM_QUEUES; q++){
+        assert(!logs[q].overlapped);
+        for(int i=0; i<JOBS_PER_QUEUE; i++)
+            assert(logs[q].order[i] == i);
+    }
+    lw_sync_delete(sync);
+}
+
+struct BlockingJob {
+    lw_event started;
+    lw_event release;
+};
+
+static void runBlockingJob(void * data){
+    BlockingJob* job = (BlockingJob*)data;
+    lw_event_signal(job->started);
+    lw_event_wait(job->release, -1);
+}
+
+static void * releaseLater(void * data){
+    // Long enough for stop() to be waiting for the job
+    BlockingJob* job = (BlockingJob*)data;
+    lw_event sleep = lw_event_new();
+    lw_event_wait(sleep, 200);
+    lw_event_delete(sleep);
+    lw_event_signal(job->release);
+    return NULL;
+}
+
+static int numDiscarded = 0, numRun = 0;
+static void countRun(void * data){ numRun++; }
+static void countDiscard(void * data){ numDiscarded++; }
+
+static void testStopDiscardsWaitingJobs(){
+    WorkerPool pool;
+    pool.start(1);
+
+    BlockingJob blocking;
+    blocking.started = lw_event_new();
+    blocking.release = lw_event_new();
+    pool.post(0, runBlockingJob, NULL, &blocking);
+    pool.post(0, countRun, countDiscard, NULL);
+    pool.post(1, countRun, countDiscard, NULL);
+    pool.post(1, countRun, NULL, NULL);
+    lw_event_wait(blocking.started, -1);
+
+    // The running job is waited for, the others are discarded
+    lw_thread releaser = lw_thread_new("release", (void*)releaseLater);
+    lw_thread_start(releaser, &blocking);
+    pool.stop();
+    lw_thread_join(releaser);
+    lw_thread_delete(releaser);
+    assert(numRun == 0 && numDiscarded == 2);
+
+    // The pool can be started again
+    pool.start(2);
+    pool.post(0, countRun, countDiscard, NULL);
+    lw_event_unsignal(blocking.started);
+    pool.post(0, runBlockingJob, NULL, &blocking);
+    lw_event_wait(blocking.started, -1);
+    pool.stop();
+    assert(numRun == 1 && numDiscarded == 2);
+
+    lw_event_delete(blocking.started);
+    lw_event_delete(blocking.release);
+}
+
+int main(int argc, char const *argv[]){
+    testOrderPerQueue();
+    testStopDiscardsWaitingJobs();
+    printf("WorkerPool tests passed.\n");
+    return 0;
+}
@@ -5,16 +5,156 @@
 #include <string>
 #include <fmitcp/Server.h>
 #include <fmitcp/Client.h>
+#include <fmitcp/Master.h>
 #include <fmitcp/common.h>
 #include <assert.h>
 
 using namespace fmitcp;
 
+/// Runs a short Gauss-Seidel co-simulation of two slaves that feed each other, and a third one fed by them
+class TestMaster : public Master {
+
+private:
+    int m_steps;
+
+public:
+    TestMaster(EventPump* pump) : Master(pump) {
+        m_steps = 0;
+    };
+
+    void onStepCompleted(double time){
+        m_steps++;
+    }
+
+    void onSimulationDone(bool ok){
+        assert(ok);
+        assert(m_steps == 10);
+
+        // The loop between slave 0 and 1 is broken, slave 2 steps with slave 0
+        assert(getLevels().size() == 2);
+        m_pump->exitEventLoop();
+    }
+};
+
+/**
+ * Shares a list of an instance with another connection, which must not get changes against the values sent to this
+ * one. The last one in the chain then sends changes after a set that fails, which must not be applied.
+ */
+class DeltaTestClient : public Client {
+
+private:
+    Master * m_master;
+    DeltaTestClient * m_next;
+    bool m_connected;
+    bool m_started;
+    int m_message_id;
+    int m_fmuId;
+    int m_valueReferenceSet;
+    int m_sets;
+
+    void run(){
+        if(m_valueReferenceSet == 0){
+            std::vector<int> valueRefs(2, 0);
+            valueRefs[1] = 1;
+            prepare_value_references(m_message_id++, m_fmuId, valueRefs);
+        } else {
+            fmi2_import_get_real(m_message_id++, m_fmuId, m_valueReferenceSet);
+        }
+    }
+
+public:
+    DeltaTestClient(EventPump* pump, Master* master, DeltaTestClient* next) : Client(pump) {
+        m_master = master;
+        m_next = next;
+        m_connected = false;
+        m_started = false;
+        m_message_id = 1;
+        m_fmuId = 0;
+        m_valueReferenceSet = 0;
+        m_sets = 0;
+        setDeltaEncoding(true);
+    };
+
+    /// Start on an instance, with the list of the previous client or 0 to prepare one
+    void start(int fmuId, int valueReferenceSet){
+        m_fmuId = fmuId;
+        m_valueReferenceSet = valueReferenceSet;
+        m_started = true;
+        if(m_connected)
+            run();
+    }
+
+    void onConnect(){
+        assert(hasCapability(fmitcp_proto::capability_delta_encoding));
+        m_connected = true;
+        if(m_started)
+            run();
+    }
+
+    void on_prepare_value_references_res(int message_id, fmitcp_proto::fmi2_status_t status, int valueReferenceSet){
+        assert(status == fmitcp_proto::fmi2_status_ok && valueReferenceSet != 0);
+        m_valueReferenceSet = valueReferenceSet;
+        fmi2_import_get_real(m_message_id++, m_fmuId, m_valueReferenceSet);
+    }
+
+    void on_fmi2_import_get_real_res(int message_id, const vector<double>& values, fmitcp_proto::fmi2_status_t status){
+        // All values, also when another connection got them before
+        assert(status == fmitcp_proto::fmi2_status_ok && values.size() == 2);
+        if(m_next){
+            m_next->start(m_fmuId, m_valueReferenceSet);
+            return;
+        }
+
+        // Does not fit the list. The second set goes out before the first has failed, as a change against it.
+        std::vector<double> values3(3, 1.0);
+        fmi2_import_set_real(m_message_id++, m_fmuId, m_valueReferenceSet, values3);
+        values3[0] = 2.0;
+        fmi2_import_set_real(m_message_id++, m_fmuId, m_valueReferenceSet, values3);
+    }
+
+    void on_fmi2_import_set_real_res(int message_id, fmitcp_proto::fmi2_status_t status){
+        std::vector<double> values2(2, 1.0);
+        switch(++m_sets){
+        case 1:
+            assert(status == fmitcp_proto::fmi2_status_error);
+            break;
+        case 2:
+            // The change fits the list, but not the values the server has
+            assert(status == fmitcp_proto::fmi2_status_error);
+            fmi2_import_set_real(m_message_id++, m_fmuId, m_valueReferenceSet, values2);
+            break;
+        case 3:
+            // All values again, then a change against them
+            assert(status == fmitcp_proto::fmi2_status_ok);
+            values2[1] = 2.0;
+            fmi2_import_set_real(m_message_id++, m_fmuId, m_valueReferenceSet, values2);
+            break;
+        default:
+            assert(status == fmitcp_proto::fmi2_status_ok);
+            m_master->simulate(0, 1, 0.1);
+            break;
+        }
+    }
+
+    void onError(string err){
+        m_pump->exitEventLoop();
+    };
+
+    void on_error_res(int message_id, const string& reason){
+        assert(false);
+    }
+};
+
 /// Sends all possible network messages to see that everything is working OK
 class TestClient : public Client {
 
 private:
+    DeltaTestClient * m_deltaClient;
+    bool m_loopback;
     int m_message_id;
+    int m_fmuId;
+    int m_stateId;
+    bool m_gotStepOutputs;
 
     void assertMessageId(int message_id){
         assert(message_id == m_message_id-1);
@@ -24,37 +164,51 @@ private:
     }
 
 public:
-    TestClient(EventPump* pump) : Client(pump) {
+    TestClient(EventPump* pump, DeltaTestClient* deltaClient, bool loopback) : Client(pump) {
+        m_deltaClient = deltaClient;
+        m_loopback = loopback;
         m_message_id = 1;
+        m_fmuId = 0;
+        m_stateId = 0;
+        m_gotStepOutputs = false;
+        // The subscribed outputs come as changes, the callbacks still get all of them
+        setDeltaEncoding(true);
     };
     ~TestClient(){};
 
     void onConnect() {
+      assert(getServerHello().protocolversion() == FMITCP_PROTOCOL_VERSION);
+      assert(hasCapability(fmitcp_proto::capability_pipelining));
+#ifdef __linux__
+      // The server is local, so the rest of the test runs over shared memory unless it is in this process
+      assert(isUsingSharedMemory() != m_loopback);
+#endif
       fmi2_import_instantiate(messageId());
     };
 
-    void on_fmi2_import_instantiate_res(int message_id, fmitcp_proto::jm_status_enu_t status) {
+    void on_fmi2_import_instantiate_res(int message_id, fmitcp_proto::jm_status_enu_t status, int fmuId) {
       assertMessageId(message_id);
+      m_fmuId = fmuId;
       double relTol = 0.0001,
           tStart = 0,
           tStop = 10;
       bool StopTimeDefined = true;
-      fmi2_import_initialize_slave(messageId(), 0, true, relTol, tStart, StopTimeDefined, tStop);
+      fmi2_import_initialize_slave(messageId(), m_fmuId, true, relTol, tStart, StopTimeDefined, tStop);
     }
 
     void on_fmi2_import_initialize_slave_res(int message_id, fmitcp_proto::fmi2_status_t status){
         assertMessageId(message_id);
-        fmi2_import_terminate_slave(messageId(), 0);
+        fmi2_import_terminate_slave(messageId(), m_fmuId);
     }
 
     void on_fmi2_import_terminate_slave_res(int message_id, fmitcp_proto::fmi2_status_t status){
         assertMessageId(message_id);
-        fmi2_import_reset_slave(messageId(), 0);
+        fmi2_import_reset_slave(messageId(), m_fmuId);
     }
 
     void on_fmi2_import_reset_slave_res(int message_id, fmitcp_proto::fmi2_status_t status){
         assertMessageId(message_id);
-        fmi2_import_free_slave_instance(messageId(),0);
+        fmi2_import_free_slave_instance(messageId(), m_fmuId);
     }
 
     void on_fmi2_import_free_slave_instance_res(int message_id){
@@ -62,50 +216,68 @@ public:
         std::vector<int> valueRefs;
         std::vector<int> orders;
         std::vector<double> values;
-        fmi2_import_set_real_input_derivatives(messageId(),0,valueRefs,orders,values);
+        fmi2_import_set_real_input_derivatives(messageId(), m_fmuId,valueRefs,orders,values);
     }
 
     void on_fmi2_import_set_real_input_derivatives_res(int message_id, fmitcp_proto::fmi2_status_t status){
         assertMessageId(message_id);
         std::vector<int> valueRefs;
         std::vector<int> orders;
-        fmi2_import_get_real_output_derivatives(messageId(),0,valueRefs,orders);
+        fmi2_import_get_real_output_derivatives(messageId(), m_fmuId,valueRefs,orders);
     }
 
     void on_fmi2_import_get_real_output_derivatives_res(int message_id, fmitcp_proto::fmi2_status_t status, const vector<double>& values){
         assertMessageId(message_id);
-        fmi2_import_cancel_step(messageId(),0);
+        fmi2_import_cancel_step(messageId(), m_fmuId);
     }
 
     void on_fmi2_import_cancel_step_res(int message_id, fmitcp_proto::fmi2_status_t status){
         assertMessageId(message_id);
-        fmi2_import_do_step(messageId(),0,0.0,0.1,true);
+        assert(hasCapability(fmitcp_proto::capability_output_subscriptions));
+        assert(hasCapability(fmitcp_proto::capability_delta_encoding));
+        assert(hasCapability(fmitcp_proto::capability_jacobian));
+        std::vector<int> realValueRefs(1, 0);
+        std::vector<int> valueRefs;
+        subscribe_outputs(messageId(), m_fmuId, realValueRefs, valueRefs, valueRefs, valueRefs);
+    }
+
+    void on_subscribe_outputs_res(int message_id, fmitcp_proto::fmi2_status_t status){
+        assertMessageId(message_id);
+        fmi2_import_do_step(messageId(), m_fmuId,0.0,0.1,true);
+    }
+
+    void on_fmi2_import_do_step_outputs(int message_id, const vector<double>& realValues, const vector<int>& integerValues,
+                                        const vector<bool>& booleanValues, const vector<string>& stringValues){
+        assertMessageId(message_id);
+        assert(realValues.size() == 1 && integerValues.empty());
+        m_gotStepOutputs = true;
     }
 
     void on_fmi2_import_do_step_res(int message_id, fmitcp_proto::fmi2_status_t status){
         assertMessageId(message_id);
-        fmi2_import_get_status(messageId(), 0, fmitcp_proto::fmi2_do_step_status);
+        assert(m_gotStepOutputs);
+        fmi2_import_get_status(messageId(), m_fmuId, fmitcp_proto::fmi2_do_step_status);
     }
 
     void on_fmi2_import_get_status_res(int message_id, fmitcp_proto::fmi2_status_t status){
         assertMessageId(message_id);
-        fmi2_import_get_real_status(messageId(), 0, fmitcp_proto::fmi2_do_step_status);
+        fmi2_import_get_real_status(messageId(), m_fmuId, fmitcp_proto::fmi2_do_step_status);
     }
     void on_fmi2_import_get_real_status_res(int message_id, double value){
         assertMessageId(message_id);
-        fmi2_import_get_integer_status(messageId(), 0, fmitcp_proto::fmi2_do_step_status);
+        fmi2_import_get_integer_status(messageId(), m_fmuId, fmitcp_proto::fmi2_do_step_status);
     }
     void on_fmi2_import_get_integer_status_res(int message_id, int value){
         assertMessageId(message_id);
-        fmi2_import_get_boolean_status(messageId(), 0, fmitcp_proto::fmi2_do_step_status);
+        fmi2_import_get_boolean_status(messageId(), m_fmuId, fmitcp_proto::fmi2_do_step_status);
     }
     void on_fmi2_import_get_boolean_status_res(int message_id, bool value){
         assertMessageId(message_id);
-        fmi2_import_get_string_status(messageId(), 0, fmitcp_proto::fmi2_do_step_status);
+        fmi2_import_get_string_status(messageId(), m_fmuId, fmitcp_proto::fmi2_do_step_status);
     }
     void on_fmi2_import_get_string_status_res(int message_id, string value){
         assertMessageId(message_id);
-        fmi2_import_get_version(messageId(), 0);
+        fmi2_import_get_version(messageId(), m_fmuId);
     }
 
     /*
@@ -158,14 +330,14 @@ public:
     void on_fmi2_import_get_version_res(int message_id, string version){
         assertMessageId(message_id);
         std::vector<string> categories;
-        fmi2_import_set_debug_logging(messageId(), 0, true, categories);
+        fmi2_import_set_debug_logging(messageId(), m_fmuId, true, categories);
     }
 
     void on_fmi2_import_set_debug_logging_res(int message_id, fmitcp_proto::fmi2_status_t status){
         assertMessageId(message_id);
         std::vector<int> valueRefs;
         std::vector<double> values;
-        fmi2_import_set_real(messageId(), 0, valueRefs, values);
+        fmi2_import_set_real(messageId(), m_fmuId, valueRefs, values);
     }
 
     /*
@@ -175,9 +347,6 @@ public:
         void fmi2_import_get_fmu_state();
         void fmi2_import_set_fmu_state();
         void fmi2_import_free_fmu_state();
-        void fmi2_import_serialized_fmu_state_size();
-        void fmi2_import_serialize_fmu_state();
-        void fmi2_import_de_serialize_fmu_state();
         void fmi2_import_get_directional_derivative(int message_id, int fmuId, const vector<int>& v_ref, const vector<int>& z_ref, const vector<double>& dv);
 */
 
@@ -187,45 +356,45 @@ public:
         assertMessageId(message_id);
         std::vector<int> valueRefs;
         std::vector<int> values;
-        fmi2_import_set_integer(messageId(), 0, valueRefs, values);
+        fmi2_import_set_integer(messageId(), m_fmuId, valueRefs, values);
     }
 
     void on_fmi2_import_set_integer_res(int message_id, fmitcp_proto::fmi2_status_t status){
         assertMessageId(message_id);
         std::vector<int> valueRefs;
         std::vector<bool> values;
-        fmi2_import_set_boolean(messageId(), 0, valueRefs, values);
+        fmi2_import_set_boolean(messageId(), m_fmuId, valueRefs, values);
     }
 
     void on_fmi2_import_set_boolean_res(int message_id, fmitcp_proto::fmi2_status_t status){
         assertMessageId(message_id);
         std::vector<int> valueRefs;
         std::vector<string> values;
-        fmi2_import_set_string(messageId(), 0, valueRefs, values);
+        fmi2_import_set_string(messageId(), m_fmuId, valueRefs, values);
     }
 
     void on_fmi2_import_set_string_res(int message_id, fmitcp_proto::fmi2_status_t status){
         assertMessageId(message_id);
         std::vector<int> valueRefs;
-        fmi2_import_get_real(messageId(), 0, valueRefs);
+        fmi2_import_get_real(messageId(), m_fmuId, valueRefs);
     }
 
     void on_fmi2_import_get_real_res(int message_id, const vector<double>& values, fmitcp_proto::fmi2_status_t status){
         assertMessageId(message_id);
         std::vector<int> valueRefs;
-        fmi2_import_get_integer(messageId(), 0, valueRefs);
+        fmi2_import_get_integer(messageId(), m_fmuId, valueRefs);
     }
 
     void on_fmi2_import_get_integer_res(int message_id, const vector<int>& values, fmitcp_proto::fmi2_status_t status){
         assertMessageId(message_id);
         std::vector<int> valueRefs;
-        fmi2_import_get_boolean(messageId(), 0, valueRefs);
+        fmi2_import_get_boolean(messageId(), m_fmuId, valueRefs);
     }
 
     void on_fmi2_import_get_boolean_res(int message_id, const vector<bool>& values, fmitcp_proto::fmi2_status_t status){
         assertMessageId(message_id);
         std::vector<int> valueRefs;
-        fmi2_import_get_string(messageId(), 0, valueRefs);
+        fmi2_import_get_string(messageId(), m_fmuId, valueRefs);
     }
 
     void on_fmi2_import_get_string_res(int message_id, const vector<string>& values, fmitcp_proto::fmi2_status_t status){
@@ -233,31 +402,81 @@ public:
         std::vector<int> v_ref;
         std::vector<int> z_ref;
         std::vector<double> dv;
-        fmi2_import_get_directional_derivative(messageId(), 0, v_ref, z_ref, dv);
+        fmi2_import_get_directional_derivative(messageId(), m_fmuId, v_ref, z_ref, dv);
     }
 
-    /*
-    void on_fmi2_import_get_fmu_state_res(int message_id, int stateId){
-        m_pump->exitEventLoop();
+    void on_fmi2_import_get_fmu_state_res(int message_id, int stateId, fmitcp_proto::fmi2_status_t status){
+        assertMessageId(message_id);
+        m_stateId = stateId;
+        fmi2_import_set_fmu_state(messageId(), m_fmuId, m_stateId);
     }
 
     void on_fmi2_import_set_fmu_state_res(int message_id, fmitcp_proto::fmi2_status_t status){
-        m_pump->exitEventLoop();
+        assertMessageId(message_id);
+        fmi2_import_serialized_fmu_state_size(messageId(), m_fmuId, m_stateId);
+    }
+
+    void on_fmi2_import_serialized_fmu_state_size_res(int message_id, long long size, fmitcp_proto::fmi2_status_t status){
+        assertMessageId(message_id);
+        fmi2_import_serialize_fmu_state(messageId(), m_fmuId, m_stateId);
+    }
+
+    void on_fmi2_import_serialize_fmu_state_res(int message_id, const string& state, fmitcp_proto::fmi2_status_t status){
+        assertMessageId(message_id);
+        fmi2_import_de_serialize_fmu_state(messageId(), m_fmuId, state);
+    }
+
+    void on_fmi2_import_de_serialize_fmu_state_res(int message_id, int stateId, fmitcp_proto::fmi2_status_t status){
+        assertMessageId(message_id);
+        fmi2_import_free_fmu_state(messageId(), m_fmuId, m_stateId);
     }
 
     void on_fmi2_import_free_fmu_state_res(int message_id, fmitcp_proto::fmi2_status_t status){
-        m_pump->exitEventLoop();
+        assertMessageId(message_id);
+        get_xml(messageId(), m_fmuId);
     }
-    */
 
     void on_fmi2_import_get_directional_derivative_res(int message_id, const vector<double>& dz, fmitcp_proto::fmi2_status_t status){
         assertMessageId(message_id);
-        get_xml(messageId(),0);
+        std::vector<int> unknowns(2, 0), knowns(3, 0);
+        get_jacobian(messageId(), m_fmuId, unknowns, knowns, true, true, 0.0, 0.1);
     }
 
-    void onGetXmlRes(int message_id, string xml){
+    void on_get_jacobian_res(int message_id, fmitcp_proto::fmi2_status_t status, const vector<double>& values, const vector<int>& rows, const vector<int>& columns){
         assertMessageId(message_id);
-        m_pump->exitEventLoop();
+        assert(values.size() == 6 && rows.size() == 6 && columns.size() == 6);
+        std::vector<int> valueRefs;
+        std::vector<double> realValues;
+        std::vector<int> integerValues;
+        std::vector<bool> booleanValues;
+        std::vector<string> stringValues;
+        fmi2_import_step_exchange(messageId(), m_fmuId,
+                                  valueRefs, realValues, valueRefs, integerValues,
+                                  valueRefs, booleanValues, valueRefs, stringValues,
+                                  0.0, 0.1, true,
+                                  valueRefs, valueRefs, valueRefs, valueRefs);
+    }
+
+    void on_fmi2_import_step_exchange_res(int message_id, fmitcp_proto::fmi2_status_t status, const vector<double>& realValues,
+                                          const vector<int>& integerValues, const vector<bool>& booleanValues, const vector<string>& stringValues){
+        assertMessageId(message_id);
+        std::vector<int> valueRefs;
+        prepare_value_references(messageId(), m_fmuId, valueRefs);
+    }
+
+    void on_prepare_value_references_res(int message_id, fmitcp_proto::fmi2_status_t status, int valueReferenceSet){
+        assertMessageId(message_id);
+        release_value_references(messageId(), m_fmuId, valueReferenceSet);
+    }
+
+    void on_release_value_references_res(int message_id, fmitcp_proto::fmi2_status_t status){
+        assertMessageId(message_id);
+        fmi2_import_get_fmu_state(messageId(), m_fmuId);
+    }
+
+    void onGetXmlRes(int message_id, fmitcp_proto::jm_log_level_enu_t logLevel, string xml){
+        assertMessageId(message_id);
+        m_deltaClient->start(m_fmuId, 0);
     };
 
     void onDisconnect(){
@@ -270,6 +489,11 @@ public:
         m_pump->exitEventLoop();
     };
 
+    void on_error_res(int message_id, const string& reason){
+        // Every feature the test uses was agreed on in the hellos
+        assert(false);
+    }
+
 };
 
 void printHelp(){
@@ -284,6 +508,9 @@ int main(int argc, char const *argv[]){
     // Defaults
     string hostName = "localhost";
     long port = 3123;
+    int numWorkers = 0;
+    string unixSocketPath;
+    bool loopback = false;
 
     int j;
     for (j = 1; j < argc; j++) {
@@ -307,6 +534,16 @@ int main(int argc, char const *argv[]){
         } else if (arg == "--host" && !last) {
             hostName = argv[j+1];
 
+        } else if (arg == "--workers" && !last) {
+            std::istringstream ss(argv[j+1]);
+            ss >> numWorkers;
+
+        } else if (arg == "--unix" && !last) {
+            unixSocketPath = argv[j+1];
+
+        } else if (arg == "--loopback") {
+            loopback = true;
+
         }
     }
 
@@ -316,12 +553,36 @@ int main(int argc, char const *argv[]){
 
     Server server("", false, jm_log_level_all, &pump);
     server.sendDummyResponses(true);
+    server.setNumWorkers(numWorkers);
     server.host(hostName,port);
+    if (!unixSocketPath.empty()) {
+        server.hostUnix(unixSocketPath);
+    }
     server.getLogger()->setPrefix("Server: ");
 
-    TestClient client(&pump);
+    TestMaster master(&pump);
+    master.addSlave(hostName,port);
+    master.addSlave(hostName,port);
+    master.addSlave(hostName,port);
+    master.connect(0, 1, 1, 2);
+    master.connect(1, 1, 0, 2);
+    master.connect(1, 3, 2, 2);
+    master.setScheme(Master::GAUSS_SEIDEL);
+
+    DeltaTestClient deltaClient2(&pump, &master, NULL);
+    DeltaTestClient deltaClient1(&pump, NULL, &deltaClient2);
+    deltaClient2.connect(hostName,port);
+    deltaClient1.connect(hostName,port);
+
+    TestClient client(&pump, &deltaClient1, loopback);
     client.getLogger()->setPrefix("Client:        ");
-    client.connect(hostName,port);
+    if (loopback) {
+        client.connectLoopback(&server);
+    } else if (unixSocketPath.empty()) {
+        client.connect(hostName,port);
+    } else if (!client.connectUnix(unixSocketPath)) {
+        return EXIT_FAILURE;
+    }
 
     pump.startEventLoop();
 